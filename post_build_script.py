@@ -1,14 +1,134 @@
+import hashlib
+import os
+import struct
 import subprocess
+import time
 
 Import("env")
 
+BUNDLE_MAGIC = b"OTAB"
+BUNDLE_VERSION = 1
+BUNDLE_LABEL_SIZE = 16
+
+# Images streamed in one connection. The device keeps a data image in its
+# "otastage" partition until the new app is validated, and refuses bundles
+# with data images without one.
+BUNDLE_IMAGES = [
+    ("app", "firmware.bin"),
+    ("spiffs", "littlefs.bin"),
+    ("spiffs", "spiffs.bin"),
+]
+STAGING_PARTITION = "otastage"
+
+
+def partition_labels(env):
+    """Labels in the configured partition table, empty for a board default."""
+    table = env.GetProjectOption("board_build.partitions", "")
+    path = os.path.join(env.subst("$PROJECT_DIR"), table)
+    if not table or not os.path.isfile(path):
+        return set()
+
+    with open(path) as csv:
+        rows = [line.split("#")[0].split(",") for line in csv]
+    return set(row[0].strip() for row in rows if len(row) > 1)
+
+
+def stale_data_image(env, path):
+    """True when a file under the data dir changed after buildfs made path."""
+    built = os.path.getmtime(path)
+    for root, _, files in os.walk(env.subst("$PROJECT_DATA_DIR")):
+        for name in files:
+            if os.path.getmtime(os.path.join(root, name)) > built:
+                return True
+    return False
+
+
+def make_bundle(env, build_dir, output_path):
+    entries = []
+    labels = set()
+    table = partition_labels(env)
+
+    for label, file_name in BUNDLE_IMAGES:
+        path = os.path.join(build_dir, file_name)
+        if label in labels or not os.path.isfile(path):
+            continue
+
+        # Either would get the whole bundle refused on the device
+        if label != "app" and (STAGING_PARTITION not in table or label not in table):
+            print("Not bundling %s: the partition table has no %s or %s" % (file_name, STAGING_PARTITION, label))
+            continue
+        if label != "app" and stale_data_image(env, path):
+            print("Not bundling %s: older than the data dir, run buildfs" % file_name)
+            continue
+
+        with open(path, "rb") as image:
+            data = image.read()
+
+        labels.add(label)
+        entries.append((label, data))
+
+    with open(output_path, "wb") as bundle:
+        bundle.write(BUNDLE_MAGIC)
+        bundle.write(struct.pack("<HH", BUNDLE_VERSION, len(entries)))
+
+        for label, data in entries:
+            bundle.write(label.encode().ljust(BUNDLE_LABEL_SIZE, b"\0"))
+            bundle.write(struct.pack("<I", len(data)))
+            bundle.write(hashlib.sha256(data).digest())
+
+        for _, data in entries:
+            bundle.write(data)
+
+    print("Bundle %s: %s" % (output_path, ", ".join("%s (%d bytes)" % (label, len(data)) for label, data in entries)))
+
+
+def publish(path, destination):
+    """Uploads path unless the server already has the same bytes.
+
+    nginx derives the ETag from mtime and size, and scp -p keeps the mtime, so
+    an unchanged image keeps its ETag and Last-Modified and devices polling
+    with If-None-Match get a 304. A changed one gets the upload time.
+    """
+    with open(path, "rb") as image:
+        digest = hashlib.sha256(image.read()).hexdigest()
+
+    record_path = path + ".published"
+    published = None
+    if os.path.isfile(record_path):
+        with open(record_path) as record:
+            published = record.read().split()
+
+    if published is not None and published[0] == digest and published[2] == destination:
+        mtime = int(published[1])
+        code = 0
+        print("%s unchanged, not uploaded" % path)
+    else:
+        mtime = int(time.time())
+        os.utime(path, (mtime, mtime))
+        code = subprocess.call(["scp", "-p", path, destination])
+        print(code)
+
+        if code == 0:
+            with open(record_path, "w") as record:
+                record.write("%s %d %s\n" % (digest, mtime, destination))
+
+    print("ETag %s: \"%x-%x\"" % (os.path.basename(path), mtime, os.path.getsize(path)))
+    return code
+
+
 def after_build(source, target, env):
     # Your custom script or commands to run after the build
     print("Running custom script after build")
     print(source)
     print(target) 
     print(env)
-    code = subprocess.call(['scp', '.pio/build/esp32-s3-devkitm-1/firmware.bin', 'zzzorgo@home-r:/usr/share/nginx/html/esp32/firmware.bin'])
-    print(code)
+
+    build_dir = env.subst("$BUILD_DIR")
+    bundle_path = os.path.join(build_dir, "firmware.bundle")
+    make_bundle(env, build_dir, bundle_path)
+
+    # firmware.bin stays published for devices that still pull the plain image
+    publish(os.path.join(build_dir, "firmware.bin"), "zzzorgo@home-r:/usr/share/nginx/html/esp32/firmware.bin")
+    publish(bundle_path, "zzzorgo@home-r:/usr/share/nginx/html/esp32/firmware.bundle")
 
 env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", after_build)
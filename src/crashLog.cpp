@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "crashLog.h"
+
+#define CRASH_LOG_MAGIC 0x43524c47
+#define CRASH_LOG_VERSION 1
+
+struct CrashLogTraceRecord {
+    uint16_t event;
+    uint16_t reserved;
+    uint32_t a;
+    uint32_t b;
+};
+
+static uint8_t recordCheck(uint8_t type, const uint8_t* payload, size_t len)
+{
+    uint8_t check = type ^ (uint8_t)len;
+
+    for (size_t i = 0; i < len; i++)
+    {
+        check ^= payload[i];
+    }
+
+    return check;
+}
+
+// Wrap safe: true when position is before limit
+static bool before(uint32_t position, uint32_t limit)
+{
+    return (int32_t)(position - limit) < 0;
+}
+
+CrashLog::CrashLog(CrashLogRegion* region)
+    : region(region),
+      bootStart(0)
+{
+}
+
+bool CrashLog::begin(const char* resetReason, uint32_t timeMs)
+{
+    bool kept = region->magic == CRASH_LOG_MAGIC &&
+                region->version == CRASH_LOG_VERSION &&
+                region->head - region->tail <= CRASH_LOG_DATA_SIZE;
+
+    if (kept)
+    {
+        CrashLogRecord record;
+        uint8_t payload[255];
+        uint32_t position = region->tail;
+
+        while (before(position, region->head) && readRecord(position, &record, payload))
+        {
+            position += sizeof(record) + record.len;
+        }
+
+        region->head = position;
+    }
+    else
+    {
+        memset(region, 0, sizeof(*region));
+        region->magic = CRASH_LOG_MAGIC;
+        region->version = CRASH_LOG_VERSION;
+    }
+
+    kept = kept && region->head != region->tail;
+    region->bootCount++;
+    bootStart = region->head;
+    append(CRASH_LOG_BOOT, resetReason, strnlen(resetReason, CRASH_LOG_MAX_TEXT), timeMs);
+    return kept;
+}
+
+void CrashLog::text(const char* line, size_t len, uint32_t timeMs)
+{
+    append(CRASH_LOG_TEXT, line, len < CRASH_LOG_MAX_TEXT ? len : CRASH_LOG_MAX_TEXT, timeMs);
+}
+
+void CrashLog::trace(uint16_t event, uint32_t a, uint32_t b, uint32_t timeMs)
+{
+    CrashLogTraceRecord trace = {
+        .event = event,
+        .reserved = 0,
+        .a = a,
+        .b = b,
+    };
+
+    append(CRASH_LOG_TRACE, &trace, sizeof(trace), timeMs);
+}
+
+CrashLogCursor CrashLog::previousBoots() const
+{
+    CrashLogCursor cursor = {
+        .position = region->tail,
+        .end = bootStart,
+    };
+
+    // This boot already overwrote all of them
+    if (!before(cursor.position, cursor.end))
+    {
+        cursor.end = cursor.position;
+    }
+
+    return cursor;
+}
+
+CrashLogCursor CrashLog::all() const
+{
+    CrashLogCursor cursor = {
+        .position = region->tail,
+        .end = region->head,
+    };
+    return cursor;
+}
+
+bool CrashLog::next(CrashLogCursor* cursor, char* line, size_t size) const
+{
+    CrashLogRecord record;
+    uint8_t payload[256];
+
+    if (!before(cursor->position, cursor->end) || before(cursor->position, region->tail) ||
+        !readRecord(cursor->position, &record, payload))
+    {
+        return false;
+    }
+
+    cursor->position += sizeof(record) + record.len;
+    payload[record.len] = 0;
+
+    switch (record.type)
+    {
+    case CRASH_LOG_BOOT:
+        snprintf(line, size, "[boot %u] reset: %s", record.boot, (const char*)payload);
+        break;
+    case CRASH_LOG_TEXT:
+        snprintf(line, size, "[boot %u +%u.%03u s] %s", record.boot, record.timeMs / 1000, record.timeMs % 1000, (const char*)payload);
+        break;
+    default:
+    {
+        CrashLogTraceRecord trace;
+        memcpy(&trace, payload, sizeof(trace));
+        snprintf(line, size, "[boot %u +%u.%03u s] trace %s %u %u",
+                 record.boot,
+                 record.timeMs / 1000,
+                 record.timeMs % 1000,
+                 crashLogTraceName(trace.event),
+                 trace.a,
+                 trace.b);
+        break;
+    }
+    }
+
+    return true;
+}
+
+uint32_t CrashLog::bootCount() const
+{
+    return region->bootCount;
+}
+
+// Makes room first, so after a reset at any point tail and head still sit
+// on record boundaries and only the record being written is lost
+void CrashLog::append(uint8_t type, const void* payload, size_t len, uint32_t timeMs)
+{
+    CrashLogRecord record = {
+        .type = type,
+        .len = (uint8_t)len,
+        .check = recordCheck(type, (const uint8_t*)payload, len),
+        .boot = (uint8_t)region->bootCount,
+        .timeMs = timeMs,
+    };
+    uint32_t size = sizeof(record) + len;
+
+    while (region->head - region->tail + size > CRASH_LOG_DATA_SIZE)
+    {
+        CrashLogRecord oldest;
+        read(region->tail, &oldest, sizeof(oldest));
+        region->tail += sizeof(oldest) + oldest.len;
+    }
+
+    write(region->head, &record, sizeof(record));
+    write(region->head + sizeof(record), payload, len);
+    region->head += size;
+}
+
+void CrashLog::read(uint32_t position, void* output, size_t len) const
+{
+    size_t offset = position % CRASH_LOG_DATA_SIZE;
+    size_t first = len < CRASH_LOG_DATA_SIZE - offset ? len : CRASH_LOG_DATA_SIZE - offset;
+
+    memcpy(output, region->data + offset, first);
+    memcpy((uint8_t*)output + first, region->data, len - first);
+}
+
+void CrashLog::write(uint32_t position, const void* input, size_t len)
+{
+    size_t offset = position % CRASH_LOG_DATA_SIZE;
+    size_t first = len < CRASH_LOG_DATA_SIZE - offset ? len : CRASH_LOG_DATA_SIZE - offset;
+
+    memcpy(region->data + offset, input, first);
+    memcpy(region->data, (const uint8_t*)input + first, len - first);
+}
+
+bool CrashLog::readRecord(uint32_t position, CrashLogRecord* record, uint8_t* payload) const
+{
+    read(position, record, sizeof(*record));
+
+    if (record->type > CRASH_LOG_TRACE ||
+        region->head - position < sizeof(*record) + record->len)
+    {
+        return false;
+    }
+
+    read(position + sizeof(*record), payload, record->len);
+    return recordCheck(record->type, payload, record->len) == record->check;
+}
+
+const char* crashLogTraceName(uint16_t event)
+{
+    switch (event)
+    {
+    case CRASH_TRACE_UPDATE_START:
+        return "update-start";
+    case CRASH_TRACE_UPDATE_END:
+        return "update-end";
+    case CRASH_TRACE_RESTART:
+        return "restart";
+    }
+    return "unknown";
+}
@@ -0,0 +1,92 @@
+#ifndef __ESP_CRASH_LOG__
+#define __ESP_CRASH_LOG__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fits RTC slow memory next to the bootloader's reserved bytes
+#define CRASH_LOG_DATA_SIZE 4096
+#define CRASH_LOG_MAX_TEXT 200
+
+enum CrashLogRecordType {
+    CRASH_LOG_BOOT,
+    CRASH_LOG_TEXT,
+    CRASH_LOG_TRACE,
+};
+
+// Fixed size trace events for hot paths, formatted only when dumped
+enum CrashLogTrace {
+    // a: 0 for a pulled update, 1 for a pushed one
+    CRASH_TRACE_UPDATE_START,
+    // a: bytes received, b: esp_err_t
+    CRASH_TRACE_UPDATE_END,
+    // Right before esp_restart(), a: OtaState, b: shutdown time in ms
+    CRASH_TRACE_RESTART,
+};
+
+// The memory that must survive a reset: RTC_NOINIT on the device, a mapped
+// file on the host. Positions are byte counters that only grow, the ring
+// offset is position % CRASH_LOG_DATA_SIZE.
+struct CrashLogRegion {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t bootCount;
+    uint32_t head;
+    uint32_t tail;
+    uint8_t data[CRASH_LOG_DATA_SIZE];
+};
+
+// Record header in the ring, the payload follows
+struct CrashLogRecord {
+    uint8_t type;
+    uint8_t len;
+    // XOR of type, len and the payload
+    uint8_t check;
+    // Low byte of the boot count
+    uint8_t boot;
+    uint32_t timeMs;
+};
+
+struct CrashLogCursor {
+    uint32_t position;
+    uint32_t end;
+};
+
+// Log lines and trace events written with a memcpy, no flash involved, the
+// oldest records overwritten when full. begin() runs once per boot: it keeps
+// what the previous boots left unless the region is corrupt and appends a
+// boot record carrying the reset reason. Not locked, callers on several
+// tasks serialize around it.
+class CrashLog {
+public:
+    explicit CrashLog(CrashLogRegion* region);
+
+    // Returns true when records of earlier boots survived. A reset in the
+    // middle of a write only loses that record: records are checked one by
+    // one and the ring is cut at the first bad one.
+    bool begin(const char* resetReason, uint32_t timeMs);
+    void text(const char* line, size_t len, uint32_t timeMs);
+    void trace(uint16_t event, uint32_t a, uint32_t b, uint32_t timeMs);
+
+    // Records from before this boot, or everything
+    CrashLogCursor previousBoots() const;
+    CrashLogCursor all() const;
+    // Formats the next record as a line, false at the end. A record
+    // overwritten since the cursor was taken ends the walk.
+    bool next(CrashLogCursor* cursor, char* line, size_t size) const;
+
+    uint32_t bootCount() const;
+
+private:
+    void append(uint8_t type, const void* payload, size_t len, uint32_t timeMs);
+    void read(uint32_t position, void* output, size_t len) const;
+    void write(uint32_t position, const void* input, size_t len);
+    bool readRecord(uint32_t position, CrashLogRecord* record, uint8_t* payload) const;
+
+    CrashLogRegion* region;
+    uint32_t bootStart;
+};
+
+const char* crashLogTraceName(uint16_t event);
+
+#endif // __ESP_CRASH_LOG__
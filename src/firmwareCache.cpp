@@ -0,0 +1,668 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "firmwareCache.h"
+#include "otaImageCheck.h"
+
+#define FIRMWARE_CACHE_MAGIC 0x31435746
+#define FIRMWARE_CACHE_COMPARE_STEP 64
+
+struct FirmwareCacheHeader {
+    uint32_t magic;
+    uint32_t size;
+    uint8_t sha256[OTA_SHA256_LEN];
+};
+
+static void formatEtag(const uint8_t* sha256, char* output)
+{
+    output[0] = '"';
+    for (int i = 0; i < 8; i++)
+    {
+        snprintf(output + 1 + i * 2, 3, "%02x", sha256[i]);
+    }
+    output[17] = '"';
+    output[18] = 0;
+}
+
+FirmwareCache::FirmwareCache()
+    : store(nullptr),
+      writer(nullptr, FLASH_ERASE_ON_DEMAND),
+      currentState(FIRMWARE_CACHE_EMPTY),
+      currentGeneration(0),
+      readers(0),
+      imageSize(0),
+      filled(0)
+{
+    imageEtag[0] = 0;
+    memset(&statistics, 0, sizeof(statistics));
+}
+
+bool FirmwareCache::begin(FlashDevice* device)
+{
+    FirmwareCacheHeader header;
+
+    store = device;
+    imageSize = 0;
+    imageEtag[0] = 0;
+    currentState = FIRMWARE_CACHE_EMPTY;
+
+    if (store->size() < 2 * FLASH_WRITER_SECTOR_SIZE || !store->read(capacity(), (uint8_t*)&header, sizeof(header)))
+    {
+        return false;
+    }
+
+    if (header.magic != FIRMWARE_CACHE_MAGIC || header.size == 0 || header.size > capacity())
+    {
+        return false;
+    }
+
+    imageSize = header.size;
+    formatEtag(header.sha256, imageEtag);
+    memcpy(imageSha256, header.sha256, OTA_SHA256_LEN);
+    currentState = FIRMWARE_CACHE_READY;
+    return true;
+}
+
+bool FirmwareCache::startFill(size_t expectedSize, uint8_t* sectorBuffer)
+{
+    if (store == nullptr || currentState == FIRMWARE_CACHE_FILLING || expectedSize > capacity())
+    {
+        return false;
+    }
+
+    // New replies see FILLING before this looks at the readers, a reply
+    // counts itself before it looks at the state
+    int previousState = currentState;
+    currentState = FIRMWARE_CACHE_FILLING;
+
+    if (readers > 0)
+    {
+        currentState = previousState;
+        return false;
+    }
+
+    currentGeneration++;
+    imageSize = 0;
+    imageEtag[0] = 0;
+    filled = 0;
+    writer = FlashWriter(sectorBuffer, FLASH_ERASE_ON_DEMAND);
+
+    if (!store->erase(capacity(), FLASH_WRITER_SECTOR_SIZE) || !writer.begin(store, expectedSize))
+    {
+        abortFill();
+        return false;
+    }
+
+    otaSha256Start(&hash);
+    return true;
+}
+
+bool FirmwareCache::writeFill(const uint8_t* data, size_t len)
+{
+    if (currentState != FIRMWARE_CACHE_FILLING || filled + len > capacity() || !writer.write(data, len))
+    {
+        return false;
+    }
+
+    otaSha256Update(&hash, data, len);
+    filled += len;
+    return true;
+}
+
+bool FirmwareCache::finishFill()
+{
+    if (currentState != FIRMWARE_CACHE_FILLING || filled == 0 || !writer.finish() || !writeHeader())
+    {
+        abortFill();
+        return false;
+    }
+
+    statistics.fills++;
+    currentState = FIRMWARE_CACHE_READY;
+    return true;
+}
+
+void FirmwareCache::abortFill()
+{
+    // The header sector is already erased, nothing stale survives a reboot
+    imageSize = 0;
+    imageEtag[0] = 0;
+    currentState = FIRMWARE_CACHE_EMPTY;
+}
+
+// Programmed last, an interrupted fill leaves no header
+bool FirmwareCache::writeHeader()
+{
+    FirmwareCacheHeader header;
+
+    header.magic = FIRMWARE_CACHE_MAGIC;
+    header.size = filled;
+    otaSha256Finish(&hash, header.sha256);
+
+    if (!store->write(capacity(), (const uint8_t*)&header, sizeof(header)))
+    {
+        return false;
+    }
+
+    imageSize = filled;
+    formatEtag(header.sha256, imageEtag);
+    memcpy(imageSha256, header.sha256, OTA_SHA256_LEN);
+    return true;
+}
+
+FirmwareCacheReply FirmwareCache::reply(const char* range, const char* ifNoneMatch, const char* ifRange)
+{
+    FirmwareCacheReply reply = {503, 0, 0, currentGeneration};
+
+    statistics.requests++;
+    readers++;
+
+    if (currentState != FIRMWARE_CACHE_READY)
+    {
+        readers--;
+        statistics.unavailable++;
+        return reply;
+    }
+
+    if (ifNoneMatch != nullptr && httpEtagMatches(ifNoneMatch, imageEtag))
+    {
+        readers--;
+        statistics.notModified++;
+        reply.status = 304;
+        return reply;
+    }
+
+    // A range of some older image is no use to the client, it gets all of this one
+    bool useRange = range != nullptr && (ifRange == nullptr || strcmp(ifRange, imageEtag) == 0);
+    HttpRangeResult result = useRange ? parseHttpRange(range, imageSize, &reply.offset, &reply.length) : HTTP_RANGE_NONE;
+
+    switch (result)
+    {
+    case HTTP_RANGE_NONE:
+        statistics.full++;
+        reply.status = 200;
+        reply.offset = 0;
+        reply.length = imageSize;
+        break;
+    case HTTP_RANGE_OK:
+        statistics.partial++;
+        reply.status = 206;
+        break;
+    case HTTP_RANGE_UNSATISFIABLE:
+        readers--;
+        statistics.unsatisfiable++;
+        reply.status = 416;
+        reply.offset = 0;
+        reply.length = 0;
+        break;
+    }
+
+    return reply;
+}
+
+size_t FirmwareCache::read(const FirmwareCacheReply* reply, size_t index, uint8_t* buffer, size_t len)
+{
+    if (currentState != FIRMWARE_CACHE_READY || reply->generation != currentGeneration || index >= reply->length)
+    {
+        return 0;
+    }
+
+    size_t take = reply->length - index < len ? reply->length - index : len;
+    if (!store->read(reply->offset + index, buffer, take))
+    {
+        return 0;
+    }
+
+    statistics.bytesServed += take;
+    return take;
+}
+
+void FirmwareCache::endReply(const FirmwareCacheReply* reply)
+{
+    if (reply->status == 200 || reply->status == 206)
+    {
+        readers--;
+    }
+}
+
+size_t FirmwareCache::contentRange(const FirmwareCacheReply* reply, char* output, size_t size) const
+{
+    int len = 0;
+
+    if (reply->status == 206)
+    {
+        len = snprintf(output, size, "bytes %lu-%lu/%lu",
+                       (unsigned long)reply->offset,
+                       (unsigned long)(reply->offset + reply->length - 1),
+                       (unsigned long)imageSize);
+    }
+    else if (reply->status == 416)
+    {
+        len = snprintf(output, size, "bytes */%lu", (unsigned long)imageSize);
+    }
+
+    return len > 0 && (size_t)len < size ? len : 0;
+}
+
+bool FirmwareCache::readImage(size_t offset, uint8_t* buffer, size_t len)
+{
+    if (currentState != FIRMWARE_CACHE_READY || offset + len > imageSize)
+    {
+        return false;
+    }
+
+    return store->read(offset, buffer, len);
+}
+
+FirmwareCacheState FirmwareCache::state() const
+{
+    return (FirmwareCacheState)currentState;
+}
+
+bool FirmwareCache::serving() const
+{
+    return readers > 0;
+}
+
+size_t FirmwareCache::size() const
+{
+    return imageSize;
+}
+
+size_t FirmwareCache::capacity() const
+{
+    return store != nullptr ? store->size() - FLASH_WRITER_SECTOR_SIZE : 0;
+}
+
+const char* FirmwareCache::etag() const
+{
+    return imageEtag;
+}
+
+bool FirmwareCache::sha256(uint8_t output[OTA_SHA256_LEN]) const
+{
+    if (currentState != FIRMWARE_CACHE_READY)
+    {
+        return false;
+    }
+
+    memcpy(output, imageSha256, OTA_SHA256_LEN);
+    return true;
+}
+
+void FirmwareCache::stats(FirmwareCacheStats* output) const
+{
+    *output = statistics;
+}
+
+FirmwareCacheTransport::FirmwareCacheTransport(FirmwareCache* cache)
+    : cache(cache),
+      isOpen(false),
+      index(0)
+{
+    current.status = 0;
+    ifNoneMatch[0] = 0;
+}
+
+FirmwareCacheTransport::~FirmwareCacheTransport()
+{
+    close();
+}
+
+bool FirmwareCacheTransport::start(const char* range)
+{
+    close();
+    current = cache->reply(range, ifNoneMatch[0] != 0 ? ifNoneMatch : nullptr, nullptr);
+    ifNoneMatch[0] = 0;
+    isOpen = current.status == 200 || current.status == 206;
+    index = 0;
+    return isOpen || current.status == 304;
+}
+
+bool FirmwareCacheTransport::open(const char* url)
+{
+    return start(nullptr);
+}
+
+bool FirmwareCacheTransport::openRange(const char* url, uint32_t offset, uint32_t len)
+{
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%u-%u", (unsigned)offset, (unsigned)(offset + len - 1));
+    return start(range);
+}
+
+int FirmwareCacheTransport::statusCode()
+{
+    return current.status;
+}
+
+int64_t FirmwareCacheTransport::contentLength()
+{
+    return isOpen ? (int64_t)current.length : -1;
+}
+
+int FirmwareCacheTransport::read(uint8_t* buffer, size_t len)
+{
+    if (!isOpen)
+    {
+        return -1;
+    }
+
+    size_t n = cache->read(&current, index, buffer, len);
+    index += n;
+    return n;
+}
+
+bool FirmwareCacheTransport::isComplete()
+{
+    return isOpen && index == current.length;
+}
+
+void FirmwareCacheTransport::close()
+{
+    if (isOpen)
+    {
+        cache->endReply(&current);
+        isOpen = false;
+    }
+}
+
+void FirmwareCacheTransport::setValidators(const HalHttpValidators* validators)
+{
+    ifNoneMatch[0] = 0;
+    if (validators != nullptr)
+    {
+        strcpy(ifNoneMatch, validators->etag);
+    }
+}
+
+void FirmwareCacheTransport::responseValidators(HalHttpValidators* output)
+{
+    bool answered = current.status == 200 || current.status == 206 || current.status == 304;
+    strcpy(output->etag, answered ? cache->etag() : "");
+    output->lastModified[0] = 0;
+}
+
+// Reads until len bytes or the end of the body, returns the count
+static size_t readFully(HalHttpTransport* transport, uint8_t* buffer, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len)
+    {
+        int n = transport->read(buffer + got, len - got);
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+
+    return got;
+}
+
+static bool matchesCachedStart(FirmwareCache* cache, const uint8_t* data, size_t len)
+{
+    uint8_t cached[FIRMWARE_CACHE_COMPARE_STEP];
+
+    // A start shorter than the probe is the whole image
+    if (cache->state() != FIRMWARE_CACHE_READY || cache->size() < len || (len < OTA_IMAGE_CHECK_FETCH_SIZE && cache->size() != len))
+    {
+        return false;
+    }
+
+    for (size_t offset = 0; offset < len; offset += sizeof(cached))
+    {
+        size_t take = len - offset < sizeof(cached) ? len - offset : sizeof(cached);
+
+        if (!cache->readImage(offset, cached, take) || memcmp(cached, data + offset, take) != 0)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+FirmwareCacheFetch fetchFirmwareCache(FirmwareCache* cache, HalHttpTransport* transport, const char* url,
+                                      uint8_t* buffer, size_t bufferSize, uint8_t* sectorBuffer, bool (*shouldStop)(void))
+{
+    bool opened = transport->openRange(url, 0, OTA_IMAGE_CHECK_FETCH_SIZE);
+    int status = opened ? transport->statusCode() : 0;
+    size_t got = status == 206 || status == 200 ? readFully(transport, buffer, OTA_IMAGE_CHECK_FETCH_SIZE) : 0;
+    transport->close();
+
+    // Validators the caller set only ever describe the cached image
+    if (status == 304)
+    {
+        return cache->state() == FIRMWARE_CACHE_READY ? FIRMWARE_CACHE_CURRENT : FIRMWARE_CACHE_FAILED;
+    }
+
+    if (got == 0)
+    {
+        return FIRMWARE_CACHE_FAILED;
+    }
+
+    // No partitions and no running app: only whether it is an image at all
+    OtaImageCheck check(nullptr, nullptr);
+    if (check.checkStream(buffer, got) == OTA_IMAGE_MALFORMED)
+    {
+        return FIRMWARE_CACHE_REJECTED;
+    }
+
+    if (matchesCachedStart(cache, buffer, got))
+    {
+        return FIRMWARE_CACHE_CURRENT;
+    }
+
+    if (!transport->open(url) || transport->statusCode() != 200)
+    {
+        transport->close();
+        return FIRMWARE_CACHE_FAILED;
+    }
+
+    int64_t length = transport->contentLength();
+    if (length > (int64_t)cache->capacity())
+    {
+        transport->close();
+        return FIRMWARE_CACHE_FAILED;
+    }
+
+    if (!cache->startFill(length > 0 ? length : 0, sectorBuffer))
+    {
+        transport->close();
+        return cache->serving() ? FIRMWARE_CACHE_BUSY : FIRMWARE_CACHE_FAILED;
+    }
+
+    bool succeeded = false;
+
+    while (shouldStop == nullptr || !shouldStop())
+    {
+        int n = transport->read(buffer, bufferSize);
+
+        if (n == 0)
+        {
+            succeeded = transport->isComplete();
+            break;
+        }
+
+        if (n < 0 || !cache->writeFill(buffer, n))
+        {
+            break;
+        }
+    }
+
+    transport->close();
+
+    if (!succeeded)
+    {
+        cache->abortFill();
+        return FIRMWARE_CACHE_FAILED;
+    }
+
+    return cache->finishFill() ? FIRMWARE_CACHE_FETCHED : FIRMWARE_CACHE_FAILED;
+}
+
+HalHttpTransport* firmwareCacheSource(const FirmwareCache* cache, FirmwareCacheFetch result, HalHttpTransport* origin, HalHttpTransport* cached)
+{
+    if (cache->state() == FIRMWARE_CACHE_READY && (result == FIRMWARE_CACHE_FETCHED || result == FIRMWARE_CACHE_CURRENT))
+    {
+        return cached;
+    }
+
+    origin->setValidators(nullptr);
+    return origin;
+}
+
+static bool parseNumber(const char** text, uint64_t* output)
+{
+    const char* p = *text;
+    uint64_t value = 0;
+
+    while (*p >= '0' && *p <= '9')
+    {
+        // Saturates, nothing cached comes close
+        value = value < UINT32_MAX ? value * 10 + (*p - '0') : value;
+        p++;
+    }
+
+    if (p == *text)
+    {
+        return false;
+    }
+
+    *text = p;
+    *output = value;
+    return true;
+}
+
+static const char* skipSpaces(const char* p)
+{
+    while (*p == ' ' || *p == '\t')
+    {
+        p++;
+    }
+    return p;
+}
+
+HttpRangeResult parseHttpRange(const char* header, size_t size, size_t* offset, size_t* length)
+{
+    if (header == nullptr || strncmp(header, "bytes=", 6) != 0 || strchr(header, ',') != nullptr)
+    {
+        return HTTP_RANGE_NONE;
+    }
+
+    const char* p = skipSpaces(header + 6);
+    uint64_t first = 0;
+    uint64_t last = 0;
+    bool hasFirst = parseNumber(&p, &first);
+
+    if (*p != '-')
+    {
+        return HTTP_RANGE_NONE;
+    }
+
+    p++;
+    bool hasLast = parseNumber(&p, &last);
+
+    if (*skipSpaces(p) != 0 || (!hasFirst && !hasLast) || (hasFirst && hasLast && last < first))
+    {
+        return HTTP_RANGE_NONE;
+    }
+
+    if (!hasFirst)
+    {
+        // Suffix: the last "last" bytes
+        if (last == 0 || size == 0)
+        {
+            return HTTP_RANGE_UNSATISFIABLE;
+        }
+
+        *length = last < size ? last : size;
+        *offset = size - *length;
+        return HTTP_RANGE_OK;
+    }
+
+    if (first >= size)
+    {
+        return HTTP_RANGE_UNSATISFIABLE;
+    }
+
+    uint64_t end = hasLast && last < size - 1 ? last : size - 1;
+    *offset = first;
+    *length = end - first + 1;
+    return HTTP_RANGE_OK;
+}
+
+bool httpEtagMatches(const char* header, const char* etag)
+{
+    size_t etagLength = strlen(etag);
+    const char* p = skipSpaces(header);
+
+    if (p[0] == '*' && *skipSpaces(p + 1) == 0)
+    {
+        return true;
+    }
+
+    while (*p != 0)
+    {
+        p = skipSpaces(p);
+        if (strncmp(p, "W/", 2) == 0)
+        {
+            p += 2;
+        }
+
+        const char* end = strchr(p, ',');
+        size_t tagLength = end != nullptr ? end - p : strlen(p);
+
+        while (tagLength > 0 && (p[tagLength - 1] == ' ' || p[tagLength - 1] == '\t'))
+        {
+            tagLength--;
+        }
+
+        if (etagLength > 0 && tagLength == etagLength && strncmp(p, etag, etagLength) == 0)
+        {
+            return true;
+        }
+
+        if (end == nullptr)
+        {
+            break;
+        }
+        p = end + 1;
+    }
+
+    return false;
+}
+
+const char* firmwareCacheStateName(FirmwareCacheState state)
+{
+    switch (state)
+    {
+    case FIRMWARE_CACHE_EMPTY:
+        return "empty";
+    case FIRMWARE_CACHE_FILLING:
+        return "filling";
+    case FIRMWARE_CACHE_READY:
+        return "ready";
+    }
+    return "unknown";
+}
+
+const char* firmwareCacheFetchName(FirmwareCacheFetch result)
+{
+    switch (result)
+    {
+    case FIRMWARE_CACHE_FETCHED:
+        return "fetched";
+    case FIRMWARE_CACHE_CURRENT:
+        return "current";
+    case FIRMWARE_CACHE_REJECTED:
+        return "rejected";
+    case FIRMWARE_CACHE_BUSY:
+        return "busy";
+    case FIRMWARE_CACHE_FAILED:
+        return "failed";
+    }
+    return "unknown";
+}
@@ -0,0 +1,173 @@
+#ifndef __ESP_FIRMWARE_CACHE__
+#define __ESP_FIRMWARE_CACHE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "flashWriter.h"
+#include "otaSha256.h"
+
+// Quoted, the first 8 bytes of the image's SHA-256 in hex
+#define FIRMWARE_CACHE_ETAG_SIZE 19
+
+enum FirmwareCacheState {
+    FIRMWARE_CACHE_EMPTY,
+    FIRMWARE_CACHE_FILLING,
+    FIRMWARE_CACHE_READY,
+};
+
+struct FirmwareCacheStats {
+    uint32_t requests;
+    uint32_t full;
+    uint32_t partial;
+    uint32_t notModified;
+    uint32_t unsatisfiable;
+    // Answered 503, nothing cached yet or a fill running
+    uint32_t unavailable;
+    uint64_t bytesServed;
+    uint32_t fills;
+};
+
+// What to answer one GET. 200 and 206 stream length bytes from offset with
+// read() and must be ended with endReply() once the connection is gone.
+struct FirmwareCacheReply {
+    int status;
+    size_t offset;
+    size_t length;
+    uint32_t generation;
+};
+
+enum HttpRangeResult {
+    // No usable Range header, serve the whole body
+    HTTP_RANGE_NONE,
+    HTTP_RANGE_OK,
+    HTTP_RANGE_UNSATISFIABLE,
+};
+
+// One update image kept on a FlashDevice (a data partition or PSRAM) for
+// the other devices of a site. The image fills the store from offset 0, a
+// header in the last sector records it once complete, so a cache survives
+// reboots on flash. Fills run on one task; replies and reads on the web
+// server's.
+class FirmwareCache {
+public:
+    FirmwareCache();
+
+    // Picks up an image an earlier boot cached, false when there is none
+    bool begin(FlashDevice* store);
+
+    // Invalidates the cached image. False while a reply is streaming or when
+    // expectedSize (0 if unknown) does not fit. sectorBuffer holds
+    // FLASH_WRITER_SECTOR_SIZE bytes until finishFill() or abortFill().
+    bool startFill(size_t expectedSize, uint8_t* sectorBuffer);
+    bool writeFill(const uint8_t* data, size_t len);
+    bool finishFill();
+    void abortFill();
+
+    // range, ifNoneMatch and ifRange are the request headers, nullptr when
+    // absent
+    FirmwareCacheReply reply(const char* range, const char* ifNoneMatch, const char* ifRange);
+    // Reads straight into the caller's buffer, the response's send buffer on
+    // the device. index counts from the start of the reply. 0 at the end or
+    // once a fill replaced the image the reply was for.
+    size_t read(const FirmwareCacheReply* reply, size_t index, uint8_t* buffer, size_t len);
+    void endReply(const FirmwareCacheReply* reply);
+    // "bytes a-b/size" for a 206, "bytes */size" for a 416, 0 otherwise
+    size_t contentRange(const FirmwareCacheReply* reply, char* output, size_t size) const;
+
+    // Raw access to the cached image for the fill's comparisons
+    bool readImage(size_t offset, uint8_t* buffer, size_t len);
+
+    FirmwareCacheState state() const;
+    // A 200 or 206 is streaming, a fill has to wait
+    bool serving() const;
+    size_t size() const;
+    size_t capacity() const;
+    const char* etag() const;
+    // SHA-256 of the cached image, false unless READY
+    bool sha256(uint8_t output[OTA_SHA256_LEN]) const;
+    void stats(FirmwareCacheStats* output) const;
+
+private:
+    bool writeHeader();
+
+    FlashDevice* store;
+    FlashWriter writer;
+    OtaSha256Context hash;
+    volatile int currentState;
+    volatile uint32_t currentGeneration;
+    volatile int readers;
+    size_t imageSize;
+    size_t filled;
+    char imageEtag[FIRMWARE_CACHE_ETAG_SIZE + 1];
+    uint8_t imageSha256[OTA_SHA256_LEN];
+    FirmwareCacheStats statistics;
+};
+
+// The cached image as if it were downloaded, so the gateway updates itself
+// from the copy it serves instead of fetching the origin twice. The url is
+// ignored.
+class FirmwareCacheTransport : public HalHttpTransport {
+public:
+    explicit FirmwareCacheTransport(FirmwareCache* cache);
+    ~FirmwareCacheTransport();
+
+    bool open(const char* url) override;
+    bool openRange(const char* url, uint32_t offset, uint32_t len) override;
+    int statusCode() override;
+    int64_t contentLength() override;
+    int read(uint8_t* buffer, size_t len) override;
+    bool isComplete() override;
+    void close() override;
+    // Only the ETag is compared, the cache keeps no dates
+    void setValidators(const HalHttpValidators* validators) override;
+    void responseValidators(HalHttpValidators* output) override;
+
+private:
+    bool start(const char* range);
+
+    FirmwareCache* cache;
+    FirmwareCacheReply current;
+    char ifNoneMatch[HAL_HTTP_ETAG_SIZE];
+    bool isOpen;
+    size_t index;
+};
+
+enum FirmwareCacheFetch {
+    FIRMWARE_CACHE_FETCHED,
+    // The origin still serves the cached image, only its start was fetched
+    FIRMWARE_CACHE_CURRENT,
+    // The origin answered with something that is not an update
+    FIRMWARE_CACHE_REJECTED,
+    // A reply is streaming, try again later
+    FIRMWARE_CACHE_BUSY,
+    FIRMWARE_CACHE_FAILED,
+};
+
+// Refreshes the cache from url. The first OTA_IMAGE_CHECK_FETCH_SIZE bytes
+// are fetched with a ranged request first: they hold the bundle manifest
+// with every image's SHA-256, or the app descriptor with the ELF hash, so
+// when they match the cached image the download is skipped. buffer holds at
+// least OTA_IMAGE_CHECK_FETCH_SIZE bytes and sectorBuffer
+// FLASH_WRITER_SECTOR_SIZE. shouldStop may be nullptr. Validators set on
+// the transport beforehand must describe the cached image: a 304 keeps it.
+FirmwareCacheFetch fetchFirmwareCache(FirmwareCache* cache, HalHttpTransport* transport, const char* url,
+                                      uint8_t* buffer, size_t bufferSize, uint8_t* sectorBuffer, bool (*shouldStop)(void));
+
+// What a gateway installs from after fetchFirmwareCache: cached while the
+// cache holds the origin's image, else origin. Validators set for the
+// refresh described the cache, they are dropped from origin so its answer
+// to the fallback is the image and not a 304.
+HalHttpTransport* firmwareCacheSource(const FirmwareCache* cache, FirmwareCacheFetch result, HalHttpTransport* origin, HalHttpTransport* cached);
+
+// Single range only: "bytes=a-b", "bytes=a-" or "bytes=-n". A list of
+// ranges or another unit is ignored, as RFC 7233 allows.
+HttpRangeResult parseHttpRange(const char* header, size_t size, size_t* offset, size_t* length);
+// If-None-Match: "*" or a list of tags, weak ones compared weakly
+bool httpEtagMatches(const char* header, const char* etag);
+
+const char* firmwareCacheStateName(FirmwareCacheState state);
+const char* firmwareCacheFetchName(FirmwareCacheFetch result);
+
+#endif // __ESP_FIRMWARE_CACHE__
@@ -0,0 +1,171 @@
+#include <string.h>
+
+#include "flashWriter.h"
+
+static size_t roundUpToSector(size_t len)
+{
+    return (len + FLASH_WRITER_SECTOR_SIZE - 1) / FLASH_WRITER_SECTOR_SIZE * FLASH_WRITER_SECTOR_SIZE;
+}
+
+FlashWriter::FlashWriter(uint8_t* sectorBuffer, FlashEraseStrategy strategy)
+    : device(nullptr),
+      sectorBuffer(sectorBuffer),
+      strategy(strategy),
+      sectorLength(0),
+      writeOffset(0),
+      erasedEnd(0),
+      eraseLimit(0),
+      eraseAheadWindow(16)
+{
+    memset(&writerStats, 0, sizeof(writerStats));
+}
+
+void FlashWriter::setEraseAheadWindow(int sectors)
+{
+    eraseAheadWindow = sectors;
+}
+
+bool FlashWriter::begin(FlashDevice* flash, size_t expectedSize)
+{
+    device = flash;
+    sectorLength = 0;
+    writeOffset = 0;
+    erasedEnd = 0;
+    memset(&writerStats, 0, sizeof(writerStats));
+
+    size_t partitionSize = device->size();
+    eraseLimit = expectedSize > 0 ? roundUpToSector(expectedSize) : partitionSize;
+    if (eraseLimit > partitionSize)
+    {
+        return false;
+    }
+
+    if (strategy == FLASH_ERASE_BULK && expectedSize > 0)
+    {
+        if (!device->erase(0, eraseLimit))
+        {
+            return false;
+        }
+
+        erasedEnd = eraseLimit;
+        writerStats.sectorsErased += eraseLimit / FLASH_WRITER_SECTOR_SIZE;
+        writerStats.sectorsErasedAhead += eraseLimit / FLASH_WRITER_SECTOR_SIZE;
+    }
+
+    return true;
+}
+
+bool FlashWriter::ensureErased(size_t end)
+{
+    while (erasedEnd < end)
+    {
+        if (erasedEnd >= device->size() || !device->erase(erasedEnd, FLASH_WRITER_SECTOR_SIZE))
+        {
+            return false;
+        }
+
+        erasedEnd += FLASH_WRITER_SECTOR_SIZE;
+        writerStats.sectorsErased++;
+        writerStats.eraseStalls++;
+    }
+
+    return true;
+}
+
+bool FlashWriter::flushSector(size_t len)
+{
+    if (len == 0)
+    {
+        return true;
+    }
+
+    if (!ensureErased(writeOffset + FLASH_WRITER_SECTOR_SIZE) || !device->write(writeOffset, sectorBuffer, len))
+    {
+        return false;
+    }
+
+    writeOffset += len;
+    writerStats.writes++;
+    writerStats.bytesWritten += len;
+    sectorLength = 0;
+    return true;
+}
+
+bool FlashWriter::write(const uint8_t* data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t take = FLASH_WRITER_SECTOR_SIZE - sectorLength;
+        if (take > len)
+        {
+            take = len;
+        }
+
+        memcpy(sectorBuffer + sectorLength, data, take);
+        sectorLength += take;
+        data += take;
+        len -= take;
+
+        if (sectorLength == FLASH_WRITER_SECTOR_SIZE && !flushSector(FLASH_WRITER_SECTOR_SIZE))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FlashWriter::idle(int maxSectors)
+{
+    if (strategy == FLASH_ERASE_ON_DEMAND || device == nullptr)
+    {
+        return false;
+    }
+
+    size_t windowEnd = writeOffset + (size_t)eraseAheadWindow * FLASH_WRITER_SECTOR_SIZE;
+    bool erased = false;
+
+    for (int i = 0; i < maxSectors; i++)
+    {
+        if (erasedEnd >= windowEnd || erasedEnd >= eraseLimit)
+        {
+            break;
+        }
+
+        if (!device->erase(erasedEnd, FLASH_WRITER_SECTOR_SIZE))
+        {
+            return erased;
+        }
+
+        erasedEnd += FLASH_WRITER_SECTOR_SIZE;
+        writerStats.sectorsErased++;
+        writerStats.sectorsErasedAhead++;
+        erased = true;
+    }
+
+    return erased;
+}
+
+bool FlashWriter::finish()
+{
+    return flushSector(sectorLength);
+}
+
+const FlashWriterStats* FlashWriter::stats() const
+{
+    return &writerStats;
+}
+
+const char* flashEraseStrategyName(FlashEraseStrategy strategy)
+{
+    switch (strategy)
+    {
+    case FLASH_ERASE_ON_DEMAND:
+        return "demand";
+    case FLASH_ERASE_AHEAD:
+        return "ahead";
+    case FLASH_ERASE_BULK:
+        return "bulk";
+    }
+    return "unknown";
+}
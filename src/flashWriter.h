@@ -0,0 +1,74 @@
+#ifndef __ESP_FLASH_WRITER__
+#define __ESP_FLASH_WRITER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLASH_WRITER_SECTOR_SIZE 4096
+
+// One partition worth of NOR flash. Offsets are relative to the partition,
+// erase ranges are sector aligned.
+class FlashDevice {
+public:
+    virtual ~FlashDevice() {}
+    virtual size_t size() = 0;
+    virtual bool erase(size_t offset, size_t len) = 0;
+    virtual bool write(size_t offset, const uint8_t* data, size_t len) = 0;
+    virtual bool read(size_t offset, uint8_t* data, size_t len) = 0;
+};
+
+enum FlashEraseStrategy {
+    // Erase each sector right before it is programmed
+    FLASH_ERASE_ON_DEMAND,
+    // Erase upcoming sectors from idle(), fall back to on demand
+    FLASH_ERASE_AHEAD,
+    // Erase the whole expected image in begin()
+    FLASH_ERASE_BULK,
+};
+
+struct FlashWriterStats {
+    uint32_t sectorsErased;
+    uint32_t sectorsErasedAhead;
+    // Erases that had to run inline because the write caught up
+    uint32_t eraseStalls;
+    uint32_t writes;
+    size_t bytesWritten;
+};
+
+// Coalesces arbitrary sized chunks into sector sized, sector aligned
+// programs so each flash operation costs one command sequence, and moves
+// erases off the write path when the caller reports idle time.
+class FlashWriter {
+public:
+    // sectorBuffer must hold FLASH_WRITER_SECTOR_SIZE bytes and outlive the writer
+    FlashWriter(uint8_t* sectorBuffer, FlashEraseStrategy strategy);
+
+    // expectedSize 0 means unknown, bulk erase then degrades to erase ahead
+    bool begin(FlashDevice* device, size_t expectedSize);
+    bool write(const uint8_t* data, size_t len);
+    // Erases at most maxSectors ahead of the write position, returns true
+    // when there was something to erase
+    bool idle(int maxSectors = 1);
+    bool finish();
+
+    const FlashWriterStats* stats() const;
+    void setEraseAheadWindow(int sectors);
+
+private:
+    bool ensureErased(size_t end);
+    bool flushSector(size_t len);
+
+    FlashDevice* device;
+    uint8_t* sectorBuffer;
+    FlashEraseStrategy strategy;
+    size_t sectorLength;
+    size_t writeOffset;
+    size_t erasedEnd;
+    size_t eraseLimit;
+    int eraseAheadWindow;
+    FlashWriterStats writerStats;
+};
+
+const char* flashEraseStrategyName(FlashEraseStrategy strategy);
+
+#endif // __ESP_FLASH_WRITER__
@@ -0,0 +1,165 @@
+#ifndef __ESP_OTA_HAL__
+#define __ESP_OTA_HAL__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flashWriter.h"
+
+// Seams between the update core and the platform. halEsp.cpp implements them
+// on ESP-IDF, native/halPosix.cpp on Linux for the native environment.
+// Logging stays a free function: smartLog is provided by smartLogger.cpp on
+// the device and native/smartLoggerPosix.cpp on the host.
+
+class HalClock {
+public:
+    virtual ~HalClock() {}
+    virtual int64_t nowMicroS() = 0;
+    virtual void sleepMs(uint32_t ms) = 0;
+};
+
+// Key/value store with NVS handle semantics: open a namespace, read or
+// write, commit, close
+class HalStorage {
+public:
+    virtual ~HalStorage() {}
+    virtual bool open(const char* nvsNamespace, bool writable) = 0;
+    // Fails when the key is missing or does not fit outputSize
+    virtual bool getString(const char* key, char* output, size_t outputSize) = 0;
+    virtual bool setString(const char* key, const char* value) = 0;
+    // len holds the buffer size on entry and the stored size on success
+    virtual bool getBlob(const char* key, void* output, size_t* len) = 0;
+    virtual bool setBlob(const char* key, const void* value, size_t len) = 0;
+    virtual bool commit() = 0;
+    virtual void close() = 0;
+};
+
+class HalPartitions {
+public:
+    virtual ~HalPartitions() {}
+    // Next OTA app slot, never the running one. nullptr while the running
+    // image awaits its rollback verdict: the slot holds the image to go back to.
+    virtual FlashDevice* openApp() = 0;
+    // A filesystem partition (SPIFFS, FAT or LittleFS) by label, nullptr for
+    // anything else: NVS, otadata, PHY data or the staging partition
+    virtual FlashDevice* openData(const char* label) = 0;
+    // Holds a data image of size bytes until the app it came with is
+    // validated, so the partition it replaces is only touched then. nullptr
+    // without one.
+    virtual FlashDevice* openStaging(size_t size) = 0;
+    virtual const char* label(FlashDevice* partition) = 0;
+    // Label of the app slot that booted
+    virtual const char* runningLabel() = 0;
+    // Full image check of a freshly written app slot
+    virtual bool verifyApp(FlashDevice* partition) = 0;
+    virtual bool setBootPartition(FlashDevice* partition) = 0;
+};
+
+#define HAL_HTTP_ETAG_SIZE 72
+#define HAL_HTTP_DATE_SIZE 32
+
+// What a server said about a body it sent, echoed back on the next request
+// so an unchanged body costs a 304. Empty strings when absent.
+struct HalHttpValidators {
+    char etag[HAL_HTTP_ETAG_SIZE];
+    char lastModified[HAL_HTTP_DATE_SIZE];
+};
+
+// Blocking HTTP GET in streaming mode: open, inspect status and headers,
+// then read the body in caller sized pieces
+class HalHttpTransport {
+public:
+    virtual ~HalHttpTransport() {}
+    virtual bool open(const char* url) = 0;
+    // Asks for len bytes at offset. A server without range support answers
+    // 200 with the whole body, statusCode() tells which. Transports that
+    // cannot send the header only serve offset 0 that way.
+    virtual bool openRange(const char* url, uint32_t offset, uint32_t len)
+    {
+        return offset == 0 && open(url);
+    }
+    virtual int statusCode() = 0;
+    // -1 when the server did not announce a length
+    virtual int64_t contentLength() = 0;
+    // Bytes read, 0 at the end of the body, negative on error
+    virtual int read(uint8_t* buffer, size_t len) = 0;
+    virtual bool isComplete() = 0;
+    virtual void close() = 0;
+    // Sent as If-None-Match and If-Modified-Since with the next request
+    // only, nullptr sends neither. A transport that cannot send them never
+    // sees a 304.
+    virtual void setValidators(const HalHttpValidators* validators) {}
+    // ETag and Last-Modified of the last response, still there after close()
+    virtual void responseValidators(HalHttpValidators* output)
+    {
+        output->etag[0] = 0;
+        output->lastModified[0] = 0;
+    }
+};
+
+#define HAL_WIFI_SSID_SIZE 33
+
+// Station side of the radio
+struct HalWifiLink {
+    uint8_t bssid[6];
+    uint8_t channel;
+    // IPv4 addresses in network byte order, as lwIP keeps them. ip 0 means
+    // DHCP.
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t netmask;
+    uint32_t dns;
+};
+
+enum HalWifiStatus {
+    HAL_WIFI_CONNECTING,
+    // Associated and holding an IP address
+    HAL_WIFI_CONNECTED,
+    // Definitive for this attempt: SSID not found or authentication refused
+    HAL_WIFI_FAILED,
+    HAL_WIFI_DISCONNECTED,
+};
+
+struct HalWifiNetwork {
+    char ssid[HAL_WIFI_SSID_SIZE];
+    int8_t rssi;
+    uint8_t channel;
+    uint8_t bssid[6];
+};
+
+class HalWifi {
+public:
+    virtual ~HalWifi() {}
+    // Starts joining without waiting. With a link the radio goes straight to
+    // that BSSID and channel, skipping the scan, and takes the IP config as
+    // static unless link->ip is 0. Without one it scans and asks DHCP.
+    virtual bool begin(const char* ssid, const char* password, const HalWifiLink* link) = 0;
+    virtual HalWifiStatus status() = 0;
+    // Current association, only valid while connected
+    virtual bool link(HalWifiLink* output) = 0;
+    // Signal of the current association in dBm
+    virtual int rssi() = 0;
+    virtual void disconnect() = 0;
+    // Background scan: scanResults returns -1 while it runs, then the number
+    // of networks written (at most max)
+    virtual bool startScan() = 0;
+    virtual int scanResults(HalWifiNetwork* output, int max) = 0;
+};
+
+enum HalPowerLevel {
+    HAL_POWER_FULL,
+    // Associated, radio in modem sleep between beacons, CPU clocked down
+    HAL_POWER_SAVE,
+    // Radio stopped, the chip may light sleep
+    HAL_POWER_RADIO_OFF,
+};
+
+class HalPower {
+public:
+    virtual ~HalPower() {}
+    virtual void setLevel(HalPowerLevel level) = 0;
+    // Halts the chip until the timer fires, only at HAL_POWER_RADIO_OFF
+    virtual void lightSleep(int64_t microS) = 0;
+};
+
+#endif // __ESP_OTA_HAL__
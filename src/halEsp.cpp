@@ -0,0 +1,553 @@
+#include <Arduino.h>
+#include <WiFi.h>
+#include <esp_ota_ops.h>
+#include <esp_image_format.h>
+#include <esp_sleep.h>
+#include <esp_heap_caps.h>
+
+#include "smartLogger.h"
+#include "halEsp.h"
+
+int64_t EspClock::nowMicroS()
+{
+    return esp_timer_get_time();
+}
+
+void EspClock::sleepMs(uint32_t ms)
+{
+    vTaskDelay(ms / portTICK_PERIOD_MS);
+}
+
+EspStorage::EspStorage()
+    : handle(0),
+      isOpen(false)
+{
+}
+
+bool EspStorage::open(const char* nvsNamespace, bool writable)
+{
+    esp_err_t returnStatus = nvs_open(nvsNamespace, writable ? NVS_READWRITE : NVS_READONLY, &handle);
+
+    if (returnStatus != ESP_OK)
+    {
+        SMART_LOGE("NVS", "Error (%s) opening NVS handle", esp_err_to_name(returnStatus));
+        return false;
+    }
+
+    isOpen = true;
+    return true;
+}
+
+bool EspStorage::getString(const char* key, char* output, size_t outputSize)
+{
+    size_t requiredSize = outputSize;
+    esp_err_t returnStatus = nvs_get_str(handle, key, output, &requiredSize);
+
+    if (returnStatus != ESP_OK)
+    {
+        SMART_LOGE("NVS", "Error reading %s (%s)", key, esp_err_to_name(returnStatus));
+        return false;
+    }
+
+    return true;
+}
+
+bool EspStorage::setString(const char* key, const char* value)
+{
+    esp_err_t returnStatus = nvs_set_str(handle, key, value);
+
+    if (returnStatus != ESP_OK)
+    {
+        SMART_LOGE("NVS", "Error setting %s (%s)", key, esp_err_to_name(returnStatus));
+        return false;
+    }
+
+    return true;
+}
+
+bool EspStorage::getBlob(const char* key, void* output, size_t* len)
+{
+    return nvs_get_blob(handle, key, output, len) == ESP_OK;
+}
+
+bool EspStorage::setBlob(const char* key, const void* value, size_t len)
+{
+    esp_err_t returnStatus = nvs_set_blob(handle, key, value, len);
+
+    if (returnStatus != ESP_OK)
+    {
+        SMART_LOGE("NVS", "Error setting %s (%s)", key, esp_err_to_name(returnStatus));
+        return false;
+    }
+
+    return true;
+}
+
+bool EspStorage::commit()
+{
+    return nvs_commit(handle) == ESP_OK;
+}
+
+void EspStorage::close()
+{
+    if (isOpen)
+    {
+        nvs_close(handle);
+        isOpen = false;
+    }
+}
+
+size_t EspPartitionFlash::size()
+{
+    return partition->size;
+}
+
+bool EspPartitionFlash::erase(size_t offset, size_t len)
+{
+    return esp_partition_erase_range(partition, offset, len) == ESP_OK;
+}
+
+bool EspPartitionFlash::write(size_t offset, const uint8_t* data, size_t len)
+{
+    return esp_partition_write(partition, offset, data, len) == ESP_OK;
+}
+
+bool EspPartitionFlash::read(size_t offset, uint8_t* data, size_t len)
+{
+    return esp_partition_read(partition, offset, data, len) == ESP_OK;
+}
+
+bool EspPsramFlash::begin(size_t size)
+{
+    if (memory == NULL)
+    {
+        memory = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+        length = memory != NULL ? size : 0;
+
+        if (memory != NULL)
+        {
+            memset(memory, 0xFF, size);
+        }
+    }
+
+    return memory != NULL;
+}
+
+size_t EspPsramFlash::size()
+{
+    return length;
+}
+
+bool EspPsramFlash::erase(size_t offset, size_t len)
+{
+    if (offset + len > length)
+    {
+        return false;
+    }
+
+    memset(memory + offset, 0xFF, len);
+    return true;
+}
+
+bool EspPsramFlash::write(size_t offset, const uint8_t* data, size_t len)
+{
+    if (offset + len > length)
+    {
+        return false;
+    }
+
+    memcpy(memory + offset, data, len);
+    return true;
+}
+
+bool EspPsramFlash::read(size_t offset, uint8_t* data, size_t len)
+{
+    if (offset + len > length)
+    {
+        return false;
+    }
+
+    memcpy(data, memory + offset, len);
+    return true;
+}
+
+FlashDevice* EspPartitions::openApp()
+{
+    esp_ota_img_states_t state;
+
+    // What esp_ota_begin() refuses, the raw partition writes would not
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY)
+    {
+        SMART_LOGW("OTA", "Running image not verified yet, keeping the previous one");
+        return nullptr;
+    }
+
+    appFlash.partition = esp_ota_get_next_update_partition(NULL);
+    return appFlash.partition != NULL ? &appFlash : nullptr;
+}
+
+FlashDevice* EspPartitions::openData(const char* label)
+{
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+
+    if (partition == NULL)
+    {
+        return nullptr;
+    }
+
+    bool filesystem = partition->subtype == ESP_PARTITION_SUBTYPE_DATA_FAT ||
+                      partition->subtype == ESP_PARTITION_SUBTYPE_DATA_SPIFFS ||
+                      partition->subtype == PARTITION_SUBTYPE_DATA_LITTLEFS;
+
+    if (!filesystem || strcmp(label, OTA_STAGING_PARTITION) == 0)
+    {
+        SMART_LOGE("OTA", "%s is no filesystem partition, not writing it", label);
+        return nullptr;
+    }
+
+    dataFlash.partition = partition;
+    return &dataFlash;
+}
+
+FlashDevice* EspPartitions::openStaging(size_t size)
+{
+    stagingFlash.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, OTA_STAGING_PARTITION);
+    return stagingFlash.partition != NULL && stagingFlash.partition->size >= size ? &stagingFlash : nullptr;
+}
+
+const char* EspPartitions::label(FlashDevice* partition)
+{
+    return ((EspPartitionFlash*)partition)->partition->label;
+}
+
+const char* EspPartitions::runningLabel()
+{
+    return esp_ota_get_running_partition()->label;
+}
+
+bool EspPartitions::verifyApp(FlashDevice* partition)
+{
+    const esp_partition_t* app = ((EspPartitionFlash*)partition)->partition;
+    const esp_partition_pos_t position = {
+        .offset = app->address,
+        .size = app->size,
+    };
+    esp_image_metadata_t metadata;
+
+    return esp_image_verify(ESP_IMAGE_VERIFY, &position, &metadata) == ESP_OK;
+}
+
+bool EspPartitions::setBootPartition(FlashDevice* partition)
+{
+    esp_err_t err = esp_ota_set_boot_partition(((EspPartitionFlash*)partition)->partition);
+
+    if (err != ESP_OK)
+    {
+        SMART_LOGE("OTA", "esp_ota_set_boot_partition failed (%s)", esp_err_to_name(err));
+        return false;
+    }
+
+    return true;
+}
+
+EspHttpTransport::EspHttpTransport(const char* certPem, http_event_handle_cb eventHandler, int bufferSize)
+    : certPem(certPem),
+      eventHandler(eventHandler),
+      hasValidators(false),
+      bufferSize(bufferSize),
+      client(NULL),
+      length(-1)
+{
+    lastValidators.etag[0] = 0;
+    lastValidators.lastModified[0] = 0;
+}
+
+EspHttpTransport::~EspHttpTransport()
+{
+    close();
+}
+
+bool EspHttpTransport::open(const char* url)
+{
+    return start(url, nullptr);
+}
+
+bool EspHttpTransport::openRange(const char* url, uint32_t offset, uint32_t len)
+{
+    char range[40];
+    snprintf(range, sizeof(range), "bytes=%u-%u", offset, offset + len - 1);
+    return start(url, range);
+}
+
+bool EspHttpTransport::start(const char* url, const char* range)
+{
+    esp_http_client_config_t config = {
+        .url = url,
+        .cert_pem = certPem,
+        .event_handler = onEvent,
+        .buffer_size = bufferSize,
+        .user_data = this,
+        .keep_alive_enable = true,
+    };
+
+    lastValidators.etag[0] = 0;
+    lastValidators.lastModified[0] = 0;
+
+    client = esp_http_client_init(&config);
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    if (range != nullptr)
+    {
+        esp_http_client_set_header(client, "Range", range);
+    }
+
+    if (hasValidators)
+    {
+        if (sendValidators.etag[0] != 0)
+        {
+            esp_http_client_set_header(client, "If-None-Match", sendValidators.etag);
+        }
+        if (sendValidators.lastModified[0] != 0)
+        {
+            esp_http_client_set_header(client, "If-Modified-Since", sendValidators.lastModified);
+        }
+        hasValidators = false;
+    }
+
+    esp_err_t err = esp_http_client_open(client, 0);
+    if (err != ESP_OK)
+    {
+        SMART_LOGE("HTTP", "Connection failed (%s)", esp_err_to_name(err));
+        return false;
+    }
+
+    length = esp_http_client_fetch_headers(client);
+    return true;
+}
+
+int EspHttpTransport::statusCode()
+{
+    return esp_http_client_get_status_code(client);
+}
+
+int64_t EspHttpTransport::contentLength()
+{
+    return length > 0 ? length : -1;
+}
+
+int EspHttpTransport::read(uint8_t* buffer, size_t len)
+{
+    return esp_http_client_read(client, (char*)buffer, len);
+}
+
+bool EspHttpTransport::isComplete()
+{
+    return esp_http_client_is_complete_data_received(client);
+}
+
+void EspHttpTransport::close()
+{
+    if (client != NULL)
+    {
+        esp_http_client_close(client);
+        esp_http_client_cleanup(client);
+        client = NULL;
+    }
+}
+
+void EspHttpTransport::setValidators(const HalHttpValidators* validators)
+{
+    hasValidators = validators != nullptr;
+    if (hasValidators)
+    {
+        sendValidators = *validators;
+    }
+}
+
+void EspHttpTransport::responseValidators(HalHttpValidators* output)
+{
+    *output = lastValidators;
+}
+
+esp_err_t EspHttpTransport::onEvent(esp_http_client_event_t* event)
+{
+    EspHttpTransport* transport = (EspHttpTransport*)event->user_data;
+
+    if (event->event_id == HTTP_EVENT_ON_HEADER)
+    {
+        char* output = nullptr;
+        size_t size = 0;
+
+        if (strcasecmp(event->header_key, "ETag") == 0)
+        {
+            output = transport->lastValidators.etag;
+            size = sizeof(transport->lastValidators.etag);
+        }
+        else if (strcasecmp(event->header_key, "Last-Modified") == 0)
+        {
+            output = transport->lastValidators.lastModified;
+            size = sizeof(transport->lastValidators.lastModified);
+        }
+
+        // A value that does not fit would not match the server's anyway
+        if (output != nullptr && strlen(event->header_value) < size)
+        {
+            strcpy(output, event->header_value);
+        }
+    }
+
+    return transport->eventHandler != nullptr ? transport->eventHandler(event) : ESP_OK;
+}
+
+bool EspWifi::begin(const char* ssid, const char* password, const HalWifiLink* link)
+{
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);
+
+    if (link != nullptr && link->ip != 0)
+    {
+        WiFi.config(IPAddress(link->ip), IPAddress(link->gateway), IPAddress(link->netmask), IPAddress(link->dns));
+    }
+    else
+    {
+        // Back to DHCP
+        WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    }
+
+    if (link != nullptr)
+    {
+        return WiFi.begin(ssid, password, link->channel, link->bssid, true) != WL_CONNECT_FAILED;
+    }
+
+    return WiFi.begin(ssid, password) != WL_CONNECT_FAILED;
+}
+
+HalWifiStatus EspWifi::status()
+{
+    switch (WiFi.status())
+    {
+    case WL_CONNECTED:
+        return HAL_WIFI_CONNECTED;
+    case WL_NO_SSID_AVAIL:
+    case WL_CONNECT_FAILED:
+        return HAL_WIFI_FAILED;
+    case WL_CONNECTION_LOST:
+        return HAL_WIFI_DISCONNECTED;
+    default:
+        return HAL_WIFI_CONNECTING;
+    }
+}
+
+bool EspWifi::link(HalWifiLink* output)
+{
+    uint8_t* bssid = WiFi.BSSID();
+
+    if (WiFi.status() != WL_CONNECTED || bssid == NULL)
+    {
+        return false;
+    }
+
+    memcpy(output->bssid, bssid, sizeof(output->bssid));
+    output->channel = WiFi.channel();
+    output->ip = WiFi.localIP();
+    output->gateway = WiFi.gatewayIP();
+    output->netmask = WiFi.subnetMask();
+    output->dns = WiFi.dnsIP();
+    return true;
+}
+
+int EspWifi::rssi()
+{
+    return WiFi.RSSI();
+}
+
+void EspWifi::disconnect()
+{
+    WiFi.disconnect();
+}
+
+bool EspWifi::startScan()
+{
+    WiFi.persistent(false);
+    WiFi.setAutoReconnect(false);
+    WiFi.scanDelete();
+    return WiFi.scanNetworks(true) == WIFI_SCAN_RUNNING;
+}
+
+int EspWifi::scanResults(HalWifiNetwork* output, int max)
+{
+    int16_t found = WiFi.scanComplete();
+
+    if (found == WIFI_SCAN_RUNNING)
+    {
+        return -1;
+    }
+
+    int count = 0;
+
+    for (int i = 0; i < found && count < max; i++)
+    {
+        HalWifiNetwork* network = &output[count++];
+        memset(network, 0, sizeof(*network));
+        strncpy(network->ssid, WiFi.SSID(i).c_str(), sizeof(network->ssid) - 1);
+        network->rssi = WiFi.RSSI(i);
+        network->channel = WiFi.channel(i);
+        memcpy(network->bssid, WiFi.BSSID(i), sizeof(network->bssid));
+    }
+
+    WiFi.scanDelete();
+    return count;
+}
+
+void EspPower::setLevel(HalPowerLevel level)
+{
+    switch (level)
+    {
+    case HAL_POWER_FULL:
+        setCpuFrequencyMhz(240);
+        WiFi.setSleep(WIFI_PS_NONE);
+        break;
+    case HAL_POWER_SAVE:
+        // Wakes for every third DTIM beacon, a frame queued at the AP
+        // waits a few hundred ms at most
+        WiFi.setSleep(WIFI_PS_MAX_MODEM);
+        setCpuFrequencyMhz(80);
+        break;
+    case HAL_POWER_RADIO_OFF:
+        WiFi.mode(WIFI_OFF);
+        setCpuFrequencyMhz(80);
+        break;
+    }
+}
+
+void EspPower::lightSleep(int64_t microS)
+{
+    esp_sleep_enable_timer_wakeup(microS);
+    esp_light_sleep_start();
+}
+
+bool EspRollbackPlatform::isPendingVerify()
+{
+    esp_ota_img_states_t state;
+    return esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK &&
+           state == ESP_OTA_IMG_PENDING_VERIFY;
+}
+
+bool EspRollbackPlatform::markValid()
+{
+    return esp_ota_mark_app_valid_cancel_rollback() == ESP_OK;
+}
+
+void EspRollbackPlatform::rollback()
+{
+    SMART_LOGW("Rollback", "Health checks failed, rolling back");
+    esp_ota_mark_app_invalid_rollback_and_reboot();
+}
+
+int64_t EspRollbackPlatform::nowMicroS()
+{
+    return esp_timer_get_time();
+}
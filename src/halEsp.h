@@ -0,0 +1,144 @@
+#ifndef __ESP_OTA_HAL_ESP__
+#define __ESP_OTA_HAL_ESP__
+
+#include <nvs.h>
+#include <esp_partition.h>
+#include <esp_http_client.h>
+
+#include "hal.h"
+#include "otaRollback.h"
+
+class EspClock : public HalClock {
+public:
+    int64_t nowMicroS() override;
+    void sleepMs(uint32_t ms) override;
+};
+
+class EspStorage : public HalStorage {
+public:
+    EspStorage();
+
+    bool open(const char* nvsNamespace, bool writable) override;
+    bool getString(const char* key, char* output, size_t outputSize) override;
+    bool setString(const char* key, const char* value) override;
+    bool getBlob(const char* key, void* output, size_t* len) override;
+    bool setBlob(const char* key, const void* value, size_t len) override;
+    bool commit() override;
+    void close() override;
+
+private:
+    nvs_handle_t handle;
+    bool isOpen;
+};
+
+class EspPartitionFlash : public FlashDevice {
+public:
+    size_t size() override;
+    bool erase(size_t offset, size_t len) override;
+    bool write(size_t offset, const uint8_t* data, size_t len) override;
+    bool read(size_t offset, uint8_t* data, size_t len) override;
+
+    const esp_partition_t* partition = NULL;
+};
+
+// PSRAM standing in for a partition, for a firmware cache on boards without
+// a spare data partition. Gone after a reboot.
+class EspPsramFlash : public FlashDevice {
+public:
+    // False when PSRAM cannot hold size bytes
+    bool begin(size_t size);
+
+    size_t size() override;
+    bool erase(size_t offset, size_t len) override;
+    bool write(size_t offset, const uint8_t* data, size_t len) override;
+    bool read(size_t offset, uint8_t* data, size_t len) override;
+
+private:
+    uint8_t* memory = NULL;
+    size_t length = 0;
+};
+
+// Data partition that holds a bundle's data image until its app is validated.
+// Without one in the partition table bundles carrying data images are refused.
+#define OTA_STAGING_PARTITION "otastage"
+// esp_partition_subtype_t has no LittleFS entry before IDF 5.1
+#define PARTITION_SUBTYPE_DATA_LITTLEFS ((esp_partition_subtype_t)0x83)
+
+class EspPartitions : public HalPartitions {
+public:
+    FlashDevice* openApp() override;
+    FlashDevice* openData(const char* label) override;
+    FlashDevice* openStaging(size_t size) override;
+    const char* label(FlashDevice* partition) override;
+    const char* runningLabel() override;
+    bool verifyApp(FlashDevice* partition) override;
+    bool setBootPartition(FlashDevice* partition) override;
+
+private:
+    EspPartitionFlash appFlash;
+    EspPartitionFlash dataFlash;
+    EspPartitionFlash stagingFlash;
+};
+
+class EspHttpTransport : public HalHttpTransport {
+public:
+    // bufferSize sizes the client's receive buffer, 0 keeps the IDF default
+    EspHttpTransport(const char* certPem, http_event_handle_cb eventHandler, int bufferSize = 0);
+    ~EspHttpTransport();
+
+    bool open(const char* url) override;
+    bool openRange(const char* url, uint32_t offset, uint32_t len) override;
+    int statusCode() override;
+    int64_t contentLength() override;
+    int read(uint8_t* buffer, size_t len) override;
+    bool isComplete() override;
+    void close() override;
+    void setValidators(const HalHttpValidators* validators) override;
+    void responseValidators(HalHttpValidators* output) override;
+
+private:
+    bool start(const char* url, const char* range);
+    // Picks ETag and Last-Modified off the response, then hands the event on
+    // to eventHandler
+    static esp_err_t onEvent(esp_http_client_event_t* event);
+
+    const char* certPem;
+    http_event_handle_cb eventHandler;
+    HalHttpValidators sendValidators;
+    bool hasValidators;
+    HalHttpValidators lastValidators;
+    int bufferSize;
+    esp_http_client_handle_t client;
+    int64_t length;
+};
+
+// Arduino WiFi station. Auto reconnect and Arduino's own NVS copy of the
+// credentials are turned off, WifiManager decides when to join.
+class EspWifi : public HalWifi {
+public:
+    bool begin(const char* ssid, const char* password, const HalWifiLink* link) override;
+    HalWifiStatus status() override;
+    bool link(HalWifiLink* output) override;
+    int rssi() override;
+    void disconnect() override;
+    bool startScan() override;
+    int scanResults(HalWifiNetwork* output, int max) override;
+};
+
+// Power save through the Arduino WiFi sleep setting and CPU clock, light
+// sleep on the timer only
+class EspPower : public HalPower {
+public:
+    void setLevel(HalPowerLevel level) override;
+    void lightSleep(int64_t microS) override;
+};
+
+class EspRollbackPlatform : public RollbackPlatform {
+public:
+    bool isPendingVerify() override;
+    bool markValid() override;
+    void rollback() override;
+    int64_t nowMicroS() override;
+};
+
+#endif // __ESP_OTA_HAL_ESP__
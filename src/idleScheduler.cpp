@@ -0,0 +1,259 @@
+#include <string.h>
+
+#include "idleScheduler.h"
+#include "smartLogger.h"
+
+// Typical ESP32-S3 module figures: Wi-Fi connected without power save at
+// 240 MHz, DTIM3 modem sleep at 80 MHz, light sleep with the radio off.
+// Measure the board and override them for real budgets.
+static const IdleConfig defaultIdleConfig = {
+    .mode = IDLE_MODE_OFF,
+    .checkIntervalMicroS = 0,
+    .idleAfterMicroS = 10 * 1000000LL,
+    .maxSleepMicroS = 60 * 1000000LL,
+    .wakeTimeoutMicroS = 30 * 1000000LL,
+    .microAmps = {100000, 25000, 240},
+};
+
+IdleScheduler::IdleScheduler(HalPower* power, HalClock* clock, WifiManager* wifi)
+    : power(power),
+      clock(clock),
+      wifi(wifi),
+      config(defaultIdleConfig),
+      level(HAL_POWER_FULL),
+      currentState(IDLE_STATE_ACTIVE),
+      activityPending(false),
+      busy(false),
+      checkPending(false),
+      lastActivityMicroS(0),
+      nextCheckMicroS(0),
+      stateStartMicroS(0),
+      accountedMicroS(0),
+      startMicroS(0)
+{
+    memset(&statistics, 0, sizeof(statistics));
+    statistics.lastWakeMicroS = -1;
+    statistics.maxWakeMicroS = -1;
+}
+
+void IdleScheduler::setConfig(const IdleConfig* idleConfig)
+{
+    config = *idleConfig;
+    nextCheckMicroS = clock->nowMicroS() + config.checkIntervalMicroS;
+
+    // Wake through the normal path, the next idle entry uses the new mode
+    activityPending = true;
+}
+
+const IdleConfig* IdleScheduler::getConfig() const
+{
+    return &config;
+}
+
+void IdleScheduler::begin()
+{
+    int64_t now = clock->nowMicroS();
+
+    startMicroS = now;
+    accountedMicroS = now;
+    lastActivityMicroS = now;
+    nextCheckMicroS = now + config.checkIntervalMicroS;
+    enter(IDLE_STATE_ACTIVE, now);
+}
+
+IdleAction IdleScheduler::poll()
+{
+    int64_t now = clock->nowMicroS();
+    account(now);
+
+    if (activityPending)
+    {
+        activityPending = false;
+        lastActivityMicroS = now;
+    }
+
+    if (config.checkIntervalMicroS > 0 && now >= nextCheckMicroS)
+    {
+        checkPending = true;
+        nextCheckMicroS = now + config.checkIntervalMicroS;
+    }
+
+    switch (currentState)
+    {
+    case IDLE_STATE_ACTIVE:
+        if (checkPending && wifi->isConnected())
+        {
+            checkPending = false;
+            statistics.checks++;
+            return IDLE_ACTION_CHECK;
+        }
+
+        if (config.mode != IDLE_MODE_OFF && !busy && !checkPending &&
+            now - lastActivityMicroS >= config.idleAfterMicroS)
+        {
+            enterIdle(now);
+        }
+        break;
+
+    case IDLE_STATE_IDLE:
+        if (checkPending || lastActivityMicroS > stateStartMicroS || config.mode == IDLE_MODE_OFF)
+        {
+            wake(now);
+        }
+        else if (level == HAL_POWER_RADIO_OFF)
+        {
+            int64_t sleepMicroS = config.maxSleepMicroS;
+
+            if (config.checkIntervalMicroS > 0 && nextCheckMicroS - now < sleepMicroS)
+            {
+                sleepMicroS = nextCheckMicroS - now;
+            }
+
+            if (sleepMicroS > 0)
+            {
+                power->lightSleep(sleepMicroS);
+            }
+        }
+        break;
+
+    case IDLE_STATE_WAKING:
+        if (wifi->isConnected())
+        {
+            statistics.lastWakeMicroS = now - stateStartMicroS;
+            if (statistics.lastWakeMicroS > statistics.maxWakeMicroS)
+            {
+                statistics.maxWakeMicroS = statistics.lastWakeMicroS;
+            }
+
+            SMART_LOGD("Idle", "Ready %lld ms after wake", statistics.lastWakeMicroS / 1000);
+            lastActivityMicroS = now;
+            enter(IDLE_STATE_ACTIVE, now);
+        }
+        else if (now - stateStartMicroS >= config.wakeTimeoutMicroS)
+        {
+            // Try again at the next check rather than burning the battery
+            // on an unreachable AP
+            statistics.failedWakes++;
+            checkPending = false;
+            SMART_LOGW("Idle", "Network not back after %lld ms", (now - stateStartMicroS) / 1000);
+            enterIdle(now);
+        }
+        break;
+    }
+
+    return IDLE_ACTION_NONE;
+}
+
+void IdleScheduler::noteActivity()
+{
+    activityPending = true;
+}
+
+void IdleScheduler::setBusy(bool value)
+{
+    busy = value;
+}
+
+IdleState IdleScheduler::state() const
+{
+    return currentState;
+}
+
+void IdleScheduler::stats(IdleStats* output) const
+{
+    int64_t now = clock->nowMicroS();
+    uint64_t microAmpMicroS = 0;
+
+    *output = statistics;
+
+    if (now > accountedMicroS)
+    {
+        output->levelMicroS[level] += now - accountedMicroS;
+    }
+
+    for (int i = 0; i < 3; i++)
+    {
+        microAmpMicroS += (uint64_t)output->levelMicroS[i] * config.microAmps[i];
+    }
+
+    output->microAmpHours = microAmpMicroS / 3600000000ULL;
+    output->averageMicroAmps = now > startMicroS ? microAmpMicroS / (now - startMicroS) : config.microAmps[level];
+}
+
+// Time since the last poll is charged to the level it was spent at,
+// including a light sleep that just returned
+void IdleScheduler::account(int64_t now)
+{
+    if (now > accountedMicroS)
+    {
+        statistics.levelMicroS[level] += now - accountedMicroS;
+        accountedMicroS = now;
+    }
+}
+
+void IdleScheduler::enterIdle(int64_t now)
+{
+    // Without scheduled checks nothing would ever turn the radio back on
+    if (config.mode == IDLE_MODE_RADIO_OFF && config.checkIntervalMicroS > 0)
+    {
+        wifi->suspend();
+        level = HAL_POWER_RADIO_OFF;
+    }
+    else
+    {
+        level = HAL_POWER_SAVE;
+    }
+
+    power->setLevel(level);
+    enter(IDLE_STATE_IDLE, now);
+}
+
+void IdleScheduler::wake(int64_t now)
+{
+    bool radioWasOff = level == HAL_POWER_RADIO_OFF;
+
+    statistics.wakes++;
+    level = HAL_POWER_FULL;
+    power->setLevel(level);
+
+    if (radioWasOff)
+    {
+        wifi->resume();
+    }
+
+    enter(IDLE_STATE_WAKING, now);
+}
+
+void IdleScheduler::enter(IdleState next, int64_t now)
+{
+    currentState = next;
+    stateStartMicroS = now;
+}
+
+const char* idleModeName(IdleMode mode)
+{
+    switch (mode)
+    {
+    case IDLE_MODE_OFF:
+        return "off";
+    case IDLE_MODE_MODEM:
+        return "modem";
+    case IDLE_MODE_RADIO_OFF:
+        return "radio-off";
+    }
+    return "unknown";
+}
+
+const char* idleStateName(IdleState state)
+{
+    switch (state)
+    {
+    case IDLE_STATE_ACTIVE:
+        return "active";
+    case IDLE_STATE_IDLE:
+        return "idle";
+    case IDLE_STATE_WAKING:
+        return "waking";
+    }
+    return "unknown";
+}
@@ -0,0 +1,106 @@
+#ifndef __ESP_IDLE_SCHEDULER__
+#define __ESP_IDLE_SCHEDULER__
+
+#include "hal.h"
+#include "wifiManager.h"
+
+enum IdleMode {
+    // Always at full power, the behaviour before idle modes existed
+    IDLE_MODE_OFF,
+    // Stay associated in modem sleep, WebSocket commands still arrive
+    IDLE_MODE_MODEM,
+    // Stop the radio and light sleep until the next check, unreachable in
+    // between. Needs a check interval, otherwise behaves like modem mode.
+    IDLE_MODE_RADIO_OFF,
+};
+
+enum IdleState {
+    IDLE_STATE_ACTIVE,
+    IDLE_STATE_IDLE,
+    // Powering up, waiting for the network to be usable
+    IDLE_STATE_WAKING,
+};
+
+enum IdleAction {
+    IDLE_ACTION_NONE,
+    // An update check is due and the network is up
+    IDLE_ACTION_CHECK,
+};
+
+struct IdleConfig {
+    IdleMode mode;
+    // 0 disables scheduled checks
+    int64_t checkIntervalMicroS;
+    // Quiet time at full power before dropping to idle
+    int64_t idleAfterMicroS;
+    // Longest single light sleep, bounds how late a changed schedule is seen
+    int64_t maxSleepMicroS;
+    // Give up on a wake that never gets the network back
+    int64_t wakeTimeoutMicroS;
+    // Board supply current per power level, for the charge estimate
+    uint32_t microAmps[3];
+};
+
+struct IdleStats {
+    // Time spent at each HalPowerLevel
+    int64_t levelMicroS[3];
+    uint32_t wakes;
+    uint32_t failedWakes;
+    uint32_t checks;
+    // Wake to network ready, -1 before the first wake
+    int64_t lastWakeMicroS;
+    int64_t maxWakeMicroS;
+    // Integrated from levelMicroS and microAmps
+    uint64_t microAmpHours;
+    uint32_t averageMicroAmps;
+};
+
+// Decides when the device may drop its power level between update checks
+// and brings the network back when a check is due or, in modem mode, when a
+// command arrives. Polled from the Wi-Fi task, so it never races the
+// WifiManager it suspends and resumes.
+class IdleScheduler {
+public:
+    IdleScheduler(HalPower* power, HalClock* clock, WifiManager* wifi);
+
+    void setConfig(const IdleConfig* config);
+    const IdleConfig* getConfig() const;
+    void begin();
+    IdleAction poll();
+
+    // Callable from any task
+    void noteActivity();
+    // An update or rollback check in progress keeps the device active
+    void setBusy(bool busy);
+
+    IdleState state() const;
+    // Snapshot including the time at the current level, safe from any task
+    void stats(IdleStats* output) const;
+
+private:
+    void account(int64_t now);
+    void enterIdle(int64_t now);
+    void wake(int64_t now);
+    void enter(IdleState next, int64_t now);
+
+    HalPower* power;
+    HalClock* clock;
+    WifiManager* wifi;
+    IdleConfig config;
+    IdleStats statistics;
+    HalPowerLevel level;
+    IdleState currentState;
+    volatile bool activityPending;
+    bool busy;
+    bool checkPending;
+    int64_t lastActivityMicroS;
+    int64_t nextCheckMicroS;
+    int64_t stateStartMicroS;
+    int64_t accountedMicroS;
+    int64_t startMicroS;
+};
+
+const char* idleModeName(IdleMode mode);
+const char* idleStateName(IdleState state);
+
+#endif // __ESP_IDLE_SCHEDULER__
@@ -0,0 +1,112 @@
+#include <string.h>
+
+#include "messagePool.h"
+
+static void raiseHighWater(std::atomic<uint32_t>* highWater, uint32_t value)
+{
+    uint32_t current = highWater->load();
+
+    while (value > current && !highWater->compare_exchange_weak(current, value))
+    {
+    }
+}
+
+MessagePool::MessagePool()
+    : slabsInUse(0),
+      slabsHighWater(0),
+      slabsExhausted(0),
+      handlesInUse(0),
+      handlesHighWater(0),
+      handlesExhausted(0),
+      messages(0),
+      nextHandle(0)
+{
+    for (int i = 0; i < MESSAGE_POOL_SLAB_COUNT; i++)
+    {
+        slabs[i].len = 0;
+        slabs[i].refs = 0;
+    }
+
+    for (int i = 0; i < MESSAGE_POOL_HANDLE_COUNT; i++)
+    {
+        handleUsed[i] = false;
+    }
+}
+
+MessageSlab* MessagePool::acquire(const void* data, size_t len)
+{
+    if (len > MESSAGE_POOL_SLAB_SIZE)
+    {
+        return nullptr;
+    }
+
+    for (int i = 0; i < MESSAGE_POOL_SLAB_COUNT; i++)
+    {
+        int expected = 0;
+
+        if (slabs[i].refs.compare_exchange_strong(expected, 1))
+        {
+            memcpy(slabs[i].data, data, len);
+            slabs[i].len = len;
+            messages++;
+            raiseHighWater(&slabsHighWater, ++slabsInUse);
+            return &slabs[i];
+        }
+    }
+
+    slabsExhausted++;
+    return nullptr;
+}
+
+void MessagePool::retain(MessageSlab* slab)
+{
+    slab->refs++;
+}
+
+void MessagePool::release(MessageSlab* slab)
+{
+    if (--slab->refs == 0)
+    {
+        slabsInUse--;
+    }
+}
+
+void* MessagePool::acquireHandle()
+{
+    uint32_t start = nextHandle;
+
+    for (int n = 0; n < MESSAGE_POOL_HANDLE_COUNT; n++)
+    {
+        int i = (start + n) % MESSAGE_POOL_HANDLE_COUNT;
+        bool expected = false;
+
+        if (!handleUsed[i].load(std::memory_order_relaxed) && handleUsed[i].compare_exchange_strong(expected, true))
+        {
+            nextHandle = i + 1;
+            raiseHighWater(&handlesHighWater, ++handlesInUse);
+            return handles[i];
+        }
+    }
+
+    handlesExhausted++;
+    return nullptr;
+}
+
+void MessagePool::releaseHandle(void* handle)
+{
+    size_t index = ((uint8_t*)handle - handles[0]) / MESSAGE_POOL_HANDLE_SIZE;
+
+    handleUsed[index] = false;
+    handlesInUse--;
+}
+
+void MessagePool::stats(MessagePoolStats* output) const
+{
+    output->slabsInUse = slabsInUse;
+    output->slabsHighWater = slabsHighWater;
+    output->slabsExhausted = slabsExhausted;
+    output->handlesInUse = handlesInUse;
+    output->handlesHighWater = handlesHighWater;
+    output->handlesExhausted = handlesExhausted;
+    output->messages = messages;
+}
@@ -0,0 +1,70 @@
+#ifndef __ESP_MESSAGE_POOL__
+#define __ESP_MESSAGE_POOL__
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// One log line, the largest outbound WebSocket frame the firmware sends
+#define MESSAGE_POOL_SLAB_SIZE 256
+#define MESSAGE_POOL_SLAB_COUNT 16
+// Per-client message objects queued by the web server, each referencing a
+// slab. Sized for every slab queued to a few clients.
+#define MESSAGE_POOL_HANDLE_SIZE 64
+#define MESSAGE_POOL_HANDLE_COUNT 32
+
+struct MessageSlab {
+    uint8_t data[MESSAGE_POOL_SLAB_SIZE];
+    size_t len;
+    // 0 when free
+    std::atomic<int> refs;
+};
+
+struct MessagePoolStats {
+    uint32_t slabsInUse;
+    uint32_t slabsHighWater;
+    // acquire() calls that found every slab referenced
+    uint32_t slabsExhausted;
+    uint32_t handlesInUse;
+    uint32_t handlesHighWater;
+    uint32_t handlesExhausted;
+    uint32_t messages;
+};
+
+// Fixed slabs for outbound frame payloads and fixed blocks for the message
+// objects that queue them. A broadcast fills one slab and takes a reference
+// per client, so N clients share one payload and nothing touches the heap.
+// Claimed and freed with atomics: the log task fills slabs while async_tcp
+// releases them as the acks come in.
+class MessagePool {
+public:
+    MessagePool();
+
+    // The caller holds one reference, nullptr when the pool is exhausted or
+    // len does not fit a slab
+    MessageSlab* acquire(const void* data, size_t len);
+    void retain(MessageSlab* slab);
+    void release(MessageSlab* slab);
+
+    // MESSAGE_POOL_HANDLE_SIZE bytes, nullptr when exhausted
+    void* acquireHandle();
+    void releaseHandle(void* handle);
+
+    void stats(MessagePoolStats* output) const;
+
+private:
+    MessageSlab slabs[MESSAGE_POOL_SLAB_COUNT];
+    alignas(8) uint8_t handles[MESSAGE_POOL_HANDLE_COUNT][MESSAGE_POOL_HANDLE_SIZE];
+    std::atomic<bool> handleUsed[MESSAGE_POOL_HANDLE_COUNT];
+    std::atomic<uint32_t> slabsInUse;
+    std::atomic<uint32_t> slabsHighWater;
+    std::atomic<uint32_t> slabsExhausted;
+    std::atomic<uint32_t> handlesInUse;
+    std::atomic<uint32_t> handlesHighWater;
+    std::atomic<uint32_t> handlesExhausted;
+    std::atomic<uint32_t> messages;
+    // Where the next search starts, handles are freed roughly in order
+    std::atomic<uint32_t> nextHandle;
+};
+
+#endif // __ESP_MESSAGE_POOL__
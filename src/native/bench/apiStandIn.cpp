@@ -0,0 +1,499 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "apiStandIn.h"
+
+// How long a POST /ota keeps the fake update running
+#define API_STAND_IN_UPDATE_MICROS 500000
+
+static int64_t monotonicMicroS()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+ApiStandIn::ApiStandIn(size_t (*allocationCount)(void))
+    : allocationCount(allocationCount),
+      updateStartMicroS(0),
+      updatesStarted(0),
+      listenFd(-1),
+      listenPort(0),
+      running(false),
+      allocations(0)
+{
+    for (int i = 0; i < API_STAND_IN_CONNECTIONS; i++)
+    {
+        connections[i].fd = -1;
+        connections[i].slot = nullptr;
+        connections[i].finished = false;
+    }
+}
+
+ApiStandIn::~ApiStandIn()
+{
+    stop();
+}
+
+bool ApiStandIn::start()
+{
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listenFd < 0)
+    {
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t addressLength = sizeof(address);
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listenFd, 64) != 0 ||
+        getsockname(listenFd, (struct sockaddr*)&address, &addressLength) != 0)
+    {
+        ::close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    listenPort = ntohs(address.sin_port);
+    running = true;
+    worker = std::thread(&ApiStandIn::serve, this);
+    return true;
+}
+
+void ApiStandIn::stop()
+{
+    if (!running)
+    {
+        return;
+    }
+
+    running = false;
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+
+    ::close(listenFd);
+    listenFd = -1;
+}
+
+uint16_t ApiStandIn::port() const
+{
+    return listenPort;
+}
+
+const ResponseSlotPool* ApiStandIn::pool() const
+{
+    return &slots;
+}
+
+uint64_t ApiStandIn::servingAllocations() const
+{
+    return allocations;
+}
+
+void ApiStandIn::serve()
+{
+    struct pollfd fds[API_STAND_IN_CONNECTIONS + 1];
+
+    while (running)
+    {
+        fds[0] = {listenFd, POLLIN, 0};
+        for (int i = 0; i < API_STAND_IN_CONNECTIONS; i++)
+        {
+            Connection* connection = &connections[i];
+            short events = connection->slot != nullptr || connection->finished ? POLLOUT : POLLIN;
+            fds[i + 1] = {connection->fd, events, 0};
+        }
+
+        if (poll(fds, API_STAND_IN_CONNECTIONS + 1, 50) <= 0)
+        {
+            continue;
+        }
+
+        size_t before = allocationCount != nullptr ? allocationCount() : 0;
+
+        if (fds[0].revents & POLLIN)
+        {
+            accept();
+        }
+
+        for (int i = 0; i < API_STAND_IN_CONNECTIONS; i++)
+        {
+            Connection* connection = &connections[i];
+            short revents = fds[i + 1].revents;
+
+            if (connection->fd < 0 || revents == 0)
+            {
+                continue;
+            }
+
+            if (revents & (POLLERR | POLLHUP))
+            {
+                closeConnection(connection);
+            }
+            else if (revents & POLLIN)
+            {
+                ssize_t len = recv(connection->fd, connection->request + connection->requestLen,
+                                   sizeof(connection->request) - 1 - connection->requestLen, 0);
+                if (len <= 0)
+                {
+                    closeConnection(connection);
+                    continue;
+                }
+
+                connection->requestLen += len;
+                connection->request[connection->requestLen] = 0;
+
+                if (strstr(connection->request, "\r\n\r\n") != nullptr)
+                {
+                    route(connection);
+                }
+                else if (connection->requestLen == sizeof(connection->request) - 1)
+                {
+                    respond(connection, 431, "text/plain", nullptr);
+                }
+            }
+            else if ((revents & POLLOUT) && !writeSome(connection))
+            {
+                closeConnection(connection);
+            }
+        }
+
+        if (allocationCount != nullptr)
+        {
+            allocations += allocationCount() - before;
+        }
+    }
+
+    for (int i = 0; i < API_STAND_IN_CONNECTIONS; i++)
+    {
+        closeConnection(&connections[i]);
+    }
+}
+
+void ApiStandIn::accept()
+{
+    for (int i = 0; i < API_STAND_IN_CONNECTIONS; i++)
+    {
+        Connection* connection = &connections[i];
+        if (connection->fd >= 0)
+        {
+            continue;
+        }
+
+        connection->fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+        if (connection->fd < 0)
+        {
+            return;
+        }
+
+        connection->requestLen = 0;
+        connection->headLen = 0;
+        connection->headSent = 0;
+        connection->slot = nullptr;
+        connection->bodySent = 0;
+        connection->finished = false;
+    }
+
+    // Every connection is busy, leave the rest in the backlog like lwIP does
+}
+
+void ApiStandIn::route(Connection* connection)
+{
+    int64_t now = monotonicMicroS();
+
+    if (stateMachine.isActive() && now - updateStartMicroS > API_STAND_IN_UPDATE_MICROS)
+    {
+        stateMachine.finish(true);
+    }
+
+    bool isGet = strncmp(connection->request, "GET ", 4) == 0;
+    bool isPost = strncmp(connection->request, "POST ", 5) == 0;
+    const char* path = connection->request + (isGet ? 4 : 5);
+
+    if (!(isGet && strncmp(path, "/ota/status ", 12) == 0) &&
+        !(isGet && strncmp(path, "/metrics ", 9) == 0) &&
+        !(isPost && strncmp(path, "/ota ", 5) == 0))
+    {
+        respond(connection, 404, "text/plain", nullptr);
+        return;
+    }
+
+    ResponseSlot* slot = slots.acquire();
+    if (slot == nullptr)
+    {
+        respond(connection, 503, "text/plain", nullptr);
+        return;
+    }
+
+    if (isGet && strncmp(path, "/metrics ", 9) == 0)
+    {
+        OtaMetricsSnapshot metrics = {
+            .state = stateMachine.state(),
+            .updatesStarted = updatesStarted,
+            .updatesSucceeded = updatesStarted - (stateMachine.isActive() ? 1 : 0),
+            .updatesFailed = 0,
+            .bytesReceived = 0,
+            .lastThroughput = 0,
+            .internalHeap = {},
+            .psramHeap = {},
+            .tasks = {},
+            .taskCount = 0,
+            .wifiConnected = false,
+            .wifiRssi = 0,
+            .wifiReconnects = 0,
+            .wifiFastConnects = 0,
+            .wifiScanConnects = 0,
+            .wifiFastFallbacks = 0,
+            .wifiFailures = 0,
+            .wifiLastConnectMicroS = -1,
+            .powerLevelMicroS = {now, 0, 0},
+            .averageMicroAmps = 0,
+            .idleWakes = 0,
+            .idleFailedWakes = 0,
+            .idleLastWakeMicroS = -1,
+            .idleMaxWakeMicroS = -1,
+            .logDropped = 0,
+            .uptimeMicroS = now,
+            .apiRequests = slots.requests(),
+            .apiRejected = slots.rejected(),
+            .apiSlotsHighWater = slots.highWater(),
+            .wsPool = {},
+            .scrubTargets = {},
+            .scrubTargetCount = 0,
+            .scrubCorrupt = 0,
+            .scrubBytes = 0,
+            .scrubLongestStepMicroS = 0,
+        };
+        slot->len = renderOtaMetrics(&metrics, slot->body, sizeof(slot->body));
+        respond(connection, 200, "text/plain; version=0.0.4", slot);
+        return;
+    }
+
+    int code = 200;
+    if (isPost)
+    {
+        code = stateMachine.tryStart() ? 202 : 409;
+        if (code == 202)
+        {
+            updateStartMicroS = now;
+            updatesStarted++;
+        }
+    }
+
+    OtaStatusSnapshot status = {
+        .state = otaStateName(stateMachine.state()),
+        .stopReason = otaStopReasonName(stateMachine.stopReason()),
+        .rollbackGate = "not required",
+        .activation = "none",
+        .eraseStrategy = "ahead",
+        .bytesReceived = 0,
+        .contentLength = -1,
+        .receiveSize = 0,
+        .source = "pull",
+        .lastThroughput = 0,
+        .uptimeMicroS = now,
+    };
+    slot->len = renderOtaStatus(&status, slot->body, sizeof(slot->body));
+    respond(connection, code, "application/json", slot);
+}
+
+void ApiStandIn::respond(Connection* connection, int code, const char* contentType, ResponseSlot* slot)
+{
+    int len = snprintf(connection->head, sizeof(connection->head),
+                       "HTTP/1.1 %d \r\nContent-Type: %s\r\n%sConnection: close\r\n\r\n",
+                       code,
+                       contentType,
+                       slot != nullptr ? "Transfer-Encoding: chunked\r\n" : "Content-Length: 0\r\n");
+    connection->headLen = len;
+    connection->headSent = 0;
+    connection->slot = slot;
+    connection->bodySent = 0;
+    connection->finished = true;
+}
+
+// One segment per call: the headers, one body chunk or the terminator.
+// Returns false when the response is complete or the socket failed.
+bool ApiStandIn::writeSome(Connection* connection)
+{
+    if (connection->headSent < connection->headLen)
+    {
+        ssize_t written = send(connection->fd, connection->head + connection->headSent,
+                               connection->headLen - connection->headSent, MSG_NOSIGNAL);
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        connection->headSent += written;
+        return true;
+    }
+
+    if (connection->slot == nullptr)
+    {
+        return false;
+    }
+
+    // Chunk framing as AsyncChunkedResponse does it: size line, data, CRLF
+    uint8_t segment[API_STAND_IN_SEGMENT_SIZE];
+    const size_t framing = 8;
+    size_t len = readResponseSlot(connection->slot, segment + 6, sizeof(segment) - framing, connection->bodySent);
+    char sizeLine[7];
+    snprintf(sizeLine, sizeof(sizeLine), "%04zx\r\n", len);
+    memcpy(segment, sizeLine, 6);
+    memcpy(segment + 6 + len, "\r\n", 2);
+
+    size_t total = len + framing;
+    if (len == 0)
+    {
+        // Last chunk "0000\r\n\r\n"
+        total = framing;
+    }
+
+    if (send(connection->fd, segment, total, MSG_NOSIGNAL) != (ssize_t)total)
+    {
+        return false;
+    }
+
+    connection->bodySent += len;
+    return len > 0;
+}
+
+void ApiStandIn::closeConnection(Connection* connection)
+{
+    if (connection->fd < 0)
+    {
+        return;
+    }
+
+    // Same place the device returns the slot: the disconnect callback
+    slots.release(connection->slot);
+    connection->slot = nullptr;
+    ::close(connection->fd);
+    connection->fd = -1;
+}
+
+static int requestOnce(uint16_t port, const char* request)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    char response[2048];
+    char discard[512];
+    size_t used = 0;
+
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        send(fd, request, strlen(request), MSG_NOSIGNAL) != (ssize_t)strlen(request))
+    {
+        close(fd);
+        return -1;
+    }
+
+    // Only the status line matters, the rest is read to the close
+    ssize_t len;
+    while (used < sizeof(response) - 1 && (len = recv(fd, response + used, sizeof(response) - 1 - used, 0)) > 0)
+    {
+        used += len;
+    }
+
+    while (recv(fd, discard, sizeof(discard), 0) > 0)
+    {
+    }
+
+    close(fd);
+    response[used] = 0;
+
+    int code = 0;
+    return sscanf(response, "HTTP/1.1 %d", &code) == 1 ? code : -1;
+}
+
+ApiLoadResult runApiLoad(uint16_t port, int clients, int requestsPerClient)
+{
+    static const char* statusRequest = "GET /ota/status HTTP/1.1\r\nHost: device\r\n\r\n";
+    static const char* metricsRequest = "GET /metrics HTTP/1.1\r\nHost: device\r\n\r\n";
+    static const char* updateRequest = "POST /ota HTTP/1.1\r\nHost: device\r\nContent-Length: 0\r\n\r\n";
+
+    std::vector<double> latencies(clients * requestsPerClient);
+    std::vector<int> codes(clients * requestsPerClient);
+    std::vector<std::thread> threads;
+
+    int64_t startMicroS = monotonicMicroS();
+
+    for (int client = 0; client < clients; client++)
+    {
+        threads.emplace_back([&, client]() {
+            for (int i = 0; i < requestsPerClient; i++)
+            {
+                int n = client * requestsPerClient + i;
+                const char* request = n % 20 == 0 ? updateRequest : n % 5 == 0 ? metricsRequest : statusRequest;
+
+                int64_t sentMicroS = monotonicMicroS();
+                codes[n] = requestOnce(port, request);
+                latencies[n] = (monotonicMicroS() - sentMicroS) / 1000.0;
+            }
+        });
+    }
+
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    double wallS = (monotonicMicroS() - startMicroS) / 1e6;
+
+    ApiLoadResult result;
+    memset(&result, 0, sizeof(result));
+    result.requests = latencies.size();
+
+    for (int code : codes)
+    {
+        if (code == 200 || code == 202 || code == 409)
+        {
+            result.ok++;
+        }
+        else if (code == 503)
+        {
+            result.rejected++;
+        }
+        else
+        {
+            result.errors++;
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t count = latencies.size();
+    result.requestsPerS = wallS > 0 ? count / wallS : 0;
+    result.p50Ms = latencies[count / 2];
+    result.p90Ms = latencies[count * 90 / 100];
+    result.p99Ms = latencies[count * 99 / 100];
+    result.maxMs = latencies[count - 1];
+    return result;
+}
@@ -0,0 +1,84 @@
+#ifndef __ESP_API_STAND_IN__
+#define __ESP_API_STAND_IN__
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+
+#include "../../otaApi.h"
+#include "../../otaStateMachine.h"
+
+#define API_STAND_IN_CONNECTIONS 16
+#define API_STAND_IN_REQUEST_SIZE 512
+// AsyncTCP hands the filler at most the free send buffer, one MSS on lwIP
+#define API_STAND_IN_SEGMENT_SIZE 536
+
+// Loopback copy of the device REST endpoints: one event loop thread like
+// the async_tcp task, the same ResponseSlotPool and renderers, and chunked
+// responses written one segment per loop turn. allocationCount, when set,
+// is sampled around each event so the bench can show the serving path
+// stays off the heap.
+class ApiStandIn {
+public:
+    explicit ApiStandIn(size_t (*allocationCount)(void) = nullptr);
+    ~ApiStandIn();
+
+    bool start();
+    void stop();
+
+    uint16_t port() const;
+    const ResponseSlotPool* pool() const;
+    uint64_t servingAllocations() const;
+
+private:
+    struct Connection {
+        int fd;
+        char request[API_STAND_IN_REQUEST_SIZE];
+        size_t requestLen;
+        char head[160];
+        size_t headLen;
+        size_t headSent;
+        ResponseSlot* slot;
+        size_t bodySent;
+        bool finished;
+    };
+
+    void serve();
+    void accept();
+    void route(Connection* connection);
+    void respond(Connection* connection, int code, const char* contentType, ResponseSlot* slot);
+    bool writeSome(Connection* connection);
+    void closeConnection(Connection* connection);
+
+    size_t (*allocationCount)(void);
+    Connection connections[API_STAND_IN_CONNECTIONS];
+    ResponseSlotPool slots;
+    OtaStateMachine stateMachine;
+    int64_t updateStartMicroS;
+    uint32_t updatesStarted;
+    int listenFd;
+    uint16_t listenPort;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> allocations;
+    std::thread worker;
+};
+
+struct ApiLoadResult {
+    uint32_t requests;
+    uint32_t ok;
+    // 503 from an exhausted slot pool
+    uint32_t rejected;
+    uint32_t errors;
+    double requestsPerS;
+    double p50Ms;
+    double p90Ms;
+    double p99Ms;
+    double maxMs;
+};
+
+// clients threads each send requestsPerClient requests back to back, one
+// connection per request as AsyncWebServer closes after every response.
+// Mix: mostly status polls, some metrics scrapes, the odd POST /ota.
+ApiLoadResult runApiLoad(uint16_t port, int clients, int requestsPerClient);
+
+#endif // __ESP_API_STAND_IN__
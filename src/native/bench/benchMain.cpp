@@ -0,0 +1,1271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../../otaBundle.h"
+#include "../../otaImageCheck.h"
+#include "../../otaSha256.h"
+#include "../../otaTransfer.h"
+#include "../../otaValidators.h"
+#include "../../partitionScrubber.h"
+#include "../../receiveSizer.h"
+#include "../../secretCache.h"
+#include "../halPosix.h"
+#include "prefetchTransport.h"
+#include "apiStandIn.h"
+#include "decryptingStorage.h"
+#include "sharedFlashBus.h"
+#include "sharedLink.h"
+#include "standInServer.h"
+#include "webSocketStandIn.h"
+
+#define BENCH_READ_BUFFER_SIZE 4096
+// Matches OTA_CHUNK_COUNT of the device pipeline, the prefetch ring holds
+// that many read buffers
+#define BENCH_CHUNK_COUNT 4
+// Read sizes the adaptive mode may pick, as OTA_CHUNK_SIZE_MIN/MAX on the device
+#define BENCH_ADAPTIVE_MIN 1024
+#define BENCH_ADAPTIVE_MAX 16384
+#define BENCH_DEFAULT_APP_SIZE (512 * 1024)
+#define BENCH_DEFAULT_DATA_SIZE (64 * 1024)
+// Long enough for several application bursts to fall inside the update
+#define BENCH_SHAPING_IMAGE_SIZE (2 * 1024 * 1024)
+#define BENCH_POLLING_NAMESPACE "otaSettings"
+#define BENCH_SECRETS_NAMESPACE "credentials"
+// Estimate for one 32 byte XTS-AES entry through the ESP32-S3 AES driver;
+// the device's "secrets" command gives the real read time to check it by
+#define BENCH_NVS_DECRYPT_NS_PER_ENTRY 10000
+// OTA_NVS_BOOT_BUDGET_US, the device adds its NVS init to the read
+#define BENCH_NVS_BOOT_BUDGET_US (100 * 1000)
+#define BENCH_SECRETS_RUNS 50
+// A 1.5 MB app in a 2 MB slot, about what the device's OTA slots hold
+#define BENCH_SCRUB_APP_SIZE (1536 * 1024)
+#define BENCH_SCRUB_SLOT_SIZE (2 * 1024 * 1024)
+// OTA_SCRUB_CHUNK_SIZE of the device
+#define BENCH_SCRUB_CHUNK_SIZE 4096
+// A foreground flash access every millisecond, a cache miss or an NVS read
+#define BENCH_SCRUB_FOREGROUND_US 1000
+// One chunk read is the bound, host sleeps overshoot by a few hundred us
+#define BENCH_SCRUB_WAIT_CHUNKS 4
+
+// C++ heap accounting by malloc's usable size; atomic, the stand-in
+// server, prefetcher and scrubber threads allocate alongside the bench
+static std::atomic<size_t> heapLive(0);
+static std::atomic<size_t> heapPeak(0);
+// Pretend heap size for the adaptive sizer, 0 for unlimited
+static size_t heapLimit = 0;
+// Per thread so the API stand-in can count only its own allocations
+static thread_local size_t threadAllocations = 0;
+
+static void* heapCount(void* pointer)
+{
+    if (pointer == nullptr)
+    {
+        return nullptr;
+    }
+
+    size_t size = malloc_usable_size(pointer);
+    size_t live = heapLive.fetch_add(size) + size;
+    size_t peak = heapPeak.load();
+    while (live > peak && !heapPeak.compare_exchange_weak(peak, live))
+    {
+    }
+
+    threadAllocations++;
+    return pointer;
+}
+
+static void heapRelease(void* pointer)
+{
+    if (pointer != nullptr)
+    {
+        heapLive.fetch_sub(malloc_usable_size(pointer));
+        free(pointer);
+    }
+}
+
+// Every replaceable form, so whichever pair the compiler picks meets the
+// same malloc and the same count
+void* operator new(size_t size)
+{
+    void* pointer = heapCount(malloc(size > 0 ? size : 1));
+    if (pointer == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return pointer;
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    // aligned_alloc takes whole multiples of the alignment
+    size_t alignment = (size_t)align < sizeof(void*) ? sizeof(void*) : (size_t)align;
+    size_t rounded = (size + alignment - 1) / alignment * alignment;
+    void* pointer = heapCount(aligned_alloc(alignment, rounded > 0 ? rounded : alignment));
+    if (pointer == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return pointer;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new[](size_t size, std::align_val_t align)
+{
+    return operator new(size, align);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return heapCount(malloc(size > 0 ? size : 1));
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return heapCount(malloc(size > 0 ? size : 1));
+}
+
+void operator delete(void* pointer) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete[](void* pointer) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete(void* pointer, size_t) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete[](void* pointer, size_t) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete(void* pointer, std::align_val_t) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete[](void* pointer, std::align_val_t) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete(void* pointer, size_t, std::align_val_t) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete[](void* pointer, size_t, std::align_val_t) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) noexcept
+{
+    heapRelease(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept
+{
+    heapRelease(pointer);
+}
+
+static size_t benchThreadAllocations()
+{
+    return threadAllocations;
+}
+
+static size_t benchFreeHeap()
+{
+    if (heapLimit == 0)
+    {
+        return SIZE_MAX;
+    }
+
+    size_t live = heapLive.load();
+    return live < heapLimit ? heapLimit - live : 0;
+}
+
+struct BenchResult {
+    const char* profile;
+    const char* erase;
+    // Read buffer size, "auto" for the adaptive sizer
+    char buffer[24];
+    const char* result;
+    size_t bytes;
+    double mbPerS;
+    double ttfbMs;
+    double cpuMsPerMB;
+    size_t peakHeapBytes;
+    // Read buffer, prefetch ring and sector buffer: what the device pipeline
+    // would allocate for the same setting
+    size_t ramBytes;
+    size_t finalReadSize;
+    double flashBusyMs;
+};
+
+static void appendImage(std::vector<uint8_t>* bundle, const char* label, const std::vector<uint8_t>& image)
+{
+    uint8_t entry[OTA_BUNDLE_ENTRY_SIZE];
+    memset(entry, 0, sizeof(entry));
+    strncpy((char*)entry, label, OTA_BUNDLE_LABEL_SIZE);
+
+    uint32_t size = image.size();
+    for (int i = 0; i < 4; i++)
+    {
+        entry[OTA_BUNDLE_LABEL_SIZE + i] = (uint8_t)(size >> (i * 8));
+    }
+
+    OtaSha256Context hash;
+    otaSha256Start(&hash);
+    otaSha256Update(&hash, image.data(), image.size());
+    otaSha256Finish(&hash, entry + OTA_BUNDLE_LABEL_SIZE + 4);
+
+    bundle->insert(bundle->end(), entry, entry + sizeof(entry));
+}
+
+// Same layout post_build_script.py produces: app plus a spiffs image
+static std::vector<uint8_t> makeSyntheticBundle(size_t appSize, size_t dataSize)
+{
+    std::vector<uint8_t> app(appSize);
+    std::vector<uint8_t> data(dataSize);
+
+    srand(1);
+    for (size_t i = 0; i < appSize; i++)
+    {
+        app[i] = rand();
+    }
+    app[0] = 0xE9;
+    // esp_app_desc_t magic, so the pre-check parses the descriptor
+    const uint8_t descMagic[] = {0x32, 0x54, 0xCD, 0xAB};
+    memcpy(app.data() + OTA_APP_DESC_OFFSET, descMagic, sizeof(descMagic));
+
+    for (size_t i = 0; i < dataSize; i++)
+    {
+        data[i] = rand();
+    }
+
+    std::vector<uint8_t> bundle = {'O', 'T', 'A', 'B', OTA_BUNDLE_VERSION, 0, 2, 0};
+    appendImage(&bundle, "app", app);
+    appendImage(&bundle, "spiffs", data);
+    bundle.insert(bundle.end(), app.begin(), app.end());
+    bundle.insert(bundle.end(), data.begin(), data.end());
+    return bundle;
+}
+
+static bool readFile(const char* path, std::vector<uint8_t>* content)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    uint8_t buffer[8192];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        content->insert(content->end(), buffer, buffer + len);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static double threadCpuMs()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0 +
+           usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0;
+}
+
+// bufferSize 0 runs the adaptive sizer over BENCH_ADAPTIVE_MIN..MAX
+static BenchResult runProfile(const std::vector<uint8_t>* image, const NetworkProfile* profile, FlashEraseStrategy erase, bool realTimeFlash, size_t bufferSize)
+{
+    static uint8_t sectorBuffer[FLASH_WRITER_SECTOR_SIZE];
+    size_t readBufferSize = bufferSize > 0 ? bufferSize : BENCH_ADAPTIVE_MAX;
+    std::vector<uint8_t> readBuffer(readBufferSize);
+
+    BenchResult result;
+    memset(&result, 0, sizeof(result));
+    result.profile = profile->name;
+    result.erase = flashEraseStrategyName(erase);
+    if (bufferSize > 0)
+    {
+        snprintf(result.buffer, sizeof(result.buffer), "%zu", bufferSize);
+    }
+    else
+    {
+        snprintf(result.buffer, sizeof(result.buffer), "auto");
+    }
+    result.ramBytes = readBufferSize * (BENCH_CHUNK_COUNT + 1) + FLASH_WRITER_SECTOR_SIZE;
+
+    StandInServer server;
+    if (!server.start(image, profile))
+    {
+        result.result = "server";
+        return result;
+    }
+
+    PosixClock clock;
+    SimulatedPartitions* partitions = new SimulatedPartitions(&defaultFlashTiming, realTimeFlash);
+    PosixHttpTransport socketTransport;
+    PrefetchTransport transport(&socketTransport, readBufferSize * BENCH_CHUNK_COUNT, readBufferSize);
+
+    ReceiveSizerConfig sizerConfig = {
+        .minReadSize = BENCH_ADAPTIVE_MIN,
+        .maxReadSize = readBufferSize,
+        .initialReadSize = BENCH_READ_BUFFER_SIZE,
+        .lowHeapBytes = 32 * 1024,
+        .windowMicroS = 250000,
+    };
+    ReceiveSizer sizer(&sizerConfig);
+
+    OtaTransfer transfer = {
+        .transport = &transport,
+        .partitions = partitions,
+        .clock = &clock,
+        .readBuffer = readBuffer.data(),
+        .readBufferSize = readBufferSize,
+        .sizer = bufferSize > 0 ? nullptr : &sizer,
+        .freeHeap = benchFreeHeap,
+        .sectorBuffer = sectorBuffer,
+        .eraseStrategy = erase,
+        .shouldStop = nullptr,
+        .running = nullptr,
+        .shaper = nullptr,
+    };
+
+    // Simulated partitions are not part of what the device would allocate
+    size_t heapBase = heapLive.load();
+    heapPeak.store(heapBase);
+    double cpuStart = threadCpuMs();
+
+    OtaTransferStats stats;
+    std::string url = server.url();
+    const char* error = runOtaTransfer(&transfer, url.c_str(), &stats);
+
+    double cpuMs = threadCpuMs() - cpuStart;
+    double wallS = (stats.endMicroS - stats.startMicroS) / 1e6;
+    double megabytes = stats.bytes / (1024.0 * 1024.0);
+
+    result.result = error == nullptr ? "ok" : error;
+    result.bytes = stats.bytes;
+    result.mbPerS = wallS > 0 ? megabytes / wallS : 0;
+    result.ttfbMs = (stats.firstByteMicroS - stats.startMicroS) / 1000.0;
+    result.cpuMsPerMB = megabytes > 0 ? cpuMs / megabytes : 0;
+    result.peakHeapBytes = heapPeak - heapBase;
+    result.finalReadSize = stats.readSize;
+    result.flashBusyMs = (partitions->slot(0)->busyMicroS() + partitions->slot(1)->busyMicroS() + partitions->data()->busyMicroS() +
+                          partitions->staging()->busyMicroS()) / 1000.0;
+
+    server.stop();
+    delete partitions;
+    return result;
+}
+
+static void writeResult(FILE* output, const BenchResult* result)
+{
+    fprintf(output,
+            "{\"profile\":\"%s\",\"erase\":\"%s\",\"buffer\":\"%s\",\"result\":\"%s\",\"bytes\":%zu,\"mbPerS\":%.3f,\"ttfbMs\":%.2f,\"cpuMsPerMB\":%.2f,\"peakHeapBytes\":%zu,\"ramBytes\":%zu,\"finalReadSize\":%zu,\"flashBusyMs\":%.1f}\n",
+            result->profile,
+            result->erase,
+            result->buffer,
+            result->result,
+            result->bytes,
+            result->mbPerS,
+            result->ttfbMs,
+            result->cpuMsPerMB,
+            result->peakHeapBytes,
+            result->ramBytes,
+            result->finalReadSize,
+            result->flashBusyMs);
+}
+
+// Looks up mbPerS for profile/erase/buffer in a JSON lines file from an earlier run
+static double baselineThroughput(const char* path, const char* profile, const char* erase, const char* buffer)
+{
+    FILE* file = fopen(path, "r");
+    if (file == nullptr)
+    {
+        return -1;
+    }
+
+    char line[512];
+    char key[128];
+    snprintf(key, sizeof(key), "\"profile\":\"%s\",\"erase\":\"%s\",\"buffer\":\"%s\"", profile, erase, buffer);
+    double value = -1;
+
+    while (fgets(line, sizeof(line), file) != nullptr)
+    {
+        const char* field = strstr(line, "\"mbPerS\":");
+        if (strstr(line, key) != nullptr && field != nullptr)
+        {
+            value = atof(field + 9);
+        }
+    }
+
+    fclose(file);
+    return value;
+}
+
+// Latency of the REST endpoints while clients poll concurrently
+static int runApiBench(FILE* output, const std::vector<int>& clientCounts, int requestsPerClient)
+{
+    // Cost of one /metrics render with every optional series present
+    static char page[OTA_API_SLOT_SIZE];
+    OtaMetricsSnapshot metrics;
+    memset(&metrics, 0, sizeof(metrics));
+    metrics.psramHeap.totalBytes = 8 * 1024 * 1024;
+    metrics.wifiConnected = true;
+    metrics.taskCount = OTA_METRICS_MAX_TASKS;
+    for (int i = 0; i < OTA_METRICS_MAX_TASKS; i++)
+    {
+        metrics.tasks[i] = {"otaDownloadTask", 1024};
+    }
+    metrics.scrubTargetCount = OTA_METRICS_MAX_SCRUB_TARGETS;
+    for (int i = 0; i < OTA_METRICS_MAX_SCRUB_TARGETS; i++)
+    {
+        metrics.scrubTargets[i] = {"ota_cache", "read error", 4294967295u, 4194304, 4194304};
+    }
+
+    const int renders = 10000;
+    size_t pageBytes = 0;
+    PosixClock clock;
+    int64_t renderStart = clock.nowMicroS();
+    for (int i = 0; i < renders; i++)
+    {
+        metrics.uptimeMicroS = i;
+        pageBytes = renderOtaMetrics(&metrics, page, sizeof(page));
+    }
+    double renderUs = (double)(clock.nowMicroS() - renderStart) / renders;
+
+    for (FILE* file : {output, stdout})
+    {
+        fprintf(file, "{\"bench\":\"metrics-render\",\"bytes\":%zu,\"renderUs\":%.2f}\n", pageBytes, renderUs);
+    }
+
+    for (int clients : clientCounts)
+    {
+        ApiStandIn server(benchThreadAllocations);
+        if (!server.start())
+        {
+            printf("cannot start API stand-in\n");
+            return 2;
+        }
+
+        ApiLoadResult result = runApiLoad(server.port(), clients, requestsPerClient);
+        server.stop();
+
+        for (FILE* file : {output, stdout})
+        {
+            fprintf(file,
+                    "{\"bench\":\"api\",\"clients\":%d,\"requests\":%u,\"ok\":%u,\"rejected\":%u,\"errors\":%u,\"requestsPerS\":%.0f,"
+                    "\"p50Ms\":%.3f,\"p90Ms\":%.3f,\"p99Ms\":%.3f,\"maxMs\":%.3f,\"slotsHighWater\":%u,\"servingAllocations\":%llu}\n",
+                    clients,
+                    result.requests,
+                    result.ok,
+                    result.rejected,
+                    result.errors,
+                    result.requestsPerS,
+                    result.p50Ms,
+                    result.p90Ms,
+                    result.p99Ms,
+                    result.maxMs,
+                    server.pool()->highWater(),
+                    (unsigned long long)server.servingAllocations());
+        }
+    }
+
+    return 0;
+}
+
+// Heap allocations of smartLog fan-out with and without the message pool.
+// Per second figures assume logRate lines/s, a chatty update with profiling.
+static int runWebSocketBench(FILE* output, const std::vector<int>& clientCounts, int lines, int logRate)
+{
+    const int inFlight = 4;
+
+    for (int clients : clientCounts)
+    {
+        for (bool pooled : {false, true})
+        {
+            WebSocketLoadResult result = runWebSocketLoad(pooled, clients, lines, inFlight, benchThreadAllocations);
+
+            for (FILE* file : {output, stdout})
+            {
+                fprintf(file,
+                        "{\"bench\":\"ws\",\"mode\":\"%s\",\"clients\":%d,\"lines\":%u,\"queued\":%u,\"dropped\":%u,"
+                        "\"allocationsPerLine\":%.2f,\"allocationsPerS\":%.0f,\"nsPerLine\":%.0f,"
+                        "\"slabsHighWater\":%u,\"handlesHighWater\":%u,\"exhausted\":%u}\n",
+                        pooled ? "pool" : "heap",
+                        clients,
+                        result.lines,
+                        result.queued,
+                        result.dropped,
+                        result.allocationsPerLine,
+                        result.allocationsPerLine * logRate,
+                        result.nsPerLine,
+                        pooled ? result.pool.slabsHighWater : 0,
+                        pooled ? result.pool.handlesHighWater : 0,
+                        pooled ? result.pool.slabsExhausted + result.pool.handlesExhausted : 0);
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Application latency during an update, unshaped and per shaping mode, on
+// a modelled shared link. "none" is the application without an update.
+static int runShapingBench(FILE* output, size_t imageBytes)
+{
+    SharedLinkConfig link = {
+        .linkBytesPerS = 1000000,
+        .windowBytes = 5744,
+        .segmentBytes = 1436,
+        .deviceBytesPerS = 800000,
+        .readSize = BENCH_READ_BUFFER_SIZE,
+        .imageBytes = imageBytes,
+        .appPacketBytes = 256,
+        .appIntervalMicroS = 20000,
+        .appBurstMicroS = 2000000,
+        .appGapMicroS = 3000000,
+        .limitMicroS = 600 * 1000000LL,
+    };
+
+    PosixClock clock;
+    OtaShaper defaults(&clock);
+    OtaShaperConfig rate = *defaults.getConfig();
+    rate.rateBytesPerS = link.linkBytesPerS / 4;
+    OtaShaperConfig yield = rate;
+    yield.yieldToApp = true;
+    OtaShaperConfig background = yield;
+    background.shapeClass = OTA_SHAPE_BACKGROUND;
+
+    struct {
+        const char* mode;
+        const OtaShaperConfig* shaping;
+    } modes[] = {
+        {"none", nullptr},
+        {"off", nullptr},
+        {"rate", &rate},
+        {"yield", &yield},
+        {"background", &background},
+    };
+
+    // CONFIG_LWIP_TCP_WND_DEFAULT, and a window tuned up for download speed
+    for (uint32_t window : {5744u, 32768u})
+    {
+        link.windowBytes = window;
+
+        for (const auto& mode : modes)
+        {
+            link.imageBytes = strcmp(mode.mode, "none") == 0 ? 0 : imageBytes;
+            SharedLinkResult result = runSharedLink(&link, mode.shaping);
+
+            for (FILE* file : {output, stdout})
+            {
+                fprintf(file,
+                        "{\"bench\":\"shaping\",\"mode\":\"%s\",\"windowBytes\":%u,\"rateBytesPerS\":%u,\"otaBytes\":%zu,\"updateS\":%.2f,"
+                        "\"otaBytesPerS\":%.0f,\"appExchanges\":%u,\"p50Ms\":%.2f,\"p90Ms\":%.2f,\"p99Ms\":%.2f,\"maxMs\":%.2f,"
+                        "\"shaperWaits\":%u,\"shaperYields\":%u}\n",
+                        mode.mode,
+                        window,
+                        mode.shaping != nullptr ? mode.shaping->rateBytesPerS : 0,
+                        result.otaBytes,
+                        result.updateS,
+                        result.otaBytesPerS,
+                        result.appExchanges,
+                        result.p50Ms,
+                        result.p90Ms,
+                        result.p99Ms,
+                        result.maxMs,
+                        result.shaping.waits,
+                        result.shaping.yields);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int64_t benchMicroS()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Cost of one update check while the published image stays the same.
+// "full" GETs the whole image, what polling firmwareUpdateTask costs;
+// "precheck" is the ranged pre-check finding the running build;
+// "conditional" is the pre-check with the validators kept in storage, a
+// single 304 from the second poll on. The store is reloaded every poll as
+// after a reboot. Bytes are HTTP on the wire, requests and responses.
+static int runPollingBench(FILE* output, const std::vector<uint8_t>* image, const char* profileName, int polls)
+{
+    char storageRoot[] = "/tmp/benchPollingXXXXXX";
+    if (mkdtemp(storageRoot) == nullptr)
+    {
+        printf("cannot create a storage directory\n");
+        return 2;
+    }
+
+    // The image's own app plays the running one
+    OtaAppInfo running;
+    memset(&running, 0, sizeof(running));
+    OtaImageCheck reference(nullptr, nullptr);
+    size_t start = image->size() < OTA_IMAGE_CHECK_FETCH_SIZE ? image->size() : OTA_IMAGE_CHECK_FETCH_SIZE;
+    OtaImageVerdict parsed = reference.checkStream(image->data(), start);
+    if (parsed == OTA_IMAGE_NEED_MORE && reference.appOffset() + OTA_APP_HEADER_SIZE <= image->size())
+    {
+        parsed = reference.checkApp(image->data() + reference.appOffset(), OTA_APP_HEADER_SIZE);
+    }
+    if (parsed == OTA_IMAGE_OK)
+    {
+        running = *reference.candidate();
+    }
+
+    std::vector<uint8_t> buffer(BENCH_READ_BUFFER_SIZE);
+
+    for (int p = 0; p < networkProfileCount; p++)
+    {
+        const NetworkProfile* profile = &networkProfiles[p];
+        if (profileName != nullptr && strcmp(profileName, profile->name) != 0)
+        {
+            continue;
+        }
+
+        for (const char* mode : {"full", "precheck", "conditional"})
+        {
+            StandInServer server;
+            if (!server.start(image, profile))
+            {
+                printf("cannot start the stand-in server\n");
+                return 2;
+            }
+
+            std::string url = server.url();
+            PosixStorage storage(storageRoot);
+            PosixHttpTransport transport;
+            const char* result = "ok";
+            uint64_t firstPollBytes = 0;
+            int64_t startMicroS = benchMicroS();
+
+            for (int poll = 0; poll < polls; poll++)
+            {
+                if (strcmp(mode, "full") == 0)
+                {
+                    int len = transport.open(url.c_str()) ? 1 : -1;
+                    while (len > 0)
+                    {
+                        len = transport.read(buffer.data(), buffer.size());
+                    }
+                    result = transport.isComplete() ? "ok" : "read";
+                    transport.close();
+                }
+                else
+                {
+                    OtaValidatorStore store(&storage, BENCH_POLLING_NAMESPACE);
+                    store.load(url.c_str());
+
+                    if (strcmp(mode, "conditional") == 0)
+                    {
+                        transport.setValidators(store.get(url.c_str()));
+                    }
+
+                    OtaImageCheck check(nullptr, &running);
+                    OtaImageVerdict verdict = otaCheckRemoteImage(&transport, url.c_str(), &check, buffer.data());
+                    result = otaImageVerdictName(verdict);
+
+                    if (strcmp(mode, "conditional") == 0 && verdict == OTA_IMAGE_SAME_BUILD)
+                    {
+                        HalHttpValidators validators;
+                        transport.responseValidators(&validators);
+                        store.remember(url.c_str(), &validators);
+                    }
+                }
+
+                if (poll == 0)
+                {
+                    firstPollBytes = server.wireBytes();
+                }
+            }
+
+            double pollMs = (benchMicroS() - startMicroS) / 1000.0 / polls;
+            uint64_t steadyBytes = polls > 1 ? (server.wireBytes() - firstPollBytes) / (polls - 1) : firstPollBytes;
+
+            for (FILE* file : {output, stdout})
+            {
+                fprintf(file,
+                        "{\"bench\":\"polling\",\"profile\":\"%s\",\"mode\":\"%s\",\"result\":\"%s\",\"polls\":%d,\"requestsPerPoll\":%.2f,"
+                        "\"notModified\":%u,\"firstPollBytes\":%llu,\"bytesPerPoll\":%llu,\"msPerPoll\":%.1f,\"etag\":\"%.*s\"}\n",
+                        profile->name,
+                        mode,
+                        result,
+                        polls,
+                        (double)server.requests() / polls,
+                        server.notModified(),
+                        (unsigned long long)firstPollBytes,
+                        (unsigned long long)steadyBytes,
+                        pollMs,
+                        (int)strlen(server.etag()) - 2,
+                        server.etag() + 1);
+            }
+
+            server.stop();
+        }
+    }
+
+    std::string namespacePath = std::string(storageRoot) + "/" + BENCH_POLLING_NAMESPACE;
+    unlink((namespacePath + "/" + OTA_VALIDATORS_KEY).c_str());
+    rmdir(namespacePath.c_str());
+    rmdir(storageRoot);
+    return 0;
+}
+
+static int compareInt64(const void* a, const void* b)
+{
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Boot read of the credentials through SecretCache, from plaintext and from
+// NVS with encryption's decrypt time charged per entry. "borrowUs" is a
+// later borrow of the CA certificate once boot wiped it, what each update
+// pays. Fails when the encrypted read breaks the boot budget.
+static int runSecretsBench(FILE* output, int runs, uint32_t decryptNsPerEntry)
+{
+    char storageRoot[] = "/tmp/benchSecretsXXXXXX";
+    if (mkdtemp(storageRoot) == nullptr)
+    {
+        printf("cannot create a storage directory\n");
+        return 2;
+    }
+
+    // A 2048 bit RSA root in PEM, as in the device's CA slot
+    std::string caCert = "-----BEGIN CERTIFICATE-----\n";
+    for (int line = 0; line < 30; line++)
+    {
+        caCert += std::string(64, 'A' + line % 26) + "\n";
+    }
+    caCert += "-----END CERTIFICATE-----\n";
+
+    PosixClock clock;
+    PosixStorage files(storageRoot);
+    const char* values[SECRET_COUNT] = {"bench-network", "correct horse battery staple", caCert.c_str()};
+    int regressions = 0;
+
+    for (uint32_t decryptNs : {0u, decryptNsPerEntry})
+    {
+        DecryptingStorage storage(&files, decryptNs);
+        std::vector<int64_t> loads(runs);
+        std::vector<int64_t> borrows(runs);
+
+        SecretCache writer(&storage, &clock);
+        writer.setKeys(BENCH_SECRETS_NAMESPACE, "username", "password", "cert");
+        writer.save(values);
+        uint32_t entriesBefore = storage.entriesDecrypted();
+
+        for (int run = 0; run < runs; run++)
+        {
+            // What setupOta does with them
+            SecretCache cache(&storage, &clock);
+            cache.setKeys(BENCH_SECRETS_NAMESPACE, "username", "password", "cert");
+            cache.load();
+            cache.acquire(SECRET_WIFI_SSID);
+            cache.acquire(SECRET_WIFI_PASSWORD);
+            cache.release(SECRET_WIFI_SSID);
+            cache.release(SECRET_WIFI_PASSWORD);
+            cache.wipe();
+
+            int64_t start = clock.nowMicroS();
+            cache.acquire(SECRET_CA_CERT);
+            borrows[run] = clock.nowMicroS() - start;
+            cache.release(SECRET_CA_CERT);
+
+            SecretCacheStats stats;
+            cache.stats(&stats);
+            loads[run] = stats.lastLoadMicroS;
+        }
+
+        qsort(loads.data(), runs, sizeof(int64_t), compareInt64);
+        qsort(borrows.data(), runs, sizeof(int64_t), compareInt64);
+        bool withinBudget = loads[runs / 2] <= BENCH_NVS_BOOT_BUDGET_US;
+        regressions += withinBudget ? 0 : 1;
+
+        for (FILE* file : {output, stdout})
+        {
+            fprintf(file,
+                    "{\"bench\":\"secrets\",\"storage\":\"%s\",\"decryptNsPerEntry\":%u,\"runs\":%d,\"entriesPerBoot\":%u,"
+                    "\"loadP50Us\":%lld,\"loadMaxUs\":%lld,\"borrowP50Us\":%lld,\"budgetUs\":%d,\"withinBudget\":%s}\n",
+                    decryptNs > 0 ? "encrypted" : "plaintext",
+                    decryptNs,
+                    runs,
+                    (storage.entriesDecrypted() - entriesBefore) / runs,
+                    (long long)loads[runs / 2],
+                    (long long)loads[runs - 1],
+                    (long long)borrows[runs / 2],
+                    BENCH_NVS_BOOT_BUDGET_US,
+                    withinBudget ? "true" : "false");
+        }
+    }
+
+    std::string namespacePath = std::string(storageRoot) + "/" + BENCH_SECRETS_NAMESPACE;
+    for (const char* key : {"username", "password", "cert"})
+    {
+        unlink((namespacePath + "/" + key).c_str());
+    }
+    rmdir(namespacePath.c_str());
+    rmdir(storageRoot);
+    return regressions > 0 ? 1 : 0;
+}
+
+// esp_image_header_t with hash_appended set, up to 16 segments, the
+// checksum byte padded to 16 bytes and the SHA-256 over all of it, the way
+// esptool lays out an app
+static std::vector<uint8_t> makeAppImage(size_t size)
+{
+    int segments = (int)((size + 65535) / 65536);
+    segments = segments > 16 ? 16 : segments;
+    size_t segmentSize = (size / segments) & ~(size_t)3;
+    std::vector<uint8_t> image(24, 0);
+    uint8_t checksum = 0xEF;
+
+    image[0] = 0xE9;
+    image[1] = segments;
+    image[23] = 1;
+
+    srand(2);
+    for (int s = 0; s < segments; s++)
+    {
+        uint32_t loadAddress = 0x42000020 + s * 0x10000;
+        for (int i = 0; i < 4; i++)
+        {
+            image.push_back((uint8_t)(loadAddress >> (i * 8)));
+        }
+        for (int i = 0; i < 4; i++)
+        {
+            image.push_back((uint8_t)(segmentSize >> (i * 8)));
+        }
+        for (size_t i = 0; i < segmentSize; i++)
+        {
+            uint8_t value = rand();
+            image.push_back(value);
+            checksum ^= value;
+        }
+    }
+
+    while ((image.size() + 1) % 16 != 0)
+    {
+        image.push_back(0);
+    }
+    image.push_back(checksum);
+
+    uint8_t sha256[OTA_SHA256_LEN];
+    OtaSha256Context hash;
+    otaSha256Start(&hash);
+    otaSha256Update(&hash, image.data(), image.size());
+    otaSha256Finish(&hash, sha256);
+    image.insert(image.end(), sha256, sha256 + OTA_SHA256_LEN);
+    return image;
+}
+
+struct ScrubBenchMode {
+    const char* mode;
+    // chunkBytes 0 runs no scrubber, the foreground alone
+    PartitionScrubberConfig config;
+};
+
+// Runs passes until the target finished one more, returns its result
+static ScrubResult runScrubPass(PartitionScrubber* scrubber, int64_t* passMicroS)
+{
+    ScrubTargetStatus status;
+    scrubber->status(0, &status);
+    uint32_t passes = status.passes;
+    int64_t start = benchMicroS();
+
+    scrubber->checkNow();
+    while (scrubber->status(0, &status) && status.passes == passes)
+    {
+        int64_t wait = scrubber->step();
+        if (wait > 0)
+        {
+            usleep(wait);
+        }
+    }
+
+    *passMicroS = benchMicroS() - start;
+    return status.result;
+}
+
+// The scrubber re-hashing an app slot on simulated flash while a foreground
+// task needs the same flash every millisecond: how long a pass takes, the
+// longest step and the foreground's wait for the bus, which the chunk size
+// bounds. "unbounded" hashes 64 KB reads flat out for comparison. Each
+// mode checks the intact image and again with one bit cleared; fails when
+// the scrubber misjudges either or the bounded foreground p99 exceeds
+// BENCH_SCRUB_WAIT_CHUNKS chunk reads.
+static int runScrubBench(FILE* output, const std::vector<uint8_t>* image)
+{
+    static uint8_t buffer[65536];
+    std::vector<uint8_t> app = image->size() > 24 && (*image)[0] == 0xE9 ? *image : makeAppImage(BENCH_SCRUB_APP_SIZE);
+    const ScrubBenchMode modes[] = {
+        {"off", {0, 0, 0, 0}},
+        {"bounded", {BENCH_SCRUB_CHUNK_SIZE, 2000, 20000, 3600 * 1000000LL}},
+        {"unbounded", {sizeof(buffer), 1000000, 0, 3600 * 1000000LL}},
+    };
+    int64_t chunkReadUs = defaultFlashTiming.operationOverheadMicroS + defaultFlashTiming.readKiloByteMicroS * BENCH_SCRUB_CHUNK_SIZE / 1024;
+    int failures = 0;
+    PosixClock clock;
+
+    for (const ScrubBenchMode& mode : modes)
+    {
+        SimulatedFlash slot(app.size() > BENCH_SCRUB_SLOT_SIZE ? (app.size() + 0xffff) & ~(size_t)0xffff : BENCH_SCRUB_SLOT_SIZE);
+        slot.write(0, app.data(), app.size());
+        SharedFlashBus flash(&slot);
+        PartitionScrubber scrubber(&clock, buffer, sizeof(buffer));
+        std::vector<int64_t> waits;
+        std::atomic<bool> done(false);
+
+        std::thread foreground([&]() {
+            while (!done)
+            {
+                usleep(BENCH_SCRUB_FOREGROUND_US);
+                waits.push_back(flash.foregroundAccess());
+            }
+        });
+
+        ScrubResult intact = SCRUB_UNCHECKED;
+        ScrubResult flipped = SCRUB_UNCHECKED;
+        int64_t passMicroS = 0;
+        PartitionScrubberStats stats;
+        memset(&stats, 0, sizeof(stats));
+
+        if (mode.config.chunkBytes == 0)
+        {
+            usleep(1000000);
+        }
+        else
+        {
+            scrubber.setConfig(&mode.config);
+            scrubber.addTarget("ota_1", &flash, SCRUB_APP_IMAGE);
+            intact = runScrubPass(&scrubber, &passMicroS);
+            scrubber.stats(&stats);
+
+            // One bit gone in the middle of the image, the simulated NOR can
+            // only clear them
+            size_t offset = app.size() / 2;
+            while ((app[offset] & 1) == 0)
+            {
+                offset++;
+            }
+            uint8_t value = app[offset] & 0xFE;
+            slot.write(offset, &value, 1);
+
+            int64_t flippedMicroS;
+            flipped = runScrubPass(&scrubber, &flippedMicroS);
+        }
+
+        done = true;
+        foreground.join();
+
+        size_t count = waits.size();
+        qsort(waits.data(), count, sizeof(int64_t), compareInt64);
+        int64_t p50 = count > 0 ? waits[count / 2] : 0;
+        int64_t p99 = count > 0 ? waits[count * 99 / 100] : 0;
+        int64_t max = count > 0 ? waits[count - 1] : 0;
+        bool judged = mode.config.chunkBytes == 0 || (intact == SCRUB_INTACT && flipped == SCRUB_CORRUPT);
+        bool bounded = strcmp(mode.mode, "bounded") != 0 || p99 <= BENCH_SCRUB_WAIT_CHUNKS * chunkReadUs;
+        failures += judged && bounded ? 0 : 1;
+
+        for (FILE* file : {output, stdout})
+        {
+            fprintf(file,
+                    "{\"bench\":\"scrub\",\"mode\":\"%s\",\"imageBytes\":%zu,\"chunkBytes\":%zu,\"stepBudgetUs\":%lld,\"stepIntervalUs\":%lld,"
+                    "\"passMs\":%.1f,\"steps\":%u,\"longestStepUs\":%lld,\"dutyCycle\":%.3f,"
+                    "\"foregroundSamples\":%zu,\"foregroundWaitP50Us\":%lld,\"foregroundWaitP99Us\":%lld,\"foregroundWaitMaxUs\":%lld,"
+                    "\"intact\":\"%s\",\"flipped\":\"%s\",\"ok\":%s}\n",
+                    mode.mode,
+                    app.size(),
+                    mode.config.chunkBytes,
+                    (long long)mode.config.stepBudgetMicroS,
+                    (long long)mode.config.stepIntervalMicroS,
+                    passMicroS / 1000.0,
+                    stats.steps,
+                    (long long)stats.longestStepMicroS,
+                    passMicroS > 0 ? (double)stats.busyMicroS / passMicroS : 0.0,
+                    count,
+                    (long long)p50,
+                    (long long)p99,
+                    (long long)max,
+                    scrubResultName(intact),
+                    scrubResultName(flipped),
+                    judged && bounded ? "true" : "false");
+        }
+    }
+
+    return failures > 0 ? 1 : 0;
+}
+
+static void usage(const char* program)
+{
+    printf("usage: %s [--image file] [--profile name] [--erase demand|ahead|bulk] [--no-flash-latency]\n"
+           "          [--buffer bytes|auto] [--sweep] [--heap-limit bytes]\n"
+           "          [--api clients[,clients...]] [--requests n]\n"
+           "          [--ws clients[,clients...]] [--lines n] [--log-rate lines/s] [--shaping]\n"
+           "          [--polling] [--polls n] [--secrets] [--decrypt-ns ns] [--scrub]\n"
+           "          [--runs n] [--out results.jsonl] [--baseline results.jsonl] [--tolerance 0.10]\n",
+           program);
+}
+
+int main(int argc, char** argv)
+{
+    const char* imagePath = nullptr;
+    const char* profileName = nullptr;
+    const char* outputPath = "bench_results.jsonl";
+    const char* baselinePath = nullptr;
+    double tolerance = 0.10;
+    int runs = 1;
+    bool realTimeFlash = true;
+    FlashEraseStrategy erase = FLASH_ERASE_AHEAD;
+    std::vector<size_t> bufferSizes = {BENCH_READ_BUFFER_SIZE};
+    std::vector<int> apiClients;
+    int apiRequests = 200;
+    std::vector<int> webSocketClients;
+    int webSocketLines = 20000;
+    int logRate = 200;
+    bool shapingBench = false;
+    bool pollingBench = false;
+    bool secretsBench = false;
+    bool scrubBench = false;
+    uint32_t decryptNsPerEntry = BENCH_NVS_DECRYPT_NS_PER_ENTRY;
+    int polls = 10;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+
+        if (strcmp(argv[i], "--image") == 0 && hasValue)
+        {
+            imagePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--profile") == 0 && hasValue)
+        {
+            profileName = argv[++i];
+        }
+        else if (strcmp(argv[i], "--erase") == 0 && hasValue)
+        {
+            const char* name = argv[++i];
+            for (int strategy = FLASH_ERASE_ON_DEMAND; strategy <= FLASH_ERASE_BULK; strategy++)
+            {
+                if (strcmp(name, flashEraseStrategyName((FlashEraseStrategy)strategy)) == 0)
+                {
+                    erase = (FlashEraseStrategy)strategy;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--no-flash-latency") == 0)
+        {
+            realTimeFlash = false;
+        }
+        else if (strcmp(argv[i], "--buffer") == 0 && hasValue)
+        {
+            const char* value = argv[++i];
+            bufferSizes = {strcmp(value, "auto") == 0 ? 0 : (size_t)atoi(value)};
+        }
+        else if (strcmp(argv[i], "--sweep") == 0)
+        {
+            // Throughput against RAM: fixed sizes, then the adaptive sizer
+            bufferSizes = {1024, 2048, 4096, 8192, 16384, 32768, 0};
+        }
+        else if (strcmp(argv[i], "--heap-limit") == 0 && hasValue)
+        {
+            heapLimit = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--api") == 0 && hasValue)
+        {
+            for (char* value = strtok(argv[++i], ","); value != nullptr; value = strtok(nullptr, ","))
+            {
+                apiClients.push_back(atoi(value));
+            }
+        }
+        else if (strcmp(argv[i], "--requests") == 0 && hasValue)
+        {
+            apiRequests = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--ws") == 0 && hasValue)
+        {
+            for (char* value = strtok(argv[++i], ","); value != nullptr; value = strtok(nullptr, ","))
+            {
+                webSocketClients.push_back(atoi(value));
+            }
+        }
+        else if (strcmp(argv[i], "--lines") == 0 && hasValue)
+        {
+            webSocketLines = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--log-rate") == 0 && hasValue)
+        {
+            logRate = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--shaping") == 0)
+        {
+            shapingBench = true;
+        }
+        else if (strcmp(argv[i], "--polling") == 0)
+        {
+            pollingBench = true;
+        }
+        else if (strcmp(argv[i], "--polls") == 0 && hasValue)
+        {
+            polls = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--secrets") == 0)
+        {
+            secretsBench = true;
+        }
+        else if (strcmp(argv[i], "--scrub") == 0)
+        {
+            scrubBench = true;
+        }
+        else if (strcmp(argv[i], "--decrypt-ns") == 0 && hasValue)
+        {
+            decryptNsPerEntry = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--runs") == 0 && hasValue)
+        {
+            runs = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && hasValue)
+        {
+            outputPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && hasValue)
+        {
+            baselinePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && hasValue)
+        {
+            tolerance = atof(argv[++i]);
+        }
+        else
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<uint8_t> image;
+    if (imagePath != nullptr ? !readFile(imagePath, &image) : (image = makeSyntheticBundle(BENCH_DEFAULT_APP_SIZE, BENCH_DEFAULT_DATA_SIZE)).empty())
+    {
+        printf("cannot read %s\n", imagePath);
+        return 2;
+    }
+
+    FILE* output = fopen(outputPath, "w");
+    if (output == nullptr)
+    {
+        printf("cannot write %s\n", outputPath);
+        return 2;
+    }
+
+    smartLogQuiet = true;
+
+    if (!apiClients.empty())
+    {
+        int status = runApiBench(output, apiClients, apiRequests);
+        fclose(output);
+        return status;
+    }
+
+    if (!webSocketClients.empty())
+    {
+        int status = runWebSocketBench(output, webSocketClients, webSocketLines, logRate);
+        fclose(output);
+        return status;
+    }
+
+    if (shapingBench)
+    {
+        int status = runShapingBench(output, imagePath != nullptr ? image.size() : BENCH_SHAPING_IMAGE_SIZE);
+        fclose(output);
+        return status;
+    }
+
+    if (secretsBench)
+    {
+        int status = runSecretsBench(output, runs > 1 ? runs : BENCH_SECRETS_RUNS, decryptNsPerEntry);
+        fclose(output);
+        return status;
+    }
+
+    if (scrubBench)
+    {
+        int status = runScrubBench(output, &image);
+        fclose(output);
+        return status;
+    }
+
+    if (pollingBench)
+    {
+        int status = runPollingBench(output, &image, profileName, polls > 0 ? polls : 1);
+        fclose(output);
+        return status;
+    }
+
+    int regressions = 0;
+
+    for (int p = 0; p < networkProfileCount; p++)
+    {
+        const NetworkProfile* profile = &networkProfiles[p];
+        if (profileName != nullptr && strcmp(profileName, profile->name) != 0)
+        {
+            continue;
+        }
+
+        for (size_t bufferSize : bufferSizes)
+        {
+            for (int run = 0; run < runs; run++)
+            {
+                BenchResult result = runProfile(&image, profile, erase, realTimeFlash, bufferSize);
+                writeResult(output, &result);
+                writeResult(stdout, &result);
+
+                double baseline = baselinePath != nullptr ? baselineThroughput(baselinePath, result.profile, result.erase, result.buffer) : -1;
+                if (baseline > 0 && result.mbPerS < baseline * (1.0 - tolerance))
+                {
+                    printf("REGRESSION %s/%s/%s: %.3f MB/s vs baseline %.3f MB/s\n", result.profile, result.erase, result.buffer, result.mbPerS, baseline);
+                    regressions++;
+                }
+            }
+        }
+    }
+
+    fclose(output);
+    return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+#include <string.h>
+#include <time.h>
+
+#include "decryptingStorage.h"
+
+static int64_t monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+DecryptingStorage::DecryptingStorage(HalStorage* inner, uint32_t decryptNsPerEntry)
+    : inner(inner),
+      decryptNsPerEntry(decryptNsPerEntry),
+      entries(0)
+{
+}
+
+bool DecryptingStorage::open(const char* nvsNamespace, bool writable)
+{
+    return inner->open(nvsNamespace, writable);
+}
+
+bool DecryptingStorage::getString(const char* key, char* output, size_t outputSize)
+{
+    if (!inner->getString(key, output, outputSize))
+    {
+        // The header entry was still read and decrypted to find out
+        decrypt(0);
+        return false;
+    }
+
+    decrypt(strlen(output) + 1);
+    return true;
+}
+
+bool DecryptingStorage::setString(const char* key, const char* value)
+{
+    return inner->setString(key, value);
+}
+
+bool DecryptingStorage::getBlob(const char* key, void* output, size_t* len)
+{
+    bool found = inner->getBlob(key, output, len);
+    decrypt(found ? *len : 0);
+    return found;
+}
+
+bool DecryptingStorage::setBlob(const char* key, const void* value, size_t len)
+{
+    return inner->setBlob(key, value, len);
+}
+
+bool DecryptingStorage::commit()
+{
+    return inner->commit();
+}
+
+void DecryptingStorage::close()
+{
+    inner->close();
+}
+
+uint32_t DecryptingStorage::entriesDecrypted() const
+{
+    return entries;
+}
+
+// Busy, like the AES driver: the caller's task does the work
+void DecryptingStorage::decrypt(size_t len)
+{
+    uint32_t count = 1 + (len + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE;
+    int64_t end = monotonicNs() + (int64_t)count * decryptNsPerEntry;
+
+    entries += count;
+    while (decryptNsPerEntry > 0 && monotonicNs() < end)
+    {
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef __ESP_DECRYPTING_STORAGE__
+#define __ESP_DECRYPTING_STORAGE__
+
+#include "../../hal.h"
+
+// NVS stores a string as one header entry plus its data in 32 byte entries
+#define NVS_ENTRY_SIZE 32
+
+// Charges the CPU time of NVS encryption on every read of an inner
+// storage: each entry of the value is an XTS-AES decrypt on the device.
+// decryptNsPerEntry 0 is plaintext NVS.
+class DecryptingStorage : public HalStorage {
+public:
+    DecryptingStorage(HalStorage* inner, uint32_t decryptNsPerEntry);
+
+    bool open(const char* nvsNamespace, bool writable) override;
+    bool getString(const char* key, char* output, size_t outputSize) override;
+    bool setString(const char* key, const char* value) override;
+    bool getBlob(const char* key, void* output, size_t* len) override;
+    bool setBlob(const char* key, const void* value, size_t len) override;
+    bool commit() override;
+    void close() override;
+
+    uint32_t entriesDecrypted() const;
+
+private:
+    void decrypt(size_t len);
+
+    HalStorage* inner;
+    uint32_t decryptNsPerEntry;
+    uint32_t entries;
+};
+
+#endif // __ESP_DECRYPTING_STORAGE__
@@ -0,0 +1,127 @@
+#include <string.h>
+
+#include "prefetchTransport.h"
+
+PrefetchTransport::PrefetchTransport(HalHttpTransport* inner, size_t capacity, size_t chunkSize)
+    : inner(inner),
+      ring(capacity),
+      chunkSize(chunkSize),
+      head(0),
+      used(0),
+      finished(false),
+      failed(false),
+      stopping(false)
+{
+}
+
+PrefetchTransport::~PrefetchTransport()
+{
+    close();
+}
+
+bool PrefetchTransport::open(const char* url)
+{
+    head = 0;
+    used = 0;
+    finished = false;
+    failed = false;
+    stopping = false;
+
+    if (!inner->open(url))
+    {
+        return false;
+    }
+
+    worker = std::thread(&PrefetchTransport::fill, this);
+    return true;
+}
+
+void PrefetchTransport::fill()
+{
+    std::vector<uint8_t> chunk(chunkSize);
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [this] { return stopping || ring.size() - used >= chunkSize; });
+            if (stopping)
+            {
+                return;
+            }
+        }
+
+        int len = inner->read(chunk.data(), chunkSize);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (len <= 0)
+        {
+            finished = true;
+            failed = len < 0 || !inner->isComplete();
+            changed.notify_all();
+            return;
+        }
+
+        for (int i = 0; i < len; i++)
+        {
+            ring[(head + used + i) % ring.size()] = chunk[i];
+        }
+
+        used += len;
+        changed.notify_all();
+    }
+}
+
+int PrefetchTransport::statusCode()
+{
+    return inner->statusCode();
+}
+
+int64_t PrefetchTransport::contentLength()
+{
+    return inner->contentLength();
+}
+
+int PrefetchTransport::read(uint8_t* buffer, size_t len)
+{
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [this] { return used > 0 || finished; });
+
+    if (used == 0)
+    {
+        return failed ? -1 : 0;
+    }
+
+    size_t take = used < len ? used : len;
+    for (size_t i = 0; i < take; i++)
+    {
+        buffer[i] = ring[(head + i) % ring.size()];
+    }
+
+    head = (head + take) % ring.size();
+    used -= take;
+    changed.notify_all();
+    return take;
+}
+
+bool PrefetchTransport::isComplete()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return finished && !failed;
+}
+
+void PrefetchTransport::close()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        changed.notify_all();
+    }
+
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+
+    inner->close();
+}
@@ -0,0 +1,43 @@
+#ifndef __ESP_PREFETCH_TRANSPORT__
+#define __ESP_PREFETCH_TRANSPORT__
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../../hal.h"
+
+// Reads the wrapped transport on a background thread into a bounded buffer,
+// the host counterpart of the download task filling the chunk queue while
+// the flash-write task drains it. read() returns whatever is buffered, so a
+// short read means the network is behind, as on the device.
+class PrefetchTransport : public HalHttpTransport {
+public:
+    PrefetchTransport(HalHttpTransport* inner, size_t capacity, size_t chunkSize);
+    ~PrefetchTransport();
+
+    bool open(const char* url) override;
+    int statusCode() override;
+    int64_t contentLength() override;
+    int read(uint8_t* buffer, size_t len) override;
+    bool isComplete() override;
+    void close() override;
+
+private:
+    void fill();
+
+    HalHttpTransport* inner;
+    std::vector<uint8_t> ring;
+    size_t chunkSize;
+    size_t head;
+    size_t used;
+    bool finished;
+    bool failed;
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::thread worker;
+};
+
+#endif // __ESP_PREFETCH_TRANSPORT__
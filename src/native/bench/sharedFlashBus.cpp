@@ -0,0 +1,65 @@
+#include <time.h>
+#include <unistd.h>
+
+#include "sharedFlashBus.h"
+
+static int64_t monotonicMicroS()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+SharedFlashBus::SharedFlashBus(SimulatedFlash* inner)
+    : inner(inner)
+{
+}
+
+size_t SharedFlashBus::size()
+{
+    return inner->size();
+}
+
+bool SharedFlashBus::erase(size_t offset, size_t len)
+{
+    std::lock_guard<std::mutex> guard(bus);
+    int64_t before = inner->busyMicroS();
+    bool erased = inner->erase(offset, len);
+    hold(before);
+    return erased;
+}
+
+bool SharedFlashBus::write(size_t offset, const uint8_t* data, size_t len)
+{
+    std::lock_guard<std::mutex> guard(bus);
+    int64_t before = inner->busyMicroS();
+    bool written = inner->write(offset, data, len);
+    hold(before);
+    return written;
+}
+
+bool SharedFlashBus::read(size_t offset, uint8_t* data, size_t len)
+{
+    std::lock_guard<std::mutex> guard(bus);
+    int64_t before = inner->busyMicroS();
+    bool done = inner->read(offset, data, len);
+    hold(before);
+    return done;
+}
+
+int64_t SharedFlashBus::foregroundAccess()
+{
+    int64_t start = monotonicMicroS();
+    std::lock_guard<std::mutex> guard(bus);
+    return monotonicMicroS() - start;
+}
+
+void SharedFlashBus::hold(int64_t before)
+{
+    int64_t spent = inner->busyMicroS() - before;
+
+    if (spent > 0)
+    {
+        usleep(spent);
+    }
+}
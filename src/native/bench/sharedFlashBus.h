@@ -0,0 +1,34 @@
+#ifndef __ESP_SHARED_FLASH_BUS__
+#define __ESP_SHARED_FLASH_BUS__
+
+#include <stdint.h>
+#include <mutex>
+
+#include "../simulatedFlash.h"
+
+// One SPI flash shared by a background reader and the foreground. On the
+// device an esp_partition_read stops the flash cache, so a task that misses
+// the cache waits until the read is through. Operations on the wrapper hold
+// the bus for the inner SimulatedFlash's modelled time in real time; the
+// inner device itself can stay virtual so setting up an image is instant.
+class SharedFlashBus : public FlashDevice {
+public:
+    explicit SharedFlashBus(SimulatedFlash* inner);
+
+    size_t size() override;
+    bool erase(size_t offset, size_t len) override;
+    bool write(size_t offset, const uint8_t* data, size_t len) override;
+    bool read(size_t offset, uint8_t* data, size_t len) override;
+
+    // One foreground cache miss, returns how long it waited for the bus
+    int64_t foregroundAccess();
+
+private:
+    // Sleeps off what the inner device charged since before, with the bus held
+    void hold(int64_t before);
+
+    SimulatedFlash* inner;
+    std::mutex bus;
+};
+
+#endif // __ESP_SHARED_FLASH_BUS__
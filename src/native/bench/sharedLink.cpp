@@ -0,0 +1,149 @@
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include "sharedLink.h"
+
+#define SHARED_LINK_STEP_US 50
+
+// Simulated time, advanced by the model only
+class StepClock : public HalClock {
+public:
+    int64_t nowMicroS() override
+    {
+        return now;
+    }
+
+    void sleepMs(uint32_t ms) override
+    {
+        now += ms * 1000LL;
+    }
+
+    int64_t now = 0;
+};
+
+struct LinkPacket {
+    uint32_t bytes;
+    bool app;
+    bool response;
+    // When the application sent the request this exchange started with
+    int64_t startMicroS;
+};
+
+SharedLinkResult runSharedLink(const SharedLinkConfig* config, const OtaShaperConfig* shaping)
+{
+    StepClock clock;
+    OtaShaper shaper(&clock);
+    std::deque<LinkPacket> queue;
+    std::vector<double> latencies;
+
+    SharedLinkResult result;
+    memset(&result, 0, sizeof(result));
+
+    if (shaping != nullptr)
+    {
+        shaper.setConfig(shaping);
+    }
+    shaper.begin();
+
+    size_t otaSent = 0;
+    size_t otaQueued = 0;
+    size_t otaUnread = 0;
+    int64_t nextReadMicroS = 0;
+    int64_t nextAppMicroS = 0;
+    int64_t doneMicroS = -1;
+    // Airtime carried over between steps, in bytes times 1000000
+    int64_t airtime = 0;
+    int64_t cycle = config->appBurstMicroS + config->appGapMicroS;
+    int64_t end = config->imageBytes > 0 ? config->limitMicroS : cycle;
+
+    for (int64_t now = 0; now < end && doneMicroS < 0; now += SHARED_LINK_STEP_US)
+    {
+        clock.now = now;
+
+        if (now >= nextAppMicroS)
+        {
+            if (now % cycle < config->appBurstMicroS)
+            {
+                queue.push_back({config->appPacketBytes, true, false, now});
+                shaper.noteAppTraffic();
+            }
+            nextAppMicroS += config->appIntervalMicroS;
+        }
+
+        // The server fills whatever the window allows
+        while (otaSent < config->imageBytes && otaQueued + otaUnread + config->segmentBytes <= config->windowBytes)
+        {
+            uint32_t bytes = std::min<size_t>(config->segmentBytes, config->imageBytes - otaSent);
+            queue.push_back({bytes, false, false, now});
+            otaSent += bytes;
+            otaQueued += bytes;
+        }
+
+        if (queue.empty())
+        {
+            airtime = 0;
+        }
+        else
+        {
+            airtime += (int64_t)config->linkBytesPerS * SHARED_LINK_STEP_US;
+        }
+
+        while (!queue.empty() && airtime >= (int64_t)queue.front().bytes * 1000000)
+        {
+            LinkPacket packet = queue.front();
+            queue.pop_front();
+            airtime -= (int64_t)packet.bytes * 1000000;
+
+            if (!packet.app)
+            {
+                otaQueued -= packet.bytes;
+                otaUnread += packet.bytes;
+            }
+            else if (!packet.response)
+            {
+                // The server answers right away, behind whatever is queued
+                queue.push_back({config->appPacketBytes, true, true, packet.startMicroS});
+            }
+            else
+            {
+                latencies.push_back((now - packet.startMicroS) / 1000.0);
+                shaper.noteAppTraffic();
+            }
+        }
+
+        if (now >= nextReadMicroS && otaUnread > 0)
+        {
+            size_t bytes = std::min(otaUnread, shaping != nullptr ? shaper.limitRead(config->readSize) : config->readSize);
+            otaUnread -= bytes;
+            result.otaBytes += bytes;
+
+            int64_t wait = shaping != nullptr ? shaper.consume(bytes) : 0;
+            nextReadMicroS = now + (int64_t)bytes * 1000000 / config->deviceBytesPerS + wait;
+
+            if (result.otaBytes == config->imageBytes)
+            {
+                doneMicroS = now;
+            }
+        }
+    }
+
+    int64_t elapsed = doneMicroS >= 0 ? doneMicroS : end;
+    result.updateS = elapsed / 1e6;
+    result.otaBytesPerS = elapsed > 0 ? result.otaBytes * 1e6 / elapsed : 0;
+    shaper.stats(&result.shaping);
+
+    std::sort(latencies.begin(), latencies.end());
+    size_t count = latencies.size();
+    result.appExchanges = count;
+    if (count > 0)
+    {
+        result.p50Ms = latencies[count / 2];
+        result.p90Ms = latencies[count * 90 / 100];
+        result.p99Ms = latencies[count * 99 / 100];
+        result.maxMs = latencies[count - 1];
+    }
+
+    return result;
+}
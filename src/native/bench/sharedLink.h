@@ -0,0 +1,50 @@
+#ifndef __ESP_SHARED_LINK__
+#define __ESP_SHARED_LINK__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../otaShaper.h"
+
+struct SharedLinkConfig {
+    // Airtime left for this station, both directions share it
+    uint32_t linkBytesPerS;
+    // TCP receive window of the download, all of it can sit queued at the
+    // access point ahead of application packets
+    uint32_t windowBytes;
+    uint32_t segmentBytes;
+    // Read, decrypt and hand to the flash task, the device side ceiling
+    uint32_t deviceBytesPerS;
+    size_t readSize;
+    size_t imageBytes;
+    // Request and response of the application, one exchange per interval
+    // while a burst is on
+    uint32_t appPacketBytes;
+    int64_t appIntervalMicroS;
+    int64_t appBurstMicroS;
+    int64_t appGapMicroS;
+    // Give up on a download that has not finished by then
+    int64_t limitMicroS;
+};
+
+struct SharedLinkResult {
+    size_t otaBytes;
+    double updateS;
+    double otaBytesPerS;
+    uint32_t appExchanges;
+    double p50Ms;
+    double p90Ms;
+    double p99Ms;
+    double maxMs;
+    OtaShaperStats shaping;
+};
+
+// Discrete time model of one Wi-Fi station: a download and the
+// application's request/response traffic queued first come first served
+// for the same airtime. The download is read through an OtaShaper, and like
+// on lwIP an unread receive window stops the server from sending more.
+// shaping nullptr downloads unshaped, imageBytes 0 measures the application
+// alone for appBurstMicroS + appGapMicroS.
+SharedLinkResult runSharedLink(const SharedLinkConfig* config, const OtaShaperConfig* shaping);
+
+#endif // __ESP_SHARED_LINK__
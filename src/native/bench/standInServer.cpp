@@ -0,0 +1,324 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../firmwareCache.h"
+#include "standInServer.h"
+
+#define STAND_IN_RETRANSMIT_MS 200
+// Modification time of the served file, fixed like the one
+// post_build_script.py keeps for an unchanged image
+#define STAND_IN_MTIME 1700000000
+
+const NetworkProfile networkProfiles[] = {
+    {"lan", 8 * 1024 * 1024, 1, 0.0, 16384},
+    {"wifi-good", 2 * 1024 * 1024, 5, 0.0, 1460},
+    {"wifi-edge", 300 * 1024, 40, 0.02, 1460},
+    {"cellular", 150 * 1024, 120, 0.01, 536},
+};
+
+const int networkProfileCount = sizeof(networkProfiles) / sizeof(networkProfiles[0]);
+
+static int64_t monotonicMicroS()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+StandInServer::StandInServer()
+    : body(nullptr),
+      profile(nullptr),
+      listenFd(-1),
+      listenPort(0),
+      running(false),
+      sent(0),
+      wire(0),
+      requestCount(0),
+      notModifiedCount(0)
+{
+    entityTag[0] = 0;
+    lastModified[0] = 0;
+}
+
+StandInServer::~StandInServer()
+{
+    stop();
+}
+
+bool StandInServer::start(const std::vector<uint8_t>* content, const NetworkProfile* networkProfile)
+{
+    body = content;
+    profile = networkProfile;
+    sent = 0;
+    wire = 0;
+    requestCount = 0;
+    notModifiedCount = 0;
+
+    // nginx: hex mtime and size
+    time_t mtime = STAND_IN_MTIME;
+    struct tm modified;
+    gmtime_r(&mtime, &modified);
+    snprintf(entityTag, sizeof(entityTag), "\"%lx-%zx\"", (long)mtime, body->size());
+    strftime(lastModified, sizeof(lastModified), "%a, %d %b %Y %H:%M:%S GMT", &modified);
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;
+
+    socklen_t addressLength = sizeof(address);
+    if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listenFd, 8) != 0 ||
+        getsockname(listenFd, (struct sockaddr*)&address, &addressLength) != 0)
+    {
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    listenPort = ntohs(address.sin_port);
+    running = true;
+    worker = std::thread(&StandInServer::serve, this);
+    return true;
+}
+
+void StandInServer::stop()
+{
+    if (!running)
+    {
+        return;
+    }
+
+    running = false;
+    shutdown(listenFd, SHUT_RDWR);
+    close(listenFd);
+    listenFd = -1;
+
+    if (worker.joinable())
+    {
+        worker.join();
+    }
+}
+
+uint16_t StandInServer::port() const
+{
+    return listenPort;
+}
+
+std::string StandInServer::url(const char* path) const
+{
+    return "http://127.0.0.1:" + std::to_string(listenPort) + path;
+}
+
+uint64_t StandInServer::bytesSent() const
+{
+    return sent;
+}
+
+uint64_t StandInServer::wireBytes() const
+{
+    return wire;
+}
+
+uint32_t StandInServer::requests() const
+{
+    return requestCount;
+}
+
+uint32_t StandInServer::notModified() const
+{
+    return notModifiedCount;
+}
+
+const char* StandInServer::etag() const
+{
+    return entityTag;
+}
+
+// Value of the request header name, nullptr when absent
+static const char* findHeader(const char* request, const char* name, char* value, size_t size)
+{
+    size_t nameLength = strlen(name);
+
+    for (const char* line = strstr(request, "\r\n"); line != nullptr; line = strstr(line + 2, "\r\n"))
+    {
+        if (strncasecmp(line + 2, name, nameLength) != 0 || line[2 + nameLength] != ':')
+        {
+            continue;
+        }
+
+        const char* start = line + 2 + nameLength + 1;
+        while (*start == ' ')
+        {
+            start++;
+        }
+
+        size_t len = strcspn(start, "\r\n");
+        if (len >= size)
+        {
+            return nullptr;
+        }
+
+        memcpy(value, start, len);
+        value[len] = 0;
+        return value;
+    }
+
+    return nullptr;
+}
+
+void StandInServer::serve()
+{
+    while (running)
+    {
+        struct pollfd listening = {listenFd, POLLIN, 0};
+        if (poll(&listening, 1, 100) <= 0)
+        {
+            continue;
+        }
+
+        int clientFd = accept(listenFd, nullptr, nullptr);
+        if (clientFd < 0)
+        {
+            continue;
+        }
+
+        handle(clientFd);
+        close(clientFd);
+    }
+}
+
+void StandInServer::handle(int clientFd)
+{
+    char request[4096];
+    size_t used = 0;
+
+    while (used < sizeof(request) - 1)
+    {
+        ssize_t len = recv(clientFd, request + used, sizeof(request) - 1 - used, 0);
+        if (len <= 0)
+        {
+            return;
+        }
+
+        used += len;
+        request[used] = 0;
+
+        if (strstr(request, "\r\n\r\n") != nullptr)
+        {
+            break;
+        }
+    }
+
+    char rangeValue[64];
+    char ifNoneMatchValue[128];
+    char ifModifiedSinceValue[64];
+    const char* range = findHeader(request, "Range", rangeValue, sizeof(rangeValue));
+    const char* ifNoneMatch = findHeader(request, "If-None-Match", ifNoneMatchValue, sizeof(ifNoneMatchValue));
+    const char* ifModifiedSince = findHeader(request, "If-Modified-Since", ifModifiedSinceValue, sizeof(ifModifiedSinceValue));
+
+    requestCount++;
+    wire += used;
+
+    // RFC 7232: If-None-Match wins over If-Modified-Since, which nginx
+    // compares for an exact match
+    bool unchanged = ifNoneMatch != nullptr ? httpEtagMatches(ifNoneMatch, entityTag)
+                                            : ifModifiedSince != nullptr && strcmp(ifModifiedSince, lastModified) == 0;
+    size_t offset = 0;
+    size_t length = body->size();
+    HttpRangeResult ranged = unchanged ? HTTP_RANGE_NONE : parseHttpRange(range, body->size(), &offset, &length);
+
+    usleep(profile->latencyMs * 1000);
+
+    char headers[512];
+    int headerLength = snprintf(headers, sizeof(headers), "HTTP/1.1 ");
+
+    if (unchanged)
+    {
+        notModifiedCount++;
+        length = 0;
+        headerLength += snprintf(headers + headerLength, sizeof(headers) - headerLength, "304 Not Modified\r\n");
+    }
+    else if (ranged == HTTP_RANGE_UNSATISFIABLE)
+    {
+        length = 0;
+        headerLength += snprintf(headers + headerLength, sizeof(headers) - headerLength,
+                                 "416 Range Not Satisfiable\r\nContent-Range: bytes */%zu\r\nContent-Length: 0\r\n", body->size());
+    }
+    else if (ranged == HTTP_RANGE_OK)
+    {
+        headerLength += snprintf(headers + headerLength, sizeof(headers) - headerLength,
+                                 "206 Partial Content\r\nContent-Range: bytes %zu-%zu/%zu\r\nContent-Length: %zu\r\n",
+                                 offset, offset + length - 1, body->size(), length);
+    }
+    else
+    {
+        headerLength += snprintf(headers + headerLength, sizeof(headers) - headerLength, "200 OK\r\nContent-Length: %zu\r\n", length);
+    }
+
+    headerLength += snprintf(headers + headerLength, sizeof(headers) - headerLength,
+                             "Content-Type: application/octet-stream\r\nETag: %s\r\nLast-Modified: %s\r\n"
+                             "Accept-Ranges: bytes\r\nConnection: close\r\n\r\n",
+                             entityTag, lastModified);
+    send(clientFd, headers, headerLength, MSG_NOSIGNAL);
+    wire += headerLength;
+
+    int noDelay = 1;
+    setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    int64_t startMicroS = monotonicMicroS();
+    size_t end = offset + length;
+    size_t first = offset;
+
+    while (offset < end && running)
+    {
+        size_t len = end - offset;
+        if (len > profile->chunkSize)
+        {
+            len = profile->chunkSize;
+        }
+
+        if (profile->loss > 0 && (double)rand() / RAND_MAX < profile->loss)
+        {
+            usleep(STAND_IN_RETRANSMIT_MS * 1000);
+            startMicroS += STAND_IN_RETRANSMIT_MS * 1000;
+        }
+
+        ssize_t written = send(clientFd, body->data() + offset, len, MSG_NOSIGNAL);
+        if (written <= 0)
+        {
+            return;
+        }
+
+        offset += written;
+        sent += written;
+        wire += written;
+
+        // Pace to the profile bandwidth
+        int64_t due = startMicroS + (int64_t)(offset - first) * 1000000 / profile->bandwidthBytesPerS;
+        int64_t now = monotonicMicroS();
+        if (due > now)
+        {
+            usleep(due - now);
+        }
+    }
+}
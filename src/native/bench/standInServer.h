@@ -0,0 +1,65 @@
+#ifndef __ESP_STAND_IN_SERVER__
+#define __ESP_STAND_IN_SERVER__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Shape of the link between the device and the update server
+struct NetworkProfile {
+    const char* name;
+    uint32_t bandwidthBytesPerS;
+    // One-way delay before the response starts
+    uint32_t latencyMs;
+    // Chance per written chunk to stall for a retransmission timeout
+    double loss;
+    // Size of every send() on the server side
+    uint32_t chunkSize;
+};
+
+extern const NetworkProfile networkProfiles[];
+extern const int networkProfileCount;
+
+// Loopback HTTP/1.1 server that plays back one in-memory file with the
+// timing of a NetworkProfile. Stands in for the nginx host in benchmarks:
+// an nginx style ETag and Last-Modified, conditional requests answered 304
+// and a single Range answered 206.
+class StandInServer {
+public:
+    StandInServer();
+    ~StandInServer();
+
+    bool start(const std::vector<uint8_t>* body, const NetworkProfile* profile);
+    void stop();
+
+    uint16_t port() const;
+    std::string url(const char* path = "/firmware.bundle") const;
+    // Body bytes only
+    uint64_t bytesSent() const;
+    // Everything on the wire in both directions, headers included
+    uint64_t wireBytes() const;
+    uint32_t requests() const;
+    uint32_t notModified() const;
+    const char* etag() const;
+
+private:
+    void serve();
+    void handle(int clientFd);
+
+    const std::vector<uint8_t>* body;
+    const NetworkProfile* profile;
+    int listenFd;
+    uint16_t listenPort;
+    std::atomic<bool> running;
+    std::atomic<uint64_t> sent;
+    std::atomic<uint64_t> wire;
+    std::atomic<uint32_t> requestCount;
+    std::atomic<uint32_t> notModifiedCount;
+    char entityTag[40];
+    char lastModified[40];
+    std::thread worker;
+};
+
+#endif // __ESP_STAND_IN_SERVER__
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <new>
+
+#include "webSocketStandIn.h"
+
+#define WEB_SOCKET_STAND_IN_MAX_CLIENTS 8
+
+static MessagePool standInPool;
+
+class StandInFrame {
+public:
+    virtual ~StandInFrame() {}
+    virtual size_t length() const = 0;
+};
+
+class HeapFrame : public StandInFrame {
+public:
+    HeapFrame(const char* text, size_t len)
+        : data(new uint8_t[len + 1]),
+          len(len)
+    {
+        memcpy(data, text, len);
+        data[len] = 0;
+    }
+
+    ~HeapFrame() override
+    {
+        delete[] data;
+    }
+
+    size_t length() const override
+    {
+        return len;
+    }
+
+private:
+    uint8_t* data;
+    size_t len;
+};
+
+class PooledFrame : public StandInFrame {
+public:
+    explicit PooledFrame(MessageSlab* slab)
+        : slab(slab)
+    {
+    }
+
+    ~PooledFrame() override
+    {
+        standInPool.release(slab);
+    }
+
+    static void operator delete(void* block)
+    {
+        standInPool.releaseHandle(block);
+    }
+
+    size_t length() const override
+    {
+        return slab->len;
+    }
+
+private:
+    MessageSlab* slab;
+};
+
+static_assert(sizeof(PooledFrame) <= MESSAGE_POOL_HANDLE_SIZE, "message handle too small");
+
+struct FrameNode {
+    StandInFrame* frame;
+    FrameNode* next;
+};
+
+struct StandInClient {
+    FrameNode* head;
+    FrameNode* tail;
+    int queued;
+    uint64_t bytesAcked;
+};
+
+static void enqueue(StandInClient* client, StandInFrame* frame)
+{
+    FrameNode* node = new FrameNode{frame, nullptr};
+
+    if (client->tail == nullptr)
+    {
+        client->head = node;
+    }
+    else
+    {
+        client->tail->next = node;
+    }
+
+    client->tail = node;
+    client->queued++;
+}
+
+static void ackOldest(StandInClient* client)
+{
+    FrameNode* node = client->head;
+
+    client->head = node->next;
+    if (client->head == nullptr)
+    {
+        client->tail = nullptr;
+    }
+
+    client->queued--;
+    client->bytesAcked += node->frame->length();
+    delete node->frame;
+    delete node;
+}
+
+WebSocketLoadResult runWebSocketLoad(bool pooled, int clients, int lines, int inFlight, size_t (*allocationCount)(void))
+{
+    StandInClient standInClients[WEB_SOCKET_STAND_IN_MAX_CLIENTS];
+    WebSocketLoadResult result;
+    char line[MESSAGE_POOL_SLAB_SIZE];
+
+    memset(standInClients, 0, sizeof(standInClients));
+    memset(&result, 0, sizeof(result));
+    if (clients > WEB_SOCKET_STAND_IN_MAX_CLIENTS)
+    {
+        clients = WEB_SOCKET_STAND_IN_MAX_CLIENTS;
+    }
+
+    size_t allocationsBefore = allocationCount();
+    auto start = std::chrono::steady_clock::now();
+
+    for (int n = 0; n < lines; n++)
+    {
+        size_t len = snprintf(line, sizeof(line), "[OTA] Written %d of 1048576 bytes, %d B/s", n * 4096, 100000 + n % 977);
+        bool delivered = false;
+
+        MessageSlab* slab = pooled ? standInPool.acquire(line, len) : nullptr;
+
+        for (int c = 0; c < clients; c++)
+        {
+            StandInClient* client = &standInClients[c];
+
+            if (client->queued >= inFlight)
+            {
+                ackOldest(client);
+            }
+
+            if (!pooled)
+            {
+                enqueue(client, new HeapFrame(line, len));
+                result.queued++;
+                delivered = true;
+                continue;
+            }
+
+            void* handle = slab != nullptr ? standInPool.acquireHandle() : nullptr;
+            if (handle != nullptr)
+            {
+                standInPool.retain(slab);
+                enqueue(client, new (handle) PooledFrame(slab));
+                result.queued++;
+                delivered = true;
+            }
+        }
+
+        if (slab != nullptr)
+        {
+            standInPool.release(slab);
+        }
+
+        result.dropped += delivered ? 0 : 1;
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    result.allocations = allocationCount() - allocationsBefore;
+
+    for (int c = 0; c < clients; c++)
+    {
+        while (standInClients[c].queued > 0)
+        {
+            ackOldest(&standInClients[c]);
+        }
+    }
+
+    result.lines = lines;
+    result.allocationsPerLine = lines > 0 ? (double)result.allocations / lines : 0;
+    result.nsPerLine = lines > 0 ? std::chrono::duration<double, std::nano>(end - start).count() / lines : 0;
+    standInPool.stats(&result.pool);
+    return result;
+}
@@ -0,0 +1,29 @@
+#ifndef __ESP_WEB_SOCKET_STAND_IN__
+#define __ESP_WEB_SOCKET_STAND_IN__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../messagePool.h"
+
+struct WebSocketLoadResult {
+    uint32_t lines;
+    // Frames queued over all clients
+    uint32_t queued;
+    // Lines no client got because the pool was exhausted
+    uint32_t dropped;
+    uint64_t allocations;
+    double allocationsPerLine;
+    double nsPerLine;
+    MessagePoolStats pool;
+};
+
+// Host model of smartLog fanning lines out to WebSocket clients. Each client
+// keeps its outbound frames in a list with a node per frame, as the web
+// server's LinkedList does, and acks the oldest once inFlight are queued.
+// Unpooled frames copy the payload per client like
+// AsyncWebSocketBasicMessage; pooled frames share a MessagePool slab and
+// live in its handles, as webSocketPoolSend queues them on the device.
+WebSocketLoadResult runWebSocketLoad(bool pooled, int clients, int lines, int inFlight, size_t (*allocationCount)(void));
+
+#endif // __ESP_WEB_SOCKET_STAND_IN__
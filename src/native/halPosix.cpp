@@ -0,0 +1,597 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "halPosix.h"
+
+#define SIMULATED_APP_SLOT_SIZE 0x140000
+#define SIMULATED_SPIFFS_SIZE 0x160000
+#define APP_IMAGE_MAGIC 0xE9
+
+int64_t PosixClock::nowMicroS()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void PosixClock::sleepMs(uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+PosixStorage::PosixStorage(const char* root)
+    : root(root),
+      writable(false)
+{
+}
+
+std::string PosixStorage::path(const char* key)
+{
+    return directory + "/" + key;
+}
+
+bool PosixStorage::open(const char* nvsNamespace, bool write)
+{
+    directory = root + "/" + nvsNamespace;
+    writable = write;
+
+    if (writable)
+    {
+        mkdir(root.c_str(), 0755);
+        mkdir(directory.c_str(), 0755);
+    }
+
+    struct stat info;
+    return stat(directory.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+bool PosixStorage::getString(const char* key, char* output, size_t outputSize)
+{
+    size_t len = outputSize - 1;
+
+    if (!getBlob(key, output, &len))
+    {
+        return false;
+    }
+
+    output[len] = 0;
+    return true;
+}
+
+bool PosixStorage::setString(const char* key, const char* value)
+{
+    return setBlob(key, value, strlen(value));
+}
+
+bool PosixStorage::getBlob(const char* key, void* output, size_t* len)
+{
+    FILE* file = fopen(path(key).c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    size_t stored = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    bool fits = stored <= *len;
+    if (fits)
+    {
+        *len = fread(output, 1, stored, file);
+    }
+
+    fclose(file);
+    return fits;
+}
+
+bool PosixStorage::setBlob(const char* key, const void* value, size_t len)
+{
+    if (!writable)
+    {
+        return false;
+    }
+
+    FILE* file = fopen(path(key).c_str(), "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    bool written = fwrite(value, 1, len, file) == len;
+    fclose(file);
+    return written;
+}
+
+bool PosixStorage::commit()
+{
+    return writable;
+}
+
+void PosixStorage::close()
+{
+    directory.clear();
+    writable = false;
+}
+
+SimulatedPartitions::SimulatedPartitions(const SimulatedFlashTiming* timing, bool realTime)
+    : appSlots{
+          SimulatedFlash(SIMULATED_APP_SLOT_SIZE, timing, realTime),
+          SimulatedFlash(SIMULATED_APP_SLOT_SIZE, timing, realTime),
+      },
+      spiffs(SIMULATED_SPIFFS_SIZE, timing, realTime),
+      stage(SIMULATED_SPIFFS_SIZE, timing, realTime),
+      hasStaging(true)
+{
+}
+
+FlashDevice* SimulatedPartitions::openApp()
+{
+    if (partitionTable.isPendingVerify())
+    {
+        return nullptr;
+    }
+
+    return &appSlots[(partitionTable.runningSlot() + 1) % SIMULATED_APP_SLOTS];
+}
+
+FlashDevice* SimulatedPartitions::openData(const char* label)
+{
+    return strcmp(label, "spiffs") == 0 ? &spiffs : nullptr;
+}
+
+FlashDevice* SimulatedPartitions::openStaging(size_t size)
+{
+    return hasStaging && size <= stage.size() ? &stage : nullptr;
+}
+
+const char* SimulatedPartitions::label(FlashDevice* partition)
+{
+    if (partition == &spiffs)
+    {
+        return "spiffs";
+    }
+
+    if (partition == &stage)
+    {
+        return "otastage";
+    }
+
+    return partition == &appSlots[0] ? "app0" : "app1";
+}
+
+const char* SimulatedPartitions::runningLabel()
+{
+    return label(&appSlots[partitionTable.runningSlot()]);
+}
+
+bool SimulatedPartitions::verifyApp(FlashDevice* partition)
+{
+    uint8_t magic = 0;
+    return ((SimulatedFlash*)partition)->read(0, &magic, 1) && magic == APP_IMAGE_MAGIC;
+}
+
+bool SimulatedPartitions::setBootPartition(FlashDevice* partition)
+{
+    if (partition != openApp())
+    {
+        return false;
+    }
+
+    partitionTable.flashNextSlot();
+    return true;
+}
+
+void SimulatedPartitions::removeStaging()
+{
+    hasStaging = false;
+}
+
+SimulatedFlash* SimulatedPartitions::slot(int index)
+{
+    return &appSlots[index];
+}
+
+SimulatedFlash* SimulatedPartitions::data()
+{
+    return &spiffs;
+}
+
+SimulatedFlash* SimulatedPartitions::staging()
+{
+    return &stage;
+}
+
+SimulatedPartitionTable* SimulatedPartitions::table()
+{
+    return &partitionTable;
+}
+
+PosixHttpTransport::PosixHttpTransport()
+    : hasValidators(false),
+      socketFd(-1),
+      status(0),
+      length(-1),
+      received(0),
+      endOfStream(false),
+      pendingOffset(0),
+      pendingLength(0)
+{
+    lastValidators.etag[0] = 0;
+    lastValidators.lastModified[0] = 0;
+}
+
+PosixHttpTransport::~PosixHttpTransport()
+{
+    close();
+}
+
+bool PosixHttpTransport::open(const char* url)
+{
+    return start(url, "");
+}
+
+bool PosixHttpTransport::openRange(const char* url, uint32_t offset, uint32_t len)
+{
+    return start(url, "Range: bytes=" + std::to_string(offset) + "-" + std::to_string((uint64_t)offset + len - 1) + "\r\n");
+}
+
+bool PosixHttpTransport::start(const char* url, const std::string& headers)
+{
+    // The same transport serves a ranged check and then the download
+    status = 0;
+    length = -1;
+    received = 0;
+    endOfStream = false;
+    pendingOffset = 0;
+    pendingLength = 0;
+    lastValidators.etag[0] = 0;
+    lastValidators.lastModified[0] = 0;
+
+    std::string conditional;
+    if (hasValidators)
+    {
+        if (sendValidators.etag[0] != 0)
+        {
+            conditional += "If-None-Match: " + std::string(sendValidators.etag) + "\r\n";
+        }
+        if (sendValidators.lastModified[0] != 0)
+        {
+            conditional += "If-Modified-Since: " + std::string(sendValidators.lastModified) + "\r\n";
+        }
+        hasValidators = false;
+    }
+
+    const char* prefix = "http://";
+    if (strncmp(url, prefix, strlen(prefix)) != 0)
+    {
+        return false;
+    }
+
+    const char* hostStart = url + strlen(prefix);
+    const char* pathStart = strchr(hostStart, '/');
+    std::string hostPort = pathStart != nullptr ? std::string(hostStart, pathStart - hostStart) : std::string(hostStart);
+    std::string path = pathStart != nullptr ? std::string(pathStart) : std::string("/");
+
+    std::string host = hostPort;
+    std::string port = "80";
+    size_t colon = hostPort.find(':');
+    if (colon != std::string::npos)
+    {
+        host = hostPort.substr(0, colon);
+        port = hostPort.substr(colon + 1);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    struct addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+    {
+        return false;
+    }
+
+    for (struct addrinfo* address = addresses; address != nullptr; address = address->ai_next)
+    {
+        socketFd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (socketFd < 0)
+        {
+            continue;
+        }
+
+        if (connect(socketFd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+            break;
+        }
+
+        ::close(socketFd);
+        socketFd = -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    if (socketFd < 0)
+    {
+        return false;
+    }
+
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + hostPort + "\r\nConnection: close\r\n" + headers + conditional + "\r\n";
+    if (send(socketFd, request.data(), request.size(), 0) != (ssize_t)request.size())
+    {
+        return false;
+    }
+
+    return readHeaders();
+}
+
+// Up to the end of the line, without the blanks around it
+static void copyHeaderValue(const char* value, char* output, size_t size)
+{
+    while (*value == ' ' || *value == '\t')
+    {
+        value++;
+    }
+
+    size_t len = strcspn(value, "\r\n");
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+    {
+        len--;
+    }
+
+    // A value that does not fit would not match the server's anyway
+    if (len >= size)
+    {
+        len = 0;
+    }
+
+    memcpy(output, value, len);
+    output[len] = 0;
+}
+
+bool PosixHttpTransport::readHeaders()
+{
+    size_t used = 0;
+    char* end = nullptr;
+
+    while (end == nullptr)
+    {
+        if (used == sizeof(headerBuffer) - 1)
+        {
+            return false;
+        }
+
+        ssize_t len = recv(socketFd, headerBuffer + used, sizeof(headerBuffer) - 1 - used, 0);
+        if (len <= 0)
+        {
+            return false;
+        }
+
+        used += len;
+        headerBuffer[used] = 0;
+        end = strstr(headerBuffer, "\r\n\r\n");
+    }
+
+    size_t headerLength = end - headerBuffer + 4;
+    pendingOffset = headerLength;
+    pendingLength = used - headerLength;
+    *end = 0;
+
+    if (sscanf(headerBuffer, "HTTP/%*s %d", &status) != 1)
+    {
+        return false;
+    }
+
+    for (char* line = strstr(headerBuffer, "\r\n"); line != nullptr; line = strstr(line + 2, "\r\n"))
+    {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+        {
+            length = atoll(line + 2 + 15);
+        }
+        else if (strncasecmp(line + 2, "ETag:", 5) == 0)
+        {
+            copyHeaderValue(line + 2 + 5, lastValidators.etag, sizeof(lastValidators.etag));
+        }
+        else if (strncasecmp(line + 2, "Last-Modified:", 14) == 0)
+        {
+            copyHeaderValue(line + 2 + 14, lastValidators.lastModified, sizeof(lastValidators.lastModified));
+        }
+    }
+
+    return true;
+}
+
+int PosixHttpTransport::statusCode()
+{
+    return status;
+}
+
+int64_t PosixHttpTransport::contentLength()
+{
+    return length;
+}
+
+int PosixHttpTransport::read(uint8_t* buffer, size_t len)
+{
+    if (length >= 0 && received >= length)
+    {
+        return 0;
+    }
+
+    if (length >= 0 && (int64_t)len > length - received)
+    {
+        len = length - received;
+    }
+
+    if (pendingLength > 0)
+    {
+        size_t take = pendingLength < len ? pendingLength : len;
+        memcpy(buffer, headerBuffer + pendingOffset, take);
+        pendingOffset += take;
+        pendingLength -= take;
+        received += take;
+        return take;
+    }
+
+    ssize_t got = recv(socketFd, buffer, len, 0);
+    if (got == 0)
+    {
+        endOfStream = true;
+    }
+    else if (got > 0)
+    {
+        received += got;
+    }
+
+    return got;
+}
+
+bool PosixHttpTransport::isComplete()
+{
+    return length >= 0 ? received == length : endOfStream;
+}
+
+void PosixHttpTransport::close()
+{
+    if (socketFd >= 0)
+    {
+        ::close(socketFd);
+        socketFd = -1;
+    }
+}
+
+void PosixHttpTransport::setValidators(const HalHttpValidators* validators)
+{
+    hasValidators = validators != nullptr;
+    if (hasValidators)
+    {
+        sendValidators = *validators;
+    }
+}
+
+void PosixHttpTransport::responseValidators(HalHttpValidators* output)
+{
+    *output = lastValidators;
+}
+
+PosixFileTransport::PosixFileTransport()
+    : file(nullptr),
+      length(-1),
+      remaining(0),
+      partial(false),
+      endOfFile(false)
+{
+}
+
+PosixFileTransport::~PosixFileTransport()
+{
+    close();
+}
+
+bool PosixFileTransport::open(const char* path)
+{
+    file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    remaining = length;
+    partial = false;
+    endOfFile = false;
+    return true;
+}
+
+bool PosixFileTransport::openRange(const char* path, uint32_t offset, uint32_t len)
+{
+    if (!open(path) || offset >= length)
+    {
+        close();
+        return false;
+    }
+
+    fseek(file, offset, SEEK_SET);
+    length = length - offset < len ? length - offset : len;
+    remaining = length;
+    partial = true;
+    return true;
+}
+
+int PosixFileTransport::statusCode()
+{
+    if (file == nullptr)
+    {
+        return 0;
+    }
+
+    return partial ? 206 : 200;
+}
+
+int64_t PosixFileTransport::contentLength()
+{
+    return length;
+}
+
+int PosixFileTransport::read(uint8_t* buffer, size_t len)
+{
+    if ((int64_t)len > remaining)
+    {
+        len = remaining;
+    }
+
+    size_t got = len > 0 ? fread(buffer, 1, len, file) : 0;
+    if (got == 0)
+    {
+        endOfFile = true;
+    }
+
+    remaining -= got;
+    return got;
+}
+
+bool PosixFileTransport::isComplete()
+{
+    return endOfFile;
+}
+
+void PosixFileTransport::close()
+{
+    if (file != nullptr)
+    {
+        fclose(file);
+        file = nullptr;
+    }
+}
+
+CrashLogRegion* mapCrashLogFile(const char* path)
+{
+    int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    // Extending the file zero fills it, an empty region begin() initializes
+    if (ftruncate(fd, sizeof(CrashLogRegion)) != 0)
+    {
+        ::close(fd);
+        return nullptr;
+    }
+
+    void* region = mmap(nullptr, sizeof(CrashLogRegion), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    return region == MAP_FAILED ? nullptr : (CrashLogRegion*)region;
+}
@@ -0,0 +1,137 @@
+#ifndef __ESP_OTA_HAL_POSIX__
+#define __ESP_OTA_HAL_POSIX__
+
+#include <stdio.h>
+#include <string>
+
+#include "../crashLog.h"
+#include "../hal.h"
+#include "simulatedFlash.h"
+#include "simulatedPartitionTable.h"
+
+// Silences smartLog on the host, for benchmarks
+extern bool smartLogQuiet;
+// When set smartLog also writes each line to it, as on the device
+extern CrashLog* smartLogCrashLog;
+
+// Shared mapping of a file standing in for RTC memory: whatever was written
+// before the process died is there for the next one. Created zeroed when
+// missing, nullptr on error.
+CrashLogRegion* mapCrashLogFile(const char* path);
+
+class PosixClock : public HalClock {
+public:
+    int64_t nowMicroS() override;
+    void sleepMs(uint32_t ms) override;
+};
+
+// One file per key under <root>/<namespace>/
+class PosixStorage : public HalStorage {
+public:
+    explicit PosixStorage(const char* root);
+
+    bool open(const char* nvsNamespace, bool writable) override;
+    bool getString(const char* key, char* output, size_t outputSize) override;
+    bool setString(const char* key, const char* value) override;
+    bool getBlob(const char* key, void* output, size_t* len) override;
+    bool setBlob(const char* key, const void* value, size_t len) override;
+    bool commit() override;
+    void close() override;
+
+private:
+    std::string path(const char* key);
+
+    std::string root;
+    std::string directory;
+    bool writable;
+};
+
+// Default Arduino layout: two 1.25 MB app slots and a "spiffs" data
+// partition plus an "otastage" partition as large as spiffs, all backed by
+// SimulatedFlash, with boot selection tracked by a SimulatedPartitionTable
+class SimulatedPartitions : public HalPartitions {
+public:
+    explicit SimulatedPartitions(const SimulatedFlashTiming* timing = &defaultFlashTiming, bool realTime = false);
+
+    FlashDevice* openApp() override;
+    FlashDevice* openData(const char* label) override;
+    FlashDevice* openStaging(size_t size) override;
+    const char* label(FlashDevice* partition) override;
+    const char* runningLabel() override;
+    bool verifyApp(FlashDevice* partition) override;
+    bool setBootPartition(FlashDevice* partition) override;
+
+    // A partition table without "otastage"
+    void removeStaging();
+
+    SimulatedFlash* slot(int index);
+    SimulatedFlash* data();
+    SimulatedFlash* staging();
+    SimulatedPartitionTable* table();
+
+private:
+    SimulatedFlash appSlots[SIMULATED_APP_SLOTS];
+    SimulatedFlash spiffs;
+    SimulatedFlash stage;
+    bool hasStaging;
+    SimulatedPartitionTable partitionTable;
+};
+
+// Plain HTTP/1.1 GET over a socket, enough for a local stand-in server.
+// TLS is not available on the host, https:// URLs fail to open.
+class PosixHttpTransport : public HalHttpTransport {
+public:
+    PosixHttpTransport();
+    ~PosixHttpTransport();
+
+    bool open(const char* url) override;
+    bool openRange(const char* url, uint32_t offset, uint32_t len) override;
+    int statusCode() override;
+    int64_t contentLength() override;
+    int read(uint8_t* buffer, size_t len) override;
+    bool isComplete() override;
+    void close() override;
+    void setValidators(const HalHttpValidators* validators) override;
+    void responseValidators(HalHttpValidators* output) override;
+
+private:
+    bool start(const char* url, const std::string& headers);
+    bool readHeaders();
+
+    HalHttpValidators sendValidators;
+    bool hasValidators;
+    HalHttpValidators lastValidators;
+    int socketFd;
+    int status;
+    int64_t length;
+    int64_t received;
+    bool endOfStream;
+    char headerBuffer[4096];
+    size_t pendingOffset;
+    size_t pendingLength;
+};
+
+// Serves a local file as if it were an HTTP 200 response
+class PosixFileTransport : public HalHttpTransport {
+public:
+    PosixFileTransport();
+    ~PosixFileTransport();
+
+    bool open(const char* path) override;
+    // Answers 206 with the requested slice
+    bool openRange(const char* path, uint32_t offset, uint32_t len) override;
+    int statusCode() override;
+    int64_t contentLength() override;
+    int read(uint8_t* buffer, size_t len) override;
+    bool isComplete() override;
+    void close() override;
+
+private:
+    FILE* file;
+    int64_t length;
+    int64_t remaining;
+    bool partial;
+    bool endOfFile;
+};
+
+#endif // __ESP_OTA_HAL_POSIX__
@@ -0,0 +1,1278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "../crashLog.h"
+#include "../firmwareCache.h"
+#include "../idleScheduler.h"
+#include "../otaActivation.h"
+#include "../otaBundle.h"
+#include "../otaPartitionWriter.h"
+#include "../otaRollback.h"
+#include "../otaTransfer.h"
+#include "../otaValidators.h"
+#include "../smartLogger.h"
+#include "../wifiManager.h"
+#include "halPosix.h"
+#include "simulatedWifi.h"
+
+#define NATIVE_READ_BUFFER_SIZE 4096
+
+static void usage(const char* program)
+{
+    printf("usage: %s [--erase demand|ahead|bulk] [--running <app.bin>] [--rate bytes/s] [--quiet] <http://host:port/path | file>\n"
+           "       %s --wifi-sim\n"
+           "       %s --idle-sim\n"
+           "       %s --crash-log-sim\n"
+           "       %s --activation-sim\n"
+           "       %s --rollback-sim\n"
+           "       %s --bundle-sim\n"
+           "       %s --cache-sim <image>\n",
+           program,
+           program,
+           program,
+           program,
+           program,
+           program,
+           program,
+           program);
+}
+
+// Polls like wifiManagerTask, 100 ms of simulated time per step
+static void runWifi(WifiManager* manager, SimulatedWifi* wifi, int64_t forMicroS, bool untilConnected)
+{
+    int64_t end = wifi->nowMicroS() + forMicroS;
+
+    while (wifi->nowMicroS() < end)
+    {
+        if (manager->poll() == WIFI_MANAGER_CONNECTED && untilConnected)
+        {
+            return;
+        }
+
+        wifi->advance(100000);
+    }
+}
+
+static void printWifi(const char* scenario, const WifiManager* manager)
+{
+    const WifiManagerStats* stats = manager->stats();
+
+    printf("%-22s %-16s %-7s last connect %6lld ms (%s), cached %u, scan %u, fallbacks %u, failures %u, reconnects %u\n",
+           scenario,
+           wifiManagerStateName(manager->state()),
+           manager->connectedSsid(),
+           (long long)(stats->lastConnectMicroS / 1000),
+           stats->lastConnectFast ? "cached" : "scan",
+           stats->fastConnects,
+           stats->scanConnects,
+           stats->fastFallbacks,
+           stats->failures,
+           stats->reconnects);
+}
+
+#define WIFI_SIM_PASSWORD "secret"
+
+// Stands in for SecretCache: one password for every network, counting who
+// still holds it
+class SimulatedPasswords : public WifiPasswordSource {
+public:
+    const char* acquirePassword(const char* ssid) override
+    {
+        lent++;
+        outstanding++;
+        return WIFI_SIM_PASSWORD;
+    }
+
+    void releasePassword(const char* ssid) override
+    {
+        outstanding--;
+    }
+
+    int lent = 0;
+    int outstanding = 0;
+};
+
+// True when a file of the namespace holds the password in plaintext
+static bool storedPassword(const char* root, const char* nvsNamespace)
+{
+    for (const char* key : {"networks", "link"})
+    {
+        std::string path = std::string(root) + "/" + nvsNamespace + "/" + key;
+        FILE* file = fopen(path.c_str(), "rb");
+        std::string content;
+        char buffer[256];
+        size_t len;
+
+        if (file == nullptr)
+        {
+            continue;
+        }
+
+        while ((len = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        {
+            content.append(buffer, len);
+        }
+        fclose(file);
+
+        if (content.find(WIFI_SIM_PASSWORD) != std::string::npos)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Boot and outage scenarios of the Wi-Fi connection manager against a
+// simulated radio, with the link cache in a scratch PosixStorage. The
+// passwords are borrowed for each join and must be back afterwards.
+static int runWifiScenarios()
+{
+    char root[] = "/tmp/wifi-sim-XXXXXX";
+    if (mkdtemp(root) == nullptr)
+    {
+        return 2;
+    }
+
+    PosixStorage storage(root);
+    SimulatedWifi wifi;
+    SimulatedPasswords passwords;
+    int lab = wifi.addAccessPoint("lab", 6, -58);
+
+    {
+        WifiManager manager(&wifi, &storage, &wifi);
+        manager.setPasswordSource(&passwords);
+        manager.begin("lab", nullptr);
+        runWifi(&manager, &wifi, 30000000, true);
+        printWifi("cold boot", &manager);
+    }
+
+    {
+        wifi.disconnect();
+        WifiManager manager(&wifi, &storage, &wifi);
+        manager.setPasswordSource(&passwords);
+        manager.begin("lab", nullptr);
+        runWifi(&manager, &wifi, 30000000, true);
+        printWifi("warm boot", &manager);
+    }
+
+    {
+        wifi.disconnect();
+        wifi.setAccessPoint(lab, true, 11);
+        WifiManager manager(&wifi, &storage, &wifi);
+        manager.setPasswordSource(&passwords);
+        manager.begin("lab", nullptr);
+        runWifi(&manager, &wifi, 30000000, true);
+        printWifi("AP changed channel", &manager);
+
+        wifi.setAccessPoint(lab, false, 11);
+        runWifi(&manager, &wifi, 45000000, false);
+        printWifi("AP down 45 s", &manager);
+
+        wifi.setAccessPoint(lab, true, 11);
+        runWifi(&manager, &wifi, 120000000, true);
+        printWifi("AP back", &manager);
+
+        // The lab AP is strong but congested
+        manager.recordThroughput(120000);
+        manager.poll();
+    }
+
+    // A second network, weaker in the scan. Boot stays on the remembered
+    // winner until its link breaks, then the history decides.
+    int office = wifi.addAccessPoint("office", 1, -72);
+
+    {
+        wifi.disconnect();
+        WifiManager manager(&wifi, &storage, &wifi);
+        manager.setPasswordSource(&passwords);
+        manager.addNetwork("office", nullptr);
+        manager.begin("lab", nullptr);
+        runWifi(&manager, &wifi, 30000000, true);
+        printWifi("second network", &manager);
+
+        wifi.setAccessPoint(lab, true, 3);
+        wifi.dropLink();
+        runWifi(&manager, &wifi, 30000000, true);
+        printWifi("winner moved", &manager);
+
+        manager.recordThroughput(600000);
+        manager.poll();
+    }
+
+    {
+        wifi.disconnect();
+        WifiManager manager(&wifi, &storage, &wifi);
+        manager.setPasswordSource(&passwords);
+        manager.begin("lab", nullptr);
+        runWifi(&manager, &wifi, 30000000, true);
+        printWifi("stored networks", &manager);
+
+        wifi.setAccessPoint(office, false, 1);
+        runWifi(&manager, &wifi, 30000000, true);
+        printWifi("office down", &manager);
+    }
+
+    bool stored = storedPassword(root, WIFI_MANAGER_NVS_NAMESPACE);
+    printf("passwords lent %d times, %d not given back, %s in NVS\n", passwords.lent, passwords.outstanding, stored ? "stored" : "not stored");
+    return passwords.lent > 0 && passwords.outstanding == 0 && !stored ? 0 : 1;
+}
+
+// A day with an update check every hour, each keeping the device busy for
+// 8 s, and a /ws command every 6 hours, once per idle mode
+static int runIdleScenarios()
+{
+    const IdleMode modes[] = {IDLE_MODE_OFF, IDLE_MODE_MODEM, IDLE_MODE_RADIO_OFF};
+    const int64_t day = 24 * 3600 * 1000000LL;
+    const int64_t checkBusy = 8 * 1000000LL;
+    const int64_t commandEvery = 6 * 3600 * 1000000LL;
+
+    for (IdleMode mode : modes)
+    {
+        char root[] = "/tmp/idle-sim-XXXXXX";
+        if (mkdtemp(root) == nullptr)
+        {
+            return 2;
+        }
+
+        PosixStorage storage(root);
+        SimulatedWifi wifi;
+        wifi.addAccessPoint("lab", 6, -58);
+
+        WifiManager manager(&wifi, &storage, &wifi);
+        manager.begin("lab", "secret");
+        runWifi(&manager, &wifi, 30000000, true);
+
+        IdleScheduler scheduler(&wifi, &wifi, &manager);
+        IdleConfig config = *scheduler.getConfig();
+        config.mode = mode;
+        config.checkIntervalMicroS = 3600 * 1000000LL;
+        scheduler.setConfig(&config);
+        scheduler.begin();
+
+        int64_t start = wifi.nowMicroS();
+        int64_t busyUntil = 0;
+        int64_t nextCommand = start + commandEvery;
+        uint32_t commands = 0;
+        uint32_t commandsAnswered = 0;
+
+        while (wifi.nowMicroS() - start < day)
+        {
+            int64_t now = wifi.nowMicroS();
+
+            // Commands only arrive while the station is associated
+            if (now >= nextCommand)
+            {
+                nextCommand += commandEvery;
+                commands++;
+
+                if (manager.isConnected())
+                {
+                    commandsAnswered++;
+                    scheduler.noteActivity();
+                }
+            }
+
+            manager.poll();
+            scheduler.setBusy(now < busyUntil);
+
+            if (scheduler.poll() == IDLE_ACTION_CHECK)
+            {
+                busyUntil = wifi.nowMicroS() + checkBusy;
+            }
+
+            wifi.advance(100000);
+        }
+
+        IdleStats stats;
+        scheduler.stats(&stats);
+
+        printf("%-10s average %6.2f mA, %7.1f mAh/day, full %5lld s, save %5lld s, off %5lld s, checks %u, wakes %u, "
+               "wake %lld ms (max %lld), commands answered %u/%u\n",
+               idleModeName(mode),
+               stats.averageMicroAmps / 1000.0,
+               stats.microAmpHours / 1000.0,
+               (long long)(stats.levelMicroS[HAL_POWER_FULL] / 1000000),
+               (long long)(stats.levelMicroS[HAL_POWER_SAVE] / 1000000),
+               (long long)(stats.levelMicroS[HAL_POWER_RADIO_OFF] / 1000000),
+               stats.checks,
+               stats.wakes,
+               (long long)(stats.lastWakeMicroS / 1000),
+               (long long)(stats.maxWakeMicroS / 1000),
+               commandsAnswered,
+               commands);
+    }
+
+    return 0;
+}
+
+// One simulated boot in a child process, so whatever it leaves behind is
+// only in the mapped file. The child ends with exit(0) or abort().
+static void runCrashLogBoot(const char* path, const char* resetReason, int lines, bool crash, bool tornWrite)
+{
+    if (fork() != 0)
+    {
+        wait(nullptr);
+        return;
+    }
+
+    CrashLogRegion* region = mapCrashLogFile(path);
+    if (region == nullptr)
+    {
+        _exit(2);
+    }
+
+    CrashLog crashLog(region);
+    crashLog.begin(resetReason, 0);
+    smartLogCrashLog = &crashLog;
+
+    crashLog.trace(CRASH_TRACE_UPDATE_START, 0, 0, 0);
+    for (int i = 0; i < lines; i++)
+    {
+        SMART_LOGI("OTA", "Written %d of 1048576 bytes, %d B/s", i * 4096, 100000 + i % 977);
+    }
+
+    if (crash)
+    {
+        SMART_LOGE("OTA", "Flash write task stack overflow");
+    }
+
+    // A reset after a record header landed but before its payload did
+    if (tornWrite)
+    {
+        memset(region->data + region->head % CRASH_LOG_DATA_SIZE, 0xa5, 6);
+        region->head += 20;
+    }
+
+    if (crash)
+    {
+        abort();
+    }
+
+    crashLog.trace(CRASH_TRACE_RESTART, 4, 0, 0);
+    exit(0);
+}
+
+// Three boots against a file-backed region: a clean restart, a crash in the
+// middle of an update that wraps the ring, and a boot that dumps what the
+// earlier ones left. Then the cost of one line on the logging path.
+static int runCrashLogScenarios()
+{
+    char path[] = "/tmp/crash-log-sim-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        return 2;
+    }
+    close(fd);
+
+    runCrashLogBoot(path, "power-on", 20, false, false);
+    runCrashLogBoot(path, "software", 50, true, true);
+
+    CrashLogRegion* region = mapCrashLogFile(path);
+    if (region == nullptr)
+    {
+        return 2;
+    }
+
+    CrashLog crashLog(region);
+    bool kept = crashLog.begin("panic", 0);
+    CrashLogCursor cursor = crashLog.previousBoots();
+    char line[256];
+    int lines = 0;
+
+    printf("boot %u, earlier boots %s\n", crashLog.bootCount(), kept ? "kept" : "lost");
+    while (crashLog.next(&cursor, line, sizeof(line)))
+    {
+        // The head and tail of the dump, the progress lines in between
+        if (lines < 3 || cursor.position >= cursor.end - 128)
+        {
+            printf("  %s\n", line);
+        }
+        else if (lines == 3)
+        {
+            printf("  ...\n");
+        }
+        lines++;
+    }
+    printf("%d lines from earlier boots in %u bytes\n", lines, CRASH_LOG_DATA_SIZE);
+
+    const int calls = 1000000;
+    const char* sample = "[OTA] Written 1040384 of 1048576 bytes, 100977 B/s";
+    size_t sampleLen = strlen(sample);
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < calls; i++)
+    {
+        crashLog.text(sample, sampleLen, i);
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    printf("text(): %.1f ns per %zu byte line\n", std::chrono::duration<double, std::nano>(end - start).count() / calls, sampleLen);
+
+    unlink(path);
+    return 0;
+}
+
+struct ActivationScenario {
+    const char* name;
+    OtaActivationMode mode;
+    uint32_t windowStartS;
+    uint32_t windowLengthS;
+    // Local time of day when the update is staged, -1 for an unset clock
+    int32_t stagedAtS;
+    // Seconds after staging the "activate" command arrives, -1 for never
+    int32_t commandAfterS;
+    // Polls the application hook needs to flush, -1 for never
+    int hookPolls;
+};
+
+static int flushPollsLeft;
+
+static bool flushHook(void* context)
+{
+    return flushPollsLeft >= 0 && flushPollsLeft-- == 0;
+}
+
+// When a staged update reboots per activation mode, polled every 100 ms as
+// the Wi-Fi task does
+static int runActivationScenarios()
+{
+    const ActivationScenario scenarios[] = {
+        {"now", OTA_ACTIVATE_NOW, 0, 0, 14 * 3600, -1, 0},
+        {"window 03:00 1h", OTA_ACTIVATE_WINDOW, 3 * 3600, 3600, 14 * 3600, -1, 0},
+        {"window 23:30 1h", OTA_ACTIVATE_WINDOW, 23 * 3600 + 1800, 3600, 22 * 3600, -1, 0},
+        {"window, clock unset", OTA_ACTIVATE_WINDOW, 3 * 3600, 3600, -1, 600, 0},
+        {"command", OTA_ACTIVATE_COMMAND, 0, 0, 14 * 3600, 1800, 0},
+        {"command, slow hook", OTA_ACTIVATE_COMMAND, 0, 0, 14 * 3600, 60, 25},
+        {"command, stuck hook", OTA_ACTIVATE_COMMAND, 0, 0, 14 * 3600, 60, -1},
+    };
+    const int64_t pollMicroS = 100000;
+    const int64_t limitMicroS = 48 * 3600 * 1000000LL;
+
+    for (const ActivationScenario& scenario : scenarios)
+    {
+        SimulatedWifi clock;
+        OtaActivation activation(&clock);
+        activation.addHook("flush", flushHook, nullptr);
+
+        OtaActivationConfig config = *activation.getConfig();
+        config.mode = scenario.mode;
+        config.windowStartS = scenario.windowStartS;
+        config.windowLengthS = scenario.windowLengthS;
+        activation.setConfig(&config);
+
+        flushPollsLeft = scenario.hookPolls;
+        activation.stage();
+
+        int64_t start = clock.nowMicroS();
+        int64_t preparedAt = -1;
+        OtaActivationState state = OTA_ACTIVATION_STAGED;
+
+        while (state != OTA_ACTIVATION_READY && clock.nowMicroS() - start < limitMicroS)
+        {
+            int64_t elapsedS = (clock.nowMicroS() - start) / 1000000;
+
+            if (scenario.commandAfterS >= 0 && elapsedS == scenario.commandAfterS && activation.state() == OTA_ACTIVATION_STAGED)
+            {
+                activation.request();
+            }
+
+            int32_t secondsOfDay = scenario.stagedAtS < 0 ? -1 : (int32_t)((scenario.stagedAtS + elapsedS) % (24 * 3600));
+            state = activation.poll(secondsOfDay);
+
+            if (state == OTA_ACTIVATION_PREPARING && preparedAt < 0)
+            {
+                preparedAt = clock.nowMicroS();
+            }
+
+            if (state != OTA_ACTIVATION_READY)
+            {
+                clock.advance(pollMicroS);
+            }
+        }
+
+        int64_t waited = clock.nowMicroS() - start;
+        printf("%-22s %s after %lld.%01lld s",
+               scenario.name,
+               otaActivationStateName(state),
+               (long long)(waited / 1000000),
+               (long long)(waited / 100000 % 10));
+        if (preparedAt >= 0)
+        {
+            printf(", hooks %lld ms", (long long)((clock.nowMicroS() - preparedAt) / 1000));
+        }
+        if (activation.skippedHook() != nullptr)
+        {
+            printf(", skipped %s", activation.skippedHook());
+        }
+        printf("\n");
+    }
+
+    return 0;
+}
+
+struct RollbackScenario {
+    const char* name;
+    // Polls until the health check first passes, -1 for never
+    int healthyAfterPolls;
+    // What initArduino() does without the verifyRollbackLater() override
+    bool frameworkMarksValid;
+    RollbackGateState expectedGate;
+    // Still booted into the new image at the end, not the previous one
+    bool newImageRuns;
+    SimulatedImageState expectedState;
+};
+
+static int healthPollsLeft;
+
+static bool healthCheck(void* context)
+{
+    return healthPollsLeft >= 0 && healthPollsLeft-- == 0;
+}
+
+// An update started while the new image is still PENDING_VERIFY must leave
+// the other slot alone, it is what the gate rolls back to. Once validated the
+// same update goes ahead.
+static bool runUpdateDuringGate()
+{
+    static uint8_t sectorBuffer[FLASH_WRITER_SECTOR_SIZE];
+    SimulatedPartitions partitions;
+    SimulatedPartitionTable* table = partitions.table();
+    std::vector<uint8_t> previous(64 * 1024);
+    std::vector<uint8_t> after(previous.size());
+    OtaBundleEntry entry = {};
+
+    table->flashNextSlot();
+    table->reboot();
+    SimulatedFlash* previousSlot = partitions.slot((table->runningSlot() + 1) % SIMULATED_APP_SLOTS);
+
+    for (size_t i = 0; i < previous.size(); i++)
+    {
+        previous[i] = i * 11 + 3;
+    }
+    previous[0] = 0xE9;
+    previousSlot->write(0, previous.data(), previous.size());
+
+    RollbackGate gate(table);
+    gate.addCheck("server", healthCheck, nullptr);
+    healthPollsLeft = 3;
+    RollbackGateState state = gate.begin();
+
+    strcpy(entry.label, OTA_BUNDLE_APP_LABEL);
+    PartitionBundleSink during(&partitions, sectorBuffer, FLASH_ERASE_AHEAD);
+    during.setContentLength(previous.size());
+    bool refused = state == ROLLBACK_GATE_CHECKING && !during.beginImage(&entry);
+    during.abort();
+
+    previousSlot->read(0, after.data(), after.size());
+    bool kept = after == previous;
+
+    while (state == ROLLBACK_GATE_CHECKING)
+    {
+        table->advance(100000);
+        state = gate.poll();
+    }
+
+    PartitionBundleSink validated(&partitions, sectorBuffer, FLASH_ERASE_AHEAD);
+    validated.setContentLength(previous.size());
+    bool accepted = state == ROLLBACK_GATE_VALIDATED && validated.beginImage(&entry);
+    validated.abort();
+
+    bool ok = refused && kept && accepted;
+    printf("%-24s %-12s previous slot %s, %s once validated %s\n",
+           "update during gate",
+           refused ? "refused" : "started",
+           kept ? "kept" : "erased",
+           accepted ? "accepted" : "refused",
+           ok ? "ok" : "UNEXPECTED");
+    return ok;
+}
+
+// The first boot of a new image through the bootloader's PENDING_VERIFY
+// state, polled every HEALTH_CHECK_POLL_MS like healthCheckTask. A failed
+// check must end in platform rollback(), esp_ota_mark_app_invalid_rollback_and_reboot
+// on the device, and the previous slot running again.
+static int runRollbackScenarios()
+{
+    const RollbackScenario scenarios[] = {
+        {"healthy", 3, false, ROLLBACK_GATE_VALIDATED, true, SIMULATED_IMAGE_VALID},
+        {"healthy at deadline", 299, false, ROLLBACK_GATE_VALIDATED, true, SIMULATED_IMAGE_VALID},
+        {"health check fails", -1, false, ROLLBACK_GATE_ROLLED_BACK, false, SIMULATED_IMAGE_INVALID},
+        // Why the override exists: the broken image is kept
+        {"no verifyRollbackLater", -1, true, ROLLBACK_GATE_NOT_REQUIRED, true, SIMULATED_IMAGE_VALID},
+    };
+    const int64_t pollMicroS = 100000;
+    int failures = 0;
+
+    for (const RollbackScenario& scenario : scenarios)
+    {
+        SimulatedPartitionTable table;
+        table.flashNextSlot();
+        table.reboot();
+        int newSlot = table.runningSlot();
+        bool pendingAtBoot = table.isPendingVerify();
+
+        if (scenario.frameworkMarksValid && table.isPendingVerify())
+        {
+            table.markValid();
+        }
+
+        RollbackGate gate(&table);
+        gate.addCheck("server", healthCheck, nullptr);
+        healthPollsLeft = scenario.healthyAfterPolls;
+
+        RollbackGateState state = gate.begin();
+        while (state == ROLLBACK_GATE_CHECKING)
+        {
+            table.advance(pollMicroS);
+            state = gate.poll();
+        }
+
+        bool ok = pendingAtBoot &&
+                  state == scenario.expectedGate &&
+                  (table.runningSlot() == newSlot) == scenario.newImageRuns &&
+                  table.slotState(newSlot) == scenario.expectedState;
+        failures += ok ? 0 : 1;
+
+        printf("%-24s %-12s running ota_%d, new image %s, %d reboots%s%s %s\n",
+               scenario.name,
+               rollbackGateStateName(state),
+               table.runningSlot(),
+               table.slotState(newSlot) == SIMULATED_IMAGE_VALID ? "valid" : table.slotState(newSlot) == SIMULATED_IMAGE_INVALID ? "invalid" : "pending",
+               table.rebootCount(),
+               gate.failedCheck() != nullptr ? ", failed " : "",
+               gate.failedCheck() != nullptr ? gate.failedCheck() : "",
+               ok ? "ok" : "UNEXPECTED");
+    }
+
+    failures += runUpdateDuringGate() ? 0 : 1;
+    return failures > 0 ? 1 : 0;
+}
+
+struct BundleScenario {
+    const char* name;
+    // Flips a byte of the spiffs image after its manifest hash was taken
+    bool corruptData;
+    // The stream ends this many bytes early
+    size_t truncateBy;
+    bool stagingPartition;
+    // The partition the data image names, only filesystems take one
+    const char* dataLabel;
+    bool expectCommit;
+    // The new app fails its rollback gate, the old one boots again
+    bool rollsBack;
+};
+
+static void appendLittleEndian(std::vector<uint8_t>* output, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        output->push_back(value >> (8 * i));
+    }
+}
+
+static void appendBundleEntry(std::vector<uint8_t>* bundle, const char* label, const std::vector<uint8_t>& image)
+{
+    uint8_t name[OTA_BUNDLE_LABEL_SIZE] = {};
+    uint8_t digest[OTA_SHA256_LEN];
+    OtaSha256Context hash;
+
+    memcpy(name, label, strlen(label));
+    otaSha256Start(&hash);
+    otaSha256Update(&hash, image.data(), image.size());
+    otaSha256Finish(&hash, digest);
+
+    bundle->insert(bundle->end(), name, name + sizeof(name));
+    appendLittleEndian(bundle, image.size(), 4);
+    bundle->insert(bundle->end(), digest, digest + sizeof(digest));
+}
+
+// An app and a spiffs image fed through PartitionBundleSink the way
+// firmwareFlashWriteTask does. The spiffs partition the running app mounts
+// must hold exactly what it held before until the new app booted and was
+// validated; after a rollback it never changes.
+static int runBundleScenarios()
+{
+    const BundleScenario scenarios[] = {
+        {"verified", false, 0, true, "spiffs", true, false},
+        {"verified, rolled back", false, 0, true, "spiffs", true, true},
+        {"data hash mismatch", true, 0, true, "spiffs", false, false},
+        {"truncated", false, 1000, true, "spiffs", false, false},
+        {"no staging partition", false, 0, false, "spiffs", false, false},
+        {"data for otastage", false, 0, true, "otastage", false, false},
+        {"data for nvs", false, 0, true, "nvs", false, false},
+    };
+    static uint8_t sectorBuffer[FLASH_WRITER_SECTOR_SIZE];
+    char root[] = "/tmp/bundle-sim-XXXXXX";
+    std::vector<uint8_t> app(200000);
+    std::vector<uint8_t> data(100000);
+    int failures = 0;
+
+    if (mkdtemp(root) == nullptr)
+    {
+        return 2;
+    }
+
+    for (size_t i = 0; i < app.size(); i++)
+    {
+        app[i] = i * 31;
+    }
+    app[0] = 0xE9;
+
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = i * 7 + 1;
+    }
+
+    for (const BundleScenario& scenario : scenarios)
+    {
+        SimulatedPartitions partitions;
+        SimulatedFlash* spiffs = partitions.data();
+        std::vector<uint8_t> mounted(spiffs->size());
+        std::vector<uint8_t> after(spiffs->size());
+        std::vector<uint8_t> stream(OTA_BUNDLE_MAGIC, OTA_BUNDLE_MAGIC + 4);
+
+        appendLittleEndian(&stream, OTA_BUNDLE_VERSION, 2);
+        appendLittleEndian(&stream, 2, 2);
+        appendBundleEntry(&stream, OTA_BUNDLE_APP_LABEL, app);
+        appendBundleEntry(&stream, scenario.dataLabel, data);
+        stream.insert(stream.end(), app.begin(), app.end());
+        size_t dataOffset = stream.size();
+        stream.insert(stream.end(), data.begin(), data.end());
+
+        if (!scenario.stagingPartition)
+        {
+            partitions.removeStaging();
+        }
+
+        for (size_t i = 0; i < mounted.size(); i++)
+        {
+            mounted[i] = i * 13 + 5;
+        }
+        spiffs->write(0, mounted.data(), mounted.size());
+
+        if (scenario.corruptData)
+        {
+            stream[dataOffset + 500] ^= 0x01;
+        }
+        stream.resize(stream.size() - scenario.truncateBy);
+
+        PartitionBundleSink sink(&partitions, sectorBuffer, FLASH_ERASE_AHEAD);
+        OtaBundleReader reader(&sink);
+        bool committed = true;
+
+        for (size_t offset = 0; committed && offset < stream.size(); offset += NATIVE_READ_BUFFER_SIZE)
+        {
+            size_t len = stream.size() - offset < NATIVE_READ_BUFFER_SIZE ? stream.size() - offset : NATIVE_READ_BUFFER_SIZE;
+            committed = reader.feed(stream.data() + offset, len);
+        }
+
+        committed = committed && reader.finish() && sink.commit(false);
+        if (!committed)
+        {
+            sink.abort();
+        }
+
+        // The old app keeps its filesystem until the new one is validated
+        spiffs->read(0, after.data(), after.size());
+        bool keptAtCommit = after == mounted;
+        bool applied = false;
+        bool cleared = true;
+
+        if (committed)
+        {
+            PosixStorage storage(root);
+            OtaPendingDataStore store(&storage, "otaSettings");
+            OtaPendingData pending;
+
+            if (sink.pendingData(&pending))
+            {
+                store.save(&pending);
+            }
+
+            // Across the reboot into the new app, as setupOta finds it
+            SimulatedPartitionTable* table = partitions.table();
+            partitions.setBootPartition(sink.stagedApp());
+            table->reboot();
+
+            if (scenario.rollsBack)
+            {
+                table->rollback();
+            }
+            else
+            {
+                table->markValid();
+            }
+
+            applied = store.load(&pending) && applyPendingData(&partitions, &pending, sectorBuffer);
+            store.clear();
+            cleared = !store.load(&pending);
+        }
+
+        spiffs->read(0, after.data(), after.size());
+        bool untouched = after == mounted;
+        bool replaced = memcmp(after.data(), data.data(), data.size()) == 0;
+        bool ok = committed == scenario.expectCommit &&
+                  keptAtCommit &&
+                  cleared &&
+                  applied == (scenario.expectCommit && !scenario.rollsBack) &&
+                  (applied ? replaced : untouched);
+        failures += ok ? 0 : 1;
+
+        const char* error = sink.lastError() != nullptr ? sink.lastError() : reader.error();
+        printf("%-22s %-34s spiffs %-9s %s\n",
+               scenario.name,
+               committed ? (applied ? "applied once validated" : "dropped after rollback") : error,
+               untouched ? "untouched" : replaced ? "replaced" : "damaged",
+               ok ? "ok" : "UNEXPECTED");
+    }
+
+    return failures > 0 ? 1 : 0;
+}
+
+// TCP segment sized pieces, as the web server fills its send buffer
+#define CACHE_SIM_SEND_SIZE 1436
+
+struct CacheRequest {
+    const char* name;
+    const char* range;
+    // "etag" stands for the cached image's tag
+    const char* ifNoneMatch;
+    const char* ifRange;
+};
+
+static const char* cacheHeader(const char* value, const FirmwareCache* cache)
+{
+    return value != nullptr && strcmp(value, "etag") == 0 ? cache->etag() : value;
+}
+
+// Answers one GET like the gateway's /ota/firmware route and checks the
+// body against the image
+static bool serveCacheRequest(FirmwareCache* cache, const CacheRequest* request, const std::vector<uint8_t>& image)
+{
+    FirmwareCacheReply reply = cache->reply(request->range, cacheHeader(request->ifNoneMatch, cache), cacheHeader(request->ifRange, cache));
+    char contentRange[64] = "";
+    uint8_t buffer[CACHE_SIM_SEND_SIZE];
+    size_t sent = 0;
+    bool matches = true;
+
+    cache->contentRange(&reply, contentRange, sizeof(contentRange));
+
+    while (size_t n = cache->read(&reply, sent, buffer, sizeof(buffer)))
+    {
+        matches = matches && reply.offset + sent + n <= image.size() && memcmp(buffer, image.data() + reply.offset + sent, n) == 0;
+        sent += n;
+    }
+
+    cache->endReply(&reply);
+    matches = matches && sent == reply.length;
+
+    printf("%-24s %d %-28s %8zu bytes %s\n", request->name, reply.status, contentRange, sent, matches ? "ok" : "MISMATCH");
+    return matches;
+}
+
+static bool readFile(const char* path, std::vector<uint8_t>* output)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    uint8_t buffer[NATIVE_READ_BUFFER_SIZE];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        output->insert(output->end(), buffer, buffer + n);
+    }
+
+    fclose(file);
+    return true;
+}
+
+static bool writeFile(const char* path, const std::vector<uint8_t>& data)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    fclose(file);
+    return written;
+}
+
+static FirmwareCacheFetch fetchCache(FirmwareCache* cache, const char* path, PosixFileTransport* transport, SimulatedFlash* store)
+{
+    static uint8_t buffer[NATIVE_READ_BUFFER_SIZE];
+    static uint8_t sectorBuffer[FLASH_WRITER_SECTOR_SIZE];
+    int64_t busy = store->busyMicroS();
+
+    FirmwareCacheFetch result = fetchFirmwareCache(cache, transport, path, buffer, sizeof(buffer), sectorBuffer, nullptr);
+    printf("%-24s %-8s %s %8zu bytes, %lld us flash\n",
+           "fetch",
+           firmwareCacheFetchName(result),
+           cache->etag(),
+           cache->size(),
+           (long long)(store->busyMicroS() - busy));
+    return result;
+}
+
+// An origin whose ranged probe fails, a network error half way through the
+// refresh, and which answers 304 to any request carrying validators
+class FlakyOrigin : public PosixFileTransport {
+public:
+    bool openRange(const char* path, uint32_t offset, uint32_t len) override
+    {
+        return false;
+    }
+
+    bool open(const char* path) override
+    {
+        notModified = hasValidators;
+        return notModified || PosixFileTransport::open(path);
+    }
+
+    int statusCode() override
+    {
+        return notModified ? 304 : PosixFileTransport::statusCode();
+    }
+
+    void close() override
+    {
+        if (!notModified)
+        {
+            PosixFileTransport::close();
+        }
+        notModified = false;
+    }
+
+    void setValidators(const HalHttpValidators* validators) override
+    {
+        hasValidators = validators != nullptr && !otaValidatorsEmpty(validators);
+    }
+
+private:
+    bool hasValidators = false;
+    bool notModified = false;
+};
+
+// A gateway's cache on a simulated 2 MB data partition, filled from a
+// local image standing in for the origin: refreshes, a reboot, the
+// conditional and range requests other devices send, and a refresh racing
+// a download
+static int runCacheScenarios(const char* path)
+{
+    std::vector<uint8_t> image;
+    std::vector<uint8_t> release;
+
+    if (!readFile(path, &image) || image.size() < OTA_IMAGE_CHECK_FETCH_SIZE)
+    {
+        printf("%s is missing or too small\n", path);
+        return 2;
+    }
+
+    // The next release differs in the manifest hashes or the descriptor
+    char releasePath[] = "/tmp/cache-sim-XXXXXX";
+    int fd = mkstemp(releasePath);
+    if (fd < 0)
+    {
+        return 2;
+    }
+    close(fd);
+    release = image;
+    release[40] ^= 0xFF;
+    if (!writeFile(releasePath, release))
+    {
+        unlink(releasePath);
+        return 2;
+    }
+
+    SimulatedFlash store(2 * 1024 * 1024);
+    PosixFileTransport transport;
+    FirmwareCache cache;
+    bool ok = true;
+    int failures = 0;
+
+    cache.begin(&store);
+    const CacheRequest empty = {"before the first fetch", nullptr, nullptr, nullptr};
+    serveCacheRequest(&cache, &empty, image);
+
+    ok = ok && fetchCache(&cache, path, &transport, &store) == FIRMWARE_CACHE_FETCHED;
+    ok = ok && fetchCache(&cache, path, &transport, &store) == FIRMWARE_CACHE_CURRENT;
+
+    FirmwareCache rebooted;
+    rebooted.begin(&store);
+    printf("%-24s %-8s %s %8zu bytes\n", "reboot", firmwareCacheStateName(rebooted.state()), rebooted.etag(), rebooted.size());
+    ok = ok && strcmp(rebooted.etag(), cache.etag()) == 0;
+
+    char range[64];
+    char suffix[64];
+    char beyond[64];
+    char weak[64];
+    snprintf(range, sizeof(range), "bytes=%zu-%zu", image.size() / 2, image.size() / 2 + 99999);
+    snprintf(suffix, sizeof(suffix), "bytes=-%d", OTA_IMAGE_CHECK_FETCH_SIZE);
+    snprintf(beyond, sizeof(beyond), "bytes=%zu-", image.size());
+    snprintf(weak, sizeof(weak), "\"0\", W/%s", cache.etag());
+
+    const CacheRequest requests[] = {
+        {"full", nullptr, nullptr, nullptr},
+        {"header probe", "bytes=0-511", nullptr, nullptr},
+        {"resume", range, nullptr, nullptr},
+        {"suffix", suffix, nullptr, nullptr},
+        {"open ended", "bytes=4096-", nullptr, nullptr},
+        {"past the end", beyond, nullptr, nullptr},
+        {"reversed, ignored", "bytes=9-2", nullptr, nullptr},
+        {"list, ignored", "bytes=0-1,5-6", nullptr, nullptr},
+        {"if-none-match current", nullptr, "etag", nullptr},
+        {"if-none-match weak", nullptr, weak, nullptr},
+        {"if-none-match stale", nullptr, "\"0123456789abcdef\"", nullptr},
+        {"if-range current", range, nullptr, "etag"},
+        {"if-range stale", range, nullptr, "\"0123456789abcdef\""},
+    };
+
+    for (const CacheRequest& request : requests)
+    {
+        if (!serveCacheRequest(&rebooted, &request, image))
+        {
+            failures++;
+        }
+    }
+
+    // The gateway updates itself from the copy it serves
+    static uint8_t readBuffer[NATIVE_READ_BUFFER_SIZE];
+    static uint8_t sectorBuffer[FLASH_WRITER_SECTOR_SIZE];
+    PosixClock clock;
+    SimulatedPartitions partitions;
+    FirmwareCacheTransport cacheTransport(&cache);
+    OtaTransfer transfer = {
+        .transport = &cacheTransport,
+        .partitions = &partitions,
+        .clock = &clock,
+        .readBuffer = readBuffer,
+        .readBufferSize = sizeof(readBuffer),
+        .sizer = nullptr,
+        .freeHeap = nullptr,
+        .sectorBuffer = sectorBuffer,
+        .eraseStrategy = FLASH_ERASE_AHEAD,
+        .shouldStop = nullptr,
+        .running = nullptr,
+        .shaper = nullptr,
+    };
+    OtaTransferStats transferStats;
+    const char* error = runOtaTransfer(&transfer, "cache", &transferStats);
+    printf("%-24s %-8s %8zu bytes\n", "gateway update", error == nullptr ? "ok" : error, transferStats.bytes);
+    ok = ok && error == nullptr && !cache.serving();
+
+    // A device still downloading holds the old image in place
+    FirmwareCacheReply downloading = cache.reply(nullptr, nullptr, nullptr);
+    ok = ok && fetchCache(&cache, releasePath, &transport, &store) == FIRMWARE_CACHE_BUSY;
+    cache.endReply(&downloading);
+    ok = ok && fetchCache(&cache, releasePath, &transport, &store) == FIRMWARE_CACHE_FETCHED;
+    const CacheRequest next = {"after the release", nullptr, nullptr, nullptr};
+    if (!serveCacheRequest(&cache, &next, release))
+    {
+        failures++;
+    }
+
+    // An error page from the origin never replaces a good image
+    const char* page = "<html>502 Bad Gateway</html>";
+    std::vector<uint8_t> errorPage(page, page + strlen(page));
+    writeFile(releasePath, errorPage);
+    ok = ok && fetchCache(&cache, releasePath, &transport, &store) == FIRMWARE_CACHE_REJECTED && cache.state() == FIRMWARE_CACHE_READY;
+    unlink(releasePath);
+
+    // The refresh fails and the update falls back to the origin, whose
+    // request must not carry the validators that described the cache
+    FlakyOrigin origin;
+    HalHttpValidators cachedValidators = {};
+    snprintf(cachedValidators.etag, sizeof(cachedValidators.etag), "%s", cache.etag());
+    origin.setValidators(&cachedValidators);
+    FirmwareCacheFetch refresh = fetchCache(&cache, path, &origin, &store);
+    HalHttpTransport* source = firmwareCacheSource(&cache, refresh, &origin, &cacheTransport);
+    bool opened = source->open(path);
+    int status = opened ? source->statusCode() : 0;
+    source->close();
+    printf("%-24s %-8s %d\n", "fallback to the origin", source == &origin ? "origin" : "cache", status);
+    ok = ok && refresh == FIRMWARE_CACHE_FAILED && source == &origin && status == 200;
+
+    FirmwareCacheStats stats;
+    rebooted.stats(&stats);
+    printf("served %u requests: %u full, %u partial, %u not modified, %u unsatisfiable, %llu bytes\n",
+           stats.requests,
+           stats.full,
+           stats.partial,
+           stats.notModified,
+           stats.unsatisfiable,
+           (unsigned long long)stats.bytesServed);
+
+    return ok && failures == 0 ? 0 : 1;
+}
+
+// The descriptor of a local app image stands in for the running app
+static bool loadRunningApp(const char* path, OtaAppInfo* info)
+{
+    uint8_t header[OTA_APP_HEADER_SIZE];
+    FILE* file = fopen(path, "rb");
+
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    size_t len = fread(header, 1, sizeof(header), file);
+    fclose(file);
+    return otaParseAppHeader(header, len, info);
+}
+
+int main(int argc, char** argv)
+{
+    FlashEraseStrategy eraseStrategy = FLASH_ERASE_AHEAD;
+    const char* source = nullptr;
+    OtaAppInfo runningApp;
+    bool hasRunningApp = false;
+    uint32_t rateBytesPerS = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--erase") == 0 && i + 1 < argc)
+        {
+            const char* name = argv[++i];
+            for (int strategy = FLASH_ERASE_ON_DEMAND; strategy <= FLASH_ERASE_BULK; strategy++)
+            {
+                if (strcmp(name, flashEraseStrategyName((FlashEraseStrategy)strategy)) == 0)
+                {
+                    eraseStrategy = (FlashEraseStrategy)strategy;
+                }
+            }
+        }
+        else if (strcmp(argv[i], "--running") == 0 && i + 1 < argc)
+        {
+            hasRunningApp = loadRunningApp(argv[++i], &runningApp);
+            if (!hasRunningApp)
+            {
+                printf("%s is not an app image\n", argv[i]);
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+        {
+            rateBytesPerS = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--quiet") == 0)
+        {
+            smartLogQuiet = true;
+        }
+        else if (strcmp(argv[i], "--wifi-sim") == 0)
+        {
+            smartLogQuiet = true;
+            return runWifiScenarios();
+        }
+        else if (strcmp(argv[i], "--idle-sim") == 0)
+        {
+            smartLogQuiet = true;
+            return runIdleScenarios();
+        }
+        else if (strcmp(argv[i], "--crash-log-sim") == 0)
+        {
+            smartLogQuiet = true;
+            return runCrashLogScenarios();
+        }
+        else if (strcmp(argv[i], "--activation-sim") == 0)
+        {
+            return runActivationScenarios();
+        }
+        else if (strcmp(argv[i], "--rollback-sim") == 0)
+        {
+            smartLogQuiet = true;
+            return runRollbackScenarios();
+        }
+        else if (strcmp(argv[i], "--bundle-sim") == 0)
+        {
+            smartLogQuiet = true;
+            return runBundleScenarios();
+        }
+        else if (strcmp(argv[i], "--cache-sim") == 0 && i + 1 < argc)
+        {
+            smartLogQuiet = true;
+            return runCacheScenarios(argv[i + 1]);
+        }
+        else
+        {
+            source = argv[i];
+        }
+    }
+
+    if (source == nullptr)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+
+    static uint8_t readBuffer[NATIVE_READ_BUFFER_SIZE];
+    static uint8_t sectorBuffer[FLASH_WRITER_SECTOR_SIZE];
+
+    PosixClock clock;
+    SimulatedPartitions partitions;
+    PosixHttpTransport httpTransport;
+    PosixFileTransport fileTransport;
+    bool isHttp = strncmp(source, "http://", 7) == 0;
+
+    OtaShaper shaper(&clock);
+    OtaShaperConfig shaperConfig = *shaper.getConfig();
+    shaperConfig.rateBytesPerS = rateBytesPerS;
+    shaper.setConfig(&shaperConfig);
+
+    OtaTransfer transfer = {
+        .transport = isHttp ? (HalHttpTransport*)&httpTransport : (HalHttpTransport*)&fileTransport,
+        .partitions = &partitions,
+        .clock = &clock,
+        .readBuffer = readBuffer,
+        .readBufferSize = sizeof(readBuffer),
+        .sizer = nullptr,
+        .freeHeap = nullptr,
+        .sectorBuffer = sectorBuffer,
+        .eraseStrategy = eraseStrategy,
+        .shouldStop = nullptr,
+        .running = hasRunningApp ? &runningApp : nullptr,
+        .shaper = rateBytesPerS > 0 ? &shaper : nullptr,
+    };
+
+    OtaTransferStats stats;
+    const char* error = runOtaTransfer(&transfer, source, &stats);
+
+    int64_t flashBusy = partitions.slot(0)->busyMicroS() + partitions.slot(1)->busyMicroS() + partitions.data()->busyMicroS() +
+                        partitions.staging()->busyMicroS();
+
+    printf("result: %s\n", error == nullptr ? "ok" : error);
+    if (hasRunningApp)
+    {
+        printf("image check: %s\n", otaImageVerdictName(stats.imageCheck));
+    }
+    printf("bytes: %zu in %u reads, %lld us wall, first byte after %lld us\n",
+           stats.bytes,
+           stats.reads,
+           (long long)(stats.endMicroS - stats.startMicroS),
+           (long long)(stats.firstByteMicroS - stats.startMicroS));
+    if (rateBytesPerS > 0)
+    {
+        printf("shaped to %u B/s: %u waits, %lld us waited\n", rateBytesPerS, stats.shaping.waits, (long long)stats.shaping.waitMicroS);
+    }
+    printf("flash (%s erase): %u writes, %u sectors erased, %u ahead, %u stalls, %lld us simulated busy\n",
+           flashEraseStrategyName(eraseStrategy),
+           stats.flash.writes,
+           stats.flash.sectorsErased,
+           stats.flash.sectorsErasedAhead,
+           stats.flash.eraseStalls,
+           (long long)flashBusy);
+
+    return error == nullptr ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+#include <string.h>
+#include <unistd.h>
+
+#include "simulatedFlash.h"
+
+#define SIMULATED_FLASH_PAGE_SIZE 256
+#define SIMULATED_FLASH_BLOCK_SIZE 65536
+
+const SimulatedFlashTiming defaultFlashTiming = {
+    .eraseSectorMicroS = 30000,
+    .eraseBlockMicroS = 120000,
+    .programPageMicroS = 400,
+    .readKiloByteMicroS = 64,
+    .operationOverheadMicroS = 30,
+};
+
+SimulatedFlash::SimulatedFlash(size_t size, const SimulatedFlashTiming* timing, bool realTime)
+    : memory(size, 0xff),
+      timing(*timing),
+      realTime(realTime),
+      busy(0),
+      longest(0),
+      erases(0),
+      writes(0),
+      reads(0),
+      errors(0)
+{
+}
+
+void SimulatedFlash::spend(int64_t microS)
+{
+    busy += microS;
+
+    if (microS > longest)
+    {
+        longest = microS;
+    }
+
+    if (realTime)
+    {
+        usleep(microS);
+    }
+}
+
+size_t SimulatedFlash::size()
+{
+    return memory.size();
+}
+
+bool SimulatedFlash::erase(size_t offset, size_t len)
+{
+    if (offset % FLASH_WRITER_SECTOR_SIZE != 0 || len % FLASH_WRITER_SECTOR_SIZE != 0 || offset + len > memory.size())
+    {
+        return false;
+    }
+
+    memset(memory.data() + offset, 0xff, len);
+    erases++;
+
+    int64_t cost = timing.operationOverheadMicroS;
+    size_t end = offset + len;
+
+    while (offset < end)
+    {
+        if (offset % SIMULATED_FLASH_BLOCK_SIZE == 0 && end - offset >= SIMULATED_FLASH_BLOCK_SIZE)
+        {
+            cost += timing.eraseBlockMicroS;
+            offset += SIMULATED_FLASH_BLOCK_SIZE;
+        }
+        else
+        {
+            cost += timing.eraseSectorMicroS;
+            offset += FLASH_WRITER_SECTOR_SIZE;
+        }
+    }
+
+    spend(cost);
+    return true;
+}
+
+bool SimulatedFlash::write(size_t offset, const uint8_t* data, size_t len)
+{
+    if (offset + len > memory.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((memory[offset + i] & data[i]) != data[i])
+        {
+            errors++;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < len; i++)
+    {
+        memory[offset + i] &= data[i];
+    }
+
+    // Programs split at page boundaries, a partial page costs a full one
+    size_t firstPage = offset / SIMULATED_FLASH_PAGE_SIZE;
+    size_t lastPage = (offset + len + SIMULATED_FLASH_PAGE_SIZE - 1) / SIMULATED_FLASH_PAGE_SIZE;
+
+    writes++;
+    spend(timing.operationOverheadMicroS + timing.programPageMicroS * (int64_t)(lastPage - firstPage));
+    return true;
+}
+
+bool SimulatedFlash::read(size_t offset, uint8_t* data, size_t len)
+{
+    if (offset + len > memory.size())
+    {
+        return false;
+    }
+
+    memcpy(data, memory.data() + offset, len);
+    reads++;
+    spend(timing.operationOverheadMicroS + timing.readKiloByteMicroS * (int64_t)len / 1024);
+    return true;
+}
+
+int64_t SimulatedFlash::busyMicroS() const
+{
+    return busy;
+}
+
+int64_t SimulatedFlash::longestOperationMicroS() const
+{
+    return longest;
+}
+
+uint32_t SimulatedFlash::eraseOperations() const
+{
+    return erases;
+}
+
+uint32_t SimulatedFlash::writeOperations() const
+{
+    return writes;
+}
+
+uint32_t SimulatedFlash::readOperations() const
+{
+    return reads;
+}
+
+uint32_t SimulatedFlash::programErrors() const
+{
+    return errors;
+}
@@ -0,0 +1,59 @@
+#ifndef __ESP_SIMULATED_FLASH__
+#define __ESP_SIMULATED_FLASH__
+
+#include <stdint.h>
+#include <vector>
+
+#include "../flashWriter.h"
+
+// Typical datasheet figures (GD25Q32/W25Q32 class) for the quad SPI NOR
+// parts on ESP32-S3 modules
+struct SimulatedFlashTiming {
+    int64_t eraseSectorMicroS;
+    // 64 KB block erase, used for aligned ranges like the real driver does
+    int64_t eraseBlockMicroS;
+    int64_t programPageMicroS;
+    // esp_partition_read at 80 MHz QIO, 64 byte transactions with the cache
+    // disabled around each
+    int64_t readKiloByteMicroS;
+    // SPI command setup and cache disable/enable around every operation
+    int64_t operationOverheadMicroS;
+};
+
+extern const SimulatedFlashTiming defaultFlashTiming;
+
+// NOR semantics: erase sets bytes to 0xFF, programming can only clear bits.
+// Busy time is accumulated on a virtual clock; with realTime set the model
+// also sleeps so it can sit behind a real network stand-in.
+class SimulatedFlash : public FlashDevice {
+public:
+    SimulatedFlash(size_t size, const SimulatedFlashTiming* timing = &defaultFlashTiming, bool realTime = false);
+
+    size_t size() override;
+    bool erase(size_t offset, size_t len) override;
+    bool write(size_t offset, const uint8_t* data, size_t len) override;
+    bool read(size_t offset, uint8_t* data, size_t len) override;
+
+    int64_t busyMicroS() const;
+    int64_t longestOperationMicroS() const;
+    uint32_t eraseOperations() const;
+    uint32_t writeOperations() const;
+    uint32_t readOperations() const;
+    // Programs that tried to set a bit that was not erased
+    uint32_t programErrors() const;
+
+private:
+    void spend(int64_t microS);
+
+    std::vector<uint8_t> memory;
+    SimulatedFlashTiming timing;
+    bool realTime;
+    int64_t busy;
+    int64_t longest;
+    uint32_t erases;
+    uint32_t writes;
+    uint32_t reads;
+    uint32_t errors;
+};
+
+#endif // __ESP_SIMULATED_FLASH__
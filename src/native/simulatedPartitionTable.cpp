@@ -0,0 +1,108 @@
+#include "simulatedPartitionTable.h"
+
+SimulatedPartitionTable::SimulatedPartitionTable()
+    : bootSlot(0),
+      running(0),
+      reboots(0),
+      now(0)
+{
+    states[0] = SIMULATED_IMAGE_VALID;
+
+    for (int i = 1; i < SIMULATED_APP_SLOTS; i++)
+    {
+        states[i] = SIMULATED_IMAGE_UNDEFINED;
+    }
+}
+
+void SimulatedPartitionTable::flashNextSlot()
+{
+    bootSlot = (running + 1) % SIMULATED_APP_SLOTS;
+    states[bootSlot] = SIMULATED_IMAGE_NEW;
+}
+
+void SimulatedPartitionTable::reboot()
+{
+    reboots++;
+    now = 0;
+
+    if (states[running] == SIMULATED_IMAGE_PENDING_VERIFY)
+    {
+        states[running] = SIMULATED_IMAGE_ABORTED;
+    }
+
+    if (states[bootSlot] == SIMULATED_IMAGE_NEW)
+    {
+        states[bootSlot] = SIMULATED_IMAGE_PENDING_VERIFY;
+        running = bootSlot;
+        return;
+    }
+
+    if (states[bootSlot] == SIMULATED_IMAGE_VALID || states[bootSlot] == SIMULATED_IMAGE_UNDEFINED)
+    {
+        running = bootSlot;
+        return;
+    }
+
+    // Boot slot unusable, fall back to the first valid image
+    for (int i = 0; i < SIMULATED_APP_SLOTS; i++)
+    {
+        if (states[i] == SIMULATED_IMAGE_VALID)
+        {
+            bootSlot = i;
+            running = i;
+            return;
+        }
+    }
+}
+
+void SimulatedPartitionTable::advance(int64_t microS)
+{
+    now += microS;
+}
+
+int SimulatedPartitionTable::runningSlot() const
+{
+    return running;
+}
+
+SimulatedImageState SimulatedPartitionTable::slotState(int slot) const
+{
+    return states[slot];
+}
+
+int SimulatedPartitionTable::rebootCount() const
+{
+    return reboots;
+}
+
+bool SimulatedPartitionTable::isPendingVerify()
+{
+    return states[running] == SIMULATED_IMAGE_PENDING_VERIFY;
+}
+
+bool SimulatedPartitionTable::markValid()
+{
+    states[running] = SIMULATED_IMAGE_VALID;
+    return true;
+}
+
+void SimulatedPartitionTable::rollback()
+{
+    states[running] = SIMULATED_IMAGE_INVALID;
+
+    for (int i = 0; i < SIMULATED_APP_SLOTS; i++)
+    {
+        if (states[i] == SIMULATED_IMAGE_VALID)
+        {
+            bootSlot = i;
+            break;
+        }
+    }
+
+    reboot();
+}
+
+int64_t SimulatedPartitionTable::nowMicroS()
+{
+    return now;
+}
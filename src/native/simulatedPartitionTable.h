@@ -0,0 +1,48 @@
+#ifndef __ESP_SIMULATED_PARTITION_TABLE__
+#define __ESP_SIMULATED_PARTITION_TABLE__
+
+#include "../otaRollback.h"
+
+#define SIMULATED_APP_SLOTS 2
+
+// Mirrors esp_ota_img_states_t
+enum SimulatedImageState {
+    SIMULATED_IMAGE_NEW,
+    SIMULATED_IMAGE_PENDING_VERIFY,
+    SIMULATED_IMAGE_VALID,
+    SIMULATED_IMAGE_INVALID,
+    SIMULATED_IMAGE_ABORTED,
+    SIMULATED_IMAGE_UNDEFINED,
+};
+
+// Two ota_N slots plus the otadata selection logic of the bootloader with
+// CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE. Time is advanced by the caller so
+// deadline handling is deterministic.
+class SimulatedPartitionTable : public RollbackPlatform {
+public:
+    SimulatedPartitionTable();
+
+    // Equivalent of a successful esp_ota_end + esp_ota_set_boot_partition
+    void flashNextSlot();
+    // Bootloader pass: promotes NEW images, aborts unconfirmed ones
+    void reboot();
+    void advance(int64_t microS);
+
+    int runningSlot() const;
+    SimulatedImageState slotState(int slot) const;
+    int rebootCount() const;
+
+    bool isPendingVerify() override;
+    bool markValid() override;
+    void rollback() override;
+    int64_t nowMicroS() override;
+
+private:
+    SimulatedImageState states[SIMULATED_APP_SLOTS];
+    int bootSlot;
+    int running;
+    int reboots;
+    int64_t now;
+};
+
+#endif // __ESP_SIMULATED_PARTITION_TABLE__
@@ -0,0 +1,228 @@
+#include <string.h>
+
+#include "simulatedWifi.h"
+
+const SimulatedWifiTiming defaultWifiTiming = {
+    .scanMs = 2200,
+    .associateMs = 180,
+    .dhcpMs = 1200,
+};
+
+SimulatedWifi::SimulatedWifi(const SimulatedWifiTiming* timing)
+    : accessPointCount(0),
+      timing(timing),
+      current(-1),
+      joining(false),
+      connected(false),
+      dropped(false),
+      resolveAtMicroS(-1),
+      willConnect(false),
+      scanDoneAtMicroS(-1),
+      now(0)
+{
+    memset(accessPoints, 0, sizeof(accessPoints));
+}
+
+int SimulatedWifi::addAccessPoint(const char* ssid, uint8_t channel, int8_t rssi)
+{
+    if (accessPointCount == SIMULATED_WIFI_MAX_ACCESS_POINTS)
+    {
+        return -1;
+    }
+
+    int index = accessPointCount++;
+    AccessPoint* accessPoint = &accessPoints[index];
+    const uint8_t bssid[6] = {0x24, 0x0a, 0xc4, 0x12, 0x34, (uint8_t)(0x56 + index)};
+
+    strncpy(accessPoint->ssid, ssid, sizeof(accessPoint->ssid) - 1);
+    memcpy(accessPoint->link.bssid, bssid, sizeof(bssid));
+    accessPoint->link.channel = channel;
+    // 192.168.<index + 1>.50 behind gateway .1
+    accessPoint->link.ip = 0x32000000 | (uint32_t)(index + 1) << 16 | 0xa8c0;
+    accessPoint->link.gateway = 0x01000000 | (uint32_t)(index + 1) << 16 | 0xa8c0;
+    accessPoint->link.netmask = 0x00ffffff;
+    accessPoint->link.dns = accessPoint->link.gateway;
+    accessPoint->rssi = rssi;
+    accessPoint->up = true;
+    return index;
+}
+
+void SimulatedWifi::setAccessPoint(int index, bool up, uint8_t channel)
+{
+    accessPoints[index].up = up;
+    accessPoints[index].link.channel = channel;
+
+    if (!up && index == current)
+    {
+        dropLink();
+    }
+}
+
+void SimulatedWifi::dropLink()
+{
+    if (connected)
+    {
+        connected = false;
+        dropped = true;
+    }
+}
+
+void SimulatedWifi::advance(int64_t microS)
+{
+    now += microS;
+
+    if (joining && resolveAtMicroS >= 0 && now >= resolveAtMicroS)
+    {
+        joining = false;
+        connected = willConnect;
+    }
+}
+
+bool SimulatedWifi::begin(const char* ssid, const char* password, const HalWifiLink* link)
+{
+    joining = true;
+    connected = false;
+    dropped = false;
+    current = -1;
+
+    if (link != nullptr)
+    {
+        // Directed join: no scan, static IP unless none is given. A wrong
+        // channel or BSSID never answers, the caller's timeout ends it.
+        for (int i = 0; i < accessPointCount; i++)
+        {
+            const AccessPoint* accessPoint = &accessPoints[i];
+
+            if (accessPoint->up &&
+                strcmp(accessPoint->ssid, ssid) == 0 &&
+                link->channel == accessPoint->link.channel &&
+                memcmp(link->bssid, accessPoint->link.bssid, sizeof(link->bssid)) == 0)
+            {
+                current = i;
+            }
+        }
+
+        willConnect = current >= 0;
+        resolveAtMicroS = current >= 0 ? now + (timing->associateMs + (link->ip == 0 ? timing->dhcpMs : 0)) * 1000LL : -1;
+    }
+    else
+    {
+        // The driver scans and joins the strongest AP of that SSID
+        for (int i = 0; i < accessPointCount; i++)
+        {
+            const AccessPoint* accessPoint = &accessPoints[i];
+
+            if (accessPoint->up && strcmp(accessPoint->ssid, ssid) == 0 &&
+                (current < 0 || accessPoint->rssi > accessPoints[current].rssi))
+            {
+                current = i;
+            }
+        }
+
+        willConnect = current >= 0;
+        resolveAtMicroS = now + (timing->scanMs + (current >= 0 ? timing->associateMs + timing->dhcpMs : 0)) * 1000LL;
+    }
+
+    return true;
+}
+
+HalWifiStatus SimulatedWifi::status()
+{
+    if (connected)
+    {
+        return HAL_WIFI_CONNECTED;
+    }
+
+    if (dropped)
+    {
+        return HAL_WIFI_DISCONNECTED;
+    }
+
+    if (!joining && resolveAtMicroS >= 0 && !willConnect)
+    {
+        return HAL_WIFI_FAILED;
+    }
+
+    return HAL_WIFI_CONNECTING;
+}
+
+bool SimulatedWifi::link(HalWifiLink* output)
+{
+    if (!connected)
+    {
+        return false;
+    }
+
+    *output = accessPoints[current].link;
+    return true;
+}
+
+int SimulatedWifi::rssi()
+{
+    return connected ? accessPoints[current].rssi : 0;
+}
+
+void SimulatedWifi::disconnect()
+{
+    joining = false;
+    connected = false;
+    dropped = false;
+    current = -1;
+    resolveAtMicroS = -1;
+}
+
+bool SimulatedWifi::startScan()
+{
+    scanDoneAtMicroS = now + timing->scanMs * 1000LL;
+    return true;
+}
+
+int SimulatedWifi::scanResults(HalWifiNetwork* output, int max)
+{
+    if (scanDoneAtMicroS < 0 || now < scanDoneAtMicroS)
+    {
+        return -1;
+    }
+
+    int count = 0;
+
+    for (int i = 0; i < accessPointCount && count < max; i++)
+    {
+        if (!accessPoints[i].up)
+        {
+            continue;
+        }
+
+        HalWifiNetwork* network = &output[count++];
+        memcpy(network->ssid, accessPoints[i].ssid, sizeof(network->ssid));
+        network->rssi = accessPoints[i].rssi;
+        network->channel = accessPoints[i].link.channel;
+        memcpy(network->bssid, accessPoints[i].link.bssid, sizeof(network->bssid));
+    }
+
+    scanDoneAtMicroS = -1;
+    return count;
+}
+
+int64_t SimulatedWifi::nowMicroS()
+{
+    return now;
+}
+
+void SimulatedWifi::sleepMs(uint32_t ms)
+{
+    advance(ms * 1000LL);
+}
+
+void SimulatedWifi::setLevel(HalPowerLevel level)
+{
+    if (level == HAL_POWER_RADIO_OFF)
+    {
+        disconnect();
+    }
+}
+
+void SimulatedWifi::lightSleep(int64_t microS)
+{
+    advance(microS);
+}
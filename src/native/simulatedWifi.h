@@ -0,0 +1,71 @@
+#ifndef __ESP_SIMULATED_WIFI__
+#define __ESP_SIMULATED_WIFI__
+
+#include "../hal.h"
+
+#define SIMULATED_WIFI_MAX_ACCESS_POINTS 4
+
+// Timings of the ESP32 station as seen on a busy 2.4 GHz band
+struct SimulatedWifiTiming {
+    // Active scan over all channels
+    uint32_t scanMs;
+    // Authentication and association with a known BSSID
+    uint32_t associateMs;
+    uint32_t dhcpMs;
+};
+
+extern const SimulatedWifiTiming defaultWifiTiming;
+
+// Access points the station can join. Time only moves through advance(),
+// sleepMs() or lightSleep(), so a WifiManager run is deterministic.
+class SimulatedWifi : public HalWifi, public HalClock, public HalPower {
+public:
+    explicit SimulatedWifi(const SimulatedWifiTiming* timing = &defaultWifiTiming);
+
+    // Returns the index for setAccessPoint, -1 when full
+    int addAccessPoint(const char* ssid, uint8_t channel, int8_t rssi);
+    void setAccessPoint(int index, bool up, uint8_t channel);
+    // Drops the current association as a beacon loss would
+    void dropLink();
+    void advance(int64_t microS);
+
+    bool begin(const char* ssid, const char* password, const HalWifiLink* link) override;
+    HalWifiStatus status() override;
+    bool link(HalWifiLink* output) override;
+    int rssi() override;
+    void disconnect() override;
+    bool startScan() override;
+    int scanResults(HalWifiNetwork* output, int max) override;
+
+    int64_t nowMicroS() override;
+    void sleepMs(uint32_t ms) override;
+
+    // Radio off drops the association, sleeping only moves the clock
+    void setLevel(HalPowerLevel level) override;
+    void lightSleep(int64_t microS) override;
+
+private:
+    struct AccessPoint {
+        char ssid[HAL_WIFI_SSID_SIZE];
+        HalWifiLink link;
+        int8_t rssi;
+        bool up;
+    };
+
+    AccessPoint accessPoints[SIMULATED_WIFI_MAX_ACCESS_POINTS];
+    int accessPointCount;
+    const SimulatedWifiTiming* timing;
+    // Joined or being joined, -1 for none
+    int current;
+    bool joining;
+    bool connected;
+    bool dropped;
+    // When the pending attempt resolves, -1 for never
+    int64_t resolveAtMicroS;
+    bool willConnect;
+    // -1 when no scan was started
+    int64_t scanDoneAtMicroS;
+    int64_t now;
+};
+
+#endif // __ESP_SIMULATED_WIFI__
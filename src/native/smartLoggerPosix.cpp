@@ -0,0 +1,54 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../sdkconfig.h"
+#include "../smartLogger.h"
+#include "halPosix.h"
+
+bool smartLogQuiet = false;
+CrashLog* smartLogCrashLog = nullptr;
+SmartLogFilter smartLogFilter(SMART_LOG_INFO);
+static PosixClock logClock;
+// Crash log times count from process start, like millis() on the device
+static int64_t startMs = logClock.nowMicroS() / 1000;
+
+static void writeSmartLog(const char* buffer) {
+    if (smartLogCrashLog != nullptr) {
+        smartLogCrashLog->text(buffer, strlen(buffer), logClock.nowMicroS() / 1000 - startMs);
+    }
+
+    if (!smartLogQuiet) {
+        printf("%s\n", buffer);
+    }
+}
+
+void smartLog(const char* str, ...) {
+    if ((smartLogQuiet && smartLogCrashLog == nullptr) || !smartLogFilter.enabled(SMART_LOG_INFO, CONFIG_APP_LOG_TAG)) {
+        return;
+    }
+
+    char buffer[256];
+    va_list args;
+    va_start(args, str);
+    vsnprintf(buffer, sizeof(buffer), str, args);
+    va_end(args);
+
+    writeSmartLog(buffer);
+}
+
+void smartLogTagged(SmartLogLevel level, const char* tag, const char* str, ...) {
+    if (smartLogQuiet && smartLogCrashLog == nullptr) {
+        return;
+    }
+
+    char buffer[256];
+    int prefix = snprintf(buffer, sizeof(buffer), "[%s] ", tag);
+
+    va_list args;
+    va_start(args, str);
+    vsnprintf(buffer + prefix, sizeof(buffer) - prefix, str, args);
+    va_end(args);
+
+    writeSmartLog(buffer);
+}
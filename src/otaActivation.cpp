@@ -0,0 +1,174 @@
+#include <string.h>
+
+#include "otaActivation.h"
+
+#define SECONDS_PER_DAY (24 * 3600)
+
+static const OtaActivationConfig defaultActivationConfig = {
+    .mode = OTA_ACTIVATE_NOW,
+    .windowStartS = 3 * 3600,
+    .windowLengthS = 3600,
+    .hookTimeoutMicroS = 30 * 1000000LL,
+};
+
+OtaActivation::OtaActivation(HalClock* clock)
+    : clock(clock),
+      config(defaultActivationConfig),
+      hookCount(0),
+      currentState(OTA_ACTIVATION_NONE),
+      requested(false),
+      preparingMicroS(0),
+      skippedHookName(nullptr)
+{
+}
+
+bool OtaActivation::addHook(const char* name, PreRebootHook hook, void* context)
+{
+    if (hookCount >= OTA_ACTIVATION_MAX_HOOKS)
+    {
+        return false;
+    }
+
+    hooks[hookCount++] = {name, hook, context, false};
+    return true;
+}
+
+void OtaActivation::setConfig(const OtaActivationConfig* activationConfig)
+{
+    config = *activationConfig;
+}
+
+const OtaActivationConfig* OtaActivation::getConfig() const
+{
+    return &config;
+}
+
+void OtaActivation::stage()
+{
+    requested = false;
+    currentState = OTA_ACTIVATION_STAGED;
+}
+
+void OtaActivation::clear()
+{
+    requested = false;
+    currentState = OTA_ACTIVATION_NONE;
+}
+
+bool OtaActivation::request()
+{
+    if (currentState == OTA_ACTIVATION_NONE)
+    {
+        return false;
+    }
+
+    requested = true;
+    return true;
+}
+
+OtaActivationState OtaActivation::poll(int32_t secondsOfDay)
+{
+    int64_t now = clock->nowMicroS();
+
+    if (currentState == OTA_ACTIVATION_STAGED)
+    {
+        bool due = requested ||
+                   config.mode == OTA_ACTIVATE_NOW ||
+                   (config.mode == OTA_ACTIVATE_WINDOW && inWindow(secondsOfDay));
+
+        if (!due)
+        {
+            return OTA_ACTIVATION_STAGED;
+        }
+
+        for (int i = 0; i < hookCount; i++)
+        {
+            hooks[i].done = false;
+        }
+
+        skippedHookName = nullptr;
+        preparingMicroS = now;
+        currentState = OTA_ACTIVATION_PREPARING;
+    }
+
+    if (currentState == OTA_ACTIVATION_PREPARING)
+    {
+        bool timedOut = now - preparingMicroS >= config.hookTimeoutMicroS;
+        bool ready = true;
+
+        for (int i = 0; i < hookCount; i++)
+        {
+            if (!hooks[i].done)
+            {
+                hooks[i].done = hooks[i].hook(hooks[i].context);
+            }
+
+            if (!hooks[i].done)
+            {
+                ready = false;
+                if (timedOut && skippedHookName == nullptr)
+                {
+                    skippedHookName = hooks[i].name;
+                }
+            }
+        }
+
+        if (ready || timedOut)
+        {
+            currentState = OTA_ACTIVATION_READY;
+        }
+    }
+
+    return (OtaActivationState)currentState;
+}
+
+OtaActivationState OtaActivation::state() const
+{
+    return (OtaActivationState)currentState;
+}
+
+const char* OtaActivation::skippedHook() const
+{
+    return skippedHookName;
+}
+
+bool OtaActivation::inWindow(int32_t secondsOfDay) const
+{
+    if (secondsOfDay < 0)
+    {
+        return false;
+    }
+
+    uint32_t sinceStart = (secondsOfDay + SECONDS_PER_DAY - config.windowStartS % SECONDS_PER_DAY) % SECONDS_PER_DAY;
+    return sinceStart < config.windowLengthS;
+}
+
+const char* otaActivationModeName(OtaActivationMode mode)
+{
+    switch (mode)
+    {
+    case OTA_ACTIVATE_NOW:
+        return "now";
+    case OTA_ACTIVATE_WINDOW:
+        return "window";
+    case OTA_ACTIVATE_COMMAND:
+        return "command";
+    }
+    return "unknown";
+}
+
+const char* otaActivationStateName(OtaActivationState state)
+{
+    switch (state)
+    {
+    case OTA_ACTIVATION_NONE:
+        return "none";
+    case OTA_ACTIVATION_STAGED:
+        return "staged";
+    case OTA_ACTIVATION_PREPARING:
+        return "preparing";
+    case OTA_ACTIVATION_READY:
+        return "ready";
+    }
+    return "unknown";
+}
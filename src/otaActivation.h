@@ -0,0 +1,93 @@
+#ifndef __ESP_OTA_ACTIVATION__
+#define __ESP_OTA_ACTIVATION__
+
+#include <stdint.h>
+
+#include "hal.h"
+
+#define OTA_ACTIVATION_MAX_HOOKS 8
+
+enum OtaActivationMode {
+    // Reboot into the update as soon as it is verified
+    OTA_ACTIVATE_NOW,
+    // Inside the daily maintenance window, needs a set wall clock
+    OTA_ACTIVATE_WINDOW,
+    // Only when asked to
+    OTA_ACTIVATE_COMMAND,
+};
+
+enum OtaActivationState {
+    OTA_ACTIVATION_NONE,
+    // A verified update waits in the inactive slot
+    OTA_ACTIVATION_STAGED,
+    // Due, the pre-reboot hooks are running
+    OTA_ACTIVATION_PREPARING,
+    // Switch the boot partition and restart
+    OTA_ACTIVATION_READY,
+};
+
+struct OtaActivationConfig {
+    OtaActivationMode mode;
+    // Local time, seconds after midnight. A window may run past midnight.
+    uint32_t windowStartS;
+    uint32_t windowLengthS;
+    // Hooks that are still not ready by then are skipped
+    int64_t hookTimeoutMicroS;
+};
+
+// Returns true once the application is ready for the reboot, e.g. its
+// state is flushed. Retried on every poll until it does or time runs out.
+typedef bool (*PreRebootHook)(void* context);
+
+struct PreRebootHookEntry {
+    const char* name;
+    PreRebootHook hook;
+    void* context;
+    bool done;
+};
+
+// Decides when a staged update is applied. The update path stages, poll()
+// runs on one task and reports READY once the update is due and the
+// pre-reboot hooks are through; the caller then switches the boot partition
+// and restarts. stage(), clear() and request() are callable from any task.
+class OtaActivation {
+public:
+    explicit OtaActivation(HalClock* clock);
+
+    // Must be called before the first stage()
+    bool addHook(const char* name, PreRebootHook hook, void* context);
+
+    void setConfig(const OtaActivationConfig* config);
+    const OtaActivationConfig* getConfig() const;
+
+    void stage();
+    // A new update overwrites the inactive slot, forget what was staged
+    void clear();
+    // Applies the staged update on the next poll, whatever the mode. False
+    // when nothing is staged.
+    bool request();
+
+    // secondsOfDay is the local time of day, -1 while the wall clock is not set
+    OtaActivationState poll(int32_t secondsOfDay);
+
+    OtaActivationState state() const;
+    // First hook that was not ready when its time ran out, nullptr if none
+    const char* skippedHook() const;
+
+private:
+    bool inWindow(int32_t secondsOfDay) const;
+
+    HalClock* clock;
+    OtaActivationConfig config;
+    PreRebootHookEntry hooks[OTA_ACTIVATION_MAX_HOOKS];
+    int hookCount;
+    volatile int currentState;
+    volatile bool requested;
+    int64_t preparingMicroS;
+    const char* skippedHookName;
+};
+
+const char* otaActivationModeName(OtaActivationMode mode);
+const char* otaActivationStateName(OtaActivationState state);
+
+#endif // __ESP_OTA_ACTIVATION__
@@ -0,0 +1,284 @@
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "otaApi.h"
+
+static size_t checkedLength(int len, size_t size)
+{
+    return len < 0 || (size_t)len >= size ? 0 : (size_t)len;
+}
+
+size_t renderOtaStatus(const OtaStatusSnapshot* status, char* output, size_t size)
+{
+    int len = snprintf(output, size,
+                       "{\"state\":\"%s\",\"stopReason\":\"%s\",\"rollback\":\"%s\",\"activation\":\"%s\",\"erase\":\"%s\","
+                       "\"bytes\":%" PRId64 ",\"total\":%" PRId64 ",\"receiveSize\":%" PRIu32 ",\"source\":\"%s\",\"lastThroughput\":%" PRIu32 ","
+                       "\"uptimeMs\":%" PRId64 "}\n",
+                       status->state,
+                       status->stopReason,
+                       status->rollbackGate,
+                       status->activation,
+                       status->eraseStrategy,
+                       status->bytesReceived,
+                       status->contentLength,
+                       status->receiveSize,
+                       status->source,
+                       status->lastThroughput,
+                       status->uptimeMicroS / 1000);
+    return checkedLength(len, size);
+}
+
+// Appends to a fixed buffer and remembers when something did not fit
+struct MetricsWriter {
+    char* output;
+    size_t size;
+    size_t len;
+    bool overflow;
+
+    void append(const char* format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        if (overflow)
+        {
+            return;
+        }
+
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(output + len, size - len, format, args);
+        va_end(args);
+
+        if (written < 0 || (size_t)written >= size - len)
+        {
+            overflow = true;
+            return;
+        }
+
+        len += written;
+    }
+
+    void family(const char* name, const char* type)
+    {
+        append("# TYPE %s %s\n", name, type);
+    }
+};
+
+// A family's samples sit together under its # TYPE line, so families
+// outside and regions inside. PSRAM only when fitted.
+static void renderHeap(MetricsWriter* writer, const OtaMetricsSnapshot* metrics)
+{
+    const char* const families[] = {"heap_size_bytes", "heap_free_bytes", "heap_min_free_bytes"};
+    const char* const regions[] = {"internal", "psram"};
+    const OtaHeapMetrics* heaps[] = {&metrics->internalHeap, &metrics->psramHeap};
+    int regionCount = metrics->psramHeap.totalBytes > 0 ? 2 : 1;
+
+    for (int family = 0; family < 3; family++)
+    {
+        writer->family(families[family], "gauge");
+
+        for (int region = 0; region < regionCount; region++)
+        {
+            const OtaHeapMetrics* heap = heaps[region];
+            uint32_t value = family == 0 ? heap->totalBytes : family == 1 ? heap->freeBytes : heap->minFreeBytes;
+            writer->append("%s{region=\"%s\"} %" PRIu32 "\n", families[family], regions[region], value);
+        }
+    }
+}
+
+size_t renderOtaMetrics(const OtaMetricsSnapshot* metrics, char* output, size_t size)
+{
+    MetricsWriter writer = {output, size, 0, false};
+
+    writer.family("ota_state", "gauge");
+    writer.append("ota_state %d\n", metrics->state);
+    writer.family("ota_updates_total", "counter");
+    writer.append("ota_updates_total{outcome=\"started\"} %" PRIu32 "\n", metrics->updatesStarted);
+    writer.append("ota_updates_total{outcome=\"succeeded\"} %" PRIu32 "\n", metrics->updatesSucceeded);
+    writer.append("ota_updates_total{outcome=\"failed\"} %" PRIu32 "\n", metrics->updatesFailed);
+    writer.family("ota_bytes_received_total", "counter");
+    writer.append("ota_bytes_received_total %" PRIu64 "\n", metrics->bytesReceived);
+    writer.family("ota_last_throughput_bytes_per_second", "gauge");
+    writer.append("ota_last_throughput_bytes_per_second %" PRIu32 "\n", metrics->lastThroughput);
+
+    renderHeap(&writer, metrics);
+
+    writer.family("task_stack_high_water_bytes", "gauge");
+    for (int i = 0; i < metrics->taskCount; i++)
+    {
+        writer.append("task_stack_high_water_bytes{task=\"%s\"} %" PRIu32 "\n", metrics->tasks[i].name, metrics->tasks[i].highWaterBytes);
+    }
+
+    writer.family("wifi_connected", "gauge");
+    writer.append("wifi_connected %d\n", metrics->wifiConnected ? 1 : 0);
+    if (metrics->wifiConnected)
+    {
+        writer.family("wifi_rssi_dbm", "gauge");
+        writer.append("wifi_rssi_dbm %" PRId32 "\n", metrics->wifiRssi);
+    }
+    writer.family("wifi_reconnects_total", "counter");
+    writer.append("wifi_reconnects_total %" PRIu32 "\n", metrics->wifiReconnects);
+    writer.family("wifi_connects_total", "counter");
+    writer.append("wifi_connects_total{path=\"cached\"} %" PRIu32 "\n", metrics->wifiFastConnects);
+    writer.append("wifi_connects_total{path=\"scan\"} %" PRIu32 "\n", metrics->wifiScanConnects);
+    writer.family("wifi_cached_fallbacks_total", "counter");
+    writer.append("wifi_cached_fallbacks_total %" PRIu32 "\n", metrics->wifiFastFallbacks);
+    writer.family("wifi_connect_failures_total", "counter");
+    writer.append("wifi_connect_failures_total %" PRIu32 "\n", metrics->wifiFailures);
+    if (metrics->wifiLastConnectMicroS >= 0)
+    {
+        writer.family("wifi_last_connect_seconds", "gauge");
+        writer.append("wifi_last_connect_seconds %" PRId64 ".%03" PRId64 "\n", metrics->wifiLastConnectMicroS / 1000000, metrics->wifiLastConnectMicroS / 1000 % 1000);
+    }
+
+    static const char* powerLevels[3] = {"full", "save", "radio_off"};
+    writer.family("power_level_seconds_total", "counter");
+    for (int i = 0; i < 3; i++)
+    {
+        writer.append("power_level_seconds_total{level=\"%s\"} %" PRId64 "\n", powerLevels[i], metrics->powerLevelMicroS[i] / 1000000);
+    }
+    writer.family("power_average_microamps", "gauge");
+    writer.append("power_average_microamps %" PRIu32 "\n", metrics->averageMicroAmps);
+    writer.family("idle_wakes_total", "counter");
+    writer.append("idle_wakes_total %" PRIu32 "\n", metrics->idleWakes);
+    writer.family("idle_failed_wakes_total", "counter");
+    writer.append("idle_failed_wakes_total %" PRIu32 "\n", metrics->idleFailedWakes);
+    if (metrics->idleLastWakeMicroS >= 0)
+    {
+        writer.family("idle_wake_seconds", "gauge");
+        writer.append("idle_wake_seconds{stat=\"last\"} %" PRId64 ".%03" PRId64 "\n", metrics->idleLastWakeMicroS / 1000000, metrics->idleLastWakeMicroS / 1000 % 1000);
+        writer.append("idle_wake_seconds{stat=\"max\"} %" PRId64 ".%03" PRId64 "\n", metrics->idleMaxWakeMicroS / 1000000, metrics->idleMaxWakeMicroS / 1000 % 1000);
+    }
+
+    writer.family("log_dropped_total", "counter");
+    writer.append("log_dropped_total %" PRIu32 "\n", metrics->logDropped);
+    writer.family("uptime_seconds", "gauge");
+    writer.append("uptime_seconds %" PRId64 "\n", metrics->uptimeMicroS / 1000000);
+
+    writer.family("http_api_requests_total", "counter");
+    writer.append("http_api_requests_total %" PRIu32 "\n", metrics->apiRequests);
+    writer.family("http_api_rejected_total", "counter");
+    writer.append("http_api_rejected_total %" PRIu32 "\n", metrics->apiRejected);
+    writer.family("http_api_slots_high_water", "gauge");
+    writer.append("http_api_slots_high_water %" PRIu32 "\n", metrics->apiSlotsHighWater);
+
+    writer.family("ws_messages_total", "counter");
+    writer.append("ws_messages_total %" PRIu32 "\n", metrics->wsPool.messages);
+    writer.family("ws_pool_in_use", "gauge");
+    writer.append("ws_pool_in_use{kind=\"slab\"} %" PRIu32 "\n", metrics->wsPool.slabsInUse);
+    writer.append("ws_pool_in_use{kind=\"handle\"} %" PRIu32 "\n", metrics->wsPool.handlesInUse);
+    writer.family("ws_pool_high_water", "gauge");
+    writer.append("ws_pool_high_water{kind=\"slab\"} %" PRIu32 "\n", metrics->wsPool.slabsHighWater);
+    writer.append("ws_pool_high_water{kind=\"handle\"} %" PRIu32 "\n", metrics->wsPool.handlesHighWater);
+    writer.family("ws_pool_exhausted_total", "counter");
+    writer.append("ws_pool_exhausted_total{kind=\"slab\"} %" PRIu32 "\n", metrics->wsPool.slabsExhausted);
+    writer.append("ws_pool_exhausted_total{kind=\"handle\"} %" PRIu32 "\n", metrics->wsPool.handlesExhausted);
+
+    writer.family("scrub_passes_total", "counter");
+    for (int i = 0; i < metrics->scrubTargetCount; i++)
+    {
+        writer.append("scrub_passes_total{target=\"%s\"} %" PRIu32 "\n", metrics->scrubTargets[i].target, metrics->scrubTargets[i].passes);
+    }
+    writer.family("scrub_result", "gauge");
+    for (int i = 0; i < metrics->scrubTargetCount; i++)
+    {
+        writer.append("scrub_result{target=\"%s\",result=\"%s\"} 1\n", metrics->scrubTargets[i].target, metrics->scrubTargets[i].result);
+    }
+    writer.family("scrub_progress_bytes", "gauge");
+    for (int i = 0; i < metrics->scrubTargetCount; i++)
+    {
+        writer.append("scrub_progress_bytes{target=\"%s\",stat=\"checked\"} %" PRIu64 "\n", metrics->scrubTargets[i].target, metrics->scrubTargets[i].bytesChecked);
+        writer.append("scrub_progress_bytes{target=\"%s\",stat=\"image\"} %" PRIu64 "\n", metrics->scrubTargets[i].target, metrics->scrubTargets[i].imageBytes);
+    }
+    writer.family("scrub_corrupt_total", "counter");
+    writer.append("scrub_corrupt_total %" PRIu32 "\n", metrics->scrubCorrupt);
+    writer.family("scrub_bytes_total", "counter");
+    writer.append("scrub_bytes_total %" PRIu64 "\n", metrics->scrubBytes);
+    writer.family("scrub_step_max_seconds", "gauge");
+    writer.append("scrub_step_max_seconds %" PRId64 ".%06" PRId64 "\n", metrics->scrubLongestStepMicroS / 1000000, metrics->scrubLongestStepMicroS % 1000000);
+
+    return writer.overflow ? 0 : writer.len;
+}
+
+ResponseSlotPool::ResponseSlotPool()
+    : inUse(0),
+      requestCount(0),
+      rejectedCount(0),
+      maxInUse(0)
+{
+    for (int i = 0; i < OTA_API_SLOT_COUNT; i++)
+    {
+        slots[i].len = 0;
+        slots[i].used = false;
+    }
+}
+
+ResponseSlot* ResponseSlotPool::acquire()
+{
+    requestCount++;
+
+    for (int i = 0; i < OTA_API_SLOT_COUNT; i++)
+    {
+        if (!slots[i].used)
+        {
+            slots[i].used = true;
+            slots[i].len = 0;
+
+            if (++inUse > maxInUse)
+            {
+                maxInUse = inUse;
+            }
+
+            return &slots[i];
+        }
+    }
+
+    rejectedCount++;
+    return nullptr;
+}
+
+void ResponseSlotPool::release(ResponseSlot* slot)
+{
+    if (slot != nullptr && slot->used)
+    {
+        slot->used = false;
+        inUse--;
+    }
+}
+
+uint32_t ResponseSlotPool::requests() const
+{
+    return requestCount;
+}
+
+uint32_t ResponseSlotPool::rejected() const
+{
+    return rejectedCount;
+}
+
+uint32_t ResponseSlotPool::highWater() const
+{
+    return maxInUse;
+}
+
+uint32_t ResponseSlotPool::active() const
+{
+    return inUse;
+}
+
+size_t readResponseSlot(const ResponseSlot* slot, uint8_t* buffer, size_t maxLen, size_t index)
+{
+    if (index >= slot->len)
+    {
+        return 0;
+    }
+
+    size_t len = slot->len - index;
+    if (len > maxLen)
+    {
+        len = maxLen;
+    }
+
+    memcpy(buffer, slot->body + index, len);
+    return len;
+}
@@ -0,0 +1,139 @@
+#ifndef __ESP_OTA_API__
+#define __ESP_OTA_API__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "messagePool.h"
+
+#define OTA_API_SLOT_COUNT 4
+// Fits a full /metrics page with OTA_METRICS_MAX_TASKS tasks and
+// OTA_METRICS_MAX_SCRUB_TARGETS scrub targets
+#define OTA_API_SLOT_SIZE 4096
+#define OTA_METRICS_MAX_TASKS 8
+#define OTA_METRICS_MAX_SCRUB_TARGETS 2
+
+// What GET /ota/status reports, filled by the firmware right before rendering
+struct OtaStatusSnapshot {
+    const char* state;
+    const char* stopReason;
+    const char* rollbackGate;
+    // Whether a verified update waits for its reboot
+    const char* activation;
+    const char* eraseStrategy;
+    int64_t bytesReceived;
+    // -1 until the server announced a length
+    int64_t contentLength;
+    uint32_t receiveSize;
+    // "pull" or "push" for the running or last finished transfer
+    const char* source;
+    // Bytes per second of the last transfer that completed
+    uint32_t lastThroughput;
+    int64_t uptimeMicroS;
+};
+
+struct OtaHeapMetrics {
+    // 0 when the region does not exist, e.g. no PSRAM fitted
+    uint32_t totalBytes;
+    uint32_t freeBytes;
+    uint32_t minFreeBytes;
+};
+
+struct OtaTaskStackMetrics {
+    const char* name;
+    // Least free stack the task ever had
+    uint32_t highWaterBytes;
+};
+
+struct OtaScrubMetrics {
+    const char* target;
+    const char* result;
+    uint32_t passes;
+    // Of the pass running now, 0 between passes
+    uint64_t bytesChecked;
+    // 0 until a pass found the image
+    uint64_t imageBytes;
+};
+
+// What GET /metrics reports
+struct OtaMetricsSnapshot {
+    int state;
+    uint32_t updatesStarted;
+    uint32_t updatesSucceeded;
+    uint32_t updatesFailed;
+    uint64_t bytesReceived;
+    uint32_t lastThroughput;
+    OtaHeapMetrics internalHeap;
+    OtaHeapMetrics psramHeap;
+    OtaTaskStackMetrics tasks[OTA_METRICS_MAX_TASKS];
+    int taskCount;
+    bool wifiConnected;
+    int32_t wifiRssi;
+    uint32_t wifiReconnects;
+    uint32_t wifiFastConnects;
+    uint32_t wifiScanConnects;
+    uint32_t wifiFastFallbacks;
+    uint32_t wifiFailures;
+    // -1 until the first connection
+    int64_t wifiLastConnectMicroS;
+    // Per HalPowerLevel
+    int64_t powerLevelMicroS[3];
+    uint32_t averageMicroAmps;
+    uint32_t idleWakes;
+    uint32_t idleFailedWakes;
+    // Wake to network ready, -1 before the first wake
+    int64_t idleLastWakeMicroS;
+    int64_t idleMaxWakeMicroS;
+    uint32_t logDropped;
+    int64_t uptimeMicroS;
+    uint32_t apiRequests;
+    uint32_t apiRejected;
+    uint32_t apiSlotsHighWater;
+    MessagePoolStats wsPool;
+    OtaScrubMetrics scrubTargets[OTA_METRICS_MAX_SCRUB_TARGETS];
+    int scrubTargetCount;
+    uint32_t scrubCorrupt;
+    uint64_t scrubBytes;
+    int64_t scrubLongestStepMicroS;
+};
+
+// Both return the rendered length, or 0 when size was too small
+size_t renderOtaStatus(const OtaStatusSnapshot* status, char* output, size_t size);
+size_t renderOtaMetrics(const OtaMetricsSnapshot* metrics, char* output, size_t size);
+
+struct ResponseSlot {
+    char body[OTA_API_SLOT_SIZE];
+    size_t len;
+    bool used;
+};
+
+// Fixed set of response bodies so a request never allocates: the handler
+// renders into a slot, the server streams it out in whatever pieces the
+// socket accepts and the slot returns when the connection closes. Owned by
+// the server task, no locking.
+class ResponseSlotPool {
+public:
+    ResponseSlotPool();
+
+    // nullptr when every slot is still streaming
+    ResponseSlot* acquire();
+    void release(ResponseSlot* slot);
+
+    uint32_t requests() const;
+    uint32_t rejected() const;
+    uint32_t highWater() const;
+    // Responses still streaming
+    uint32_t active() const;
+
+private:
+    ResponseSlot slots[OTA_API_SLOT_COUNT];
+    uint32_t inUse;
+    uint32_t requestCount;
+    uint32_t rejectedCount;
+    uint32_t maxInUse;
+};
+
+// Copies the part of the slot body starting at index, returns 0 at the end
+size_t readResponseSlot(const ResponseSlot* slot, uint8_t* buffer, size_t maxLen, size_t index);
+
+#endif // __ESP_OTA_API__
@@ -0,0 +1,288 @@
+#include <string.h>
+
+#include "otaBundle.h"
+
+#define OTA_BUNDLE_MAGIC_SIZE 4
+
+static uint32_t readLittleEndian(const uint8_t* data, int bytes)
+{
+    uint32_t value = 0;
+
+    for (int i = bytes - 1; i >= 0; i--)
+    {
+        value = (value << 8) | data[i];
+    }
+
+    return value;
+}
+
+OtaBundleReader::OtaBundleReader(OtaBundleSink* sink)
+    : sink(sink),
+      stage(STAGE_HEADER),
+      errorMessage(nullptr),
+      stagingLength(0),
+      stagingNeeded(OTA_BUNDLE_MAGIC_SIZE),
+      totalEntries(0),
+      currentEntry(0),
+      currentOffset(0)
+{
+}
+
+bool OtaBundleReader::fail(const char* message)
+{
+    if (stage != STAGE_ERROR)
+    {
+        errorMessage = message;
+        stage = STAGE_ERROR;
+    }
+
+    return false;
+}
+
+bool OtaBundleReader::parseHeader()
+{
+    if (memcmp(staging, OTA_BUNDLE_MAGIC, OTA_BUNDLE_MAGIC_SIZE) != 0)
+    {
+        // Not a bundle, hand everything to the app slot as is
+        stage = STAGE_RAW;
+        totalEntries = 1;
+        memset(&entries[0], 0, sizeof(entries[0]));
+        strcpy(entries[0].label, OTA_BUNDLE_APP_LABEL);
+
+        if (!sink->beginImage(&entries[0]))
+        {
+            return fail("app slot rejected the image");
+        }
+
+        return feedRaw(staging, stagingLength);
+    }
+
+    if (stagingNeeded < OTA_BUNDLE_HEADER_SIZE)
+    {
+        stagingNeeded = OTA_BUNDLE_HEADER_SIZE;
+        return true;
+    }
+
+    if (readLittleEndian(staging + 4, 2) != OTA_BUNDLE_VERSION)
+    {
+        return fail("unsupported bundle version");
+    }
+
+    totalEntries = readLittleEndian(staging + 6, 2);
+    if (totalEntries == 0 || totalEntries > OTA_BUNDLE_MAX_ENTRIES)
+    {
+        return fail("bad bundle entry count");
+    }
+
+    stage = STAGE_MANIFEST;
+    stagingNeeded = OTA_BUNDLE_HEADER_SIZE + totalEntries * OTA_BUNDLE_ENTRY_SIZE;
+    return true;
+}
+
+bool OtaBundleReader::parseManifest()
+{
+    const uint8_t* cursor = staging + OTA_BUNDLE_HEADER_SIZE;
+
+    for (int i = 0; i < totalEntries; i++)
+    {
+        OtaBundleEntry* current = &entries[i];
+
+        memcpy(current->label, cursor, OTA_BUNDLE_LABEL_SIZE);
+        current->label[OTA_BUNDLE_LABEL_SIZE] = 0;
+        current->size = readLittleEndian(cursor + OTA_BUNDLE_LABEL_SIZE, 4);
+        memcpy(current->sha256, cursor + OTA_BUNDLE_LABEL_SIZE + 4, OTA_SHA256_LEN);
+        current->hasHash = true;
+
+        if (current->label[0] == 0)
+        {
+            return fail("empty partition label");
+        }
+
+        cursor += OTA_BUNDLE_ENTRY_SIZE;
+    }
+
+    stage = STAGE_IMAGE;
+    currentEntry = 0;
+    return beginCurrentImage();
+}
+
+bool OtaBundleReader::beginCurrentImage()
+{
+    // Skip empty images so the caller never sees a zero length write
+    while (currentEntry < totalEntries)
+    {
+        currentOffset = 0;
+        otaSha256Start(&hash);
+
+        if (!sink->beginImage(&entries[currentEntry]))
+        {
+            return fail("partition rejected the image");
+        }
+
+        if (entries[currentEntry].size > 0)
+        {
+            return true;
+        }
+
+        if (!endCurrentImage())
+        {
+            return false;
+        }
+    }
+
+    stage = STAGE_DONE;
+    return true;
+}
+
+bool OtaBundleReader::endCurrentImage()
+{
+    uint8_t digest[OTA_SHA256_LEN];
+    otaSha256Finish(&hash, digest);
+
+    if (memcmp(digest, entries[currentEntry].sha256, OTA_SHA256_LEN) != 0)
+    {
+        return fail("image hash mismatch");
+    }
+
+    if (!sink->endImage(&entries[currentEntry]))
+    {
+        return fail("partition failed to finalize the image");
+    }
+
+    currentEntry++;
+    return true;
+}
+
+bool OtaBundleReader::feedRaw(const uint8_t* data, size_t len)
+{
+    if (len > 0 && !sink->writeImage(data, len))
+    {
+        return fail("app slot write failed");
+    }
+
+    entries[0].size += len;
+    return true;
+}
+
+bool OtaBundleReader::feed(const uint8_t* data, size_t len)
+{
+    while (len > 0)
+    {
+        switch (stage)
+        {
+        case STAGE_HEADER:
+        case STAGE_MANIFEST:
+        {
+            size_t take = stagingNeeded - stagingLength;
+            if (take > len)
+            {
+                take = len;
+            }
+
+            memcpy(staging + stagingLength, data, take);
+            stagingLength += take;
+            data += take;
+            len -= take;
+
+            if (stagingLength < stagingNeeded)
+            {
+                return true;
+            }
+
+            bool parsed = stage == STAGE_HEADER ? parseHeader() : parseManifest();
+            if (!parsed)
+            {
+                return false;
+            }
+            break;
+        }
+        case STAGE_IMAGE:
+        {
+            OtaBundleEntry* current = &entries[currentEntry];
+            size_t take = current->size - currentOffset;
+            if (take > len)
+            {
+                take = len;
+            }
+
+            otaSha256Update(&hash, data, take);
+            if (!sink->writeImage(data, take))
+            {
+                return fail("partition write failed");
+            }
+
+            currentOffset += take;
+            data += take;
+            len -= take;
+
+            if (currentOffset == current->size)
+            {
+                if (!endCurrentImage() || !beginCurrentImage())
+                {
+                    return false;
+                }
+            }
+            break;
+        }
+        case STAGE_RAW:
+            return feedRaw(data, len);
+        case STAGE_DONE:
+            return fail("trailing data after the last image");
+        case STAGE_ERROR:
+            return false;
+        }
+    }
+
+    return stage != STAGE_ERROR;
+}
+
+bool OtaBundleReader::finish()
+{
+    if (stage == STAGE_HEADER && stagingLength > 0)
+    {
+        // Stream shorter than the magic, treat it as a tiny app image
+        memset(staging + stagingLength, 0, OTA_BUNDLE_MAGIC_SIZE - stagingLength);
+        if (!parseHeader())
+        {
+            return false;
+        }
+    }
+
+    if (stage == STAGE_RAW)
+    {
+        if (!sink->endImage(&entries[0]))
+        {
+            return fail("app slot failed to finalize the image");
+        }
+
+        stage = STAGE_DONE;
+        return true;
+    }
+
+    if (stage != STAGE_DONE)
+    {
+        return fail("bundle ended before its last image");
+    }
+
+    return true;
+}
+
+bool OtaBundleReader::isBundle() const
+{
+    return totalEntries > 0 && entries[0].hasHash;
+}
+
+int OtaBundleReader::entryCount() const
+{
+    return totalEntries;
+}
+
+const OtaBundleEntry* OtaBundleReader::entry(int index) const
+{
+    return index >= 0 && index < totalEntries ? &entries[index] : nullptr;
+}
+
+const char* OtaBundleReader::error() const
+{
+    return errorMessage;
+}
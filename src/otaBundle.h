@@ -0,0 +1,88 @@
+#ifndef __ESP_OTA_BUNDLE__
+#define __ESP_OTA_BUNDLE__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "otaSha256.h"
+
+// Bundle layout, all integers little-endian:
+//   header   "OTAB", uint16 version, uint16 entry count
+//   manifest entry count x { char label[16], uint32 size, uint8 sha256[32] }
+//   images   concatenated in manifest order
+// The "app" label targets the next OTA app slot, any other label a data
+// partition. post_build_script.py writes this format.
+#define OTA_BUNDLE_MAGIC "OTAB"
+#define OTA_BUNDLE_VERSION 1
+#define OTA_BUNDLE_MAX_ENTRIES 4
+#define OTA_BUNDLE_LABEL_SIZE 16
+#define OTA_BUNDLE_HEADER_SIZE 8
+#define OTA_BUNDLE_ENTRY_SIZE (OTA_BUNDLE_LABEL_SIZE + 4 + OTA_SHA256_LEN)
+#define OTA_BUNDLE_APP_LABEL "app"
+
+struct OtaBundleEntry {
+    char label[OTA_BUNDLE_LABEL_SIZE + 1];
+    uint32_t size;
+    uint8_t sha256[OTA_SHA256_LEN];
+    // False for a plain firmware.bin stream, which carries no manifest hash
+    bool hasHash;
+};
+
+// Receives the images in manifest order. Returning false stops the stream.
+class OtaBundleSink {
+public:
+    virtual ~OtaBundleSink() {}
+    virtual bool beginImage(const OtaBundleEntry* entry) = 0;
+    virtual bool writeImage(const uint8_t* data, size_t len) = 0;
+    virtual bool endImage(const OtaBundleEntry* entry) = 0;
+};
+
+// Incremental parser fed with whatever the transport delivers. A stream
+// that does not start with the bundle magic is passed through as a single
+// app image so plain firmware.bin downloads keep working.
+class OtaBundleReader {
+public:
+    explicit OtaBundleReader(OtaBundleSink* sink);
+
+    bool feed(const uint8_t* data, size_t len);
+    // Closes a plain app stream, fails a bundle whose images are incomplete
+    bool finish();
+
+    bool isBundle() const;
+    int entryCount() const;
+    const OtaBundleEntry* entry(int index) const;
+    const char* error() const;
+
+private:
+    enum Stage {
+        STAGE_HEADER,
+        STAGE_MANIFEST,
+        STAGE_IMAGE,
+        STAGE_RAW,
+        STAGE_DONE,
+        STAGE_ERROR,
+    };
+
+    bool fail(const char* message);
+    bool parseHeader();
+    bool parseManifest();
+    bool beginCurrentImage();
+    bool endCurrentImage();
+    bool feedRaw(const uint8_t* data, size_t len);
+
+    OtaBundleSink* sink;
+    Stage stage;
+    const char* errorMessage;
+
+    uint8_t staging[OTA_BUNDLE_HEADER_SIZE + OTA_BUNDLE_MAX_ENTRIES * OTA_BUNDLE_ENTRY_SIZE];
+    size_t stagingLength;
+    size_t stagingNeeded;
+
+    OtaBundleEntry entries[OTA_BUNDLE_MAX_ENTRIES];
+    int totalEntries;
+    int currentEntry;
+    uint32_t currentOffset;
+    OtaSha256Context hash;
+};
+
+#endif // __ESP_OTA_BUNDLE__
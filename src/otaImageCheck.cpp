@@ -0,0 +1,291 @@
+#include <string.h>
+
+#include "otaImageCheck.h"
+
+#define APP_IMAGE_MAGIC 0xE9
+#define APP_IMAGE_CHIP_ID_OFFSET 12
+#define APP_DESC_MAGIC 0xABCD5432
+
+// Keeps the first OTA_APP_HEADER_SIZE bytes of the app image and lets the
+// bundle reader parse the manifest
+class AppHeaderCapture : public OtaBundleSink {
+public:
+    AppHeaderCapture()
+        : length(0),
+          began(false),
+          capturing(false)
+    {
+    }
+
+    bool beginImage(const OtaBundleEntry* entry) override
+    {
+        began = true;
+        capturing = strcmp(entry->label, OTA_BUNDLE_APP_LABEL) == 0;
+        return true;
+    }
+
+    bool writeImage(const uint8_t* data, size_t len) override
+    {
+        size_t space = sizeof(header) - length;
+
+        if (capturing && space > 0)
+        {
+            size_t take = len < space ? len : space;
+            memcpy(header + length, data, take);
+            length += take;
+        }
+
+        return true;
+    }
+
+    bool endImage(const OtaBundleEntry* entry) override
+    {
+        capturing = false;
+        return true;
+    }
+
+    uint8_t header[OTA_APP_HEADER_SIZE];
+    size_t length;
+    bool began;
+
+private:
+    bool capturing;
+};
+
+static uint32_t readLittleEndian32(const uint8_t* data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static void copyString(char* output, const uint8_t* data, size_t size)
+{
+    memcpy(output, data, size);
+    output[size] = 0;
+}
+
+OtaImageCheck::OtaImageCheck(HalPartitions* partitions, const OtaAppInfo* running)
+    : partitions(partitions),
+      running(running),
+      offset(0),
+      detailLabel("")
+{
+    memset(&app, 0, sizeof(app));
+}
+
+OtaImageVerdict OtaImageCheck::checkStream(const uint8_t* data, size_t len)
+{
+    AppHeaderCapture capture;
+    OtaBundleReader reader(&capture);
+
+    reader.feed(data, len);
+
+    if (!capture.began)
+    {
+        return OTA_IMAGE_MALFORMED;
+    }
+
+    OtaImageVerdict verdict = checkSizes(&reader);
+    if (verdict != OTA_IMAGE_OK)
+    {
+        return verdict;
+    }
+
+    if (capture.length == OTA_APP_HEADER_SIZE)
+    {
+        return checkApp(capture.header, capture.length);
+    }
+
+    // The app sits behind images the fetch did not cover
+    return reader.isBundle() && offset + OTA_APP_HEADER_SIZE > len ? OTA_IMAGE_NEED_MORE : OTA_IMAGE_MALFORMED;
+}
+
+OtaImageVerdict OtaImageCheck::checkApp(const uint8_t* data, size_t len)
+{
+    if (!otaParseAppHeader(data, len, &app))
+    {
+        return OTA_IMAGE_MALFORMED;
+    }
+
+    if (running == nullptr)
+    {
+        return OTA_IMAGE_OK;
+    }
+
+    if (app.chipId != running->chipId)
+    {
+        return OTA_IMAGE_WRONG_CHIP;
+    }
+
+    if (memcmp(app.elfSha256, running->elfSha256, sizeof(app.elfSha256)) == 0)
+    {
+        return OTA_IMAGE_SAME_BUILD;
+    }
+
+    return OTA_IMAGE_OK;
+}
+
+uint32_t OtaImageCheck::appOffset() const
+{
+    return offset;
+}
+
+const OtaAppInfo* OtaImageCheck::candidate() const
+{
+    return &app;
+}
+
+const char* OtaImageCheck::detail() const
+{
+    return detailLabel;
+}
+
+// Also finds where the app image starts in the stream
+OtaImageVerdict OtaImageCheck::checkSizes(const OtaBundleReader* reader)
+{
+    if (!reader->isBundle())
+    {
+        offset = 0;
+        return OTA_IMAGE_OK;
+    }
+
+    uint32_t position = OTA_BUNDLE_HEADER_SIZE + reader->entryCount() * OTA_BUNDLE_ENTRY_SIZE;
+    bool sawApp = false;
+
+    for (int i = 0; i < reader->entryCount(); i++)
+    {
+        const OtaBundleEntry* entry = reader->entry(i);
+        bool isApp = strcmp(entry->label, OTA_BUNDLE_APP_LABEL) == 0;
+
+        if (isApp && !sawApp)
+        {
+            offset = position;
+            sawApp = true;
+        }
+
+        position += entry->size;
+
+        if (partitions == nullptr)
+        {
+            continue;
+        }
+
+        FlashDevice* partition = isApp ? partitions->openApp() : partitions->openData(entry->label);
+        if (partition == nullptr || entry->size > partition->size())
+        {
+            detailLabel = entry->label;
+            return partition == nullptr ? OTA_IMAGE_NO_PARTITION : OTA_IMAGE_TOO_LARGE;
+        }
+    }
+
+    // A bundle of data images only, nothing to compare
+    return sawApp ? OTA_IMAGE_OK : OTA_IMAGE_MALFORMED;
+}
+
+// Reads until len bytes or the end of the body, returns the count
+static size_t readFully(HalHttpTransport* transport, uint8_t* buffer, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len)
+    {
+        int n = transport->read(buffer + got, len - got);
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+
+    return got;
+}
+
+// Returns the status, got is 0 unless the body is usable
+static int fetchRange(HalHttpTransport* transport, const char* url, uint32_t offset, uint8_t* buffer, size_t len, size_t* got)
+{
+    bool opened = transport->openRange(url, offset, len);
+    int status = opened ? transport->statusCode() : 0;
+    // A server without range support answers the whole body
+    bool usable = status == 206 || (status == 200 && offset == 0);
+
+    *got = usable ? readFully(transport, buffer, len) : 0;
+    transport->close();
+    return usable ? status : (status == 304 ? 304 : 0);
+}
+
+OtaImageVerdict otaCheckRemoteImage(HalHttpTransport* transport, const char* url, OtaImageCheck* check, uint8_t* buffer)
+{
+    size_t got = 0;
+    int status = fetchRange(transport, url, 0, buffer, OTA_IMAGE_CHECK_FETCH_SIZE, &got);
+
+    if (status == 304)
+    {
+        return OTA_IMAGE_NOT_MODIFIED;
+    }
+
+    if (status == 0)
+    {
+        return OTA_IMAGE_UNCHECKED;
+    }
+
+    OtaImageVerdict verdict = check->checkStream(buffer, got);
+    if (verdict != OTA_IMAGE_NEED_MORE)
+    {
+        return verdict;
+    }
+
+    if (fetchRange(transport, url, check->appOffset(), buffer, OTA_APP_HEADER_SIZE, &got) == 0)
+    {
+        return OTA_IMAGE_UNCHECKED;
+    }
+
+    return check->checkApp(buffer, got);
+}
+
+bool otaParseAppHeader(const uint8_t* data, size_t len, OtaAppInfo* info)
+{
+    if (len < OTA_APP_HEADER_SIZE || data[0] != APP_IMAGE_MAGIC)
+    {
+        return false;
+    }
+
+    const uint8_t* desc = data + OTA_APP_DESC_OFFSET;
+    if (readLittleEndian32(desc) != APP_DESC_MAGIC)
+    {
+        return false;
+    }
+
+    // esp_app_desc_t: magic, secure_version, 8 reserved bytes, version[32],
+    // project_name[32], time, date, idf_ver, app_elf_sha256[32]
+    info->chipId = data[APP_IMAGE_CHIP_ID_OFFSET] | (data[APP_IMAGE_CHIP_ID_OFFSET + 1] << 8);
+    info->secureVersion = readLittleEndian32(desc + 4);
+    copyString(info->version, desc + 16, 32);
+    copyString(info->projectName, desc + 48, 32);
+    memcpy(info->elfSha256, desc + 144, sizeof(info->elfSha256));
+    return true;
+}
+
+const char* otaImageVerdictName(OtaImageVerdict verdict)
+{
+    switch (verdict)
+    {
+    case OTA_IMAGE_OK:
+        return "ok";
+    case OTA_IMAGE_NEED_MORE:
+        return "need more";
+    case OTA_IMAGE_UNCHECKED:
+        return "unchecked";
+    case OTA_IMAGE_MALFORMED:
+        return "not an app image";
+    case OTA_IMAGE_WRONG_CHIP:
+        return "wrong chip";
+    case OTA_IMAGE_NO_PARTITION:
+        return "no partition";
+    case OTA_IMAGE_TOO_LARGE:
+        return "too large";
+    case OTA_IMAGE_SAME_BUILD:
+        return "same build";
+    case OTA_IMAGE_NOT_MODIFIED:
+        return "not modified";
+    }
+    return "unknown";
+}
@@ -0,0 +1,80 @@
+#ifndef __ESP_OTA_IMAGE_CHECK__
+#define __ESP_OTA_IMAGE_CHECK__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+#include "otaBundle.h"
+
+// esp_image_header_t and one esp_image_segment_header_t come first, the
+// segment holding esp_app_desc_t
+#define OTA_APP_DESC_OFFSET 32
+#define OTA_APP_DESC_SIZE 256
+#define OTA_APP_HEADER_SIZE (OTA_APP_DESC_OFFSET + OTA_APP_DESC_SIZE)
+// The bundle manifest plus the app header when the app comes first, which
+// is how post_build_script.py orders it
+#define OTA_IMAGE_CHECK_FETCH_SIZE 512
+
+// What the update decisions need out of esp_app_desc_t
+struct OtaAppInfo {
+    uint16_t chipId;
+    uint32_t secureVersion;
+    char version[33];
+    char projectName[33];
+    uint8_t elfSha256[32];
+};
+
+enum OtaImageVerdict {
+    OTA_IMAGE_OK,
+    // The app starts past the fetched bytes, fetch OTA_APP_HEADER_SIZE
+    // bytes at appOffset() and call checkApp()
+    OTA_IMAGE_NEED_MORE,
+    // Could not fetch the start of the image, nothing was checked
+    OTA_IMAGE_UNCHECKED,
+    OTA_IMAGE_MALFORMED,
+    OTA_IMAGE_WRONG_CHIP,
+    OTA_IMAGE_NO_PARTITION,
+    OTA_IMAGE_TOO_LARGE,
+    // Same app build as the running one
+    OTA_IMAGE_SAME_BUILD,
+    // The server answered 304 to the validators set on the transport
+    OTA_IMAGE_NOT_MODIFIED,
+};
+
+// Judges an update from the first bytes of its stream, before any flash is
+// erased: the manifest sizes against the partitions and the app image
+// header and descriptor against the running app.
+class OtaImageCheck {
+public:
+    // partitions may be nullptr to skip the size checks
+    OtaImageCheck(HalPartitions* partitions, const OtaAppInfo* running);
+
+    OtaImageVerdict checkStream(const uint8_t* data, size_t len);
+    OtaImageVerdict checkApp(const uint8_t* data, size_t len);
+
+    uint32_t appOffset() const;
+    // Valid once checkStream() or checkApp() parsed the descriptor
+    const OtaAppInfo* candidate() const;
+    // Label of the image a NO_PARTITION or TOO_LARGE verdict is about
+    const char* detail() const;
+
+private:
+    OtaImageVerdict checkSizes(const OtaBundleReader* reader);
+
+    HalPartitions* partitions;
+    const OtaAppInfo* running;
+    OtaAppInfo app;
+    uint32_t offset;
+    const char* detailLabel;
+};
+
+// Fetches the start of the image with ranged requests and runs the check.
+// Validators set on the transport go with the first request. buffer holds at least OTA_IMAGE_CHECK_FETCH_SIZE bytes.
+OtaImageVerdict otaCheckRemoteImage(HalHttpTransport* transport, const char* url, OtaImageCheck* check, uint8_t* buffer);
+
+// False when data is not an app image with a descriptor
+bool otaParseAppHeader(const uint8_t* data, size_t len, OtaAppInfo* info);
+const char* otaImageVerdictName(OtaImageVerdict verdict);
+
+#endif // __ESP_OTA_IMAGE_CHECK__
@@ -1,93 +1,315 @@
 #include <Arduino.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
 #include <esp_log.h>
-#include <nvs.h>
 #include <nvs_flash.h>
 #include <WiFi.h>
 #include <esp_http_client.h>
 #include <esp_ota_ops.h>
-#include <esp_https_ota.h>
 #include <esp_crt_bundle.h>
+#include <esp_heap_caps.h>
+#include <time.h>
 
 #include "sdkconfig.h"
 #include "serverSetup.h"
 #include "smartLogger.h"
 #include "otaMain.h"
+#include "otaStateMachine.h"
+#include "otaActivation.h"
+#include "otaTasks.h"
+#include "otaRollback.h"
+#include "otaBundle.h"
+#include "otaImageCheck.h"
+#include "firmwareCache.h"
+#include "otaValidators.h"
+#include "secretCache.h"
+#include "otaPartitionWriter.h"
+#include "otaSha256.h"
+#include "otaShaper.h"
+#include "partitionScrubber.h"
+#include "receiveSizer.h"
+#include "wifiManager.h"
+#include "idleScheduler.h"
+#include "halEsp.h"
+#include "crashLog.h"
 
 #define HASH_LEN 32
+#define OTA_FIRMWARE_URL "https://zzzorgo.dev/esp32/firmware.bundle"
+#define OTA_FIRMWARE_URL_SIZE 256
+// "source <token> <url>" over /ws takes https, or plain http to one of these
+// comma separated hosts, a site's gateway: -DOTA_SOURCE_HTTP_HOSTS='"10.0.0.2,gw.local"'
+#ifndef OTA_SOURCE_HTTP_HOSTS
+#define OTA_SOURCE_HTTP_HOSTS ""
+#endif
+// Without -DOTA_COMMAND_TOKEN='"..."' the source can't be changed over /ws
+// Site settings kept across reboots: the gateway role
+#define OTA_SETTINGS_NVS_NAMESPACE "otaSettings"
+#define OTA_SETTINGS_GATEWAY_KEY "gateway"
+// Data partition a gateway caches the update in, PSRAM when there is none
+#define FIRMWARE_CACHE_PARTITION "fwcache"
+#define FIRMWARE_CACHE_PSRAM_SIZE (4 * 1024 * 1024)
+#define HEALTH_CHECK_POLL_MS 100
+#define OTA_CHUNK_SIZE 4096
+#define OTA_CHUNK_SIZE_MIN 1024
+// One TLS record
+#define OTA_CHUNK_SIZE_MAX 16384
+#define OTA_CHUNK_COUNT 4
+// What "httpbuf" takes, esp_http_client's default up to one TLS record
+#define OTA_HTTP_BUFFER_MIN 512
+#define OTA_HTTP_BUFFER_MAX 16384
+// Internal RAM left for TLS, Wi-Fi and the web server when sizing chunks
+#define OTA_HEAP_RESERVE (48 * 1024)
+// The sizer falls back to OTA_CHUNK_SIZE_MIN reads below this
+#define OTA_HEAP_LOW (24 * 1024)
+#define OTA_RECEIVE_WINDOW_US 250000
+// Longest an upload body callback may hold the async_tcp task waiting on the writer
+#define OTA_UPLOAD_WAIT_MS 2000
+#define WIFI_POLL_MS 100
+// wifiManagerTask also starts idle-scheduled updates and runs the activation:
+// the pre-reboot hooks, the data image copy and restartIntoUpdate with its
+// final status frame and log flush. /metrics reports its high-water mark.
+#define WIFI_MANAGER_TASK_STACK 6144
+// Longest the restart waits for log lines, the final status frame and the
+// /ws close handshakes to be acked
+#define OTA_SHUTDOWN_TIMEOUT_MS 1500
+// RFC 6455 close code 1012, service restart
+#define OTA_WS_CLOSE_RESTART 1012
+// NVS bring-up plus the one read of the credentials, what boot may spend
+#define OTA_NVS_BOOT_BUDGET_US (100 * 1000)
+// Longest flash read of the scrubber, about 0.3 ms with the cache stopped
+#define OTA_SCRUB_CHUNK_SIZE 4096
+// How soon the scrub task notices an update or a cache fill came and went
+#define OTA_SCRUB_POLL_MS 1000
 
 int loadedBytes = 0;
 int64_t lastDataNotificationTime = 0;
 
-char username[32];
-char password[32];
-char caCert[4096];
+OtaStateMachine otaStateMachine;
 
-void readValueFromNvs(nvs_handle_t* nvsHandle, const char* key, char* output) {
-    size_t requiredSize;
-    esp_err_t returnStatus = nvs_get_str(*nvsHandle, key, NULL, &requiredSize);
+// Read size per chunk, 0 lets the download task adapt it
+size_t otaReceiveSize = 0;
+int otaHttpBufferSize = 2048;
 
-    if (returnStatus == ESP_OK)
+uint32_t otaUpdatesStarted = 0;
+uint32_t otaUpdatesSucceeded = 0;
+uint32_t otaUpdatesFailed = 0;
+uint64_t otaBytesReceived = 0;
+// Source and speed of the last finished transfer, pull and push compared
+const char* otaLastSource = "none";
+uint32_t otaLastThroughput = 0;
+// Set by "update force" for the next update, lets the running build through
+bool otaAllowSameBuild = false;
+// The origin, or the site's gateway: http://<gateway>/ota/firmware
+char otaFirmwareUrl[OTA_FIRMWARE_URL_SIZE] = OTA_FIRMWARE_URL;
+// A gateway keeps the update it pulls and serves it to the site
+bool firmwareCacheGateway = false;
+FirmwareCache firmwareCache;
+EspPartitionFlash firmwareCachePartition;
+EspPsramFlash firmwareCachePsram;
+EspStorage otaSettingsStorage;
+OtaValidatorStore otaValidatorStore(&otaSettingsStorage, OTA_SETTINGS_NVS_NAMESPACE);
+// A bundle's data image, copied over its partition once the app it came with
+// has passed the rollback gate
+OtaPendingDataStore otaPendingData(&otaSettingsStorage, OTA_SETTINGS_NVS_NAMESPACE);
+
+EspClock systemClock;
+EspStorage secretStorage;
+SecretCache secretCache(&secretStorage, &systemClock);
+int64_t otaNvsInitMicroS = 0;
+
+// Lends wifiManager the password of the network in the credentials for the
+// length of one join
+class SecretWifiPassword : public WifiPasswordSource {
+public:
+    const char* acquirePassword(const char* ssid) override
     {
-        nvs_get_str(*nvsHandle, key, output, &requiredSize);
+        bool configured = strcmp(ssid, secretCache.acquire(SECRET_WIFI_SSID)) == 0;
+        secretCache.release(SECRET_WIFI_SSID);
+        return configured ? secretCache.acquire(SECRET_WIFI_PASSWORD) : nullptr;
     }
-    else
+
+    void releasePassword(const char* ssid) override
     {
-        smartLog("Error reading %s (%s)!\n", key, esp_err_to_name(returnStatus));
+        secretCache.release(SECRET_WIFI_PASSWORD);
     }
+};
+
+SecretWifiPassword wifiPassword;
+EspWifi wifiRadio;
+EspStorage wifiStorage;
+WifiManager wifiManager(&wifiRadio, &wifiStorage, &systemClock);
+EspPower powerControl;
+IdleScheduler idleScheduler(&powerControl, &systemClock, &wifiManager);
+OtaShaper otaShaper(&systemClock);
+OtaActivation otaActivation(&systemClock);
+// Re-hashes the inactive app slot and the gateway's cache in the background
+static uint8_t scrubBuffer[OTA_SCRUB_CHUNK_SIZE];
+PartitionScrubber partitionScrubber(&systemClock, scrubBuffer, sizeof(scrubBuffer));
+EspPartitionFlash scrubAppFlash;
+int scrubAppTarget = -1;
+int scrubCacheTarget = -1;
+// Image the cache target is checked against, empty while there is none
+char scrubCacheEtag[FIRMWARE_CACHE_ETAG_SIZE + 1] = "";
+
+EspPartitions partitions;
+EspRollbackPlatform rollbackPlatform;
+RollbackGate rollbackGate(&rollbackPlatform);
+
+// Arduino's initArduino() marks a PENDING_VERIFY image valid before setup()
+// unless this says otherwise, rollbackGate has to see the state instead
+extern "C" bool verifyRollbackLater()
+{
+    return true;
 }
+// Verified app slot waiting for otaActivation, nullptr for a data-only bundle
+FlashDevice* otaStagedApp = nullptr;
+// The activation copies the pending data image before it restarts
+bool otaDataStaged = false;
 
+static void setSecretKeys(OtaSecretKeys *secretKeys)
+{
+    secretCache.setKeys(secretKeys->nvsNamespace, secretKeys->wifiSsidNvsKey, secretKeys->wifiPasswordNvsKey, secretKeys->caCertNvsKey);
+}
+
+// The one read of the credentials, users borrow them from secretCache
 void loadSecretsFromNvs(OtaSecretKeys *secretKeys)
 {
-    nvs_handle_t nvsHandle;
-    esp_err_t returnStatus;
+    setSecretKeys(secretKeys);
+    secretCache.load();
+}
+
+void saveSecretsToNvs(OtaSecretKeys *secretKeys, OtaSecretValues *secretValues)
+{
+    const char* values[SECRET_COUNT] = {secretValues->wifiSsid, secretValues->wifiPassword, secretValues->caCert};
 
-    returnStatus = nvs_open(secretKeys->nvsNamespace, NVS_READONLY, &nvsHandle);
+    setSecretKeys(secretKeys);
+    secretCache.save(values);
+}
 
-    if (returnStatus != ESP_OK)
+// Brings NVS up, timed for the boot budget
+static esp_err_t initOtaNvs()
+{
+    int64_t start = esp_timer_get_time();
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
-        smartLog("Error (%s) opening NVS handle!\n", esp_err_to_name(returnStatus));
-        return;
+        // 1.OTA app partition table has a smaller NVS partition size than the non-OTA
+        // partition table. This size mismatch may cause NVS initialization to fail.
+        // 2.NVS partition contains data in new format and cannot be recognized by this version of code.
+        // If this happens, we erase NVS partition and initialize NVS again.
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
     }
 
-    readValueFromNvs(&nvsHandle, secretKeys->wifiSsidNvsKey, username);
-    readValueFromNvs(&nvsHandle, secretKeys->wifiPasswordNvsKey, password);
-    readValueFromNvs(&nvsHandle, secretKeys->caCertNvsKey, caCert);
+    otaNvsInitMicroS = esp_timer_get_time() - start;
+    return err;
+}
+
+// Boot cost of NVS and the credentials against OTA_NVS_BOOT_BUDGET_US
+static void logSecretsBootTime()
+{
+    SecretCacheStats stats;
+    secretCache.stats(&stats);
+    int64_t totalMicroS = otaNvsInitMicroS + stats.lastLoadMicroS;
 
-    // Close the NVS handle
-    nvs_close(nvsHandle);
+    if (totalMicroS > OTA_NVS_BOOT_BUDGET_US)
+    {
+        SMART_LOGW("NVS", "NVS up in %lld us, credentials read in %lld us, over the %d us budget",
+                   otaNvsInitMicroS, stats.lastLoadMicroS, OTA_NVS_BOOT_BUDGET_US);
+    }
+    else
+    {
+        SMART_LOGI("NVS", "NVS up in %lld us, credentials read in %lld us",
+                   otaNvsInitMicroS, stats.lastLoadMicroS);
+    }
 }
 
-void writeValueToNvs(nvs_handle_t* nvsHandle, const char* key, const char* value) {
-    esp_err_t returnStatus = nvs_set_str(*nvsHandle, key, value);
-    if (returnStatus != ESP_OK)
+// Blobs, a missing key is no error
+static void loadOtaSettings()
+{
+    EspStorage storage;
+    uint8_t gateway;
+    size_t gatewayLen = sizeof(gateway);
+
+    if (!storage.open(OTA_SETTINGS_NVS_NAMESPACE, false))
+    {
+        return;
+    }
+
+    if (storage.getBlob(OTA_SETTINGS_GATEWAY_KEY, &gateway, &gatewayLen))
     {
-        printf("Error setting %s (%s)!\n", key, esp_err_to_name(returnStatus));
+        firmwareCacheGateway = gateway != 0;
     }
+
+    storage.close();
 }
 
-void saveSecretsToNvs(OtaSecretKeys *secretKeys, OtaSecretValues *secretValues)
+static void saveOtaSetting(const char* key, const void* value, size_t len)
 {
-    nvs_handle_t nvsHandle;
-    esp_err_t returnStatus;
+    EspStorage storage;
 
-    returnStatus = nvs_open(secretKeys->nvsNamespace, NVS_READWRITE, &nvsHandle);
-    if (returnStatus != ESP_OK)
+    if (!storage.open(OTA_SETTINGS_NVS_NAMESPACE, true))
     {
-        printf("Error (%s) opening NVS handle!\n", esp_err_to_name(returnStatus));
         return;
     }
 
-    writeValueToNvs(&nvsHandle, secretKeys->wifiSsidNvsKey, secretValues->wifiSsid);
-    writeValueToNvs(&nvsHandle, secretKeys->wifiPasswordNvsKey, secretValues->wifiPassword);
-    writeValueToNvs(&nvsHandle, secretKeys->caCertNvsKey, secretValues->caCert);
+    storage.setBlob(key, value, len);
+    storage.commit();
+    storage.close();
+}
+
+// https anywhere, plain http only to a host in OTA_SOURCE_HTTP_HOSTS
+static bool isAllowedSource(const char* url)
+{
+    if (strncmp(url, "https://", 8) == 0)
+    {
+        return url[8] != 0;
+    }
+
+    if (strncmp(url, "http://", 7) != 0)
+    {
+        return false;
+    }
+
+    const char* host = url + 7;
+    size_t hostLen = strcspn(host, ":/");
+    const char* allowed = OTA_SOURCE_HTTP_HOSTS;
+
+    while (hostLen > 0 && *allowed != 0)
+    {
+        size_t len = strcspn(allowed, ",");
+
+        if (len == hostLen && strncmp(allowed, host, len) == 0)
+        {
+            return true;
+        }
 
-    // Commit the changes to flash
-    nvs_commit(nvsHandle);
+        allowed += len + (allowed[len] == ',');
+    }
+
+    return false;
+}
+
+// Compares every byte whatever the first mismatch
+static bool isCommandToken(const char* token, size_t len)
+{
+#ifdef OTA_COMMAND_TOKEN
+    const char* expected = OTA_COMMAND_TOKEN;
+    size_t expectedLen = strlen(expected);
+    uint8_t diff = len != expectedLen;
+
+    for (size_t i = 0; i < len && expectedLen > 0; i++)
+    {
+        diff |= token[i] ^ expected[i % expectedLen];
+    }
 
-    // Close the NVS handle
-    nvs_close(nvsHandle);
+    return expectedLen > 0 && diff == 0;
+#else
+    (void)token;
+    (void)len;
+    return false;
+#endif
 }
 
 static void printSha256(const uint8_t *image_hash, const char *label)
@@ -127,17 +349,16 @@ esp_err_t httpEventHandler(esp_http_client_event_t *evt)
     switch (evt->event_id)
     {
     case HTTP_EVENT_ERROR:
-        smartLog("HTTP_EVENT_ERROR");
+        SMART_LOGW("HTTP", "HTTP_EVENT_ERROR");
         break;
     case HTTP_EVENT_ON_CONNECTED:
-        smartLog("HTTP_EVENT_ON_CONNECTED");
+        SMART_LOGD("HTTP", "HTTP_EVENT_ON_CONNECTED");
         break;
     case HTTP_EVENT_HEADER_SENT:
-        smartLog("HTTP_EVENT_HEADER_SENT");
+        SMART_LOGD("HTTP", "HTTP_EVENT_HEADER_SENT");
         break;
     case HTTP_EVENT_ON_HEADER:
-        // SMART_LOG(CONFIG_APP_LOG_TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
-        smartLog("HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+        SMART_LOGV("HTTP", "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
         break;
     case HTTP_EVENT_ON_DATA:
         loadedBytes += evt->data_len;
@@ -145,15 +366,15 @@ esp_err_t httpEventHandler(esp_http_client_event_t *evt)
         if (nowTimeMicroS - lastDataNotificationTime > 500000 || nowTimeMicroS <= lastDataNotificationTime)
         {
             lastDataNotificationTime = nowTimeMicroS;
-            smartLog("HTTP_EVENT_ON_DATA %d", loadedBytes);
+            SMART_LOGD("HTTP", "HTTP_EVENT_ON_DATA %d", loadedBytes);
             loadedBytes = 0;
         }
         break;
     case HTTP_EVENT_ON_FINISH:
-        smartLog("HTTP_EVENT_ON_FINISH");
+        SMART_LOGD("HTTP", "HTTP_EVENT_ON_FINISH");
         break;
     case HTTP_EVENT_DISCONNECTED:
-        smartLog("HTTP_EVENT_DISCONNECTED");
+        SMART_LOGD("HTTP", "HTTP_EVENT_DISCONNECTED");
         break;
         // case HTTP_EVENT_REDIRECT:
         //     ESP_LOGD(TAG, "HTTP_EVENT_REDIRECT");
@@ -162,88 +383,1735 @@ esp_err_t httpEventHandler(esp_http_client_event_t *evt)
     return ESP_OK;
 }
 
-void firmwareUpdateTask(void *parameter)
+struct OtaChunk {
+    char* data;
+    // 0 marks the end of the image, a negative value a failed download
+    int len;
+};
+
+struct OtaPipeline {
+    char* buffers;
+    size_t chunkSize;
+    bool buffersInPsram;
+    uint8_t* sectorBuffer;
+    // Written by the download task before the first chunk is queued
+    int64_t contentLength;
+    // Progress for GET /ota/status, written by the download task only
+    volatile int64_t bytesReceived;
+    volatile size_t receiveSize;
+    // "pull" for the HTTPS download, "push" for a POST /ota upload
+    const char* source;
+    int64_t startMicroS;
+    QueueHandle_t freeChunks;
+    QueueHandle_t filledChunks;
+    volatile bool failed;
+    // Of the pulled image, remembered once it is installed. Only a device
+    // that polls the origin itself keeps them, a gateway's describe its cache.
+    bool keepValidators;
+    HalHttpValidators validators;
+    OtaTaskProfile downloadProfile;
+    OtaTaskProfile flashWriteProfile;
+};
+
+OtaPipeline otaPipeline;
+
+static bool otaPipelineShouldStop()
+{
+    return otaPipeline.failed || otaStateMachine.stopRequested();
+}
+
+static bool createOtaPipeline()
+{
+    otaPipeline.failed = false;
+    otaPipeline.keepValidators = false;
+    otaPipeline.contentLength = 0;
+    otaPipeline.bytesReceived = 0;
+    otaPipeline.receiveSize = 0;
+    otaPipeline.startMicroS = esp_timer_get_time();
+
+    size_t maxChunkSize = otaReceiveSize > 0 ? otaReceiveSize : OTA_CHUNK_SIZE_MAX;
+    size_t minChunkSize = otaReceiveSize > 0 ? otaReceiveSize : OTA_CHUNK_SIZE_MIN;
+
+    // PSRAM takes the full size, internal RAM whatever fits above the reserve
+    otaPipeline.buffersInPsram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM) >= maxChunkSize * OTA_CHUNK_COUNT;
+
+    if (otaPipeline.buffersInPsram)
+    {
+        otaPipeline.chunkSize = maxChunkSize;
+        otaPipeline.buffers = (char*)heap_caps_malloc(maxChunkSize * OTA_CHUNK_COUNT, MALLOC_CAP_SPIRAM);
+    }
+    else
+    {
+        otaPipeline.chunkSize = chooseBufferSize(heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT),
+                                                 OTA_HEAP_RESERVE, minChunkSize, maxChunkSize, OTA_CHUNK_COUNT);
+        otaPipeline.buffers = otaPipeline.chunkSize > 0
+                                  ? (char*)heap_caps_malloc(otaPipeline.chunkSize * OTA_CHUNK_COUNT, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+                                  : NULL;
+    }
+
+    otaPipeline.sectorBuffer = (uint8_t*)malloc(FLASH_WRITER_SECTOR_SIZE);
+    otaPipeline.freeChunks = xQueueCreate(OTA_CHUNK_COUNT, sizeof(OtaChunk));
+    // One extra slot so the end marker never waits on the writer
+    otaPipeline.filledChunks = xQueueCreate(OTA_CHUNK_COUNT + 1, sizeof(OtaChunk));
+
+    if (otaPipeline.buffers == NULL || otaPipeline.sectorBuffer == NULL || otaPipeline.freeChunks == NULL || otaPipeline.filledChunks == NULL)
+    {
+        return false;
+    }
+
+    SMART_LOGD("OTA", "%d x %u byte chunks in %s", OTA_CHUNK_COUNT, otaPipeline.chunkSize, otaPipeline.buffersInPsram ? "PSRAM" : "internal RAM");
+
+    for (int i = 0; i < OTA_CHUNK_COUNT; i++)
+    {
+        OtaChunk chunk = {
+            .data = otaPipeline.buffers + i * otaPipeline.chunkSize,
+            .len = 0,
+        };
+        xQueueSend(otaPipeline.freeChunks, &chunk, 0);
+    }
+
+    return true;
+}
+
+static void destroyOtaPipeline()
+{
+    if (otaPipeline.freeChunks != NULL)
+    {
+        vQueueDelete(otaPipeline.freeChunks);
+        otaPipeline.freeChunks = NULL;
+    }
+
+    if (otaPipeline.filledChunks != NULL)
+    {
+        vQueueDelete(otaPipeline.filledChunks);
+        otaPipeline.filledChunks = NULL;
+    }
+
+    heap_caps_free(otaPipeline.buffers);
+    otaPipeline.buffers = NULL;
+    free(otaPipeline.sectorBuffer);
+    otaPipeline.sectorBuffer = NULL;
+}
+
+static void getRunningAppInfo(OtaAppInfo* info)
+{
+    const esp_app_desc_t* desc = esp_ota_get_app_description();
+
+    info->chipId = CONFIG_IDF_FIRMWARE_CHIP_ID;
+    info->secureVersion = desc->secure_version;
+    strlcpy(info->version, desc->version, sizeof(info->version));
+    strlcpy(info->projectName, desc->project_name, sizeof(info->projectName));
+    memcpy(info->elfSha256, desc->app_elf_sha256, sizeof(info->elfSha256));
+}
+
+// Stops the update unless the verdict lets it go on. A duplicate is
+// cancelled, an image that must not be written is aborted.
+static bool acceptOtaImage(OtaImageVerdict verdict, const OtaImageCheck* check)
+{
+    const OtaAppInfo* app = check->candidate();
+    bool allowSameBuild = otaAllowSameBuild;
+
+    otaAllowSameBuild = false;
+
+    switch (verdict)
+    {
+    case OTA_IMAGE_OK:
+        SMART_LOGI("OTA", "Image %s %s passed the pre-check", app->projectName, app->version);
+        return true;
+    case OTA_IMAGE_NEED_MORE:
+    case OTA_IMAGE_UNCHECKED:
+        SMART_LOGW("OTA", "Image pre-check %s, going ahead", otaImageVerdictName(verdict));
+        return true;
+    case OTA_IMAGE_NOT_MODIFIED:
+        SMART_LOGI("OTA", "Image not modified since the last check, nothing to do");
+        otaStateMachine.requestStop(OTA_STOP_CANCEL);
+        return false;
+    case OTA_IMAGE_SAME_BUILD:
+        if (allowSameBuild)
+        {
+            SMART_LOGI("OTA", "Reinstalling %s %s", app->projectName, app->version);
+            return true;
+        }
+
+        SMART_LOGI("OTA", "Already running %s %s, nothing to do", app->projectName, app->version);
+        otaStateMachine.requestStop(OTA_STOP_CANCEL);
+        return false;
+    default:
+        SMART_LOGE("OTA", "Image rejected before erasing: %s %s", otaImageVerdictName(verdict), check->detail());
+        otaStateMachine.requestStop(OTA_STOP_ABORT);
+        return false;
+    }
+}
+
+// Fetches the start of the image with ranged requests and judges it before
+// the first chunk reaches the flash task, which only erases once it has one
+static bool checkOtaDownload(HalHttpTransport* transport)
+{
+    OtaChunk chunk;
+    OtaAppInfo running;
+    // Its own handles, the flash task owns the shared ones
+    EspPartitions checkPartitions;
+    OtaImageCheck check(&checkPartitions, &running);
+
+    getRunningAppInfo(&running);
+    xQueueReceive(otaPipeline.freeChunks, &chunk, portMAX_DELAY);
+    OtaImageVerdict verdict = otaCheckRemoteImage(transport, otaFirmwareUrl, &check, (uint8_t*)chunk.data);
+    xQueueSend(otaPipeline.freeChunks, &chunk, 0);
+
+    bool accepted = acceptOtaImage(verdict, &check);
+
+    // The server's image is the running build, the next poll can ask for a 304
+    if (!accepted && verdict == OTA_IMAGE_SAME_BUILD && otaPipeline.keepValidators)
+    {
+        transport->responseValidators(&otaPipeline.validators);
+        otaValidatorStore.remember(otaFirmwareUrl, &otaPipeline.validators);
+    }
+
+    return accepted;
+}
+
+// Finds a store for the gateway's cache and picks up what an earlier boot
+// left in it
+static bool startFirmwareCache()
+{
+    FlashDevice* store = nullptr;
+
+    if (firmwareCache.capacity() > 0)
+    {
+        return true;
+    }
+
+    firmwareCachePartition.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, FIRMWARE_CACHE_PARTITION);
+    if (firmwareCachePartition.partition != NULL)
+    {
+        store = &firmwareCachePartition;
+    }
+    else if (firmwareCachePsram.begin(FIRMWARE_CACHE_PSRAM_SIZE))
+    {
+        store = &firmwareCachePsram;
+    }
+
+    if (store == nullptr)
+    {
+        SMART_LOGE("Cache", "No \"%s\" partition and not enough PSRAM, not serving updates", FIRMWARE_CACHE_PARTITION);
+        return false;
+    }
+
+    firmwareCache.begin(store);
+    SMART_LOGI("Cache", "Serving updates from %s (%u bytes), %s %s",
+               store == &firmwareCachePartition ? FIRMWARE_CACHE_PARTITION : "PSRAM",
+               firmwareCache.capacity(),
+               firmwareCacheStateName(firmwareCache.state()),
+               firmwareCache.etag());
+    return true;
+}
+
+// Brings the gateway's cache up to date with the origin, a ranged probe
+// when nothing changed
+static FirmwareCacheFetch refreshFirmwareCache(HalHttpTransport* origin)
+{
+    OtaChunk chunk;
+    uint8_t* sectorBuffer = (uint8_t*)malloc(FLASH_WRITER_SECTOR_SIZE);
+
+    if (sectorBuffer == NULL)
+    {
+        return FIRMWARE_CACHE_FAILED;
+    }
+
+    // They describe what the cache holds, worthless once it is empty
+    origin->setValidators(firmwareCache.state() == FIRMWARE_CACHE_READY ? otaValidatorStore.get(otaFirmwareUrl) : nullptr);
+
+    xQueueReceive(otaPipeline.freeChunks, &chunk, portMAX_DELAY);
+    FirmwareCacheFetch result = fetchFirmwareCache(&firmwareCache, origin, otaFirmwareUrl, (uint8_t*)chunk.data, otaPipeline.chunkSize,
+                                                   sectorBuffer, otaPipelineShouldStop);
+    xQueueSend(otaPipeline.freeChunks, &chunk, 0);
+    free(sectorBuffer);
+
+    SMART_LOGI("Cache", "Origin %s, cache %s %s, %u bytes", firmwareCacheFetchName(result), firmwareCacheStateName(firmwareCache.state()),
+               firmwareCache.etag(), firmwareCache.size());
+
+    HalHttpValidators validators;
+    origin->responseValidators(&validators);
+
+    // A 304 may leave them out, keep the ones that got it
+    if (result == FIRMWARE_CACHE_FETCHED || (result == FIRMWARE_CACHE_CURRENT && !otaValidatorsEmpty(&validators)))
+    {
+        otaValidatorStore.remember(otaFirmwareUrl, &validators);
+    }
+
+    return result;
+}
+
+// Sleeps off a shaping wait in short steps so a stop is not held up
+static void waitOtaShaper(int64_t waitMicroS)
+{
+    int64_t end = esp_timer_get_time() + waitMicroS;
+
+    while (!otaPipelineShouldStop())
+    {
+        int64_t left = end - esp_timer_get_time();
+        if (left <= 0)
+        {
+            break;
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(left < 100000 ? (left + 999) / 1000 : 100) + 1);
+    }
+}
+
+void firmwareDownloadTask(void *parameter)
 {
-    smartLog("Starting OTA example task");
+    OtaTaskProfile* profile = &otaPipeline.downloadProfile;
+    otaProfileStart(profile, "otaDownloadTask");
 
-    const esp_http_client_config_t config = {
-        .url = "https://zzzorgo.dev/esp32/firmware.bin",
-        .cert_pem = caCert,
-        .event_handler = httpEventHandler,
-        .keep_alive_enable = true,
+    smartLog("Attempting to download update from %s", otaFirmwareUrl);
+
+    OtaChunk chunk = {
+        .data = NULL,
+        .len = -1,
     };
 
-    smartLog("Attempting to download update");
-    smartLog("Attempting to download update from %s", config.url);
-    esp_err_t ret = esp_https_ota(&config);
-    if (ret == ESP_OK)
+    // A fixed otaReceiveSize pins the sizer to the chunk size
+    ReceiveSizerConfig sizerConfig = {
+        .minReadSize = otaReceiveSize > 0 ? otaPipeline.chunkSize : OTA_CHUNK_SIZE_MIN,
+        .maxReadSize = otaPipeline.chunkSize,
+        .initialReadSize = OTA_CHUNK_SIZE,
+        .lowHeapBytes = OTA_HEAP_LOW,
+        .windowMicroS = OTA_RECEIVE_WINDOW_US,
+    };
+    ReceiveSizer sizer(&sizerConfig);
+
+    // Borrowed for every connection of this update
+    EspHttpTransport origin(secretCache.acquire(SECRET_CA_CERT), httpEventHandler, otaHttpBufferSize);
+    FirmwareCacheTransport cached(&firmwareCache);
+    HalHttpTransport* transport = &origin;
+
+    // A gateway pulls the origin into its cache once and installs from
+    // there, or from the origin with a plain request when that failed
+    if (firmwareCacheGateway && firmwareCache.capacity() > 0)
     {
-        smartLog("OTA Succeed, Rebooting...");
-        delay(2000);
-        destroySmartLog();
-        delay(2000);
-        esp_restart();
+        transport = firmwareCacheSource(&firmwareCache, refreshFirmwareCache(&origin), &origin, &cached);
     }
     else
     {
-        smartLog("Firmware upgrade failed");
+        // A forced update must not be answered 304
+        otaPipeline.keepValidators = true;
+        origin.setValidators(otaAllowSameBuild ? nullptr : otaValidatorStore.get(otaFirmwareUrl));
+    }
+
+    esp_err_t ret = checkOtaDownload(transport) ? ESP_OK : ESP_ERR_INVALID_VERSION;
+
+    if (ret == ESP_OK)
+    {
+        ret = transport->open(otaFirmwareUrl) ? ESP_OK : ESP_FAIL;
+    }
+
+    if (ret == ESP_OK && otaShaper.getConfig()->shapeClass == OTA_SHAPE_BACKGROUND)
+    {
+        // Below every application task, only the shaper's waits give way to them
+        vTaskPrioritySet(NULL, tskIDLE_PRIORITY + 1);
+    }
+
+    otaShaper.begin();
+
+    if (ret == ESP_OK)
+    {
+        otaPipeline.contentLength = transport->contentLength();
+        transport->responseValidators(&otaPipeline.validators);
+        int status = transport->statusCode();
+
+        if (status != 200)
+        {
+            SMART_LOGE("OTA", "Unexpected HTTP status %d", status);
+            ret = ESP_FAIL;
+        }
+    }
+
+    while (ret == ESP_OK && !otaPipelineShouldStop())
+    {
+        otaProfileWaitBegin(profile);
+        xQueueReceive(otaPipeline.freeChunks, &chunk, portMAX_DELAY);
+        otaProfileWaitEnd(profile);
+
+        chunk.len = transport->read((uint8_t*)chunk.data, otaShaper.limitRead(sizer.readSize()));
+
+        if (chunk.len < 0)
+        {
+            ret = ESP_FAIL;
+        }
+        else if (chunk.len == 0)
+        {
+            ret = transport->isComplete() ? ESP_OK : ESP_FAIL;
+            xQueueSend(otaPipeline.freeChunks, &chunk, 0);
+            break;
+        }
+        else
+        {
+            sizer.record(chunk.len, esp_timer_get_time(), heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+            otaPipeline.bytesReceived += chunk.len;
+            otaPipeline.receiveSize = sizer.readSize();
+            otaBytesReceived += chunk.len;
+            int64_t waitMicroS = otaShaper.consume(chunk.len);
+            xQueueSend(otaPipeline.filledChunks, &chunk, portMAX_DELAY);
+
+            if (waitMicroS > 0)
+            {
+                otaProfileWaitBegin(profile);
+                waitOtaShaper(waitMicroS);
+                otaProfileWaitEnd(profile);
+            }
+        }
+    }
+
+    if (ret != ESP_OK)
+    {
+        SMART_LOGE("OTA", "Download failed (%s)", esp_err_to_name(ret));
     }
 
-    while (1)
+    SMART_LOGD("OTA", "Read size %u after %u changes, last window %u B/s", sizer.readSize(), sizer.adjustments(), sizer.lastThroughput());
+
+    OtaShaperStats shaping;
+    otaShaper.stats(&shaping);
+    if (shaping.waits > 0)
     {
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+        SMART_LOGD("OTA", "Shaped: %u waits (%u yielding to the app), %lld ms waited", shaping.waits, shaping.yields, shaping.waitMicroS / 1000);
     }
+
+    transport->close();
+    origin.close();
+    secretCache.release(SECRET_CA_CERT);
+
+    otaProfileStop(profile);
+    otaProfileReport(profile);
+
+    OtaChunk endMarker = {
+        .data = NULL,
+        .len = ret == ESP_OK && !otaPipelineShouldStop() ? 0 : -1,
+    };
+    xQueueSend(otaPipeline.filledChunks, &endMarker, portMAX_DELAY);
+
+    otaTaskRecordStack();
+    vTaskDelete(NULL);
 }
 
-void firmwareUpdate()
+// A cancel is the operator's choice, not a failure
+static void countOtaOutcome()
 {
-    xTaskCreate(
-        firmwareUpdateTask,
-        "firmwareUpdateTask",
-        8192,
-        NULL,
-        tskIDLE_PRIORITY,
-        NULL /* Task handle. */
-    );
+    OtaState state = otaStateMachine.state();
+
+    if (state == OTA_STATE_SUCCEEDED)
+    {
+        otaUpdatesSucceeded++;
+    }
+    else if (state != OTA_STATE_CANCELLED)
+    {
+        otaUpdatesFailed++;
+    }
 }
 
-void setupOta(OtaSecretKeys *secretKeys, OtaSecretValues *secretValues)
+// Local time of day, -1 until something (SNTP) set the wall clock
+static int32_t localSecondsOfDay()
 {
-    smartLog("Setting up OTA");
-    esp_err_t err = nvs_flash_init();
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    time_t now = time(NULL);
+    struct tm local;
+
+    if (now < 1600000000 || localtime_r(&now, &local) == NULL)
     {
-        // 1.OTA app partition table has a smaller NVS partition size than the non-OTA
-        // partition table. This size mismatch may cause NVS initialization to fail.
-        // 2.NVS partition contains data in new format and cannot be recognized by this version of code.
-        // If this happens, we erase NVS partition and initialize NVS again.
-        ESP_ERROR_CHECK(nvs_flash_erase());
-        err = nvs_flash_init();
+        return -1;
     }
 
-    ESP_ERROR_CHECK(err);
+    return local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+}
 
-    getPartitionsSha256();
+// The boot partition stays on the running app until otaActivation is due.
+// A data image waits for the new app to pass its rollback gate, without an
+// app it is copied right before the restart.
+static void stageOtaUpdate(FlashDevice* app, bool hasData)
+{
+    const OtaActivationConfig* config = otaActivation.getConfig();
 
-    ESP_ERROR_CHECK(esp_netif_init());
+    otaStagedApp = app;
+    otaDataStaged = app == nullptr && hasData;
+    otaActivation.stage();
 
-    if (secretValues != nullptr)
+    if (app != nullptr && hasData)
     {
-        saveSecretsToNvs(secretKeys, secretValues);
+        SMART_LOGI("OTA", "Data image follows once %s passed the rollback gate", partitions.label(app));
     }
 
-    loadSecretsFromNvs(secretKeys);
+    if (config->mode == OTA_ACTIVATE_NOW)
+    {
+        return;
+    }
+
+    SMART_LOGI("OTA", "Staged %s, activation by %s", app != nullptr ? partitions.label(app) : "data image", otaActivationModeName(config->mode));
+
+    if (config->mode == OTA_ACTIVATE_WINDOW && localSecondsOfDay() < 0)
+    {
+        SMART_LOGW("OTA", "Wall clock not set, the window opens once it is; \"activate\" applies now");
+    }
+}
+
+void firmwareFlashWriteTask(void *parameter)
+{
+    OtaTaskProfile* profile = &otaPipeline.flashWriteProfile;
+    otaProfileStart(profile, "otaFlashTask");
+
+    PartitionBundleSink sink(&partitions, otaPipeline.sectorBuffer, otaEraseStrategy);
+    OtaBundleReader reader(&sink);
+    esp_err_t ret = ESP_OK;
+
+    OtaChunk chunk;
+
+    // Keep draining after a failure so the download task never blocks forever
+    while (true)
+    {
+        if (xQueueReceive(otaPipeline.filledChunks, &chunk, 0) != pdTRUE)
+        {
+            // The network is the bottleneck right now, spend the gap erasing
+            sink.idle();
 
-    WiFi.begin(username, password);
+            otaProfileWaitBegin(profile);
+            xQueueReceive(otaPipeline.filledChunks, &chunk, portMAX_DELAY);
+            otaProfileWaitEnd(profile);
+        }
+
+        if (chunk.len <= 0)
+        {
+            break;
+        }
+
+        if (otaPipeline.contentLength > 0)
+        {
+            sink.setContentLength(otaPipeline.contentLength);
+        }
+
+        if (ret == ESP_OK && !reader.feed((const uint8_t*)chunk.data, chunk.len))
+        {
+            SMART_LOGE("OTA", "%s", reader.error());
+            ret = ESP_ERR_INVALID_RESPONSE;
+            otaPipeline.failed = true;
+        }
+
+        xQueueSend(otaPipeline.freeChunks, &chunk, 0);
+    }
 
-    while (WiFi.status() != WL_CONNECTED)
+    if (chunk.len < 0 && ret == ESP_OK)
     {
-        delay(500);
-        smartLog("[Wifi] Connecting...");
+        ret = ESP_FAIL;
     }
 
-    smartLog("[Wifi] Connected! %s", WiFi.localIP().toString().c_str());
+    int64_t transferMicroS = esp_timer_get_time() - otaPipeline.startMicroS;
+    if (ret == ESP_OK && transferMicroS > 0)
+    {
+        otaLastSource = otaPipeline.source;
+        otaLastThroughput = otaPipeline.bytesReceived * 1000000 / transferMicroS;
+        SMART_LOGI("OTA", "%s: %lld bytes in %lld ms, %u B/s", otaLastSource, otaPipeline.bytesReceived, transferMicroS / 1000, otaLastThroughput);
+        wifiManager.recordThroughput(otaLastThroughput);
+    }
+
+    if (ret == ESP_OK && !reader.finish())
+    {
+        SMART_LOGE("OTA", "%s", reader.error());
+        ret = ESP_ERR_INVALID_RESPONSE;
+    }
+
+    if (ret == ESP_OK)
+    {
+        ret = sink.commit(false) ? ESP_OK : ESP_FAIL;
+    }
+    else
+    {
+        sink.abort();
+    }
+
+    if (ret == ESP_OK && reader.isBundle())
+    {
+        SMART_LOGI("OTA", "Bundle with %d images verified", reader.entryCount());
+    }
+
+    otaProfileStop(profile);
+    otaProfileReport(profile);
+    otaProfileStop(getSmartLogProfile());
+    otaProfileReport(getSmartLogProfile());
+
+    // The download task sent the end marker as its last queue operation
+    destroyOtaPipeline();
+
+    otaStateMachine.finish(ret == ESP_OK);
+    countOtaOutcome();
+    crashLogTrace(CRASH_TRACE_UPDATE_END, otaPipeline.bytesReceived, ret);
+    SMART_LOGI("OTA", "%s (%s)", otaStateName(otaStateMachine.state()), esp_err_to_name(ret));
+
+    if (ret == ESP_OK && otaPipeline.keepValidators)
+    {
+        otaValidatorStore.remember(otaFirmwareUrl, &otaPipeline.validators);
+    }
+
+    if (ret == ESP_OK)
+    {
+        OtaPendingData pending;
+        bool hasData = sink.pendingData(&pending);
+
+        if (hasData)
+        {
+            otaPendingData.save(&pending);
+        }
+
+        stageOtaUpdate(sink.stagedApp(), hasData);
+    }
+
+    otaTaskRecordStack();
+    vTaskDelete(NULL);
+}
+
+// Claims the update, builds the pipeline and starts the flash write task.
+// The caller then feeds filledChunks and ends with an end marker.
+static bool startOtaPipeline(const char* source)
+{
+    // The inactive slot holds the image a failed gate rolls back to
+    if (rollbackGate.state() == ROLLBACK_GATE_CHECKING)
+    {
+        SMART_LOGW("OTA", "Running image not verified yet, ignoring trigger");
+        return false;
+    }
+
+    if (otaActivation.state() >= OTA_ACTIVATION_PREPARING)
+    {
+        SMART_LOGW("OTA", "Rebooting into the staged update, ignoring trigger");
+        return false;
+    }
+
+    if (!otaStateMachine.tryStart())
+    {
+        SMART_LOGW("OTA", "Update already %s, ignoring trigger", otaStateName(otaStateMachine.state()));
+        return false;
+    }
+
+    // The new update overwrites the inactive slot and the staging partition
+    otaActivation.clear();
+    otaStagedApp = nullptr;
+    otaDataStaged = false;
+    otaPendingData.clear();
+
+    smartLog("Starting OTA task (%s)", source);
+    otaUpdatesStarted++;
+    crashLogTrace(CRASH_TRACE_UPDATE_START, strcmp(source, "push") == 0, 0);
+
+    if (!createOtaPipeline())
+    {
+        SMART_LOGE("OTA", "Not enough memory for the update pipeline");
+        destroyOtaPipeline();
+        otaStateMachine.finish(false);
+        countOtaOutcome();
+        return false;
+    }
+
+    otaPipeline.source = source;
+    otaProfileStart(getSmartLogProfile(), "smartLogTask");
+
+    if (createOtaTask(firmwareFlashWriteTask, "otaFlashTask", &otaTaskConfig.flashWrite, NULL, NULL) != pdPASS)
+    {
+        SMART_LOGE("OTA", "Unable to create flash write task");
+        destroyOtaPipeline();
+        otaStateMachine.finish(false);
+        countOtaOutcome();
+        return false;
+    }
+
+    return true;
+}
+
+// The writer owns the pipeline, it unwinds once it sees the end marker
+static void endOtaPipeline(bool succeeded)
+{
+    if (!succeeded)
+    {
+        otaPipeline.failed = true;
+    }
+
+    OtaChunk endMarker = {
+        .data = NULL,
+        .len = succeeded ? 0 : -1,
+    };
+    xQueueSend(otaPipeline.filledChunks, &endMarker, portMAX_DELAY);
+}
+
+bool firmwareUpdate()
+{
+    if (!startOtaPipeline("pull"))
+    {
+        return false;
+    }
+
+    if (createOtaTask(firmwareDownloadTask, "otaDownloadTask", &otaTaskConfig.download, NULL, NULL) != pdPASS)
+    {
+        SMART_LOGE("OTA", "Unable to create download task");
+        endOtaPipeline(false);
+    }
+
+    return true;
+}
+
+struct OtaUpload {
+    // Chunk being filled, data is NULL when none is held
+    OtaChunk chunk;
+    size_t total;
+    size_t received;
+    bool hasHash;
+    uint8_t expectedSha256[OTA_SHA256_LEN];
+    OtaSha256Context hash;
+    // False once the pipeline got its end marker
+    bool open;
+    // The first chunk went through the image pre-check
+    bool checked;
+};
+
+OtaUpload otaUpload;
+
+// Runs on the async_tcp task: POST /ota with a body. The body is copied into
+// the same chunks the download task fills, so flash writes stay on the
+// writer task and the web server only ever waits for a free chunk.
+static bool beginFirmwareUpload(size_t total, const char* sha256Hex)
+{
+    otaUpload.open = false;
+
+    if (sha256Hex != nullptr && !otaSha256FromHex(sha256Hex, otaUpload.expectedSha256))
+    {
+        SMART_LOGE("OTA", "Malformed SHA-256 header");
+        return false;
+    }
+
+    if (!startOtaPipeline("push"))
+    {
+        return false;
+    }
+
+    otaUpload.chunk.data = NULL;
+    otaUpload.chunk.len = 0;
+    otaUpload.total = total;
+    otaUpload.received = 0;
+    otaUpload.hasHash = sha256Hex != nullptr;
+    otaUpload.open = true;
+    otaUpload.checked = false;
+    otaPipeline.contentLength = total;
+    otaSha256Start(&otaUpload.hash);
+    return true;
+}
+
+// A push has no ranged request, its first chunk is judged before it can
+// reach the flash task
+static bool checkFirmwareUpload()
+{
+    if (otaUpload.checked)
+    {
+        return true;
+    }
+
+    OtaAppInfo running;
+    EspPartitions checkPartitions;
+    OtaImageCheck check(&checkPartitions, &running);
+
+    otaUpload.checked = true;
+    getRunningAppInfo(&running);
+    return acceptOtaImage(check.checkStream((const uint8_t*)otaUpload.chunk.data, otaUpload.chunk.len), &check);
+}
+
+// Returns whether the pipeline was told the upload succeeded
+static bool closeFirmwareUpload(bool succeeded)
+{
+    if (!otaUpload.open)
+    {
+        return false;
+    }
+
+    otaUpload.open = false;
+
+    if (otaUpload.chunk.data != NULL)
+    {
+        if (succeeded && otaUpload.chunk.len > 0 && !checkFirmwareUpload())
+        {
+            succeeded = false;
+        }
+
+        if (succeeded && otaUpload.chunk.len > 0)
+        {
+            xQueueSend(otaPipeline.filledChunks, &otaUpload.chunk, portMAX_DELAY);
+        }
+        else
+        {
+            xQueueSend(otaPipeline.freeChunks, &otaUpload.chunk, 0);
+        }
+        otaUpload.chunk.data = NULL;
+    }
+
+    succeeded = succeeded && !otaPipelineShouldStop();
+    endOtaPipeline(succeeded);
+    return succeeded;
+}
+
+static bool writeFirmwareUpload(const uint8_t* data, size_t len)
+{
+    if (!otaUpload.open)
+    {
+        return false;
+    }
+
+    if (otaPipelineShouldStop())
+    {
+        closeFirmwareUpload(false);
+        return false;
+    }
+
+    otaSha256Update(&otaUpload.hash, data, len);
+    otaUpload.received += len;
+    otaPipeline.bytesReceived += len;
+    otaBytesReceived += len;
+
+    while (len > 0)
+    {
+        if (otaUpload.chunk.data == NULL)
+        {
+            if (xQueueReceive(otaPipeline.freeChunks, &otaUpload.chunk, OTA_UPLOAD_WAIT_MS / portTICK_PERIOD_MS) != pdTRUE)
+            {
+                SMART_LOGE("OTA", "Flash writer fell behind the upload");
+                closeFirmwareUpload(false);
+                return false;
+            }
+            otaUpload.chunk.len = 0;
+        }
+
+        size_t space = otaPipeline.chunkSize - otaUpload.chunk.len;
+        size_t copied = len < space ? len : space;
+        memcpy(otaUpload.chunk.data + otaUpload.chunk.len, data, copied);
+        otaUpload.chunk.len += copied;
+        data += copied;
+        len -= copied;
+
+        if ((size_t)otaUpload.chunk.len == otaPipeline.chunkSize)
+        {
+            if (!checkFirmwareUpload())
+            {
+                closeFirmwareUpload(false);
+                return false;
+            }
+
+            xQueueSend(otaPipeline.filledChunks, &otaUpload.chunk, portMAX_DELAY);
+            otaUpload.chunk.data = NULL;
+        }
+    }
+
+    if (otaUpload.received < otaUpload.total)
+    {
+        return true;
+    }
+
+    bool matches = true;
+    if (otaUpload.hasHash)
+    {
+        uint8_t sha256[OTA_SHA256_LEN];
+        otaSha256Finish(&otaUpload.hash, sha256);
+        matches = memcmp(sha256, otaUpload.expectedSha256, OTA_SHA256_LEN) == 0;
+
+        if (!matches)
+        {
+            printSha256(sha256, "[OTA] Upload SHA-256 mismatch, got");
+        }
+    }
+
+    return closeFirmwareUpload(matches);
+}
+
+// The client went away before the last byte
+static void abortFirmwareUpload()
+{
+    if (otaUpload.open)
+    {
+        SMART_LOGW("OTA", "Upload interrupted after %u of %u bytes", otaUpload.received, otaUpload.total);
+        closeFirmwareUpload(false);
+    }
+}
+
+static void getOtaStatus(OtaStatusSnapshot* status)
+{
+    bool active = otaStateMachine.isActive();
+
+    status->state = otaStateName(otaStateMachine.state());
+    status->stopReason = otaStopReasonName(otaStateMachine.stopReason());
+    status->rollbackGate = rollbackGateStateName(rollbackGate.state());
+    status->activation = otaActivationStateName(otaActivation.state());
+    status->eraseStrategy = flashEraseStrategyName(otaEraseStrategy);
+    status->bytesReceived = active ? otaPipeline.bytesReceived : 0;
+    status->contentLength = active && otaPipeline.contentLength > 0 ? otaPipeline.contentLength : -1;
+    status->receiveSize = active ? otaPipeline.receiveSize : otaReceiveSize;
+    status->source = active ? otaPipeline.source : otaLastSource;
+    status->lastThroughput = otaLastThroughput;
+    status->uptimeMicroS = esp_timer_get_time();
+}
+
+static void getHeapMetrics(OtaHeapMetrics* heap, uint32_t caps)
+{
+    heap->totalBytes = heap_caps_get_total_size(caps);
+    heap->freeBytes = heap_caps_get_free_size(caps);
+    heap->minFreeBytes = heap_caps_get_minimum_free_size(caps);
+}
+
+// Runs on the async_tcp task once per scrape, reads counters only
+static void getOtaMetrics(OtaMetricsSnapshot* metrics)
+{
+    metrics->state = otaStateMachine.state();
+    metrics->updatesStarted = otaUpdatesStarted;
+    metrics->updatesSucceeded = otaUpdatesSucceeded;
+    metrics->updatesFailed = otaUpdatesFailed;
+    metrics->bytesReceived = otaBytesReceived;
+    metrics->lastThroughput = otaLastThroughput;
+    getHeapMetrics(&metrics->internalHeap, MALLOC_CAP_INTERNAL);
+    getHeapMetrics(&metrics->psramHeap, MALLOC_CAP_SPIRAM);
+    metrics->taskCount = otaTaskStacks(metrics->tasks, OTA_METRICS_MAX_TASKS);
+    const WifiManagerStats* wifi = wifiManager.stats();
+    metrics->wifiConnected = wifiManager.isConnected();
+    metrics->wifiRssi = metrics->wifiConnected ? WiFi.RSSI() : 0;
+    metrics->wifiReconnects = wifi->reconnects;
+    metrics->wifiFastConnects = wifi->fastConnects;
+    metrics->wifiScanConnects = wifi->scanConnects;
+    metrics->wifiFastFallbacks = wifi->fastFallbacks;
+    metrics->wifiFailures = wifi->failures;
+    metrics->wifiLastConnectMicroS = wifi->lastConnectMicroS;
+    IdleStats idle;
+    idleScheduler.stats(&idle);
+    memcpy(metrics->powerLevelMicroS, idle.levelMicroS, sizeof(metrics->powerLevelMicroS));
+    metrics->averageMicroAmps = idle.averageMicroAmps;
+    metrics->idleWakes = idle.wakes;
+    metrics->idleFailedWakes = idle.failedWakes;
+    metrics->idleLastWakeMicroS = idle.lastWakeMicroS;
+    metrics->idleMaxWakeMicroS = idle.maxWakeMicroS;
+    metrics->logDropped = getSmartLogDropped();
+    metrics->uptimeMicroS = esp_timer_get_time();
+    ScrubTargetStatus scrub;
+    metrics->scrubTargetCount = 0;
+    while (metrics->scrubTargetCount < OTA_METRICS_MAX_SCRUB_TARGETS && partitionScrubber.status(metrics->scrubTargetCount, &scrub))
+    {
+        metrics->scrubTargets[metrics->scrubTargetCount++] = {scrub.label, scrubResultName(scrub.result), scrub.passes, scrub.bytesChecked, scrub.imageBytes};
+    }
+    PartitionScrubberStats scrubStats;
+    partitionScrubber.stats(&scrubStats);
+    metrics->scrubCorrupt = scrubStats.corruptFound;
+    metrics->scrubBytes = scrubStats.bytesHashed;
+    metrics->scrubLongestStepMicroS = scrubStats.longestStepMicroS;
+}
+
+const ServerApi otaServerApi = {
+    .startUpdate = firmwareUpdate,
+    .getStatus = getOtaStatus,
+    .getMetrics = getOtaMetrics,
+    .beginUpload = beginFirmwareUpload,
+    .writeUpload = writeFirmwareUpload,
+    .abortUpload = abortFirmwareUpload,
+    .firmwareCache = &firmwareCache,
+};
+
+static bool wifiHealthCheck(void* context)
+{
+    return wifiManager.isConnected();
+}
+
+// Restarts as soon as the clients have everything instead of after a
+// fixed delay: the log and a final status frame flushed and acked, then the
+// /ws clients closed with a restart code. Bounded, a client that stops
+// acking only costs OTA_SHUTDOWN_TIMEOUT_MS.
+static void restartIntoUpdate()
+{
+    int64_t start = esp_timer_get_time();
+    int64_t deadline = start + OTA_SHUTDOWN_TIMEOUT_MS * 1000LL;
+    OtaStatusSnapshot status;
+    // One pooled frame
+    char finalFrame[MESSAGE_POOL_SLAB_SIZE];
+
+    smartLog("OTA Succeed, Rebooting...");
+    getOtaStatus(&status);
+    status.activation = "rebooting";
+
+    bool drained = flushSmartLog(renderOtaStatus(&status, finalFrame, sizeof(finalFrame)) > 0 ? finalFrame : "{\"activation\":\"rebooting\"}", deadline);
+    closeServer(OTA_WS_CLOSE_RESTART);
+
+    while (!serverDrained() && esp_timer_get_time() < deadline)
+    {
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+
+    drained = drained && serverDrained();
+    uint32_t shutdownMs = (esp_timer_get_time() - start) / 1000;
+    // Only the serial port and the crash log are left
+    printf("Restarting after %u ms shutdown%s, %u bytes of %s stack left\n",
+           shutdownMs,
+           drained ? "" : " (timed out)",
+           (unsigned)uxTaskGetStackHighWaterMark(NULL),
+           pcTaskGetName(NULL));
+    crashLogTrace(CRASH_TRACE_RESTART, otaStateMachine.state(), shutdownMs);
+    esp_restart();
+}
+
+// Copies the pending data image, it is dropped whether that worked or not
+static void applyOtaPendingData()
+{
+    OtaPendingData pending;
+    uint8_t* sectorBuffer = (uint8_t*)malloc(FLASH_WRITER_SECTOR_SIZE);
+
+    otaDataStaged = false;
+
+    if (sectorBuffer != NULL && otaPendingData.load(&pending) && applyPendingData(&partitions, &pending, sectorBuffer))
+    {
+        SMART_LOGI("OTA", "%s replaced", pending.label);
+    }
+
+    free(sectorBuffer);
+    otaPendingData.clear();
+}
+
+// A data image of the bundle the running app came with is staged like a
+// data-only update now that the app is validated. After a rollback it
+// belongs to the app that did not stay and is dropped.
+static void stagePendingData()
+{
+    OtaPendingData pending;
+
+    if (!otaPendingData.load(&pending))
+    {
+        return;
+    }
+
+    if (strcmp(pending.appLabel, partitions.runningLabel()) != 0)
+    {
+        SMART_LOGW("OTA", "%s image was for %s, which did not stay, dropping it", pending.label, pending.appLabel);
+        otaPendingData.clear();
+        return;
+    }
+
+    stageOtaUpdate(nullptr, true);
+}
+
+static void pollOtaActivation()
+{
+    if (otaActivation.poll(localSecondsOfDay()) != OTA_ACTIVATION_READY)
+    {
+        return;
+    }
+
+    if (otaActivation.skippedHook() != nullptr)
+    {
+        SMART_LOGW("OTA", "Pre-reboot hook %s not ready in time, rebooting anyway", otaActivation.skippedHook());
+    }
+
+    // Staged for a window or a command, it may have sat in flash for hours
+    ScrubTargetStatus scrub;
+    if (otaStagedApp != nullptr && partitionScrubber.status(scrubAppTarget, &scrub) && scrub.result == SCRUB_CORRUPT)
+    {
+        SMART_LOGE("OTA", "Staged update in %s went corrupt, not booting it", scrub.label);
+        otaActivation.clear();
+        otaStagedApp = nullptr;
+        return;
+    }
+
+    if (otaStagedApp != nullptr && !partitions.setBootPartition(otaStagedApp))
+    {
+        otaActivation.clear();
+        otaStagedApp = nullptr;
+        return;
+    }
+
+    // After the pre-reboot hooks, the application let go of its filesystem
+    if (otaDataStaged)
+    {
+        applyOtaPendingData();
+    }
+
+    restartIntoUpdate();
+}
+
+// Keeps the station connected after setupOta returns, runs the idle
+// schedule and applies a staged update when it is due. A radio-off idle
+// light sleeps inside idleScheduler.poll().
+void wifiManagerTask(void *parameter)
+{
+    while (true)
+    {
+        wifiManager.poll();
+
+        idleScheduler.setBusy(otaStateMachine.isActive() || rollbackGate.state() == ROLLBACK_GATE_CHECKING);
+        if (idleScheduler.poll() == IDLE_ACTION_CHECK)
+        {
+            SMART_LOGI("Idle", "Scheduled update check");
+            firmwareUpdate();
+        }
+
+        pollOtaActivation();
+
+        vTaskDelay(WIFI_POLL_MS / portTICK_PERIOD_MS);
+    }
+}
+
+// An update or a cache fill is rewriting what the scrubber reads
+static bool scrubTargetsBusy()
+{
+    return otaStateMachine.isActive() || firmwareCache.state() == FIRMWARE_CACHE_FILLING;
+}
+
+// The cache is checked against the SHA-256 in its header, from the first
+// time the gateway has one and again whenever it holds another image
+static void syncScrubCache()
+{
+    uint8_t sha256[OTA_SHA256_LEN];
+
+    if (firmwareCache.capacity() == 0)
+    {
+        return;
+    }
+
+    if (scrubCacheTarget < 0)
+    {
+        bool partition = firmwareCachePartition.partition != NULL;
+        scrubCacheTarget = partitionScrubber.addTarget(partition ? FIRMWARE_CACHE_PARTITION : "psram",
+                                                       partition ? (FlashDevice*)&firmwareCachePartition : &firmwareCachePsram,
+                                                       SCRUB_DIGEST);
+    }
+
+    if (strcmp(scrubCacheEtag, firmwareCache.etag()) == 0)
+    {
+        return;
+    }
+
+    if (firmwareCache.sha256(sha256))
+    {
+        partitionScrubber.setExpected(scrubCacheTarget, firmwareCache.size(), sha256);
+    }
+    else
+    {
+        partitionScrubber.invalidate(scrubCacheTarget);
+    }
+
+    strlcpy(scrubCacheEtag, firmwareCache.etag(), sizeof(scrubCacheEtag));
+}
+
+// Each finished pass once, an intact one with its digest like the boot log's
+static void logScrubPasses(uint32_t* reported)
+{
+    ScrubTargetStatus status;
+
+    for (int i = 0; partitionScrubber.status(i, &status); i++)
+    {
+        if (status.passes == reported[i])
+        {
+            continue;
+        }
+
+        reported[i] = status.passes;
+
+        if (status.result == SCRUB_INTACT)
+        {
+            char label[48];
+            snprintf(label, sizeof(label), "SHA-256 for %s:", status.label);
+            printSha256(status.sha256, label);
+        }
+        else if (status.result == SCRUB_CORRUPT)
+        {
+            SMART_LOGE("Scrub", "%s does not match its SHA-256 over %u bytes", status.label, status.imageBytes);
+        }
+        else
+        {
+            SMART_LOGW("Scrub", "%s: %s", status.label, scrubResultName(status.result));
+        }
+    }
+}
+
+// Below every application task, so it only gets the CPU the rest leaves.
+// Steps while no update or cache fill rewrites the targets and checks the
+// app slot again after one did.
+static void partitionScrubTask(void *parameter)
+{
+    uint32_t reported[PARTITION_SCRUBBER_MAX_TARGETS] = {0};
+    bool wasBusy = false;
+
+    while (true)
+    {
+        if (scrubTargetsBusy())
+        {
+            wasBusy = true;
+            vTaskDelay(pdMS_TO_TICKS(OTA_SCRUB_POLL_MS));
+            continue;
+        }
+
+        if (wasBusy)
+        {
+            partitionScrubber.invalidate(scrubAppTarget);
+            wasBusy = false;
+        }
+
+        syncScrubCache();
+        int64_t waitMs = partitionScrubber.step() / 1000;
+        logScrubPasses(reported);
+
+        vTaskDelay(pdMS_TO_TICKS(waitMs < OTA_SCRUB_POLL_MS ? waitMs : OTA_SCRUB_POLL_MS) + 1);
+    }
+}
+
+static void startPartitionScrubber()
+{
+    scrubAppFlash.partition = esp_ota_get_next_update_partition(NULL);
+    if (scrubAppFlash.partition != NULL)
+    {
+        scrubAppTarget = partitionScrubber.addTarget(scrubAppFlash.partition->label, &scrubAppFlash, SCRUB_APP_IMAGE);
+    }
+
+    xTaskCreate(partitionScrubTask, "scrubTask", 3072, NULL, tskIDLE_PRIORITY + 1, NULL);
+}
+
+static bool serverHealthCheck(void* context)
+{
+    if (WiFi.status() != WL_CONNECTED)
+    {
+        return false;
+    }
+
+    esp_http_client_config_t config = {
+        .url = otaFirmwareUrl,
+        .cert_pem = secretCache.acquire(SECRET_CA_CERT),
+        .method = HTTP_METHOD_HEAD,
+        .timeout_ms = 2000,
+    };
+
+    esp_http_client_handle_t client = esp_http_client_init(&config);
+    if (client == NULL)
+    {
+        secretCache.release(SECRET_CA_CERT);
+        return false;
+    }
+
+    esp_err_t err = esp_http_client_perform(client);
+    int status = esp_http_client_get_status_code(client);
+    esp_http_client_cleanup(client);
+    secretCache.release(SECRET_CA_CERT);
+
+    return err == ESP_OK && status == 200;
+}
+
+bool addOtaHealthCheck(const char* name, bool (*check)(void* context), void* context)
+{
+    return rollbackGate.addCheck(name, check, context);
+}
+
+void setOtaHealthCheckDeadline(uint32_t deadlineMs)
+{
+    rollbackGate.setDeadline(deadlineMs * 1000LL);
+}
+
+void setOtaActivation(OtaActivationMode mode, uint32_t windowStartS, uint32_t windowLengthS)
+{
+    OtaActivationConfig config = *otaActivation.getConfig();
+    config.mode = mode;
+    if (windowLengthS > 0)
+    {
+        config.windowStartS = windowStartS;
+        config.windowLengthS = windowLengthS;
+    }
+    otaActivation.setConfig(&config);
+}
+
+bool addOtaPreRebootHook(const char* name, bool (*hook)(void* context), void* context)
+{
+    return otaActivation.addHook(name, hook, context);
+}
+
+bool activateOtaUpdate()
+{
+    return otaActivation.request();
+}
+
+void healthCheckTask(void *parameter)
+{
+    while (rollbackGate.poll() == ROLLBACK_GATE_CHECKING)
+    {
+        vTaskDelay(HEALTH_CHECK_POLL_MS / portTICK_PERIOD_MS);
+    }
+
+    if (rollbackGate.state() == ROLLBACK_GATE_VALIDATED)
+    {
+        SMART_LOGI("Rollback", "Image validated %lld ms after boot", rollbackGate.validatedAtMicroS() / 1000);
+        stagePendingData();
+    }
+
+    otaTaskRecordStack();
+    vTaskDelete(NULL);
+}
+
+void firmwareUpdateStop(OtaStopReason reason)
+{
+    if (!otaStateMachine.requestStop(reason))
+    {
+        SMART_LOGW("OTA", "Nothing to stop, update is %s", otaStateName(otaStateMachine.state()));
+        return;
+    }
+
+    SMART_LOGI("OTA", "Stopping update (%s)", otaStopReasonName(reason));
+}
+
+static void logOtaActivation()
+{
+    const OtaActivationConfig* config = otaActivation.getConfig();
+    SMART_LOGI("OTA", "Activation %s, window %02u:%02u for %u min, %s",
+               otaActivationModeName(config->mode),
+               config->windowStartS / 3600,
+               config->windowStartS / 60 % 60,
+               config->windowLengthS / 60,
+               otaActivationStateName(otaActivation.state()));
+}
+
+static void logOtaShaping()
+{
+    const OtaShaperConfig* config = otaShaper.getConfig();
+    SMART_LOGI("Shape", "%s, %u B/s, yield %s at %u B/s, app %s",
+               otaShapeClassName(config->shapeClass),
+               config->rateBytesPerS,
+               config->yieldToApp ? "on" : "off",
+               config->yieldRateBytesPerS,
+               otaShaper.appBusy() ? "busy" : "quiet");
+}
+
+// A whole decimal number in [min, max], nothing else
+static bool parseCommandSize(const char* text, long min, long max, long* output)
+{
+    char* end;
+    long value = strtol(text, &end, 10);
+
+    if (end == text || *end != 0 || value < min || value > max)
+    {
+        return false;
+    }
+
+    *output = value;
+    return true;
+}
+
+bool handleOtaCommand(const char* command)
+{
+    idleScheduler.noteActivity();
+
+    if (strcmp(command, "update") == 0)
+    {
+        firmwareUpdate();
+    }
+    else if (strcmp(command, "update force") == 0)
+    {
+        otaAllowSameBuild = true;
+        firmwareUpdate();
+    }
+    else if (strcmp(command, "cancel") == 0)
+    {
+        firmwareUpdateStop(OTA_STOP_CANCEL);
+    }
+    else if (strcmp(command, "abort") == 0)
+    {
+        firmwareUpdateStop(OTA_STOP_ABORT);
+    }
+    else if (strncmp(command, "erase ", 6) == 0)
+    {
+        const char* name = command + 6;
+
+        for (int i = FLASH_ERASE_ON_DEMAND; i <= FLASH_ERASE_BULK; i++)
+        {
+            if (strcmp(name, flashEraseStrategyName((FlashEraseStrategy)i)) == 0)
+            {
+                otaEraseStrategy = (FlashEraseStrategy)i;
+            }
+        }
+
+        SMART_LOGI("OTA", "Erase strategy %s", flashEraseStrategyName(otaEraseStrategy));
+    }
+    else if (strncmp(command, "rxbuf ", 6) == 0)
+    {
+        long size = 0;
+
+        // Takes effect on the next update
+        if (strcmp(command + 6, "auto") != 0 && !parseCommandSize(command + 6, OTA_CHUNK_SIZE_MIN, OTA_CHUNK_SIZE_MAX, &size))
+        {
+            SMART_LOGW("OTA", "Usage: rxbuf <auto|%d..%d>", OTA_CHUNK_SIZE_MIN, OTA_CHUNK_SIZE_MAX);
+        }
+        else
+        {
+            otaReceiveSize = size;
+            SMART_LOGI("OTA", "Receive size %s", otaReceiveSize > 0 ? command + 6 : "adaptive");
+        }
+    }
+    else if (strncmp(command, "httpbuf ", 8) == 0)
+    {
+        long size;
+
+        if (!parseCommandSize(command + 8, OTA_HTTP_BUFFER_MIN, OTA_HTTP_BUFFER_MAX, &size))
+        {
+            SMART_LOGW("OTA", "Usage: httpbuf <%d..%d>", OTA_HTTP_BUFFER_MIN, OTA_HTTP_BUFFER_MAX);
+        }
+        else
+        {
+            otaHttpBufferSize = size;
+            SMART_LOGI("OTA", "HTTP client buffer %d", otaHttpBufferSize);
+        }
+    }
+    else if (strcmp(command, "profile") == 0)
+    {
+        otaTaskConfig.profiling = !otaTaskConfig.profiling;
+        SMART_LOGI("OTA", "Profiling %s", otaTaskConfig.profiling ? "on" : "off");
+    }
+    else if (strcmp(command, "wifi") == 0)
+    {
+        for (int i = 0; i < wifiManager.networkCount(); i++)
+        {
+            const WifiNetwork* network = wifiManager.network(i);
+            SMART_LOGI("Wifi", "%s%s: %u B/s at %d dBm",
+                       network->ssid,
+                       strcmp(network->ssid, wifiManager.connectedSsid()) == 0 ? " (connected)" : "",
+                       network->throughput,
+                       network->throughputRssi);
+        }
+    }
+    else if (strncmp(command, "idle ", 5) == 0)
+    {
+        IdleConfig config = *idleScheduler.getConfig();
+
+        for (int mode = IDLE_MODE_OFF; mode <= IDLE_MODE_RADIO_OFF; mode++)
+        {
+            if (strcmp(command + 5, idleModeName((IdleMode)mode)) == 0)
+            {
+                config.mode = (IdleMode)mode;
+            }
+        }
+
+        idleScheduler.setConfig(&config);
+        SMART_LOGI("Idle", "Mode %s", idleModeName(config.mode));
+    }
+    else if (strncmp(command, "checkevery ", 11) == 0)
+    {
+        IdleConfig config = *idleScheduler.getConfig();
+        config.checkIntervalMicroS = atoi(command + 11) * 1000000LL;
+        idleScheduler.setConfig(&config);
+        SMART_LOGI("Idle", "Update check every %lld s", config.checkIntervalMicroS / 1000000);
+    }
+    else if (strncmp(command, "shape ", 6) == 0)
+    {
+        OtaShaperConfig config = *otaShaper.getConfig();
+        const char* argument = command + 6;
+        bool known = true;
+
+        if (strncmp(argument, "rate ", 5) == 0)
+        {
+            config.rateBytesPerS = atoi(argument + 5);
+        }
+        else if (strncmp(argument, "yieldrate ", 10) == 0)
+        {
+            config.yieldRateBytesPerS = atoi(argument + 10);
+        }
+        else if (strcmp(argument, "yield on") == 0 || strcmp(argument, "yield off") == 0)
+        {
+            config.yieldToApp = strcmp(argument, "yield on") == 0;
+        }
+        else
+        {
+            known = false;
+
+            for (int shapeClass = OTA_SHAPE_URGENT; shapeClass <= OTA_SHAPE_BACKGROUND; shapeClass++)
+            {
+                if (strcmp(argument, otaShapeClassName((OtaShapeClass)shapeClass)) == 0)
+                {
+                    config.shapeClass = (OtaShapeClass)shapeClass;
+                    known = true;
+                }
+            }
+        }
+
+        if (!known)
+        {
+            SMART_LOGW("Shape", "Usage: shape <urgent|normal|background> | rate <B/s> | yieldrate <B/s> | yield <on|off>");
+        }
+
+        // Also applies to a running download, the background priority
+        // drop only to the next one
+        otaShaper.setConfig(&config);
+        logOtaShaping();
+    }
+    else if (strcmp(command, "shape") == 0)
+    {
+        logOtaShaping();
+    }
+    else if (strcmp(command, "activate") == 0)
+    {
+        if (!otaActivation.request())
+        {
+            SMART_LOGW("OTA", "Nothing staged to activate");
+        }
+    }
+    else if (strncmp(command, "activation ", 11) == 0)
+    {
+        OtaActivationConfig config = *otaActivation.getConfig();
+        unsigned hours, minutes, lengthMinutes;
+
+        if (sscanf(command + 11, "window %u:%u %u", &hours, &minutes, &lengthMinutes) == 3)
+        {
+            config.mode = OTA_ACTIVATE_WINDOW;
+            config.windowStartS = hours * 3600 + minutes * 60;
+            config.windowLengthS = lengthMinutes * 60;
+        }
+
+        for (int mode = OTA_ACTIVATE_NOW; mode <= OTA_ACTIVATE_COMMAND; mode++)
+        {
+            if (strcmp(command + 11, otaActivationModeName((OtaActivationMode)mode)) == 0)
+            {
+                config.mode = (OtaActivationMode)mode;
+            }
+        }
+
+        otaActivation.setConfig(&config);
+        logOtaActivation();
+    }
+    else if (strcmp(command, "activation") == 0)
+    {
+        logOtaActivation();
+    }
+    else if (strcmp(command, "idle") == 0)
+    {
+        IdleStats idle;
+        idleScheduler.stats(&idle);
+        SMART_LOGI("Idle", "%s, %s, %u wakes (%u failed), last wake %lld ms, max %lld ms, ~%u uA average",
+                   idleModeName(idleScheduler.getConfig()->mode),
+                   idleStateName(idleScheduler.state()),
+                   idle.wakes,
+                   idle.failedWakes,
+                   idle.lastWakeMicroS / 1000,
+                   idle.maxWakeMicroS / 1000,
+                   idle.averageMicroAmps);
+    }
+    else if (strcmp(command, "log") == 0)
+    {
+        SMART_LOGI("Log", "Default %s, built up to %s", smartLogLevelName(smartLogFilter.defaultLevel()), smartLogLevelName(SMART_LOG_MAX_LEVEL));
+
+        for (int i = 0; i < smartLogFilter.count(); i++)
+        {
+            const SmartLogTagLevel* entry = smartLogFilter.entry(i);
+            SMART_LOGI("Log", "%s %s", entry->tag, smartLogLevelName((SmartLogLevel)entry->level));
+        }
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        char tag[SMART_LOG_TAG_SIZE];
+        char levelName[16];
+        SmartLogLevel level;
+
+        if (sscanf(command + 4, "%15s %15s", tag, levelName) != 2 || !parseSmartLogLevel(levelName, &level) || !smartLogFilter.set(tag, level))
+        {
+            SMART_LOGW("Log", "Usage: log <tag|*> <none|error|warn|info|debug|verbose>");
+        }
+        else
+        {
+            SMART_LOGI("Log", "%s at %s%s", tag, smartLogLevelName(level), level > SMART_LOG_MAX_LEVEL ? ", above the build's level" : "");
+        }
+    }
+    else if (strcmp(command, "source") == 0)
+    {
+        SMART_LOGI("OTA", "Updates from %s", otaFirmwareUrl);
+    }
+    else if (strncmp(command, "source ", 7) == 0)
+    {
+        // source <token> <url|default>, until the next boot
+        const char* token = command + 7;
+        const char* argument = strchr(token, ' ');
+
+        if (argument == nullptr || !isCommandToken(token, argument - token))
+        {
+            SMART_LOGW("OTA", "source needs the command token");
+        }
+        else if (strcmp(argument + 1, "default") != 0 && !isAllowedSource(argument + 1))
+        {
+            SMART_LOGW("OTA", "Refusing %s, https or an allowed http host only", argument + 1);
+        }
+        else
+        {
+            strlcpy(otaFirmwareUrl, strcmp(argument + 1, "default") == 0 ? OTA_FIRMWARE_URL : argument + 1, sizeof(otaFirmwareUrl));
+            otaValidatorStore.clear();
+            SMART_LOGI("OTA", "Updates from %s until the next boot", otaFirmwareUrl);
+        }
+    }
+    else if (strcmp(command, "cache") == 0)
+    {
+        FirmwareCacheStats stats;
+        firmwareCache.stats(&stats);
+        SMART_LOGI("Cache", "%s, %s %s, %u bytes; %u requests: %u full, %u partial, %u not modified, %u unavailable, %llu bytes served",
+                   firmwareCacheGateway ? "gateway" : "off",
+                   firmwareCacheStateName(firmwareCache.state()),
+                   firmwareCache.etag(),
+                   firmwareCache.size(),
+                   stats.requests,
+                   stats.full,
+                   stats.partial,
+                   stats.notModified,
+                   stats.unavailable,
+                   stats.bytesServed);
+    }
+    else if (strcmp(command, "cache on") == 0 || strcmp(command, "cache off") == 0)
+    {
+        uint8_t gateway = strcmp(command, "cache on") == 0;
+
+        firmwareCacheGateway = gateway && startFirmwareCache();
+        saveOtaSetting(OTA_SETTINGS_GATEWAY_KEY, &gateway, sizeof(gateway));
+        // Installed and cached are no longer the same image
+        otaValidatorStore.clear();
+        // Stops pulling into the cache, serving what is there ends with the next boot
+        SMART_LOGI("Cache", "Gateway %s", firmwareCacheGateway ? "on, the next update fills the cache" : "off");
+    }
+    else if (strcmp(command, "secrets") == 0)
+    {
+        SecretCacheStats stats;
+        secretCache.stats(&stats);
+        SMART_LOGI("NVS", "NVS up in %lld us, last read %lld us; %u loads, %u reads, %u cached borrows, %u wipes",
+                   otaNvsInitMicroS,
+                   stats.lastLoadMicroS,
+                   stats.loads,
+                   stats.reads,
+                   stats.hits,
+                   stats.wipes);
+    }
+    else if (strcmp(command, "scrub") == 0)
+    {
+        ScrubTargetStatus status;
+        for (int i = 0; partitionScrubber.status(i, &status); i++)
+        {
+            SMART_LOGI("Scrub", "%s: %s, %u passes, %u of %u bytes", status.label, scrubResultName(status.result), status.passes, status.bytesChecked, status.imageBytes);
+        }
+
+        PartitionScrubberStats stats;
+        partitionScrubber.stats(&stats);
+        SMART_LOGI("Scrub", "%u passes, %u corrupt, %llu bytes in %u steps, longest %lld us, %lld ms busy",
+                   stats.passes,
+                   stats.corruptFound,
+                   stats.bytesHashed,
+                   stats.steps,
+                   stats.longestStepMicroS,
+                   stats.busyMicroS / 1000);
+    }
+    else if (strcmp(command, "scrub now") == 0)
+    {
+        partitionScrubber.checkNow();
+        SMART_LOGI("Scrub", "Checking every target now");
+    }
+    else if (strcmp(command, "crashlog") == 0)
+    {
+        dumpCrashLog(nullptr, true);
+    }
+    else if (strcmp(command, "status") == 0)
+    {
+        SMART_LOGI("OTA", "%s, rollback gate %s", otaStateName(otaStateMachine.state()), rollbackGateStateName(rollbackGate.state()));
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool addOtaWifiNetwork(const char* ssid, const char* password)
+{
+    return wifiManager.addNetwork(ssid, password);
+}
+
+void setOtaIdle(IdleMode mode, uint32_t checkIntervalS)
+{
+    IdleConfig config = *idleScheduler.getConfig();
+    config.mode = mode;
+    config.checkIntervalMicroS = checkIntervalS * 1000000LL;
+    idleScheduler.setConfig(&config);
+}
+
+void setOtaShaping(OtaShapeClass shapeClass, uint32_t rateBytesPerS, bool yieldToApp)
+{
+    OtaShaperConfig config = *otaShaper.getConfig();
+    config.shapeClass = shapeClass;
+    config.rateBytesPerS = rateBytesPerS;
+    config.yieldToApp = yieldToApp;
+    otaShaper.setConfig(&config);
+}
+
+void setOtaFirmwareUrl(const char* url)
+{
+    strlcpy(otaFirmwareUrl, url, sizeof(otaFirmwareUrl));
+}
+
+void setOtaFirmwareCache(bool gateway)
+{
+    firmwareCacheGateway = gateway;
+}
+
+void noteOtaAppTraffic()
+{
+    otaShaper.noteAppTraffic();
+}
+
+void setupOta(OtaSecretKeys *secretKeys, OtaSecretValues *secretValues)
+{
+    beginCrashLog();
+    smartLog("Setting up OTA");
+    setSecretKeys(secretKeys);
+    ESP_ERROR_CHECK(initOtaNvs());
+
+    getPartitionsSha256();
+
+    ESP_ERROR_CHECK(esp_netif_init());
+
+    if (secretValues != nullptr)
+    {
+        saveSecretsToNvs(secretKeys, secretValues);
+    }
+
+    loadSecretsFromNvs(secretKeys);
+    logSecretsBootTime();
+    loadOtaSettings();
+    otaValidatorStore.load(otaFirmwareUrl);
+
+    rollbackGate.addCheck("wifi", wifiHealthCheck, nullptr);
+    rollbackGate.addCheck("server", serverHealthCheck, nullptr);
+
+    if (rollbackGate.begin() == ROLLBACK_GATE_CHECKING)
+    {
+        SMART_LOGI("Rollback", "New image pending verification");
+        xTaskCreate(healthCheckTask, "healthCheckTask", 4096, NULL, 1, NULL);
+    }
+    else
+    {
+        // Validated before a restart cut the copy short, or rolled back
+        stagePendingData();
+    }
+
+    SMART_LOGI("Wifi", "Connecting...");
+    wifiManager.setPasswordSource(&wifiPassword);
+    wifiManager.addNetwork(secretCache.acquire(SECRET_WIFI_SSID), nullptr);
+    secretCache.release(SECRET_WIFI_SSID);
+    wifiManager.begin();
+
+    while (wifiManager.poll() != WIFI_MANAGER_CONNECTED)
+    {
+        delay(WIFI_POLL_MS);
+    }
+
+    SMART_LOGI("Wifi", "Connected! %s", WiFi.localIP().toString().c_str());
+    idleScheduler.begin();
+    xTaskCreate(wifiManagerTask, "wifiManagerTask", WIFI_MANAGER_TASK_STACK, NULL, 1, NULL);
+    startPartitionScrubber();
+
+    startSmartLogTask();
+
+    if (firmwareCacheGateway)
+    {
+        firmwareCacheGateway = startFirmwareCache();
+    }
 
-    setupServer(firmwareUpdate);
+    setupServer(handleOtaCommand, &otaServerApi);
+    // Whatever boot did not borrow, a download reads the CA certificate again
+    secretCache.wipe();
     smartLog("OTA is ready");
 }
@@ -1,6 +1,10 @@
 #ifndef __ESP_OTA_MAIN__
 #define __ESP_OTA_MAIN__
 
+#include "idleScheduler.h"
+#include "otaActivation.h"
+#include "otaShaper.h"
+
 struct OtaSecretKeys {
     const char* nvsNamespace;
     const char* wifiSsidNvsKey;
@@ -14,7 +18,61 @@ struct OtaSecretValues {
     const char* caCert;
 };
 
+// The credentials are read from NVS once at boot and wiped from RAM once
+// boot no longer needs them.
 void setupOta(OtaSecretKeys* secretKeys, OtaSecretValues* secretValues = nullptr);
 void saveSecretsToNvs(OtaSecretKeys* secretKeys, OtaSecretValues* secretValues);
 
+// Networks besides the one in OtaSecretValues, up to 4 in total. Their
+// SSIDs are kept in NVS with the speed updates reached on each, the password
+// is not copied and must stay valid; after a scan the best visible one is
+// joined and remembered for the next boot. Must be called before setupOta.
+bool addOtaWifiNetwork(const char* ssid, const char* password);
+
+// Battery idle between update checks, off by default. Modem mode stays
+// reachable over /ws; radio-off light sleeps until the next check and needs
+// checkIntervalS. A check pulls OTA_FIRMWARE_URL like the "update" command.
+void setOtaIdle(IdleMode mode, uint32_t checkIntervalS = 0);
+
+// Bandwidth of pulled updates, unshaped by default. Also settable over /ws
+// with "shape ...". With yieldToApp the download drops to a trickle
+// (normal) or stops (background) while the application has traffic; the
+// application reports it with noteOtaAppTraffic(), callable from any task.
+void setOtaShaping(OtaShapeClass shapeClass, uint32_t rateBytesPerS, bool yieldToApp = false);
+void noteOtaAppTraffic();
+
+// Where pulled updates come from, the project's server by default. The
+// other devices of a site point at its gateway instead:
+// http://<gateway>/ota/firmware. "source <token> <url|default>" over /ws
+// overrides it until the next boot, for builds with OTA_COMMAND_TOKEN and
+// only to https or an OTA_SOURCE_HTTP_HOSTS host.
+void setOtaFirmwareUrl(const char* url);
+// Makes this device the site's gateway: an update it pulls goes through a
+// cache in the "fwcache" data partition (4 MB of PSRAM without one), which
+// GET /ota/firmware serves to the rest of the site. The origin then sees
+// one download per site and release. "cache on|off" over /ws sets it too
+// and is kept in NVS, over this call. Both must be called before setupOta.
+void setOtaFirmwareCache(bool gateway);
+
+// After an update the new image stays pending until Wi-Fi is up, the update
+// server answers and every check added here has passed once. Missing the
+// deadline (30 s by default) rolls back to the previous image. Both must be
+// called before setupOta.
+bool addOtaHealthCheck(const char* name, bool (*check)(void* context), void* context = nullptr);
+void setOtaHealthCheckDeadline(uint32_t deadlineMs);
+
+// A verified update is staged in the inactive slot and applied by a reboot
+// right away (the default), inside a daily window of local time (needs the
+// wall clock set, e.g. by SNTP) or only on activateOtaUpdate() and the
+// "activate" command. A bundle's data image waits in the staging partition
+// until its app has passed the rollback gate, then takes the same way: the
+// pre-reboot hooks run, the image is copied over its partition and the
+// device restarts. The new app boots on the old filesystem and has to cope
+// with it until then. Window times are seconds after midnight.
+void setOtaActivation(OtaActivationMode mode, uint32_t windowStartS = 0, uint32_t windowLengthS = 0);
+bool activateOtaUpdate();
+// Run before the reboot into an update, until each returned true once or 30 s
+// passed. Must be called before setupOta.
+bool addOtaPreRebootHook(const char* name, bool (*hook)(void* context), void* context = nullptr);
+
 #endif // __ESP_OTA_MAIN__
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "smartLogger.h"
+#include "otaPartitionWriter.h"
+
+// First byte of every ESP app image (ESP_IMAGE_HEADER_MAGIC)
+#define APP_IMAGE_MAGIC 0xE9
+
+FlashEraseStrategy otaEraseStrategy = FLASH_ERASE_AHEAD;
+
+PartitionBundleSink::PartitionBundleSink(HalPartitions* partitions, uint8_t* sectorBuffer, FlashEraseStrategy strategy)
+    : partitions(partitions),
+      sectorBuffer(sectorBuffer),
+      partition(nullptr),
+      appPartition(nullptr),
+      stagedSize(0),
+      committed(false),
+      writer(sectorBuffer, strategy),
+      contentLength(0),
+      writingApp(false),
+      imageOpen(false),
+      checkedMagic(false),
+      error(nullptr)
+{
+    memset(&totals, 0, sizeof(totals));
+    stagedLabel[0] = 0;
+}
+
+void PartitionBundleSink::setContentLength(size_t length)
+{
+    contentLength = length;
+}
+
+bool PartitionBundleSink::fail(const char* operation)
+{
+    error = operation;
+    imageOpen = false;
+    SMART_LOGE("OTA", "%s failed on %s", operation, partition != nullptr ? partitions->label(partition) : "?");
+    return false;
+}
+
+bool PartitionBundleSink::beginImage(const OtaBundleEntry* entry)
+{
+    writingApp = strcmp(entry->label, OTA_BUNDLE_APP_LABEL) == 0;
+    checkedMagic = !writingApp;
+    partition = writingApp ? partitions->openApp() : partitions->openData(entry->label);
+
+    if (partition == nullptr)
+    {
+        SMART_LOGE("OTA", "No partition for %s", entry->label);
+        error = "partition lookup";
+        return false;
+    }
+
+    // Only a manifest size is exact, Content-Length covers a plain image
+    size_t expectedSize = entry->hasHash ? entry->size : contentLength;
+
+    if (expectedSize > partition->size())
+    {
+        SMART_LOGE("OTA", "%s image is %u bytes, partition holds %u", entry->label, (unsigned)expectedSize, (unsigned)partition->size());
+        error = "image size";
+        return false;
+    }
+
+    if (!writingApp)
+    {
+        partition = stagedLabel[0] == 0 ? partitions->openStaging(expectedSize) : nullptr;
+
+        if (partition == nullptr)
+        {
+            SMART_LOGE("OTA", "Nowhere to stage %s, refusing the bundle", entry->label);
+            error = "staging partition";
+            return false;
+        }
+    }
+
+    SMART_LOGI("OTA", "Writing %s to %s, %s erase", entry->label, partitions->label(partition), flashEraseStrategyName(otaEraseStrategy));
+
+    if (!writer.begin(partition, expectedSize))
+    {
+        return fail("erase");
+    }
+
+    imageOpen = true;
+    return true;
+}
+
+bool PartitionBundleSink::writeImage(const uint8_t* data, size_t len)
+{
+    if (!checkedMagic)
+    {
+        // Same early rejection esp_ota_write does for non-image payloads
+        if (data[0] != APP_IMAGE_MAGIC)
+        {
+            return fail("image header check");
+        }
+
+        checkedMagic = true;
+    }
+
+    if (!writer.write(data, len))
+    {
+        return fail("write");
+    }
+
+    return true;
+}
+
+bool PartitionBundleSink::endImage(const OtaBundleEntry* entry)
+{
+    imageOpen = false;
+
+    if (!writer.finish())
+    {
+        return fail("write");
+    }
+
+    const FlashWriterStats* writerStats = writer.stats();
+    SMART_LOGI("OTA", "%s done: %u bytes in %u writes, %u sectors erased (%u ahead, %u stalls)",
+               entry->label,
+               (unsigned)writerStats->bytesWritten,
+               writerStats->writes,
+               writerStats->sectorsErased,
+               writerStats->sectorsErasedAhead,
+               writerStats->eraseStalls);
+
+    totals.sectorsErased += writerStats->sectorsErased;
+    totals.sectorsErasedAhead += writerStats->sectorsErasedAhead;
+    totals.eraseStalls += writerStats->eraseStalls;
+    totals.writes += writerStats->writes;
+    totals.bytesWritten += writerStats->bytesWritten;
+
+    if (!writingApp)
+    {
+        // The reader checked the manifest hash before calling this
+        strcpy(stagedLabel, entry->label);
+        stagedSize = entry->size;
+        memcpy(stagedSha256, entry->sha256, OTA_SHA256_LEN);
+        return true;
+    }
+
+    if (!partitions->verifyApp(partition))
+    {
+        return fail("image verification");
+    }
+
+    appPartition = partition;
+    return true;
+}
+
+void PartitionBundleSink::idle()
+{
+    if (imageOpen)
+    {
+        writer.idle();
+    }
+}
+
+void PartitionBundleSink::abort()
+{
+    // Nothing to undo: the boot partition still points at the running app
+    // and data images never left the staging partition
+    imageOpen = false;
+}
+
+bool PartitionBundleSink::commit(bool activate)
+{
+    if (error != nullptr)
+    {
+        return false;
+    }
+
+    // A data image stays staged, see pendingData()
+    committed = true;
+
+    if (appPartition == nullptr || !activate)
+    {
+        // Data-only bundle or staged, keep booting the running app
+        return true;
+    }
+
+    if (!partitions->setBootPartition(appPartition))
+    {
+        return fail("set boot partition");
+    }
+
+    return true;
+}
+
+FlashDevice* PartitionBundleSink::stagedApp() const
+{
+    return appPartition;
+}
+
+bool PartitionBundleSink::pendingData(OtaPendingData* output) const
+{
+    if (!committed || stagedLabel[0] == 0)
+    {
+        return false;
+    }
+
+    memset(output, 0, sizeof(*output));
+    output->version = OTA_PENDING_DATA_VERSION;
+    strcpy(output->label, stagedLabel);
+    snprintf(output->appLabel, sizeof(output->appLabel), "%s", appPartition != nullptr ? partitions->label(appPartition) : partitions->runningLabel());
+    output->size = stagedSize;
+    memcpy(output->sha256, stagedSha256, OTA_SHA256_LEN);
+    return true;
+}
+
+const char* PartitionBundleSink::lastError() const
+{
+    return error;
+}
+
+const FlashWriterStats* PartitionBundleSink::stats() const
+{
+    return &totals;
+}
+
+OtaPendingDataStore::OtaPendingDataStore(HalStorage* storage, const char* nvsNamespace)
+    : storage(storage),
+      nvsNamespace(nvsNamespace)
+{
+}
+
+bool OtaPendingDataStore::load(OtaPendingData* output)
+{
+    size_t len = sizeof(*output);
+    bool found = false;
+
+    if (!storage->open(nvsNamespace, false))
+    {
+        return false;
+    }
+
+    if (storage->getBlob(OTA_PENDING_DATA_KEY, output, &len) &&
+        len == sizeof(*output) &&
+        output->version == OTA_PENDING_DATA_VERSION)
+    {
+        output->label[sizeof(output->label) - 1] = 0;
+        output->appLabel[sizeof(output->appLabel) - 1] = 0;
+        found = output->label[0] != 0;
+    }
+
+    storage->close();
+    return found;
+}
+
+void OtaPendingDataStore::save(const OtaPendingData* pending)
+{
+    if (storage->open(nvsNamespace, true))
+    {
+        if (storage->setBlob(OTA_PENDING_DATA_KEY, pending, sizeof(*pending)))
+        {
+            storage->commit();
+        }
+
+        storage->close();
+    }
+}
+
+// An empty label, HalStorage has no erase. Written only over a record, so
+// update polls cost no flash wear.
+void OtaPendingDataStore::clear()
+{
+    OtaPendingData none;
+
+    if (!load(&none))
+    {
+        return;
+    }
+
+    memset(&none, 0, sizeof(none));
+    none.version = OTA_PENDING_DATA_VERSION;
+    save(&none);
+}
+
+bool applyPendingData(HalPartitions* partitions, const OtaPendingData* pending, uint8_t* sectorBuffer)
+{
+    if (strcmp(pending->appLabel, partitions->runningLabel()) != 0)
+    {
+        SMART_LOGW("OTA", "%s image was for %s, %s runs, dropping it", pending->label, pending->appLabel, partitions->runningLabel());
+        return false;
+    }
+
+    FlashDevice* staging = partitions->openStaging(pending->size);
+    FlashDevice* partition = partitions->openData(pending->label);
+    OtaSha256Context hash;
+    uint8_t sha256[OTA_SHA256_LEN];
+
+    if (staging == nullptr || partition == nullptr)
+    {
+        SMART_LOGE("OTA", "No partition for the staged %s image", pending->label);
+        return false;
+    }
+
+    otaSha256Start(&hash);
+
+    for (size_t offset = 0; offset < pending->size; offset += FLASH_WRITER_SECTOR_SIZE)
+    {
+        size_t len = pending->size - offset < FLASH_WRITER_SECTOR_SIZE ? pending->size - offset : FLASH_WRITER_SECTOR_SIZE;
+
+        if (!staging->read(offset, sectorBuffer, len))
+        {
+            SMART_LOGE("OTA", "Reading the staged %s image failed", pending->label);
+            return false;
+        }
+
+        otaSha256Update(&hash, sectorBuffer, len);
+    }
+
+    otaSha256Finish(&hash, sha256);
+
+    if (memcmp(sha256, pending->sha256, OTA_SHA256_LEN) != 0)
+    {
+        SMART_LOGE("OTA", "Staged %s image changed since it verified, dropping it", pending->label);
+        return false;
+    }
+
+    size_t eraseSize = (pending->size + FLASH_WRITER_SECTOR_SIZE - 1) / FLASH_WRITER_SECTOR_SIZE * FLASH_WRITER_SECTOR_SIZE;
+    if (eraseSize > partition->size())
+    {
+        eraseSize = partition->size();
+    }
+
+    SMART_LOGI("OTA", "Copying %s from %s, %u bytes", pending->label, partitions->label(staging), (unsigned)pending->size);
+
+    if (eraseSize > 0 && !partition->erase(0, eraseSize))
+    {
+        SMART_LOGE("OTA", "Erasing %s failed", pending->label);
+        return false;
+    }
+
+    for (size_t offset = 0; offset < pending->size; offset += FLASH_WRITER_SECTOR_SIZE)
+    {
+        size_t len = pending->size - offset < FLASH_WRITER_SECTOR_SIZE ? pending->size - offset : FLASH_WRITER_SECTOR_SIZE;
+
+        if (!staging->read(offset, sectorBuffer, len) || !partition->write(offset, sectorBuffer, len))
+        {
+            SMART_LOGE("OTA", "Copying %s failed at %u", pending->label, (unsigned)offset);
+            return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,101 @@
+#ifndef __ESP_OTA_PARTITION_WRITER__
+#define __ESP_OTA_PARTITION_WRITER__
+
+#include "flashWriter.h"
+#include "hal.h"
+#include "otaBundle.h"
+
+#define OTA_PENDING_DATA_KEY "pendingData"
+#define OTA_PENDING_DATA_VERSION 1
+
+// A verified data image waiting in the staging partition
+struct OtaPendingData {
+    uint8_t version;
+    char label[OTA_BUNDLE_LABEL_SIZE + 1];
+    // App slot it belongs to: the bundle's, or the running one for a
+    // data-only bundle. Dropped when another app runs.
+    char appLabel[OTA_BUNDLE_LABEL_SIZE + 1];
+    uint32_t size;
+    uint8_t sha256[OTA_SHA256_LEN];
+};
+
+// Writes bundle images to their partitions: "app" into the next update
+// slot, anything else into the data partition with the same label. Both go
+// through FlashWriter so erases can run ahead of the download; the app image
+// is verified once complete and the boot partition only changes in commit().
+// The running app may have a data partition mounted, and the old app must
+// keep its filesystem should the new one roll back. So a data image goes to
+// the staging partition and stays there: commit() only reports it through
+// pendingData(), applyPendingData() copies it over once the app it came with
+// runs and passed the rollback gate. Without a staging partition bundles
+// with data images are refused, and it takes one data image per bundle.
+class PartitionBundleSink : public OtaBundleSink {
+public:
+    PartitionBundleSink(HalPartitions* partitions, uint8_t* sectorBuffer, FlashEraseStrategy strategy);
+
+    // Size hint for a plain firmware.bin, whose stream has no manifest
+    void setContentLength(size_t contentLength);
+
+    bool beginImage(const OtaBundleEntry* entry) override;
+    bool writeImage(const uint8_t* data, size_t len) override;
+    bool endImage(const OtaBundleEntry* entry) override;
+
+    // Called when the network has nothing for us, erases ahead
+    void idle();
+    void abort();
+    // Without activate the verified app only stays staged in its slot, for
+    // a later setBootPartition(stagedApp())
+    bool commit(bool activate = true);
+    // nullptr for a data-only bundle or before the app image verified
+    FlashDevice* stagedApp() const;
+    // After commit(), false when the bundle had no data image
+    bool pendingData(OtaPendingData* output) const;
+    // nullptr until something failed
+    const char* lastError() const;
+    // Summed over every image finished so far
+    const FlashWriterStats* stats() const;
+
+private:
+    bool fail(const char* operation);
+
+    HalPartitions* partitions;
+    uint8_t* sectorBuffer;
+    FlashDevice* partition;
+    FlashDevice* appPartition;
+    // The verified data image waiting in the staging partition, an empty
+    // label while there is none
+    char stagedLabel[OTA_BUNDLE_LABEL_SIZE + 1];
+    size_t stagedSize;
+    uint8_t stagedSha256[OTA_SHA256_LEN];
+    bool committed;
+    FlashWriter writer;
+    FlashWriterStats totals;
+    size_t contentLength;
+    bool writingApp;
+    bool imageOpen;
+    bool checkedMagic;
+    const char* error;
+};
+
+// Survives the reboot into the new app, which applies it once validated
+class OtaPendingDataStore {
+public:
+    OtaPendingDataStore(HalStorage* storage, const char* nvsNamespace);
+
+    bool load(OtaPendingData* output);
+    void save(const OtaPendingData* pending);
+    void clear();
+
+private:
+    HalStorage* storage;
+    const char* nvsNamespace;
+};
+
+// Hashes the staged image against its manifest hash again, then erases the
+// partition and copies it over sector by sector through sectorBuffer.
+// Refused unless the running app is the one it belongs to.
+bool applyPendingData(HalPartitions* partitions, const OtaPendingData* pending, uint8_t* sectorBuffer);
+
+extern FlashEraseStrategy otaEraseStrategy;
+
+#endif // __ESP_OTA_PARTITION_WRITER__
@@ -0,0 +1,119 @@
+#include "otaRollback.h"
+
+RollbackGate::RollbackGate(RollbackPlatform* platform)
+    : platform(platform),
+      checkCount(0),
+      deadlineMicroS(30 * 1000000LL),
+      startMicroS(0),
+      validatedMicroS(-1),
+      failedCheckName(nullptr),
+      currentState(ROLLBACK_GATE_IDLE)
+{
+}
+
+bool RollbackGate::addCheck(const char* name, HealthCheckFunction check, void* context)
+{
+    if (checkCount == ROLLBACK_MAX_HEALTH_CHECKS || currentState != ROLLBACK_GATE_IDLE)
+    {
+        return false;
+    }
+
+    checks[checkCount++] = {
+        .name = name,
+        .check = check,
+        .context = context,
+        .passed = false,
+    };
+    return true;
+}
+
+void RollbackGate::setDeadline(int64_t deadline)
+{
+    deadlineMicroS = deadline;
+}
+
+RollbackGateState RollbackGate::begin()
+{
+    startMicroS = platform->nowMicroS();
+    currentState = platform->isPendingVerify() ? ROLLBACK_GATE_CHECKING : ROLLBACK_GATE_NOT_REQUIRED;
+    return poll();
+}
+
+RollbackGateState RollbackGate::poll()
+{
+    if (currentState != ROLLBACK_GATE_CHECKING)
+    {
+        return currentState;
+    }
+
+    const char* pending = nullptr;
+
+    for (int i = 0; i < checkCount; i++)
+    {
+        if (!checks[i].passed)
+        {
+            checks[i].passed = checks[i].check(checks[i].context);
+        }
+
+        if (!checks[i].passed && pending == nullptr)
+        {
+            pending = checks[i].name;
+        }
+    }
+
+    int64_t now = platform->nowMicroS();
+
+    if (pending == nullptr)
+    {
+        if (platform->markValid())
+        {
+            validatedMicroS = now;
+            currentState = ROLLBACK_GATE_VALIDATED;
+            return currentState;
+        }
+
+        pending = "mark valid";
+    }
+
+    if (now - startMicroS >= deadlineMicroS)
+    {
+        failedCheckName = pending;
+        currentState = ROLLBACK_GATE_ROLLED_BACK;
+        platform->rollback();
+    }
+
+    return currentState;
+}
+
+RollbackGateState RollbackGate::state() const
+{
+    return currentState;
+}
+
+int64_t RollbackGate::validatedAtMicroS() const
+{
+    return validatedMicroS;
+}
+
+const char* RollbackGate::failedCheck() const
+{
+    return failedCheckName;
+}
+
+const char* rollbackGateStateName(RollbackGateState state)
+{
+    switch (state)
+    {
+    case ROLLBACK_GATE_IDLE:
+        return "idle";
+    case ROLLBACK_GATE_NOT_REQUIRED:
+        return "not required";
+    case ROLLBACK_GATE_CHECKING:
+        return "checking";
+    case ROLLBACK_GATE_VALIDATED:
+        return "validated";
+    case ROLLBACK_GATE_ROLLED_BACK:
+        return "rolled back";
+    }
+    return "unknown";
+}
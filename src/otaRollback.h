@@ -0,0 +1,71 @@
+#ifndef __ESP_OTA_ROLLBACK__
+#define __ESP_OTA_ROLLBACK__
+
+#include <stdint.h>
+
+#define ROLLBACK_MAX_HEALTH_CHECKS 8
+
+// Boot-time view of the app slot, backed by esp_ota_* on the device and by a
+// simulated partition table on the host
+class RollbackPlatform {
+public:
+    virtual ~RollbackPlatform() {}
+    // True when the running image was just flashed and still awaits a verdict
+    virtual bool isPendingVerify() = 0;
+    virtual bool markValid() = 0;
+    // Marks the running image invalid and boots the previous one
+    virtual void rollback() = 0;
+    virtual int64_t nowMicroS() = 0;
+};
+
+typedef bool (*HealthCheckFunction)(void* context);
+
+enum RollbackGateState {
+    ROLLBACK_GATE_IDLE,
+    // Running image was already valid, nothing to decide
+    ROLLBACK_GATE_NOT_REQUIRED,
+    ROLLBACK_GATE_CHECKING,
+    ROLLBACK_GATE_VALIDATED,
+    ROLLBACK_GATE_ROLLED_BACK,
+};
+
+struct HealthCheck {
+    const char* name;
+    HealthCheckFunction check;
+    void* context;
+    bool passed;
+};
+
+// Runs registered health checks until all have passed once or the deadline
+// expires. Each check is retried on every poll, so a check only needs to
+// report the current condition (e.g. "Wi-Fi is connected right now").
+class RollbackGate {
+public:
+    explicit RollbackGate(RollbackPlatform* platform);
+
+    bool addCheck(const char* name, HealthCheckFunction check, void* context);
+    void setDeadline(int64_t deadlineMicroS);
+
+    RollbackGateState begin();
+    RollbackGateState poll();
+
+    RollbackGateState state() const;
+    // Platform time at which the image was marked valid, -1 until then
+    int64_t validatedAtMicroS() const;
+    // First check that had not passed when the deadline hit
+    const char* failedCheck() const;
+
+private:
+    RollbackPlatform* platform;
+    HealthCheck checks[ROLLBACK_MAX_HEALTH_CHECKS];
+    int checkCount;
+    int64_t deadlineMicroS;
+    int64_t startMicroS;
+    int64_t validatedMicroS;
+    const char* failedCheckName;
+    RollbackGateState currentState;
+};
+
+const char* rollbackGateStateName(RollbackGateState state);
+
+#endif // __ESP_OTA_ROLLBACK__
@@ -0,0 +1,194 @@
+#include <string.h>
+
+#include "otaSha256.h"
+
+#ifdef ARDUINO
+
+void otaSha256Start(OtaSha256Context* context)
+{
+    mbedtls_sha256_init(context);
+    mbedtls_sha256_starts_ret(context, 0);
+}
+
+void otaSha256Update(OtaSha256Context* context, const uint8_t* data, size_t len)
+{
+    mbedtls_sha256_update_ret(context, data, len);
+}
+
+void otaSha256Finish(OtaSha256Context* context, uint8_t output[OTA_SHA256_LEN])
+{
+    mbedtls_sha256_finish_ret(context, output);
+    mbedtls_sha256_free(context);
+}
+
+#else
+
+static const uint32_t roundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotateRight(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void processBlock(OtaSha256Context* context, const uint8_t* block)
+{
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = context->state[0], b = context->state[1], c = context->state[2], d = context->state[3];
+    uint32_t e = context->state[4], f = context->state[5], g = context->state[6], h = context->state[7];
+
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + roundConstants[i] + w[i];
+        uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    context->state[0] += a;
+    context->state[1] += b;
+    context->state[2] += c;
+    context->state[3] += d;
+    context->state[4] += e;
+    context->state[5] += f;
+    context->state[6] += g;
+    context->state[7] += h;
+}
+
+void otaSha256Start(OtaSha256Context* context)
+{
+    static const uint32_t initialState[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(context->state, initialState, sizeof(initialState));
+    context->length = 0;
+    context->blockLength = 0;
+}
+
+void otaSha256Update(OtaSha256Context* context, const uint8_t* data, size_t len)
+{
+    context->length += len;
+
+    while (len > 0)
+    {
+        size_t take = sizeof(context->block) - context->blockLength;
+        if (take > len)
+        {
+            take = len;
+        }
+
+        memcpy(context->block + context->blockLength, data, take);
+        context->blockLength += take;
+        data += take;
+        len -= take;
+
+        if (context->blockLength == sizeof(context->block))
+        {
+            processBlock(context, context->block);
+            context->blockLength = 0;
+        }
+    }
+}
+
+void otaSha256Finish(OtaSha256Context* context, uint8_t output[OTA_SHA256_LEN])
+{
+    uint64_t bitLength = context->length * 8;
+    uint8_t padding = 0x80;
+
+    otaSha256Update(context, &padding, 1);
+
+    padding = 0;
+    while (context->blockLength != 56)
+    {
+        otaSha256Update(context, &padding, 1);
+    }
+
+    uint8_t lengthBytes[8];
+    for (int i = 0; i < 8; i++)
+    {
+        lengthBytes[i] = (uint8_t)(bitLength >> (56 - i * 8));
+    }
+    otaSha256Update(context, lengthBytes, 8);
+
+    for (int i = 0; i < 8; i++)
+    {
+        output[i * 4] = (uint8_t)(context->state[i] >> 24);
+        output[i * 4 + 1] = (uint8_t)(context->state[i] >> 16);
+        output[i * 4 + 2] = (uint8_t)(context->state[i] >> 8);
+        output[i * 4 + 3] = (uint8_t)context->state[i];
+    }
+}
+
+#endif
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+bool otaSha256FromHex(const char* hex, uint8_t output[OTA_SHA256_LEN])
+{
+    for (int i = 0; i < OTA_SHA256_LEN; i++)
+    {
+        int high = hexDigit(hex[i * 2]);
+        int low = high < 0 ? -1 : hexDigit(hex[i * 2 + 1]);
+
+        if (low < 0)
+        {
+            return false;
+        }
+
+        output[i] = (uint8_t)(high << 4 | low);
+    }
+
+    return hex[OTA_SHA256_LEN * 2] == 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __ESP_OTA_SHA256__
+#define __ESP_OTA_SHA256__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define OTA_SHA256_LEN 32
+
+#ifdef ARDUINO
+#include <mbedtls/sha256.h>
+typedef mbedtls_sha256_context OtaSha256Context;
+#else
+struct OtaSha256Context {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t blockLength;
+};
+#endif
+
+// Uses the hardware accelerated mbedtls implementation on the device and a
+// plain C++ one on the host
+void otaSha256Start(OtaSha256Context* context);
+void otaSha256Update(OtaSha256Context* context, const uint8_t* data, size_t len);
+void otaSha256Finish(OtaSha256Context* context, uint8_t output[OTA_SHA256_LEN]);
+
+// Parses 64 hex digits, as sha256sum prints them
+bool otaSha256FromHex(const char* hex, uint8_t output[OTA_SHA256_LEN]);
+
+#endif // __ESP_OTA_SHA256__
@@ -0,0 +1,162 @@
+#include <string.h>
+
+#include "otaShaper.h"
+
+#define OTA_SHAPER_MIN_READ 1024
+
+// Unshaped until configured, so an update runs as before
+static const OtaShaperConfig defaultShaperConfig = {
+    .shapeClass = OTA_SHAPE_NORMAL,
+    .rateBytesPerS = 0,
+    .burstBytes = 16 * 1024,
+    .yieldToApp = false,
+    .yieldRateBytesPerS = 32 * 1024,
+    .appQuietMicroS = 500000,
+    .maxPauseMicroS = 2000000,
+};
+
+OtaShaper::OtaShaper(HalClock* clock)
+    : clock(clock),
+      config(defaultShaperConfig),
+      appPending(false),
+      lastAppMicroS(-1),
+      tokens(0),
+      refillMicroS(0)
+{
+    memset(&statistics, 0, sizeof(statistics));
+}
+
+void OtaShaper::setConfig(const OtaShaperConfig* shaperConfig)
+{
+    config = *shaperConfig;
+}
+
+const OtaShaperConfig* OtaShaper::getConfig() const
+{
+    return &config;
+}
+
+void OtaShaper::begin()
+{
+    memset(&statistics, 0, sizeof(statistics));
+    tokens = (int64_t)config.burstBytes * 1000000;
+    refillMicroS = clock->nowMicroS();
+}
+
+size_t OtaShaper::limitRead(size_t wanted) const
+{
+    if (config.shapeClass == OTA_SHAPE_URGENT || (config.rateBytesPerS == 0 && !config.yieldToApp))
+    {
+        return wanted;
+    }
+
+    size_t limit = config.burstBytes > OTA_SHAPER_MIN_READ ? config.burstBytes : OTA_SHAPER_MIN_READ;
+    return wanted < limit ? wanted : limit;
+}
+
+int64_t OtaShaper::consume(size_t bytes)
+{
+    int64_t now = clock->nowMicroS();
+
+    if (appPending)
+    {
+        appPending = false;
+        lastAppMicroS = now;
+    }
+
+    if (config.shapeClass == OTA_SHAPE_URGENT)
+    {
+        return 0;
+    }
+
+    bool yielding = appBusy();
+    uint32_t rate = config.rateBytesPerS;
+
+    if (yielding && config.shapeClass == OTA_SHAPE_BACKGROUND)
+    {
+        // Sit out the application's traffic, the bucket starts over after
+        int64_t pause = lastAppMicroS + config.appQuietMicroS - now;
+        pause = pause < config.maxPauseMicroS ? pause : config.maxPauseMicroS;
+
+        tokens = 0;
+        refillMicroS = now + pause;
+        statistics.waits++;
+        statistics.yields++;
+        statistics.waitMicroS += pause;
+        return pause;
+    }
+
+    if (yielding && (rate == 0 || config.yieldRateBytesPerS < rate))
+    {
+        rate = config.yieldRateBytesPerS;
+    }
+
+    if (rate == 0)
+    {
+        return 0;
+    }
+
+    int64_t burst = (int64_t)config.burstBytes * 1000000;
+
+    if (now > refillMicroS)
+    {
+        tokens += (now - refillMicroS) * rate;
+        refillMicroS = now;
+    }
+
+    if (tokens > burst)
+    {
+        tokens = burst;
+    }
+
+    tokens -= (int64_t)bytes * 1000000;
+
+    if (tokens >= 0)
+    {
+        return 0;
+    }
+
+    int64_t wait = (-tokens + rate - 1) / rate;
+    statistics.waits++;
+    statistics.waitMicroS += wait;
+    if (yielding && rate != config.rateBytesPerS)
+    {
+        statistics.yields++;
+    }
+
+    return wait;
+}
+
+void OtaShaper::noteAppTraffic()
+{
+    appPending = true;
+}
+
+bool OtaShaper::appBusy() const
+{
+    if (!config.yieldToApp)
+    {
+        return false;
+    }
+
+    return appPending || (lastAppMicroS >= 0 && clock->nowMicroS() - lastAppMicroS < config.appQuietMicroS);
+}
+
+void OtaShaper::stats(OtaShaperStats* output) const
+{
+    *output = statistics;
+}
+
+const char* otaShapeClassName(OtaShapeClass shapeClass)
+{
+    switch (shapeClass)
+    {
+    case OTA_SHAPE_URGENT:
+        return "urgent";
+    case OTA_SHAPE_NORMAL:
+        return "normal";
+    case OTA_SHAPE_BACKGROUND:
+        return "background";
+    }
+    return "unknown";
+}
@@ -0,0 +1,81 @@
+#ifndef __ESP_OTA_SHAPER__
+#define __ESP_OTA_SHAPER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+enum OtaShapeClass {
+    // Full speed, rate and yielding ignored: a fix that has to land now
+    OTA_SHAPE_URGENT,
+    // Held to the configured rate, to the yield rate while the application
+    // has traffic
+    OTA_SHAPE_NORMAL,
+    // Like normal, but stops reading while the application has traffic and
+    // runs the download task at the lowest priority
+    OTA_SHAPE_BACKGROUND,
+};
+
+struct OtaShaperConfig {
+    OtaShapeClass shapeClass;
+    // Sustained download rate, 0 for no limit
+    uint32_t rateBytesPerS;
+    // Most a bucket that filled up while idle lets through back to back,
+    // also the largest single read while shaping
+    uint32_t burstBytes;
+    bool yieldToApp;
+    uint32_t yieldRateBytesPerS;
+    // The application counts as busy this long after its last traffic
+    int64_t appQuietMicroS;
+    // Longest stop of a background download, so the server does not time
+    // the connection out
+    int64_t maxPauseMicroS;
+};
+
+struct OtaShaperStats {
+    uint32_t waits;
+    int64_t waitMicroS;
+    // Waits caused by application traffic
+    uint32_t yields;
+};
+
+// Token bucket on the download path. The caller reads at most limitRead()
+// bytes, charges them with consume() and waits for what it returns before
+// reading again; a read larger than the tokens left puts the bucket in debt.
+// Waiting on the socket closes the TCP window, so the server slows down
+// instead of filling the radio and lwIP queues.
+class OtaShaper {
+public:
+    explicit OtaShaper(HalClock* clock);
+
+    // Applies from the next consume(), callable from any task
+    void setConfig(const OtaShaperConfig* config);
+    const OtaShaperConfig* getConfig() const;
+
+    // Starts a download with a full bucket and cleared stats
+    void begin();
+    size_t limitRead(size_t wanted) const;
+    // Returns the wait in microseconds before the next read
+    int64_t consume(size_t bytes);
+
+    // Callable from any task, whenever the application sends or receives
+    void noteAppTraffic();
+    bool appBusy() const;
+
+    void stats(OtaShaperStats* output) const;
+
+private:
+    HalClock* clock;
+    OtaShaperConfig config;
+    OtaShaperStats statistics;
+    volatile bool appPending;
+    int64_t lastAppMicroS;
+    // In bytes times 1000000, refilled at the rate per microsecond
+    int64_t tokens;
+    int64_t refillMicroS;
+};
+
+const char* otaShapeClassName(OtaShapeClass shapeClass);
+
+#endif // __ESP_OTA_SHAPER__
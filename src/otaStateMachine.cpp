@@ -0,0 +1,109 @@
+#include "otaStateMachine.h"
+
+static bool isTerminal(int state)
+{
+    return state == OTA_STATE_IDLE ||
+           state == OTA_STATE_SUCCEEDED ||
+           state == OTA_STATE_FAILED ||
+           state == OTA_STATE_CANCELLED ||
+           state == OTA_STATE_ABORTED;
+}
+
+bool OtaStateMachine::tryStart()
+{
+    int expected = currentState.load();
+
+    do
+    {
+        if (!isTerminal(expected))
+        {
+            return false;
+        }
+    } while (!currentState.compare_exchange_weak(expected, OTA_STATE_RUNNING));
+
+    currentStopReason.store(OTA_STOP_NONE);
+    return true;
+}
+
+bool OtaStateMachine::requestStop(OtaStopReason reason)
+{
+    int expected = OTA_STATE_RUNNING;
+
+    if (!currentState.compare_exchange_strong(expected, OTA_STATE_STOPPING))
+    {
+        return false;
+    }
+
+    currentStopReason.store(reason);
+    return true;
+}
+
+bool OtaStateMachine::stopRequested() const
+{
+    return currentState.load() == OTA_STATE_STOPPING;
+}
+
+void OtaStateMachine::finish(bool succeeded)
+{
+    int state = currentState.load();
+
+    if (state == OTA_STATE_STOPPING)
+    {
+        currentState.store(currentStopReason.load() == OTA_STOP_CANCEL ? OTA_STATE_CANCELLED : OTA_STATE_ABORTED);
+    }
+    else if (state == OTA_STATE_RUNNING)
+    {
+        currentState.store(succeeded ? OTA_STATE_SUCCEEDED : OTA_STATE_FAILED);
+    }
+}
+
+OtaState OtaStateMachine::state() const
+{
+    return (OtaState)currentState.load();
+}
+
+OtaStopReason OtaStateMachine::stopReason() const
+{
+    return (OtaStopReason)currentStopReason.load();
+}
+
+bool OtaStateMachine::isActive() const
+{
+    return !isTerminal(currentState.load());
+}
+
+const char* otaStateName(OtaState state)
+{
+    switch (state)
+    {
+    case OTA_STATE_IDLE:
+        return "idle";
+    case OTA_STATE_RUNNING:
+        return "running";
+    case OTA_STATE_STOPPING:
+        return "stopping";
+    case OTA_STATE_SUCCEEDED:
+        return "succeeded";
+    case OTA_STATE_FAILED:
+        return "failed";
+    case OTA_STATE_CANCELLED:
+        return "cancelled";
+    case OTA_STATE_ABORTED:
+        return "aborted";
+    }
+    return "unknown";
+}
+
+const char* otaStopReasonName(OtaStopReason reason)
+{
+    switch (reason)
+    {
+    case OTA_STOP_NONE:
+        return "none";
+    case OTA_STOP_CANCEL:
+        return "cancel";
+    case OTA_STOP_ABORT:
+        return "abort";
+    }
+    return "unknown";
+}
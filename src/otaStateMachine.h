@@ -0,0 +1,48 @@
+#ifndef __ESP_OTA_STATE_MACHINE__
+#define __ESP_OTA_STATE_MACHINE__
+
+#include <atomic>
+
+enum OtaState {
+    OTA_STATE_IDLE,
+    OTA_STATE_RUNNING,
+    OTA_STATE_STOPPING,
+    OTA_STATE_SUCCEEDED,
+    OTA_STATE_FAILED,
+    OTA_STATE_CANCELLED,
+    OTA_STATE_ABORTED,
+};
+
+enum OtaStopReason {
+    OTA_STOP_NONE,
+    // Operator no longer wants the update, not counted as a failure
+    OTA_STOP_CANCEL,
+    // Update must not be applied (bad push, wrong image), counted as a failure
+    OTA_STOP_ABORT,
+};
+
+// Single owner of the update lifecycle. Commands arrive from the web server
+// task while the update task polls stopRequested() between chunks, so every
+// transition is a compare-and-swap on one atomic word.
+class OtaStateMachine {
+public:
+    // Returns false when an update is already running or stopping
+    bool tryStart();
+    bool requestStop(OtaStopReason reason);
+    bool stopRequested() const;
+    // Moves RUNNING/STOPPING to the terminal state matching the outcome
+    void finish(bool succeeded);
+
+    OtaState state() const;
+    OtaStopReason stopReason() const;
+    bool isActive() const;
+
+private:
+    std::atomic<int> currentState{OTA_STATE_IDLE};
+    std::atomic<int> currentStopReason{OTA_STOP_NONE};
+};
+
+const char* otaStateName(OtaState state);
+const char* otaStopReasonName(OtaStopReason reason);
+
+#endif // __ESP_OTA_STATE_MACHINE__
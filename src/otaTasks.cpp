@@ -0,0 +1,194 @@
+#include <string.h>
+#include <esp_timer.h>
+
+#include "sdkconfig.h"
+#include "smartLogger.h"
+#include "otaTasks.h"
+
+// Wi-Fi and LwIP are pinned to core 0, the Arduino loop runs on core 1. The
+// download and flash-write tasks sit next to the loop so they never preempt
+// the network stack, the writer one step above the downloader so a filled
+// chunk is flushed before the next read is issued.
+OtaTaskConfig otaTaskConfig = {
+    .download = {
+        .stackSize = 8192,
+        .priority = 5,
+        .core = 1,
+    },
+    .flashWrite = {
+        .stackSize = 4096,
+        .priority = 6,
+        .core = 1,
+    },
+    .logging = {
+        .stackSize = 4096,
+        .priority = 2,
+        .core = 0,
+    },
+    .profiling = false,
+};
+
+void configureOtaTasks(const OtaTaskConfig* config)
+{
+    otaTaskConfig = *config;
+}
+
+BaseType_t createOtaTask(TaskFunction_t function, const char* name, const OtaTaskPlacement* placement, void* parameter, TaskHandle_t* handle)
+{
+    return xTaskCreatePinnedToCore(
+        function,
+        name,
+        placement->stackSize,
+        parameter,
+        placement->priority,
+        handle,
+        placement->core
+    );
+}
+
+static const char* const otaLongLivedTasks[] = {"loopTask", "async_tcp", "smartLogTask", "scrubTask", "wifiManagerTask"};
+
+// Names are copied, the TCB holding the original goes away with the task
+static char otaRecordedStackNames[OTA_METRICS_MAX_TASKS][configMAX_TASK_NAME_LEN];
+static OtaTaskStackMetrics otaRecordedStacks[OTA_METRICS_MAX_TASKS];
+static int otaRecordedStackCount = 0;
+static portMUX_TYPE otaRecordedStackLock = portMUX_INITIALIZER_UNLOCKED;
+
+void otaTaskRecordStack()
+{
+    const char* name = pcTaskGetName(NULL);
+    uint32_t highWater = uxTaskGetStackHighWaterMark(NULL);
+
+    taskENTER_CRITICAL(&otaRecordedStackLock);
+
+    int i = 0;
+    while (i < otaRecordedStackCount && strcmp(otaRecordedStacks[i].name, name) != 0)
+    {
+        i++;
+    }
+
+    if (i < otaRecordedStackCount)
+    {
+        if (highWater < otaRecordedStacks[i].highWaterBytes)
+        {
+            otaRecordedStacks[i].highWaterBytes = highWater;
+        }
+    }
+    else if (i < OTA_METRICS_MAX_TASKS)
+    {
+        strncpy(otaRecordedStackNames[i], name, configMAX_TASK_NAME_LEN - 1);
+        otaRecordedStackNames[i][configMAX_TASK_NAME_LEN - 1] = 0;
+        otaRecordedStacks[i].name = otaRecordedStackNames[i];
+        otaRecordedStacks[i].highWaterBytes = highWater;
+        otaRecordedStackCount++;
+    }
+
+    taskEXIT_CRITICAL(&otaRecordedStackLock);
+}
+
+int otaTaskStacks(OtaTaskStackMetrics* output, int max)
+{
+    int count = 0;
+
+    for (const char* name : otaLongLivedTasks)
+    {
+        TaskHandle_t task = xTaskGetHandle(name);
+
+        if (task != NULL && count < max)
+        {
+            // ESP-IDF reports stack in bytes
+            output[count].name = name;
+            output[count].highWaterBytes = uxTaskGetStackHighWaterMark(task);
+            count++;
+        }
+    }
+
+    taskENTER_CRITICAL(&otaRecordedStackLock);
+
+    for (int i = 0; i < otaRecordedStackCount && count < max; i++)
+    {
+        output[count++] = otaRecordedStacks[i];
+    }
+
+    taskEXIT_CRITICAL(&otaRecordedStackLock);
+    return count;
+}
+
+#ifdef CONFIG_FREERTOS_RUN_TIME_STATS_USING_ESP_TIMER
+#define OTA_PROFILE_RUN_TIME_UNIT "us"
+#else
+#define OTA_PROFILE_RUN_TIME_UNIT "counts"
+#endif
+
+// Looked up by name, smartLogTask's profile is started from another task
+static uint32_t otaProfileRunTime(const char* name)
+{
+#if OTA_PROFILE_RUN_TIME
+    TaskHandle_t task = xTaskGetHandle(name);
+    TaskStatus_t status;
+
+    if (task != NULL)
+    {
+        vTaskGetInfo(task, &status, pdFALSE, eRunning);
+        return status.ulRunTimeCounter;
+    }
+#else
+    (void)name;
+#endif
+    return 0;
+}
+
+void otaProfileStart(OtaTaskProfile* profile, const char* name)
+{
+    profile->name = name;
+    profile->startMicroS = esp_timer_get_time();
+    profile->endMicroS = profile->startMicroS;
+    profile->waitMicroS = 0;
+    profile->waitStartMicroS = 0;
+    profile->waitCount = 0;
+    profile->runTime = otaProfileRunTime(name);
+}
+
+void otaProfileWaitBegin(OtaTaskProfile* profile)
+{
+    if (otaTaskConfig.profiling)
+    {
+        profile->waitStartMicroS = esp_timer_get_time();
+    }
+}
+
+void otaProfileWaitEnd(OtaTaskProfile* profile)
+{
+    if (otaTaskConfig.profiling)
+    {
+        profile->waitMicroS += esp_timer_get_time() - profile->waitStartMicroS;
+        profile->waitCount++;
+    }
+}
+
+void otaProfileStop(OtaTaskProfile* profile)
+{
+    profile->endMicroS = esp_timer_get_time();
+    // Unsigned, a counter that wrapped once still gives the difference
+    profile->runTime = otaProfileRunTime(profile->name) - profile->runTime;
+}
+
+void otaProfileReport(const OtaTaskProfile* profile)
+{
+    if (!otaTaskConfig.profiling)
+    {
+        return;
+    }
+
+    int64_t wallMicroS = profile->endMicroS - profile->startMicroS;
+
+    SMART_LOGI("Profile", "%s: wall %lld us, active %lld us, waits %u",
+               profile->name,
+               wallMicroS,
+               wallMicroS - profile->waitMicroS,
+               profile->waitCount);
+
+#if OTA_PROFILE_RUN_TIME
+    SMART_LOGI("Profile", "%s: cpu %u " OTA_PROFILE_RUN_TIME_UNIT, profile->name, profile->runTime);
+#endif
+}
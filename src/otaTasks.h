@@ -0,0 +1,61 @@
+#ifndef __ESP_OTA_TASKS__
+#define __ESP_OTA_TASKS__
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "otaApi.h"
+
+struct OtaTaskPlacement {
+    uint32_t stackSize;
+    UBaseType_t priority;
+    // 0, 1 or tskNO_AFFINITY
+    BaseType_t core;
+};
+
+struct OtaTaskConfig {
+    OtaTaskPlacement download;
+    OtaTaskPlacement flashWrite;
+    OtaTaskPlacement logging;
+    // Record per-task active time, CPU time where run time stats are
+    // compiled in, and blocking waits during an update
+    bool profiling;
+};
+
+// CPU time of a task comes from the FreeRTOS run time counter, which the
+// shipped sdkconfig leaves out
+#define OTA_PROFILE_RUN_TIME (configUSE_TRACE_FACILITY && configGENERATE_RUN_TIME_STATS)
+
+// Time a pipeline task spends blocked on its queues. Every wait is a
+// voluntary context switch, so waitCount approximates the switch count even
+// when FreeRTOS run time stats are compiled out. Wall time less the waits is
+// only active time, preemption and blocking on locks or flash count in it.
+struct OtaTaskProfile {
+    const char* name;
+    int64_t startMicroS;
+    int64_t endMicroS;
+    int64_t waitMicroS;
+    int64_t waitStartMicroS;
+    uint32_t waitCount;
+    // Run time counter at start, then the task's share of the window
+    uint32_t runTime;
+};
+
+extern OtaTaskConfig otaTaskConfig;
+
+void configureOtaTasks(const OtaTaskConfig* config);
+BaseType_t createOtaTask(TaskFunction_t function, const char* name, const OtaTaskPlacement* placement, void* parameter, TaskHandle_t* handle);
+
+// Stack high-water marks for /metrics. Long lived tasks are looked up by
+// name on every call, tasks that delete themselves call otaTaskRecordStack
+// right before vTaskDelete(NULL) so their last mark survives them.
+void otaTaskRecordStack();
+int otaTaskStacks(OtaTaskStackMetrics* output, int max);
+
+void otaProfileStart(OtaTaskProfile* profile, const char* name);
+void otaProfileWaitBegin(OtaTaskProfile* profile);
+void otaProfileWaitEnd(OtaTaskProfile* profile);
+void otaProfileStop(OtaTaskProfile* profile);
+void otaProfileReport(const OtaTaskProfile* profile);
+
+#endif // __ESP_OTA_TASKS__
@@ -0,0 +1,153 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "otaBundle.h"
+#include "otaPartitionWriter.h"
+#include "otaTransfer.h"
+
+const char* runOtaTransfer(const OtaTransfer* transfer, const char* url, OtaTransferStats* stats)
+{
+    HalHttpTransport* transport = transfer->transport;
+    PartitionBundleSink sink(transfer->partitions, transfer->sectorBuffer, transfer->eraseStrategy);
+    OtaBundleReader reader(&sink);
+    const char* error = nullptr;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->startMicroS = transfer->clock->nowMicroS();
+    stats->imageCheck = OTA_IMAGE_UNCHECKED;
+
+    if (transfer->running != nullptr && transfer->readBufferSize >= OTA_IMAGE_CHECK_FETCH_SIZE)
+    {
+        OtaImageCheck check(transfer->partitions, transfer->running);
+        stats->imageCheck = otaCheckRemoteImage(transport, url, &check, transfer->readBuffer);
+
+        if (stats->imageCheck != OTA_IMAGE_OK && stats->imageCheck != OTA_IMAGE_UNCHECKED)
+        {
+            error = otaImageVerdictName(stats->imageCheck);
+        }
+    }
+
+    if (transfer->shaper != nullptr)
+    {
+        transfer->shaper->begin();
+    }
+
+    if (error == nullptr && !transport->open(url))
+    {
+        error = "connect";
+    }
+    else if (error == nullptr)
+    {
+        stats->status = transport->statusCode();
+        stats->contentLength = transport->contentLength();
+
+        if (stats->status == 304)
+        {
+            error = otaImageVerdictName(OTA_IMAGE_NOT_MODIFIED);
+        }
+        else if (stats->status != 200)
+        {
+            error = "http status";
+        }
+        else if (stats->contentLength > 0)
+        {
+            sink.setContentLength(stats->contentLength);
+        }
+    }
+
+    while (error == nullptr)
+    {
+        if (transfer->shouldStop != nullptr && transfer->shouldStop())
+        {
+            error = "stopped";
+            break;
+        }
+
+        size_t readSize = transfer->readBufferSize;
+        if (transfer->sizer != nullptr && transfer->sizer->readSize() < readSize)
+        {
+            readSize = transfer->sizer->readSize();
+        }
+
+        if (transfer->shaper != nullptr)
+        {
+            readSize = transfer->shaper->limitRead(readSize);
+        }
+
+        int len = transport->read(transfer->readBuffer, readSize);
+
+        if (len < 0)
+        {
+            error = "read";
+        }
+        else if (len == 0)
+        {
+            if (!transport->isComplete())
+            {
+                error = "connection closed early";
+            }
+            break;
+        }
+        else
+        {
+            if (stats->reads == 0)
+            {
+                stats->firstByteMicroS = transfer->clock->nowMicroS();
+            }
+
+            stats->reads++;
+            stats->bytes += len;
+
+            if (transfer->sizer != nullptr)
+            {
+                size_t freeHeap = transfer->freeHeap != nullptr ? transfer->freeHeap() : SIZE_MAX;
+                transfer->sizer->record(len, transfer->clock->nowMicroS(), freeHeap);
+            }
+
+            int64_t waitMicroS = transfer->shaper != nullptr ? transfer->shaper->consume(len) : 0;
+
+            if (!reader.feed(transfer->readBuffer, len))
+            {
+                error = reader.error();
+            }
+            else if ((size_t)len < readSize)
+            {
+                // A short read means the socket ran dry, the network is the
+                // bottleneck and an erase now costs nothing
+                sink.idle();
+            }
+
+            if (waitMicroS > 0)
+            {
+                transfer->clock->sleepMs((waitMicroS + 999) / 1000);
+            }
+        }
+    }
+
+    transport->close();
+
+    if (error == nullptr && !reader.finish())
+    {
+        error = reader.error();
+    }
+
+    if (error == nullptr && !sink.commit())
+    {
+        error = sink.lastError();
+    }
+
+    if (error != nullptr)
+    {
+        sink.abort();
+    }
+
+    stats->readSize = transfer->sizer != nullptr ? transfer->sizer->readSize() : transfer->readBufferSize;
+    stats->readSizeChanges = transfer->sizer != nullptr ? transfer->sizer->adjustments() : 0;
+    stats->flash = *sink.stats();
+    if (transfer->shaper != nullptr)
+    {
+        transfer->shaper->stats(&stats->shaping);
+    }
+    stats->endMicroS = transfer->clock->nowMicroS();
+    return error;
+}
@@ -0,0 +1,55 @@
+#ifndef __ESP_OTA_TRANSFER__
+#define __ESP_OTA_TRANSFER__
+
+#include "hal.h"
+#include "flashWriter.h"
+#include "otaImageCheck.h"
+#include "otaShaper.h"
+#include "receiveSizer.h"
+
+struct OtaTransferStats {
+    int status;
+    int64_t contentLength;
+    size_t bytes;
+    uint32_t reads;
+    // Read size in use at the end and how often the sizer changed it
+    size_t readSize;
+    uint32_t readSizeChanges;
+    int64_t startMicroS;
+    // Headers parsed and first body byte in hand
+    int64_t firstByteMicroS;
+    int64_t endMicroS;
+    OtaImageVerdict imageCheck;
+    OtaShaperStats shaping;
+    FlashWriterStats flash;
+};
+
+struct OtaTransfer {
+    HalHttpTransport* transport;
+    HalPartitions* partitions;
+    HalClock* clock;
+    uint8_t* readBuffer;
+    size_t readBufferSize;
+    // Picks each read size up to readBufferSize, nullptr reads the whole buffer
+    ReceiveSizer* sizer;
+    // Free heap fed to the sizer, may be nullptr
+    size_t (*freeHeap)(void);
+    // FLASH_WRITER_SECTOR_SIZE bytes
+    uint8_t* sectorBuffer;
+    FlashEraseStrategy eraseStrategy;
+    // Polled between reads, may be nullptr
+    bool (*shouldStop)(void);
+    // When set the start of the image is fetched with ranged requests and
+    // checked against it before the download, may be nullptr
+    const OtaAppInfo* running;
+    // Paces the reads, begun by the transfer, may be nullptr
+    OtaShaper* shaper;
+};
+
+// Single threaded version of the device pipeline: same transport, bundle
+// reader, partition sink and flash writer, without the task split. Used by
+// the native build to profile and benchmark the update path. Returns
+// nullptr on success, otherwise what failed.
+const char* runOtaTransfer(const OtaTransfer* transfer, const char* url, OtaTransferStats* stats);
+
+#endif // __ESP_OTA_TRANSFER__
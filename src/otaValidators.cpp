@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include "otaValidators.h"
+
+static uint32_t hashUrl(const char* url)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const char* p = url; *p != 0; p++)
+    {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+
+    return hash;
+}
+
+OtaValidatorStore::OtaValidatorStore(HalStorage* storage, const char* nvsNamespace)
+    : storage(storage),
+      nvsNamespace(nvsNamespace),
+      urlHash(0)
+{
+    memset(&current, 0, sizeof(current));
+}
+
+void OtaValidatorStore::load(const char* url)
+{
+    OtaValidatorsRecord record;
+    size_t len = sizeof(record);
+
+    memset(&current, 0, sizeof(current));
+    urlHash = hashUrl(url);
+
+    if (!storage->open(nvsNamespace, false))
+    {
+        return;
+    }
+
+    if (storage->getBlob(OTA_VALIDATORS_KEY, &record, &len) &&
+        len == sizeof(record) &&
+        record.version == OTA_VALIDATORS_VERSION &&
+        record.urlHash == urlHash)
+    {
+        record.validators.etag[sizeof(record.validators.etag) - 1] = 0;
+        record.validators.lastModified[sizeof(record.validators.lastModified) - 1] = 0;
+        current = record.validators;
+    }
+
+    storage->close();
+}
+
+const HalHttpValidators* OtaValidatorStore::get(const char* url) const
+{
+    return !otaValidatorsEmpty(&current) && hashUrl(url) == urlHash ? &current : nullptr;
+}
+
+void OtaValidatorStore::remember(const char* url, const HalHttpValidators* validators)
+{
+    uint32_t hash = hashUrl(url);
+
+    if (hash == urlHash &&
+        strcmp(validators->etag, current.etag) == 0 &&
+        strcmp(validators->lastModified, current.lastModified) == 0)
+    {
+        return;
+    }
+
+    current = *validators;
+    urlHash = hash;
+    save();
+}
+
+void OtaValidatorStore::clear()
+{
+    if (otaValidatorsEmpty(&current))
+    {
+        return;
+    }
+
+    memset(&current, 0, sizeof(current));
+    save();
+}
+
+void OtaValidatorStore::save()
+{
+    OtaValidatorsRecord record;
+    memset(&record, 0, sizeof(record));
+    record.version = OTA_VALIDATORS_VERSION;
+    record.urlHash = urlHash;
+    record.validators = current;
+
+    if (storage->open(nvsNamespace, true))
+    {
+        if (storage->setBlob(OTA_VALIDATORS_KEY, &record, sizeof(record)))
+        {
+            storage->commit();
+        }
+
+        storage->close();
+    }
+}
+
+bool otaValidatorsEmpty(const HalHttpValidators* validators)
+{
+    return validators->etag[0] == 0 && validators->lastModified[0] == 0;
+}
@@ -0,0 +1,45 @@
+#ifndef __ESP_OTA_VALIDATORS__
+#define __ESP_OTA_VALIDATORS__
+
+#include <stdint.h>
+
+#include "hal.h"
+
+#define OTA_VALIDATORS_KEY "validators"
+#define OTA_VALIDATORS_VERSION 1
+
+struct OtaValidatorsRecord {
+    uint8_t version;
+    // FNV-1a of the url they were answered for
+    uint32_t urlHash;
+    HalHttpValidators validators;
+};
+
+// ETag and Last-Modified of the image last accounted for at the update url:
+// installed, found to be the running build, or cached by a gateway. Sent
+// with the next poll so an unchanged image costs a single 304. Kept in NVS
+// with a hash of the url, a new update source starts without them.
+class OtaValidatorStore {
+public:
+    OtaValidatorStore(HalStorage* storage, const char* nvsNamespace);
+
+    void load(const char* url);
+    // nullptr when there are none for url
+    const HalHttpValidators* get(const char* url) const;
+    // Written only when they changed, so polls that keep getting 304 cost no
+    // flash wear. Empty validators forget the url's.
+    void remember(const char* url, const HalHttpValidators* validators);
+    void clear();
+
+private:
+    void save();
+
+    HalStorage* storage;
+    const char* nvsNamespace;
+    uint32_t urlHash;
+    HalHttpValidators current;
+};
+
+bool otaValidatorsEmpty(const HalHttpValidators* validators);
+
+#endif // __ESP_OTA_VALIDATORS__
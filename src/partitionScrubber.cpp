@@ -0,0 +1,389 @@
+#include <string.h>
+
+#include "partitionScrubber.h"
+
+// esp_image_header_t, then per segment an esp_image_segment_header_t
+#define APP_IMAGE_MAGIC 0xE9
+#define APP_IMAGE_HEADER_SIZE 24
+#define APP_IMAGE_HASH_APPENDED_OFFSET 23
+#define APP_IMAGE_SEGMENT_HEADER_SIZE 8
+#define APP_IMAGE_MAX_SEGMENTS 16
+// The checksum byte ends the image, padded to 16 bytes
+#define APP_IMAGE_ALIGN 16
+
+static const PartitionScrubberConfig defaultScrubberConfig = {
+    .chunkBytes = 4096,
+    .stepBudgetMicroS = 2000,
+    .stepIntervalMicroS = 20000,
+    .passIntervalMicroS = 6 * 3600 * 1000000LL,
+};
+
+PartitionScrubber::PartitionScrubber(HalClock* clock, uint8_t* buffer, size_t bufferSize)
+    : clock(clock),
+      buffer(buffer),
+      bufferSize(bufferSize),
+      config(defaultScrubberConfig),
+      count(0),
+      current(-1)
+{
+    memset(targets, 0, sizeof(targets));
+    memset(&statistics, 0, sizeof(statistics));
+}
+
+void PartitionScrubber::setConfig(const PartitionScrubberConfig* scrubberConfig)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    config = *scrubberConfig;
+}
+
+const PartitionScrubberConfig* PartitionScrubber::getConfig() const
+{
+    return &config;
+}
+
+int PartitionScrubber::addTarget(const char* label, FlashDevice* device, ScrubKind kind)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (count >= PARTITION_SCRUBBER_MAX_TARGETS)
+    {
+        return -1;
+    }
+
+    Target* target = &targets[count];
+    memset(target, 0, sizeof(*target));
+    target->label = label;
+    target->device = device;
+    target->kind = kind;
+    target->status.label = label;
+    target->status.lastPassMicroS = -1;
+    return count++;
+}
+
+int PartitionScrubber::targetCount() const
+{
+    return count;
+}
+
+void PartitionScrubber::setExpected(int index, size_t size, const uint8_t sha256[OTA_SHA256_LEN])
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (index < 0 || index >= count)
+    {
+        return;
+    }
+
+    Target* target = &targets[index];
+    restart(target);
+    target->hasExpected = size > 0;
+    target->expectedSize = size;
+    memcpy(target->expected, sha256, OTA_SHA256_LEN);
+}
+
+void PartitionScrubber::invalidate(int index)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (index >= 0 && index < count)
+    {
+        restart(&targets[index]);
+    }
+}
+
+void PartitionScrubber::checkNow()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        targets[i].nextPassMicroS = 0;
+    }
+}
+
+int64_t PartitionScrubber::step()
+{
+    int64_t start = clock->nowMicroS();
+    Target* target;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+
+        if (current < 0 || !targets[current].pass.running)
+        {
+            int next = dueTarget(start);
+            if (next < 0)
+            {
+                return untilNextPass(start);
+            }
+
+            current = next;
+            startPass(&targets[current]);
+        }
+
+        target = &targets[current];
+    }
+
+    Pass* pass = &target->pass;
+    size_t chunkBytes = config.chunkBytes < bufferSize ? config.chunkBytes : bufferSize;
+    ScrubResult result = pass->measured ? SCRUB_UNCHECKED : measure(target);
+    uint64_t hashed = 0;
+
+    while (result == SCRUB_UNCHECKED && pass->offset < pass->end)
+    {
+        size_t len = pass->end - pass->offset < chunkBytes ? pass->end - pass->offset : chunkBytes;
+
+        if (!target->device->read(pass->offset, buffer, len))
+        {
+            result = SCRUB_READ_ERROR;
+            break;
+        }
+
+        otaSha256Update(&pass->hash, buffer, len);
+        pass->offset += len;
+        hashed += len;
+
+        if (clock->nowMicroS() - start >= config.stepBudgetMicroS)
+        {
+            break;
+        }
+    }
+
+    if (result == SCRUB_UNCHECKED && pass->offset == pass->end)
+    {
+        result = finishPass(target);
+    }
+
+    int64_t now = clock->nowMicroS();
+    std::lock_guard<std::mutex> guard(lock);
+
+    statistics.steps++;
+    statistics.bytesHashed += hashed;
+    statistics.busyMicroS += now - start;
+    if (now - start > statistics.longestStepMicroS)
+    {
+        statistics.longestStepMicroS = now - start;
+    }
+
+    // Rewritten while this step read it, invalidate() already made it due
+    if (pass->generation != target->generation)
+    {
+        pass->running = false;
+        return config.stepIntervalMicroS;
+    }
+
+    target->status.bytesChecked = pass->offset;
+    target->status.imageBytes = pass->end;
+
+    if (result != SCRUB_UNCHECKED)
+    {
+        endPass(target, result, now);
+    }
+
+    return config.stepIntervalMicroS;
+}
+
+bool PartitionScrubber::status(int index, ScrubTargetStatus* output)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (index < 0 || index >= count)
+    {
+        return false;
+    }
+
+    *output = targets[index].status;
+    return true;
+}
+
+void PartitionScrubber::stats(PartitionScrubberStats* output)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    *output = statistics;
+}
+
+// Round robin over the targets a pass is due for
+int PartitionScrubber::dueTarget(int64_t now)
+{
+    for (int i = 1; i <= count; i++)
+    {
+        int index = (current + i + count) % count;
+        Target* target = &targets[index];
+        bool checkable = target->kind == SCRUB_APP_IMAGE || target->expectedSize > 0;
+
+        if (checkable && target->nextPassMicroS <= now)
+        {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+int64_t PartitionScrubber::untilNextPass(int64_t now)
+{
+    int64_t wait = config.passIntervalMicroS;
+
+    for (int i = 0; i < count; i++)
+    {
+        Target* target = &targets[i];
+        bool checkable = target->kind == SCRUB_APP_IMAGE || target->expectedSize > 0;
+
+        if (checkable && target->nextPassMicroS - now < wait)
+        {
+            wait = target->nextPassMicroS - now;
+        }
+    }
+
+    return wait > config.stepIntervalMicroS ? wait : config.stepIntervalMicroS;
+}
+
+// With the lock held
+void PartitionScrubber::restart(Target* target)
+{
+    target->generation++;
+    target->hasExpected = false;
+    target->expectedSize = 0;
+    target->nextPassMicroS = 0;
+    target->status.result = SCRUB_UNCHECKED;
+    target->status.bytesChecked = 0;
+    target->status.imageBytes = 0;
+}
+
+// Takes what the pass is checked against, with the lock held
+void PartitionScrubber::startPass(Target* target)
+{
+    Pass* pass = &target->pass;
+
+    pass->running = true;
+    pass->measured = target->kind == SCRUB_DIGEST;
+    pass->generation = target->generation;
+    pass->offset = 0;
+    pass->end = target->kind == SCRUB_DIGEST ? target->expectedSize : 0;
+    pass->hashAppended = false;
+    pass->hasExpected = target->hasExpected;
+    memcpy(pass->expected, target->expected, OTA_SHA256_LEN);
+    otaSha256Start(&pass->hash);
+}
+
+// Walks the segment headers to the end of the image like esp_image_verify,
+// a few small reads
+ScrubResult PartitionScrubber::measure(Target* target)
+{
+    Pass* pass = &target->pass;
+    FlashDevice* device = target->device;
+    size_t size = device->size();
+
+    if (!device->read(0, buffer, APP_IMAGE_HEADER_SIZE))
+    {
+        return SCRUB_READ_ERROR;
+    }
+
+    int segments = buffer[1];
+    if (buffer[0] != APP_IMAGE_MAGIC || segments == 0 || segments > APP_IMAGE_MAX_SEGMENTS)
+    {
+        return SCRUB_NO_IMAGE;
+    }
+
+    pass->hashAppended = buffer[APP_IMAGE_HASH_APPENDED_OFFSET] == 1;
+    size_t offset = APP_IMAGE_HEADER_SIZE;
+
+    for (int i = 0; i < segments; i++)
+    {
+        if (offset + APP_IMAGE_SEGMENT_HEADER_SIZE > size || !device->read(offset, buffer, APP_IMAGE_SEGMENT_HEADER_SIZE))
+        {
+            return offset + APP_IMAGE_SEGMENT_HEADER_SIZE > size ? SCRUB_NO_IMAGE : SCRUB_READ_ERROR;
+        }
+
+        uint32_t dataLen = buffer[4] | buffer[5] << 8 | buffer[6] << 16 | (uint32_t)buffer[7] << 24;
+        if (dataLen > size)
+        {
+            return SCRUB_NO_IMAGE;
+        }
+
+        offset += APP_IMAGE_SEGMENT_HEADER_SIZE + dataLen;
+    }
+
+    size_t end = (offset + 1 + APP_IMAGE_ALIGN - 1) & ~(size_t)(APP_IMAGE_ALIGN - 1);
+    if (end + (pass->hashAppended ? OTA_SHA256_LEN : 0) > size)
+    {
+        return SCRUB_NO_IMAGE;
+    }
+
+    pass->end = end;
+    pass->measured = true;
+    return SCRUB_UNCHECKED;
+}
+
+ScrubResult PartitionScrubber::finishPass(Target* target)
+{
+    Pass* pass = &target->pass;
+
+    otaSha256Finish(&pass->hash, pass->sha256);
+
+    if (pass->hashAppended)
+    {
+        if (!target->device->read(pass->end, pass->expected, OTA_SHA256_LEN))
+        {
+            return SCRUB_READ_ERROR;
+        }
+
+        pass->hasExpected = true;
+    }
+
+    // The first pass over an image without a hash becomes its reference
+    if (!pass->hasExpected)
+    {
+        return SCRUB_INTACT;
+    }
+
+    return memcmp(pass->sha256, pass->expected, OTA_SHA256_LEN) == 0 ? SCRUB_INTACT : SCRUB_CORRUPT;
+}
+
+// With the lock held
+void PartitionScrubber::endPass(Target* target, ScrubResult result, int64_t now)
+{
+    Pass* pass = &target->pass;
+
+    pass->running = false;
+    target->nextPassMicroS = now + config.passIntervalMicroS;
+    target->status.result = result;
+    target->status.passes++;
+    target->status.bytesChecked = 0;
+    target->status.lastPassMicroS = now;
+    statistics.passes++;
+
+    if (result == SCRUB_INTACT || result == SCRUB_CORRUPT)
+    {
+        memcpy(target->status.sha256, pass->sha256, OTA_SHA256_LEN);
+    }
+
+    if (result == SCRUB_CORRUPT)
+    {
+        statistics.corruptFound++;
+    }
+
+    if (target->kind == SCRUB_APP_IMAGE && !pass->hashAppended && result == SCRUB_INTACT && !target->hasExpected)
+    {
+        target->hasExpected = true;
+        memcpy(target->expected, pass->sha256, OTA_SHA256_LEN);
+    }
+}
+
+const char* scrubResultName(ScrubResult result)
+{
+    switch (result)
+    {
+    case SCRUB_UNCHECKED:
+        return "unchecked";
+    case SCRUB_INTACT:
+        return "intact";
+    case SCRUB_CORRUPT:
+        return "corrupt";
+    case SCRUB_NO_IMAGE:
+        return "no image";
+    case SCRUB_READ_ERROR:
+        return "read error";
+    }
+    return "unknown";
+}
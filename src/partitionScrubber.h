@@ -0,0 +1,155 @@
+#ifndef __ESP_PARTITION_SCRUBBER__
+#define __ESP_PARTITION_SCRUBBER__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+
+#include "hal.h"
+#include "flashWriter.h"
+#include "otaSha256.h"
+
+#define PARTITION_SCRUBBER_MAX_TARGETS 4
+
+enum ScrubKind {
+    // An ESP app image, checked against the SHA-256 esptool appends the way
+    // esp_partition_get_sha256 reads it
+    SCRUB_APP_IMAGE,
+    // Bytes from offset 0 with a digest known from elsewhere, setExpected()
+    SCRUB_DIGEST,
+};
+
+enum ScrubResult {
+    SCRUB_UNCHECKED,
+    SCRUB_INTACT,
+    SCRUB_CORRUPT,
+    // Erased or not an image, nothing to check
+    SCRUB_NO_IMAGE,
+    SCRUB_READ_ERROR,
+};
+
+struct PartitionScrubberConfig {
+    // Longest single flash read. On the device a read stops the flash cache,
+    // so it is also the longest a foreground task may stall on it.
+    size_t chunkBytes;
+    // A step stops reading once it took this long, after one chunk at least
+    int64_t stepBudgetMicroS;
+    // Rest between steps, bounds the share of flash and CPU time taken
+    int64_t stepIntervalMicroS;
+    // From the end of a target's pass to its next one
+    int64_t passIntervalMicroS;
+};
+
+struct ScrubTargetStatus {
+    const char* label;
+    // Of the last finished pass
+    ScrubResult result;
+    uint32_t passes;
+    // Progress of the pass running now, 0 between passes
+    size_t bytesChecked;
+    // 0 until a pass found the image
+    size_t imageBytes;
+    // -1 before the first finished pass
+    int64_t lastPassMicroS;
+    // What the last finished pass hashed
+    uint8_t sha256[OTA_SHA256_LEN];
+};
+
+struct PartitionScrubberStats {
+    uint32_t passes;
+    uint32_t corruptFound;
+    uint64_t bytesHashed;
+    uint32_t steps;
+    int64_t longestStepMicroS;
+    // Time spent inside step()
+    int64_t busyMicroS;
+};
+
+// Re-hashes partitions that are not running, the inactive app slot and the
+// gateway's cache, to catch flash that went bad before it is booted or
+// served. Work is cut into short steps polled from one low priority task;
+// each step reads chunkBytes at a time for at most stepBudgetMicroS, so
+// whatever needs the flash meanwhile waits one chunk at most. status() and
+// stats() are safe from any task.
+class PartitionScrubber {
+public:
+    // buffer holds bufferSize bytes and outlives the scrubber, chunkBytes is
+    // capped to it
+    PartitionScrubber(HalClock* clock, uint8_t* buffer, size_t bufferSize);
+
+    void setConfig(const PartitionScrubberConfig* config);
+    const PartitionScrubberConfig* getConfig() const;
+
+    // The index of the new target, -1 when full. label must outlive the
+    // scrubber.
+    int addTarget(const char* label, FlashDevice* device, ScrubKind kind);
+    int targetCount() const;
+    // For SCRUB_DIGEST targets, size 0 leaves nothing to check. Restarts the
+    // target like invalidate().
+    void setExpected(int target, size_t size, const uint8_t sha256[OTA_SHA256_LEN]);
+    // The target was rewritten: drops its running pass and last result and
+    // checks it again on the next step
+    void invalidate(int target);
+    // Every target is due on the next step, what they are checked against stays
+    void checkNow();
+
+    // Hashes for up to stepBudgetMicroS, returns how long to wait before the
+    // next call
+    int64_t step();
+
+    bool status(int target, ScrubTargetStatus* output);
+    void stats(PartitionScrubberStats* output);
+
+private:
+    // Owned by the task calling step(), the lock is not held while it reads
+    struct Pass {
+        bool running;
+        bool measured;
+        uint32_t generation;
+        size_t offset;
+        size_t end;
+        bool hashAppended;
+        bool hasExpected;
+        uint8_t expected[OTA_SHA256_LEN];
+        uint8_t sha256[OTA_SHA256_LEN];
+        OtaSha256Context hash;
+    };
+
+    struct Target {
+        const char* label;
+        FlashDevice* device;
+        ScrubKind kind;
+        // Bumped by invalidate(), a pass that read the old content is dropped
+        uint32_t generation;
+        // An image without an appended hash is compared with its last pass
+        bool hasExpected;
+        size_t expectedSize;
+        uint8_t expected[OTA_SHA256_LEN];
+        int64_t nextPassMicroS;
+        ScrubTargetStatus status;
+        Pass pass;
+    };
+
+    void restart(Target* target);
+    int dueTarget(int64_t now);
+    int64_t untilNextPass(int64_t now);
+    void startPass(Target* target);
+    ScrubResult measure(Target* target);
+    ScrubResult finishPass(Target* target);
+    void endPass(Target* target, ScrubResult result, int64_t now);
+
+    HalClock* clock;
+    uint8_t* buffer;
+    size_t bufferSize;
+    PartitionScrubberConfig config;
+    std::mutex lock;
+    Target targets[PARTITION_SCRUBBER_MAX_TARGETS];
+    int count;
+    // Round robin position, the target with a pass running if any
+    int current;
+    PartitionScrubberStats statistics;
+};
+
+const char* scrubResultName(ScrubResult result);
+
+#endif // __ESP_PARTITION_SCRUBBER__
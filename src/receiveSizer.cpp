@@ -0,0 +1,107 @@
+#include "receiveSizer.h"
+
+// A window has to beat the previous one by this much (in 1/100) to count
+#define RECEIVE_SIZER_GAIN_PERCENT 5
+
+ReceiveSizer::ReceiveSizer(const ReceiveSizerConfig* sizerConfig)
+    : config(*sizerConfig),
+      current(sizerConfig->initialReadSize),
+      direction(1),
+      windowStartMicroS(-1),
+      windowBytes(0),
+      previousThroughput(0),
+      throughput(0),
+      changes(0)
+{
+    if (current < config.minReadSize)
+    {
+        current = config.minReadSize;
+    }
+
+    if (current > config.maxReadSize)
+    {
+        current = config.maxReadSize;
+    }
+}
+
+size_t ReceiveSizer::readSize() const
+{
+    return current;
+}
+
+void ReceiveSizer::record(size_t bytes, int64_t nowMicroS, size_t freeHeap)
+{
+    if (freeHeap < config.lowHeapBytes)
+    {
+        if (current != config.minReadSize)
+        {
+            current = config.minReadSize;
+            direction = 1;
+            changes++;
+        }
+
+        windowStartMicroS = nowMicroS;
+        windowBytes = 0;
+        previousThroughput = 0;
+        return;
+    }
+
+    if (windowStartMicroS < 0)
+    {
+        windowStartMicroS = nowMicroS;
+    }
+
+    windowBytes += bytes;
+    int64_t elapsed = nowMicroS - windowStartMicroS;
+
+    if (elapsed < config.windowMicroS)
+    {
+        return;
+    }
+
+    throughput = (uint32_t)(windowBytes * 1000000 / elapsed);
+    windowStartMicroS = nowMicroS;
+    windowBytes = 0;
+
+    if (previousThroughput > 0 &&
+        (uint64_t)throughput * 100 < (uint64_t)previousThroughput * (100 + RECEIVE_SIZER_GAIN_PERCENT))
+    {
+        // The last step did not pay off, turn around
+        direction = -direction;
+    }
+
+    previousThroughput = throughput;
+
+    size_t next = direction > 0 ? current * 2 : current / 2;
+    if (next < config.minReadSize || next > config.maxReadSize)
+    {
+        direction = -direction;
+        return;
+    }
+
+    current = next;
+    changes++;
+}
+
+uint32_t ReceiveSizer::adjustments() const
+{
+    return changes;
+}
+
+uint32_t ReceiveSizer::lastThroughput() const
+{
+    return throughput;
+}
+
+size_t chooseBufferSize(size_t freeBytes, size_t reserveBytes, size_t minSize, size_t maxSize, int count)
+{
+    for (size_t size = maxSize; size >= minSize && size > 0; size /= 2)
+    {
+        if (freeBytes > reserveBytes && (freeBytes - reserveBytes) / count >= size)
+        {
+            return size;
+        }
+    }
+
+    return 0;
+}
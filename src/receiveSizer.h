@@ -0,0 +1,49 @@
+#ifndef __ESP_RECEIVE_SIZER__
+#define __ESP_RECEIVE_SIZER__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ReceiveSizerConfig {
+    size_t minReadSize;
+    // Never more than the buffer the caller reads into
+    size_t maxReadSize;
+    size_t initialReadSize;
+    // Below this much free heap reads drop to minReadSize
+    size_t lowHeapBytes;
+    // Throughput is sampled over windows of this length
+    int64_t windowMicroS;
+};
+
+// Hill climbing over the read size: double it while throughput improves,
+// step back when a change made things worse, and fall to the minimum when
+// the heap runs low. Sizes are powers of two so reads line up with flash
+// sectors and TLS records.
+class ReceiveSizer {
+public:
+    explicit ReceiveSizer(const ReceiveSizerConfig* config);
+
+    size_t readSize() const;
+    // Reports one read; freeHeap is what the allocator has left right now
+    void record(size_t bytes, int64_t nowMicroS, size_t freeHeap);
+
+    uint32_t adjustments() const;
+    // Throughput of the last complete window in bytes per second
+    uint32_t lastThroughput() const;
+
+private:
+    ReceiveSizerConfig config;
+    size_t current;
+    int direction;
+    int64_t windowStartMicroS;
+    size_t windowBytes;
+    uint32_t previousThroughput;
+    uint32_t throughput;
+    uint32_t changes;
+};
+
+// Largest power-of-two buffer between minSize and maxSize that leaves
+// reserveBytes of the given free memory untouched, 0 if none fits
+size_t chooseBufferSize(size_t freeBytes, size_t reserveBytes, size_t minSize, size_t maxSize, int count);
+
+#endif // __ESP_RECEIVE_SIZER__
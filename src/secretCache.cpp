@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include "secretCache.h"
+
+// Through a volatile pointer so the compiler cannot drop it as a dead store
+static void clearMemory(void* memory, size_t len)
+{
+    volatile uint8_t* p = (volatile uint8_t*)memory;
+
+    while (len-- > 0)
+    {
+        *p++ = 0;
+    }
+}
+
+SecretCache::SecretCache(HalStorage* storage, HalClock* clock)
+    : storage(storage),
+      clock(clock),
+      nvsNamespace(nullptr),
+      buffers{ssid, password, caCert},
+      sizes{sizeof(ssid), sizeof(password), sizeof(caCert)}
+{
+    memset(keys, 0, sizeof(keys));
+    memset(present, 0, sizeof(present));
+    memset(borrowers, 0, sizeof(borrowers));
+    memset(&statistics, 0, sizeof(statistics));
+    ssid[0] = 0;
+    password[0] = 0;
+    caCert[0] = 0;
+}
+
+void SecretCache::setKeys(const char* secretNamespace, const char* ssidKey, const char* passwordKey, const char* caCertKey)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    nvsNamespace = secretNamespace;
+    keys[SECRET_WIFI_SSID] = ssidKey;
+    keys[SECRET_WIFI_PASSWORD] = passwordKey;
+    keys[SECRET_CA_CERT] = caCertKey;
+}
+
+bool SecretCache::load()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    int64_t start = clock->nowMicroS();
+    bool loaded = true;
+
+    if (nvsNamespace == nullptr || !storage->open(nvsNamespace, false))
+    {
+        return false;
+    }
+
+    for (int id = 0; id < SECRET_COUNT; id++)
+    {
+        if (!present[id])
+        {
+            loaded &= read((SecretId)id);
+        }
+    }
+
+    storage->close();
+    statistics.loads++;
+    statistics.lastLoadMicroS = clock->nowMicroS() - start;
+    return loaded;
+}
+
+// Storage is open
+bool SecretCache::read(SecretId id)
+{
+    statistics.reads++;
+    present[id] = storage->getString(keys[id], buffers[id], sizes[id]);
+
+    if (!present[id])
+    {
+        clearMemory(buffers[id], sizes[id]);
+    }
+
+    return present[id];
+}
+
+const char* SecretCache::acquire(SecretId id)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (present[id])
+    {
+        statistics.hits++;
+    }
+    else if (nvsNamespace != nullptr && storage->open(nvsNamespace, false))
+    {
+        read(id);
+        storage->close();
+    }
+
+    borrowers[id]++;
+    return buffers[id];
+}
+
+void SecretCache::release(SecretId id)
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (borrowers[id] > 0 && --borrowers[id] == 0)
+    {
+        wipeSecret(id);
+    }
+}
+
+void SecretCache::wipe()
+{
+    std::lock_guard<std::mutex> guard(lock);
+
+    for (int id = 0; id < SECRET_COUNT; id++)
+    {
+        if (borrowers[id] == 0)
+        {
+            wipeSecret((SecretId)id);
+        }
+    }
+}
+
+// Lock held
+void SecretCache::wipeSecret(SecretId id)
+{
+    if (present[id])
+    {
+        statistics.wipes++;
+    }
+
+    clearMemory(buffers[id], sizes[id]);
+    present[id] = false;
+}
+
+bool SecretCache::save(const char* const* values)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    bool saved = true;
+
+    if (nvsNamespace == nullptr || !storage->open(nvsNamespace, true))
+    {
+        return false;
+    }
+
+    for (int id = 0; id < SECRET_COUNT; id++)
+    {
+        if (values[id] != nullptr)
+        {
+            saved &= storage->setString(keys[id], values[id]);
+
+            // Stale now, the next borrow reads the new value
+            if (borrowers[id] == 0)
+            {
+                wipeSecret((SecretId)id);
+            }
+        }
+    }
+
+    saved &= storage->commit();
+    storage->close();
+    return saved;
+}
+
+void SecretCache::stats(SecretCacheStats* output)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    *output = statistics;
+}
@@ -0,0 +1,75 @@
+#ifndef __ESP_SECRET_CACHE__
+#define __ESP_SECRET_CACHE__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <mutex>
+
+#include "hal.h"
+
+// WPA2 passphrases run to 63 characters
+#define SECRET_SSID_SIZE 33
+#define SECRET_PASSWORD_SIZE 65
+#define SECRET_CA_CERT_SIZE 4096
+
+enum SecretId {
+    SECRET_WIFI_SSID,
+    SECRET_WIFI_PASSWORD,
+    SECRET_CA_CERT,
+    SECRET_COUNT,
+};
+
+struct SecretCacheStats {
+    uint32_t loads;
+    // Secrets read from storage, each one a decrypt with NVS encryption on
+    uint32_t reads;
+    // Borrows served from memory
+    uint32_t hits;
+    uint32_t wipes;
+    int64_t lastLoadMicroS;
+};
+
+// The credentials, read from storage once at boot and lent out under a
+// lock. A secret is wiped as soon as its last borrower gives it back, and
+// wipe() clears whatever nobody borrowed, so plaintext only sits in RAM
+// while something uses it. A borrow after a wipe reads it again.
+class SecretCache {
+public:
+    SecretCache(HalStorage* storage, HalClock* clock);
+
+    void setKeys(const char* nvsNamespace, const char* ssidKey, const char* passwordKey, const char* caCertKey);
+
+    // Reads every secret not in memory in one open of the namespace
+    bool load();
+    // Unchanged until release(), an empty string when the secret is not
+    // stored
+    const char* acquire(SecretId id);
+    void release(SecretId id);
+    void wipe();
+
+    // values holds SECRET_COUNT strings, nullptr ones are left alone. Cached
+    // copies of the others are wiped unless borrowed.
+    bool save(const char* const* values);
+
+    void stats(SecretCacheStats* output);
+
+private:
+    bool read(SecretId id);
+    void wipeSecret(SecretId id);
+
+    HalStorage* storage;
+    HalClock* clock;
+    std::mutex lock;
+    const char* nvsNamespace;
+    const char* keys[SECRET_COUNT];
+    char* buffers[SECRET_COUNT];
+    size_t sizes[SECRET_COUNT];
+    bool present[SECRET_COUNT];
+    int borrowers[SECRET_COUNT];
+    char ssid[SECRET_SSID_SIZE];
+    char password[SECRET_PASSWORD_SIZE];
+    char caCert[SECRET_CA_CERT_SIZE];
+    SecretCacheStats statistics;
+};
+
+#endif // __ESP_SECRET_CACHE__
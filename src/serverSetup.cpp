@@ -1,41 +1,263 @@
 #include "serverSetup.h"
 #include "ESPAsyncWebServer.h"
 #include "smartLogger.h"
+#include "webSocketPool.h"
 
 AsyncWebServer server(80);
 AsyncWebSocket ws("/ws"); // access at ws://[esp ip]/ws
 
-void (*fwUpdate)();
+bool (*fwCommand)(const char *command);
+const ServerApi *serverApi = nullptr;
+ResponseSlotPool responseSlots;
+
+// Request whose body is being flashed, at most one at a time
+AsyncWebServerRequest *uploadRequest = nullptr;
+int uploadCode = 0;
+// Connected /ws clients, including those in their close handshake
+volatile int webSocketsOpen = 0;
 
 void onRequest(AsyncWebServerRequest *request)
 {
   request->send(404);
 }
 
+// Every response body lives in a slot until the connection closes, so
+// polling never touches the heap beyond what the library itself needs
+static ResponseSlot *acquireResponseSlot(AsyncWebServerRequest *request)
+{
+  ResponseSlot *slot = responseSlots.acquire();
+  if (slot == nullptr)
+  {
+    request->send(503);
+    return nullptr;
+  }
+
+  request->onDisconnect([slot]() { responseSlots.release(slot); });
+  return slot;
+}
+
+static void sendResponseSlot(AsyncWebServerRequest *request, int code, const char *contentType, ResponseSlot *slot)
+{
+  AsyncWebServerResponse *response = request->beginChunkedResponse(contentType, [slot](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+    return readResponseSlot(slot, buffer, maxLen, index);
+  });
+  response->setCode(code);
+  request->send(response);
+}
+
+static void sendStatus(AsyncWebServerRequest *request, int code)
+{
+  ResponseSlot *slot = acquireResponseSlot(request);
+  if (slot == nullptr)
+  {
+    return;
+  }
+
+  OtaStatusSnapshot status;
+  serverApi->getStatus(&status);
+  slot->len = renderOtaStatus(&status, slot->body, sizeof(slot->body));
+  sendResponseSlot(request, code, "application/json", slot);
+}
+
+void onStatusRequest(AsyncWebServerRequest *request)
+{
+  sendStatus(request, 200);
+}
+
+static bool isOctetStream(AsyncWebServerRequest *request)
+{
+  String type = request->contentType();
+  int parameters = type.indexOf(';');
+
+  if (parameters >= 0)
+  {
+    type = type.substring(0, parameters);
+  }
+
+  type.trim();
+  return type.equalsIgnoreCase("application/octet-stream");
+}
+
+// POST /ota with any other body, chosen once the headers are in. The library
+// collects a form-urlencoded body (curl --data-binary without -H) into a
+// String parameter as big as the image; a trivial handler has it skip the
+// body unparsed instead, then the request gets 415.
+class UnsupportedUploadHandler : public AsyncWebHandler
+{
+public:
+  bool canHandle(AsyncWebServerRequest *request) override
+  {
+    return request->method() == HTTP_POST && request->url() == "/ota" && request->contentLength() > 0 && !isOctetStream(request);
+  }
+
+  void handleRequest(AsyncWebServerRequest *request) override
+  {
+    request->send(415);
+  }
+
+  bool isRequestHandlerTrivial() override
+  {
+    return true;
+  }
+};
+
+UnsupportedUploadHandler unsupportedUploadHandler;
+
+void onUpdateRequest(AsyncWebServerRequest *request)
+{
+  if (request->contentLength() == 0)
+  {
+    sendStatus(request, serverApi->startUpdate() ? 202 : 409);
+    return;
+  }
+
+  // A body that never got to begin lost the race for the update
+  int code = request == uploadRequest ? uploadCode : 409;
+  if (request == uploadRequest)
+  {
+    uploadRequest = nullptr;
+  }
+
+  sendStatus(request, code);
+}
+
+void onUpdateBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (index == 0)
+  {
+    AsyncWebHeader *sha256 = request->getHeader("X-Firmware-Sha256");
+
+    if (uploadRequest != nullptr || !serverApi->beginUpload(total, sha256 != nullptr ? sha256->value().c_str() : nullptr))
+    {
+      return;
+    }
+
+    uploadRequest = request;
+    uploadCode = 202;
+    request->onDisconnect([request]() {
+      if (uploadRequest == request)
+      {
+        serverApi->abortUpload();
+        uploadRequest = nullptr;
+      }
+    });
+  }
+
+  if (request == uploadRequest && uploadCode == 202 && !serverApi->writeUpload(data, len))
+  {
+    // Keep reading what is left of the body, the response carries the verdict
+    uploadCode = 422;
+  }
+}
+
+void onMetricsRequest(AsyncWebServerRequest *request)
+{
+  ResponseSlot *slot = acquireResponseSlot(request);
+  if (slot == nullptr)
+  {
+    return;
+  }
+
+  OtaMetricsSnapshot metrics;
+  serverApi->getMetrics(&metrics);
+  metrics.apiRequests = responseSlots.requests();
+  metrics.apiRejected = responseSlots.rejected();
+  metrics.apiSlotsHighWater = responseSlots.highWater();
+  webSocketPool.stats(&metrics.wsPool);
+  slot->len = renderOtaMetrics(&metrics, slot->body, sizeof(slot->body));
+  sendResponseSlot(request, 200, "text/plain; version=0.0.4", slot);
+}
+
+static const char *headerValue(AsyncWebServerRequest *request, const char *name)
+{
+  AsyncWebHeader *header = request->getHeader(name);
+  return header != nullptr ? header->value().c_str() : nullptr;
+}
+
+// The site's other devices pull their update here. The body goes from the
+// cache's flash or PSRAM straight into the response's send buffer, no copy
+// is staged in RAM.
+void onFirmwareRequest(AsyncWebServerRequest *request)
+{
+  FirmwareCache *cache = serverApi->firmwareCache;
+
+  if (cache->capacity() == 0)
+  {
+    request->send(404);
+    return;
+  }
+
+  FirmwareCacheReply reply = cache->reply(headerValue(request, "Range"), headerValue(request, "If-None-Match"), headerValue(request, "If-Range"));
+  bool streaming = reply.status == 200 || reply.status == 206;
+  AsyncWebServerResponse *response;
+
+  if (streaming && request->method() == HTTP_HEAD)
+  {
+    // Only whether the image is there, the health check of the other devices
+    cache->endReply(&reply);
+    streaming = false;
+  }
+
+  if (streaming)
+  {
+    response = request->beginResponse("application/octet-stream", reply.length, [cache, reply](uint8_t *buffer, size_t maxLen, size_t index) -> size_t {
+      return cache->read(&reply, index, buffer, maxLen);
+    });
+    request->onDisconnect([cache, reply]() { cache->endReply(&reply); });
+  }
+  else
+  {
+    response = request->beginResponse(reply.status);
+  }
+
+  char contentRange[48];
+  if (cache->contentRange(&reply, contentRange, sizeof(contentRange)) > 0)
+  {
+    response->addHeader("Content-Range", contentRange);
+  }
+
+  if (reply.status != 503)
+  {
+    response->addHeader("ETag", cache->etag());
+    response->addHeader("Accept-Ranges", "bytes");
+  }
+
+  response->setCode(reply.status);
+  request->send(response);
+}
+
+static void sendPooled(AsyncWebSocketClient *client, const char *text, uint8_t opcode)
+{
+  webSocketPoolSend(&client, 1, text, strlen(text), opcode);
+}
+
 void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
 {
   if (type == WS_EVT_CONNECT)
   {
     // client connected
+    webSocketsOpen++;
     initSmartLog(client);
-    smartLog("ws[%s][%u] connect\n", server->url(), client->id());
+    SMART_LOGI("WS", "ws[%s][%u] connect", server->url(), client->id());
+    dumpCrashLog(client, false);
     client->ping();
   }
   else if (type == WS_EVT_DISCONNECT)
   {
     // client disconnected
-    destroySmartLog();
-    smartLog("ws[%s][%u] disconnect: %u\n", server->url(), client->id());
+    webSocketsOpen--;
+    removeSmartLog(client);
+    SMART_LOGI("WS", "ws[%s][%u] disconnect", server->url(), client->id());
   }
   else if (type == WS_EVT_ERROR)
   {
     // error was received from the other end
-    smartLog("ws[%s][%u] error(%u): %s\n", server->url(), client->id(), *((uint16_t *)arg), (char *)data);
+    SMART_LOGW("WS", "ws[%s][%u] error(%u): %s", server->url(), client->id(), *((uint16_t *)arg), (char *)data);
   }
   else if (type == WS_EVT_PONG)
   {
     // pong message was received (in response to a ping request maybe)
-    smartLog("ws[%s][%u] pong[%u]: %s\n", server->url(), client->id(), len, (len) ? (char *)data : "");
+    SMART_LOGD("WS", "ws[%s][%u] pong[%u]: %s", server->url(), client->id(), len, (len) ? (char *)data : "");
   }
   else if (type == WS_EVT_DATA)
   {
@@ -44,28 +266,24 @@ void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType
     if (info->final && info->index == 0 && info->len == len)
     {
       // the whole message is in a single frame and we got all of it's data
-      smartLog("ws[%s][%u] %s-message[%llu]: ", server->url(), client->id(), (info->opcode == WS_TEXT) ? "text" : "binary", info->len);
+      SMART_LOGD("WS", "ws[%s][%u] %s-message[%llu]", server->url(), client->id(), (info->opcode == WS_TEXT) ? "text" : "binary", info->len);
       if (info->opcode == WS_TEXT)
       {
         data[len] = 0;
-        smartLog("%s\n", (char *)data);
+        // The command word only, "source" carries the command token
+        SMART_LOGD("WS", "%.*s", (int)strcspn((char *)data, " "), (char *)data);
       }
       else
       {
         for (size_t i = 0; i < info->len; i++)
         {
-          smartLog("%02x ", data[i]);
+          SMART_LOGV("WS", "%02x", data[i]);
         }
-        smartLog("\n");
       }
       if (info->opcode == WS_TEXT)
-        if (strcmp((char *)data, "update") == 0)
+        if (!fwCommand((char *)data))
         {
-          fwUpdate();
-        }
-        else
-        {
-          client->binary("I got your binary message");
+          sendPooled(client, "I got your binary message", WS_BINARY);
         }
     }
     else
@@ -74,49 +292,78 @@ void onEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType
       if (info->index == 0)
       {
         if (info->num == 0)
-          smartLog("ws[%s][%u] %s-message start\n", server->url(), client->id(), (info->message_opcode == WS_TEXT) ? "text" : "binary");
-        smartLog("ws[%s][%u] frame[%u] start[%llu]\n", server->url(), client->id(), info->num, info->len);
+          SMART_LOGV("WS", "ws[%s][%u] %s-message start", server->url(), client->id(), (info->message_opcode == WS_TEXT) ? "text" : "binary");
+        SMART_LOGV("WS", "ws[%s][%u] frame[%u] start[%llu]", server->url(), client->id(), info->num, info->len);
       }
 
-      smartLog("ws[%s][%u] frame[%u] %s[%llu - %llu]: ", server->url(), client->id(), info->num, (info->message_opcode == WS_TEXT) ? "text" : "binary", info->index, info->index + len);
+      SMART_LOGV("WS", "ws[%s][%u] frame[%u] %s[%llu - %llu]", server->url(), client->id(), info->num, (info->message_opcode == WS_TEXT) ? "text" : "binary", info->index, info->index + len);
       if (info->message_opcode == WS_TEXT)
       {
         data[len] = 0;
-        smartLog("%s\n", (char *)data);
+        // The command word only, "source" carries the command token
+        SMART_LOGD("WS", "%.*s", (int)strcspn((char *)data, " "), (char *)data);
       }
       else
       {
         for (size_t i = 0; i < len; i++)
         {
-          smartLog("%02x ", data[i]);
+          SMART_LOGV("WS", "%02x", data[i]);
         }
-        smartLog("\n");
       }
 
       if ((info->index + len) == info->len)
       {
-        smartLog("ws[%s][%u] frame[%u] end[%llu]\n", server->url(), client->id(), info->num, info->len);
+        SMART_LOGV("WS", "ws[%s][%u] frame[%u] end[%llu]", server->url(), client->id(), info->num, info->len);
         if (info->final)
         {
-          smartLog("ws[%s][%u] %s-message end\n", server->url(), client->id(), (info->message_opcode == WS_TEXT) ? "text" : "binary");
+          SMART_LOGV("WS", "ws[%s][%u] %s-message end", server->url(), client->id(), (info->message_opcode == WS_TEXT) ? "text" : "binary");
           if (info->message_opcode == WS_TEXT)
-            client->text("I got your text message");
+            sendPooled(client, "I got your text message", WS_TEXT);
           else
-            client->binary("I got your binary message");
+            sendPooled(client, "I got your binary message", WS_BINARY);
         }
       }
     }
   }
 }
 
-void setupServer(void (*firmwareUpdate)(void))
+void setupServer(bool (*handleCommand)(const char *command), const ServerApi *api)
 {
-  fwUpdate = firmwareUpdate;
+  fwCommand = handleCommand;
+  serverApi = api;
 
   ws.onEvent(onEvent);
 
   server.addHandler(&ws);
+
+  if (serverApi != nullptr)
+  {
+    server.on("/ota/status", HTTP_GET, onStatusRequest);
+    // Ahead of the upload route, the first handler that accepts a request wins
+    server.addHandler(&unsupportedUploadHandler);
+    server.on("/ota", HTTP_POST, onUpdateRequest, NULL, onUpdateBody);
+    server.on("/metrics", HTTP_GET, onMetricsRequest);
+
+    if (serverApi->firmwareCache != nullptr)
+    {
+      server.on("/ota/firmware", HTTP_GET | HTTP_HEAD, onFirmwareRequest);
+    }
+  }
+
   server.onNotFound(onRequest);
 
   server.begin();
 }
+
+void closeServer(uint16_t closeCode)
+{
+  ws.closeAll(closeCode, "restarting");
+}
+
+bool serverDrained()
+{
+  MessagePoolStats pool;
+  webSocketPool.stats(&pool);
+
+  return webSocketsOpen == 0 && pool.slabsInUse == 0 && responseSlots.active() == 0 && uploadRequest == nullptr;
+}
@@ -1,6 +1,42 @@
 #ifndef __ESP_HTTP_SERVER__
 #define __ESP_HTTP_SERVER__
 
-void setupServer(void (*firmwareUpdate)(void));
+#include "otaApi.h"
+#include "firmwareCache.h"
+
+struct ServerApi {
+  // False when no update could be started, usually one is already running
+  bool (*startUpdate)();
+  void (*getStatus)(OtaStatusSnapshot *status);
+  void (*getMetrics)(OtaMetricsSnapshot *metrics);
+  // Body of POST /ota: begin with the announced length and the optional
+  // X-Firmware-Sha256 header, then every piece in order. The last write
+  // returns false when the hash does not match.
+  bool (*beginUpload)(size_t total, const char *sha256Hex);
+  bool (*writeUpload)(const uint8_t *data, size_t len);
+  // The connection dropped before the last byte
+  void (*abortUpload)();
+  // Image served on GET /ota/firmware while this device is the site's
+  // gateway, nullptr to leave the route out
+  FirmwareCache *firmwareCache;
+};
+
+// handleCommand receives every text message sent over /ws and returns false
+// when the command is unknown. With an api the server also answers
+// POST /ota, GET /ota/status and GET /metrics. An empty POST /ota pulls the
+// update from the server, one with an application/octet-stream body is the
+// image itself; any other Content-Type gets 415, so the header is required:
+//   curl -H 'Content-Type: application/octet-stream' \
+//        -H "X-Firmware-Sha256: $(sha256sum firmware.bin | cut -c1-64)" \
+//        --data-binary @firmware.bin http://device/ota
+// GET /ota/firmware answers 404 until the cache has a store, then serves
+// the cached image with ETag, If-None-Match and single Range support.
+void setupServer(bool (*handleCommand)(const char *command), const ServerApi *api = nullptr);
+
+// Shutdown before a restart: closes every /ws client with closeCode, then
+// serverDrained() turns true once the clients completed the close handshake
+// and every queued frame and HTTP response was acked.
+void closeServer(uint16_t closeCode);
+bool serverDrained();
 
 #endif // __ESP_HTTP_SERVER__
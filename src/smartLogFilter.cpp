@@ -0,0 +1,102 @@
+#include <string.h>
+
+#include "smartLogFilter.h"
+
+static const char* const smartLogLevelNames[] = {"none", "error", "warn", "info", "debug", "verbose"};
+
+SmartLogFilter::SmartLogFilter(SmartLogLevel defaultLevel)
+    : entryCount(0),
+      fallback(defaultLevel)
+{
+}
+
+bool SmartLogFilter::enabled(SmartLogLevel level, const char* tag) const
+{
+    const SmartLogTagLevel* entry = entryCount > 0 ? find(tag) : nullptr;
+    return level <= (entry != nullptr ? entry->level : fallback);
+}
+
+bool SmartLogFilter::set(const char* tag, SmartLogLevel level)
+{
+    if (strcmp(tag, "*") == 0)
+    {
+        entryCount = 0;
+        fallback = level;
+        return true;
+    }
+
+    SmartLogTagLevel* entry = (SmartLogTagLevel*)find(tag);
+    if (entry != nullptr)
+    {
+        entry->level = level;
+        return true;
+    }
+
+    if (entryCount >= SMART_LOG_MAX_TAGS || strlen(tag) >= SMART_LOG_TAG_SIZE)
+    {
+        return false;
+    }
+
+    entry = &entries[entryCount];
+    strcpy(entry->tag, tag);
+    entry->level = level;
+    entryCount = entryCount + 1;
+    return true;
+}
+
+SmartLogLevel SmartLogFilter::get(const char* tag) const
+{
+    const SmartLogTagLevel* entry = find(tag);
+    return (SmartLogLevel)(entry != nullptr ? entry->level : fallback);
+}
+
+SmartLogLevel SmartLogFilter::defaultLevel() const
+{
+    return (SmartLogLevel)fallback;
+}
+
+int SmartLogFilter::count() const
+{
+    return entryCount;
+}
+
+const SmartLogTagLevel* SmartLogFilter::entry(int index) const
+{
+    return &entries[index];
+}
+
+const SmartLogTagLevel* SmartLogFilter::find(const char* tag) const
+{
+    int count = entryCount;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(entries[i].tag, tag) == 0)
+        {
+            return &entries[i];
+        }
+    }
+
+    return nullptr;
+}
+
+const char* smartLogLevelName(SmartLogLevel level)
+{
+    return level <= SMART_LOG_VERBOSE ? smartLogLevelNames[level] : "unknown";
+}
+
+bool parseSmartLogLevel(const char* name, SmartLogLevel* level)
+{
+    for (int i = SMART_LOG_NONE; i <= SMART_LOG_VERBOSE; i++)
+    {
+        const char* levelName = smartLogLevelNames[i];
+
+        if (strcmp(name, levelName) == 0 || (name[0] == levelName[0] && name[1] == 0))
+        {
+            *level = (SmartLogLevel)i;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,52 @@
+#ifndef __ESP_SMART_LOG_FILTER__
+#define __ESP_SMART_LOG_FILTER__
+
+#include <stdint.h>
+
+enum SmartLogLevel {
+    SMART_LOG_NONE,
+    SMART_LOG_ERROR,
+    SMART_LOG_WARN,
+    SMART_LOG_INFO,
+    SMART_LOG_DEBUG,
+    SMART_LOG_VERBOSE,
+};
+
+#define SMART_LOG_MAX_TAGS 16
+#define SMART_LOG_TAG_SIZE 16
+
+struct SmartLogTagLevel {
+    char tag[SMART_LOG_TAG_SIZE];
+    volatile uint8_t level;
+};
+
+// Runtime level per tag, every other tag follows the default. With no
+// per-tag level set a check is one compare. Levels change from the /ws handler while any task logs: an entry is
+// complete before count grows and entries are never removed.
+class SmartLogFilter {
+public:
+    explicit SmartLogFilter(SmartLogLevel defaultLevel);
+
+    bool enabled(SmartLogLevel level, const char* tag) const;
+    // Tag "*" sets the default and drops every per-tag level. False when
+    // the table is full.
+    bool set(const char* tag, SmartLogLevel level);
+    SmartLogLevel get(const char* tag) const;
+    SmartLogLevel defaultLevel() const;
+
+    int count() const;
+    const SmartLogTagLevel* entry(int index) const;
+
+private:
+    const SmartLogTagLevel* find(const char* tag) const;
+
+    SmartLogTagLevel entries[SMART_LOG_MAX_TAGS];
+    volatile int entryCount;
+    volatile uint8_t fallback;
+};
+
+const char* smartLogLevelName(SmartLogLevel level);
+// Accepts the names above and their first letter
+bool parseSmartLogLevel(const char* name, SmartLogLevel* level);
+
+#endif // __ESP_SMART_LOG_FILTER__
@@ -1,30 +1,312 @@
 #include "ESPAsyncWebServer.h"
 #include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <mutex>
 
-AsyncWebSocketClient* webSocketClient;
+#include "crashLog.h"
+#include "otaTasks.h"
+#include "sdkconfig.h"
+#include "smartLogger.h"
+#include "webSocketPool.h"
+
+#define SMART_LOG_MESSAGE_SIZE 256
+#define SMART_LOG_QUEUE_LENGTH 16
+#define SMART_LOG_MAX_CLIENTS 4
+// How often the log task sends the next crash log line when no live line
+// wakes it
+#define SMART_LOG_DUMP_PACE_MS 20
+
+// Changed by async_tcp on connect and disconnect while smartLogTask sends,
+// a client is only freed after removeSmartLog() took it out under the lock
+AsyncWebSocketClient* webSocketClients[SMART_LOG_MAX_CLIENTS];
+std::mutex webSocketClientsLock;
+QueueHandle_t smartLogQueue = NULL;
+OtaTaskProfile smartLogProfile;
+uint32_t smartLogDropped = 0;
+// Lines handed to the queue and lines the log task sent, equal once flushed
+volatile uint32_t smartLogQueued = 0;
+volatile uint32_t smartLogSent = 0;
+SmartLogFilter smartLogFilter(SMART_LOG_INFO);
+
+// Survives every reset but a power cycle, checked record by record at boot
+RTC_NOINIT_ATTR CrashLogRegion crashLogRegion;
+CrashLog crashLog(&crashLogRegion);
+portMUX_TYPE crashLogLock = portMUX_INITIALIZER_UNLOCKED;
+bool crashLogStarted = false;
+// A dump in progress, to one client or to every log client when null
+bool crashLogDumping = false;
+AsyncWebSocketClient* crashLogClient = nullptr;
+CrashLogCursor crashLogCursor;
 
 void initSmartLog(void* ws) {
-    webSocketClient = (AsyncWebSocketClient*) ws;
+    std::lock_guard<std::mutex> guard(webSocketClientsLock);
+
+    for (int i = 0; i < SMART_LOG_MAX_CLIENTS; i++) {
+        if (webSocketClients[i] == nullptr) {
+            webSocketClients[i] = (AsyncWebSocketClient*) ws;
+            return;
+        }
+    }
+}
+
+void removeSmartLog(void* ws) {
+    std::lock_guard<std::mutex> guard(webSocketClientsLock);
+    uint32_t id = ((AsyncWebSocketClient*) ws)->id();
+
+    for (int i = 0; i < SMART_LOG_MAX_CLIENTS; i++) {
+        if (webSocketClients[i] != nullptr && webSocketClients[i]->id() == id) {
+            webSocketClients[i] = nullptr;
+        }
+    }
+
+    // A dump to this client alone ends with it
+    if (crashLogClient != nullptr && crashLogClient->id() == id) {
+        crashLogDumping = false;
+        crashLogClient = nullptr;
+    }
+}
+
+// Every connected client gets the same pooled payload. With the pool
+// exhausted the line still reaches the serial port.
+static void sendSmartLog(const char* buffer) {
+    {
+        std::lock_guard<std::mutex> guard(webSocketClientsLock);
+        webSocketPoolSend(webSocketClients, SMART_LOG_MAX_CLIENTS, buffer, strlen(buffer));
+    }
+
+    printf("%s\n", buffer);
+}
+
+static const char* resetReasonName(esp_reset_reason_t reason) {
+    switch (reason) {
+    case ESP_RST_POWERON:
+        return "power-on";
+    case ESP_RST_EXT:
+        return "external";
+    case ESP_RST_SW:
+        return "software";
+    case ESP_RST_PANIC:
+        return "panic";
+    case ESP_RST_INT_WDT:
+        return "interrupt watchdog";
+    case ESP_RST_TASK_WDT:
+        return "task watchdog";
+    case ESP_RST_WDT:
+        return "watchdog";
+    case ESP_RST_DEEPSLEEP:
+        return "deep sleep";
+    case ESP_RST_BROWNOUT:
+        return "brownout";
+    case ESP_RST_SDIO:
+        return "sdio";
+    default:
+        return "unknown";
+    }
+}
+
+// One crash log line per call, returns false when nothing was sent. With the
+// pool exhausted the cursor stays put and the line goes out on a later call.
+static bool sendCrashLogLine() {
+    char line[SMART_LOG_MESSAGE_SIZE];
+    std::lock_guard<std::mutex> guard(webSocketClientsLock);
+    CrashLogCursor cursor = crashLogCursor;
+
+    // Ended by removeSmartLog() since the log task looked
+    if (!crashLogDumping) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&crashLogLock);
+    bool more = crashLog.next(&cursor, line, sizeof(line));
+    portEXIT_CRITICAL(&crashLogLock);
+
+    if (!more) {
+        crashLogDumping = false;
+        crashLogClient = nullptr;
+        return false;
+    }
+
+    AsyncWebSocketClient* const* clients = crashLogClient != nullptr ? &crashLogClient : webSocketClients;
+    int count = crashLogClient != nullptr ? 1 : SMART_LOG_MAX_CLIENTS;
+
+    if (webSocketPoolSend(clients, count, line, strlen(line)) == 0) {
+        return false;
+    }
+
+    crashLogCursor = cursor;
+    return true;
+}
+
+static void smartLogTask(void* parameter) {
+    char buffer[SMART_LOG_MESSAGE_SIZE];
+
+    while (true) {
+        TickType_t wait = crashLogDumping ? pdMS_TO_TICKS(SMART_LOG_DUMP_PACE_MS) : portMAX_DELAY;
+
+        otaProfileWaitBegin(&smartLogProfile);
+        bool received = xQueueReceive(smartLogQueue, buffer, wait) == pdTRUE;
+        otaProfileWaitEnd(&smartLogProfile);
+
+        if (received) {
+            sendSmartLog(buffer);
+            smartLogSent++;
+        }
+
+        // Live lines keep priority, a dump interleaves one line at a time
+        if (crashLogDumping) {
+            sendCrashLogLine();
+        }
+    }
+}
+
+void startSmartLogTask() {
+    if (smartLogQueue != NULL) {
+        return;
+    }
+
+    smartLogQueue = xQueueCreate(SMART_LOG_QUEUE_LENGTH, SMART_LOG_MESSAGE_SIZE);
+    otaProfileStart(&smartLogProfile, "smartLogTask");
+
+    if (createOtaTask(smartLogTask, "smartLogTask", &otaTaskConfig.logging, NULL, NULL) != pdPASS) {
+        vQueueDelete(smartLogQueue);
+        smartLogQueue = NULL;
+    }
+}
+
+OtaTaskProfile* getSmartLogProfile() {
+    return &smartLogProfile;
+}
+
+uint32_t getSmartLogDropped() {
+    return smartLogDropped;
+}
+
+void beginCrashLog() {
+    portENTER_CRITICAL(&crashLogLock);
+    bool kept = crashLog.begin(resetReasonName(esp_reset_reason()), millis());
+    crashLogStarted = true;
+    portEXIT_CRITICAL(&crashLogLock);
+
+    SMART_LOGI("CrashLog", "Boot %u, %s", crashLog.bootCount(), kept ? "earlier boots kept" : "empty");
 }
 
-void destroySmartLog() {
-    webSocketClient->server()->closeAll();
+void crashLogTrace(uint16_t event, uint32_t a, uint32_t b) {
+    if (!crashLogStarted) {
+        return;
+    }
+
+    portENTER_CRITICAL(&crashLogLock);
+    crashLog.trace(event, a, b, millis());
+    portEXIT_CRITICAL(&crashLogLock);
+}
+
+void dumpCrashLog(void* ws, bool all) {
+    if (!crashLogStarted) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(webSocketClientsLock);
+
+        portENTER_CRITICAL(&crashLogLock);
+        crashLogCursor = all ? crashLog.all() : crashLog.previousBoots();
+        portEXIT_CRITICAL(&crashLogLock);
+
+        crashLogClient = (AsyncWebSocketClient*) ws;
+        crashLogDumping = true;
+    }
+
+    if (smartLogQueue == NULL) {
+        while (sendCrashLogLine()) {
+        }
+    }
+}
+
+static void queueSmartLog(const char* buffer) {
+    if (crashLogStarted) {
+        portENTER_CRITICAL(&crashLogLock);
+        crashLog.text(buffer, strlen(buffer), millis());
+        portEXIT_CRITICAL(&crashLogLock);
+    }
+
+    if (smartLogQueue == NULL) {
+        sendSmartLog(buffer);
+        return;
+    }
+
+    // Never block the caller on a slow socket, drop the line instead
+    if (xQueueSend(smartLogQueue, buffer, 0) != pdTRUE) {
+        smartLogDropped++;
+    } else {
+        smartLogQueued++;
+    }
+}
+
+static bool waitSmartLog(bool (*done)(), int64_t deadlineMicroS) {
+    while (!done()) {
+        if (esp_timer_get_time() >= deadlineMicroS) {
+            return false;
+        }
+        vTaskDelay(pdMS_TO_TICKS(5));
+    }
+    return true;
+}
+
+static bool smartLogQueueSent() {
+    return smartLogSent == smartLogQueued;
+}
+
+// Pooled frames release their slab once the client acked all of it
+static bool smartLogFramesAcked() {
+    MessagePoolStats pool;
+    webSocketPool.stats(&pool);
+    return pool.slabsInUse == 0;
+}
+
+bool flushSmartLog(const char* finalFrame, int64_t deadlineMicroS) {
+    bool flushed = waitSmartLog(smartLogQueueSent, deadlineMicroS);
+
+    {
+        std::lock_guard<std::mutex> guard(webSocketClientsLock);
+        crashLogDumping = false;
+        crashLogClient = nullptr;
+    }
+
+    if (finalFrame != nullptr) {
+        sendSmartLog(finalFrame);
+    }
+
+    return waitSmartLog(smartLogFramesAcked, deadlineMicroS) && flushed;
 }
 
 void smartLog(const char* str, ...) {
+    if (!smartLogFilter.enabled(SMART_LOG_INFO, CONFIG_APP_LOG_TAG)) {
+        return;
+    }
+
     // Get the variadic arguments using va_list
     va_list args;
     va_start(args, str);
 
-    char buffer[256];
+    char buffer[SMART_LOG_MESSAGE_SIZE];
     vsnprintf(buffer, sizeof(buffer), str, args);
 
-    if (webSocketClient != nullptr) {
-        webSocketClient->printf(buffer);
-    }
+    va_end(args);
 
-    printf(buffer);
-    printf("\n");
+    queueSmartLog(buffer);
+}
+
+void smartLogTagged(SmartLogLevel level, const char* tag, const char* str, ...) {
+    char buffer[SMART_LOG_MESSAGE_SIZE];
+    int prefix = snprintf(buffer, sizeof(buffer), "[%s] ", tag);
 
+    va_list args;
+    va_start(args, str);
+    vsnprintf(buffer + prefix, sizeof(buffer) - prefix, str, args);
     va_end(args);
+
+    queueSmartLog(buffer);
 }
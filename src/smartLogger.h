@@ -1,8 +1,61 @@
 #ifndef __ESP_SMART_LOGGER__
 #define __ESP_SMART_LOGGER__
 
+#include <stdint.h>
+
+#include "smartLogFilter.h"
+
+// Calls above this level compile to nothing, arguments included. The device
+// build keeps debug lines for the runtime filter, see platformio.ini.
+#ifndef SMART_LOG_MAX_LEVEL
+#define SMART_LOG_MAX_LEVEL SMART_LOG_INFO
+#endif
+
+#define SMART_LOG_AT(level, tag, format, ...)                                  \
+    do {                                                                       \
+        if ((level) <= SMART_LOG_MAX_LEVEL && smartLogFilter.enabled((level), (tag))) { \
+            smartLogTagged((level), (tag), format, ##__VA_ARGS__);             \
+        }                                                                      \
+    } while (0)
+
+#define SMART_LOGE(tag, format, ...) SMART_LOG_AT(SMART_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define SMART_LOGW(tag, format, ...) SMART_LOG_AT(SMART_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define SMART_LOGI(tag, format, ...) SMART_LOG_AT(SMART_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define SMART_LOGD(tag, format, ...) SMART_LOG_AT(SMART_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define SMART_LOGV(tag, format, ...) SMART_LOG_AT(SMART_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+struct OtaTaskProfile;
+
+// Runtime levels, set per tag with the /ws "log" command
+extern SmartLogFilter smartLogFilter;
+
+// Registers a /ws client for log lines, and takes it out again before the
+// web server frees it. Both are called from async_tcp.
 void initSmartLog(void* ws);
-void destroySmartLog();
+void removeSmartLog(void* ws);
+// Before a restart: waits until every queued line went out, sends
+// finalFrame to each log client and waits for the acks of all of it.
+// False when deadlineMicroS (esp_timer time) came first.
+bool flushSmartLog(const char* finalFrame, int64_t deadlineMicroS);
+// Untagged info line under CONFIG_APP_LOG_TAG
 void smartLog(const char* str, ...);
+// Use the SMART_LOG* macros, they skip the call when filtered. The line
+// goes out as "[tag] ...".
+void smartLogTagged(SmartLogLevel level, const char* tag, const char* str, ...);
+
+// Moves socket and serial output to a task placed by otaTaskConfig.logging.
+// Until it runs smartLog writes synchronously.
+void startSmartLogTask();
+OtaTaskProfile* getSmartLogProfile();
+uint32_t getSmartLogDropped();
+
+// Every smartLog line and trace also lands in a ring that survives resets,
+// see crashLog.h. Call once per boot before anything worth keeping is logged.
+void beginCrashLog();
+// A CrashLogTrace event, cheaper than a line on hot paths
+void crashLogTrace(uint16_t event, uint32_t a, uint32_t b);
+// Sends the lines of earlier boots, or all of them, to one client or to every
+// log client when ws is null. Paced by the log task behind live lines.
+void dumpCrashLog(void* ws, bool all);
 
 #endif // __ESP_SMART_LOGGER__
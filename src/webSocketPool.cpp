@@ -0,0 +1,127 @@
+#include <new>
+
+#include "webSocketPool.h"
+
+MessagePool webSocketPool;
+
+// Frame helpers of AsyncWebSocket.cpp, external but missing from its header
+size_t webSocketSendFrameWindow(AsyncClient* client);
+size_t webSocketSendFrame(AsyncClient* client, bool final, uint8_t opcode, bool mask, uint8_t* data, size_t len);
+
+// AsyncWebSocketBasicMessage without its private copy of the payload. The
+// web server deletes queued messages when they are sent or the client goes
+// away, the class operator delete hands the block back to the pool.
+class PooledWebSocketMessage : public AsyncWebSocketMessage {
+public:
+    PooledWebSocketMessage(MessageSlab* slab, uint8_t opcode)
+        : slab(slab),
+          sent(0),
+          acked(0),
+          expectedAck(0)
+    {
+        _opcode = opcode & 0x07;
+        _mask = false;
+        _status = WS_MSG_SENDING;
+    }
+
+    ~PooledWebSocketMessage() override
+    {
+        webSocketPool.release(slab);
+    }
+
+    static void operator delete(void* block)
+    {
+        webSocketPool.releaseHandle(block);
+    }
+
+    void ack(size_t len, uint32_t time) override
+    {
+        acked += len;
+
+        if (sent == slab->len && acked == expectedAck)
+        {
+            _status = WS_MSG_SENT;
+        }
+    }
+
+    size_t send(AsyncClient* client) override
+    {
+        if (_status != WS_MSG_SENDING || acked < expectedAck)
+        {
+            return 0;
+        }
+
+        if (sent == slab->len)
+        {
+            if (acked == expectedAck)
+            {
+                _status = WS_MSG_SENT;
+            }
+            return 0;
+        }
+
+        size_t toSend = slab->len - sent;
+        size_t window = webSocketSendFrameWindow(client);
+        if (window < toSend)
+        {
+            toSend = window;
+        }
+
+        uint8_t opcode = sent == 0 ? _opcode : (uint8_t)WS_CONTINUATION;
+        uint8_t* data = slab->data + sent;
+
+        sent += toSend;
+        expectedAck += toSend + (toSend < 126 ? 2 : 4);
+
+        size_t written = webSocketSendFrame(client, sent == slab->len, opcode, false, data, toSend);
+
+        if (toSend && written != toSend)
+        {
+            sent -= toSend - written;
+            expectedAck -= toSend - written;
+        }
+
+        return written;
+    }
+
+private:
+    MessageSlab* slab;
+    size_t sent;
+    size_t acked;
+    size_t expectedAck;
+};
+
+static_assert(sizeof(PooledWebSocketMessage) <= MESSAGE_POOL_HANDLE_SIZE, "message handle too small");
+
+int webSocketPoolSend(AsyncWebSocketClient* const* clients, int count, const char* data, size_t len, uint8_t opcode)
+{
+    MessageSlab* slab = webSocketPool.acquire(data, len);
+    int queued = 0;
+
+    if (slab == nullptr)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (clients[i] == nullptr || clients[i]->status() != WS_CONNECTED)
+        {
+            continue;
+        }
+
+        void* handle = webSocketPool.acquireHandle();
+        if (handle == nullptr)
+        {
+            break;
+        }
+
+        webSocketPool.retain(slab);
+        clients[i]->message(new (handle) PooledWebSocketMessage(slab, opcode));
+        queued++;
+    }
+
+    // Drop the caller's reference, the queued messages hold the rest
+    webSocketPool.release(slab);
+    return queued;
+}
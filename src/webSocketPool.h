@@ -0,0 +1,14 @@
+#ifndef __ESP_WEB_SOCKET_POOL__
+#define __ESP_WEB_SOCKET_POOL__
+
+#include "ESPAsyncWebServer.h"
+#include "messagePool.h"
+
+extern MessagePool webSocketPool;
+
+// Queues one frame to each client from a single pooled payload. Returns how
+// many clients it was queued to, 0 when the pool is exhausted; the caller
+// decides whether that frame may be dropped.
+int webSocketPoolSend(AsyncWebSocketClient* const* clients, int count, const char* data, size_t len, uint8_t opcode = WS_TEXT);
+
+#endif // __ESP_WEB_SOCKET_POOL__
@@ -0,0 +1,650 @@
+#include <string.h>
+
+#include "smartLogger.h"
+#include "wifiManager.h"
+
+#define WIFI_CACHE_KEY "link"
+#define WIFI_CACHE_VERSION 1
+#define WIFI_NETWORKS_KEY "networks"
+#define WIFI_NETWORKS_VERSION 2
+
+// Goodput of the ESP32 over TCP between a weak and a strong signal
+#define WIFI_WEAK_RSSI -90
+#define WIFI_STRONG_RSSI -50
+#define WIFI_WEAK_THROUGHPUT 50000
+#define WIFI_STRONG_THROUGHPUT 1500000
+
+// What NVS keeps between boots. The SSID is stored so a cache written for
+// another network is never tried.
+struct WifiCacheRecord {
+    uint8_t version;
+    char ssid[HAL_WIFI_SSID_SIZE];
+    HalWifiLink link;
+};
+
+// Version 1 held the passwords as well, it is overwritten on the first boot
+// that cannot read it
+struct WifiNetworkRecord {
+    char ssid[HAL_WIFI_SSID_SIZE];
+    uint32_t throughput;
+    int8_t throughputRssi;
+};
+
+struct WifiNetworksRecord {
+    uint8_t version;
+    uint8_t count;
+    WifiNetworkRecord networks[WIFI_MANAGER_MAX_NETWORKS];
+};
+
+static const WifiManagerConfig defaultWifiManagerConfig = {
+    .fastTimeoutMicroS = 3 * 1000000LL,
+    .scanTimeoutMicroS = 10 * 1000000LL,
+    .joinTimeoutMicroS = 10 * 1000000LL,
+    .backoffMinMicroS = 1 * 1000000LL,
+    .backoffMaxMicroS = 60 * 1000000LL,
+};
+
+// Linear in dB between the two reference points
+static uint32_t expectedThroughput(int rssi)
+{
+    if (rssi < WIFI_WEAK_RSSI)
+    {
+        rssi = WIFI_WEAK_RSSI;
+    }
+    else if (rssi > WIFI_STRONG_RSSI)
+    {
+        rssi = WIFI_STRONG_RSSI;
+    }
+
+    return WIFI_WEAK_THROUGHPUT + (uint32_t)(rssi - WIFI_WEAK_RSSI) * (WIFI_STRONG_THROUGHPUT - WIFI_WEAK_THROUGHPUT) /
+                                      (WIFI_STRONG_RSSI - WIFI_WEAK_RSSI);
+}
+
+// A measured speed says more than the signal (a congested AP looks fine in a
+// scan), it is only rescaled when the signal moved since
+static uint32_t networkScore(const WifiNetwork* network, int rssi)
+{
+    uint32_t expected = expectedThroughput(rssi);
+
+    if (network->throughput == 0)
+    {
+        return expected;
+    }
+
+    return (uint64_t)network->throughput * expected / expectedThroughput(network->throughputRssi);
+}
+
+WifiManager::WifiManager(HalWifi* wifi, HalStorage* storage, HalClock* clock)
+    : wifi(wifi),
+      storage(storage),
+      clock(clock),
+      config(defaultWifiManagerConfig),
+      passwordSource(nullptr),
+      networksUsed(0),
+      candidateCount(0),
+      candidateIndex(0),
+      cachedNetwork(-1),
+      connectedNetwork(-1),
+      joiningNetwork(-1),
+      pendingThroughput(0),
+      cacheValid(false),
+      fastFailed(false),
+      everConnected(false),
+      attemptStartMicroS(0),
+      stateStartMicroS(0),
+      backoffMicroS(0),
+      currentState(WIFI_MANAGER_IDLE)
+{
+    memset(&statistics, 0, sizeof(statistics));
+    statistics.lastConnectMicroS = -1;
+    memset(&cachedLink, 0, sizeof(cachedLink));
+    memset(networks, 0, sizeof(networks));
+}
+
+void WifiManager::setConfig(const WifiManagerConfig* managerConfig)
+{
+    config = *managerConfig;
+}
+
+void WifiManager::setPasswordSource(WifiPasswordSource* source)
+{
+    passwordSource = source;
+}
+
+bool WifiManager::addNetwork(const char* ssid, const char* password)
+{
+    if (ssid == nullptr || ssid[0] == 0)
+    {
+        return false;
+    }
+
+    int index = findNetwork(ssid);
+
+    if (index < 0)
+    {
+        if (networksUsed == WIFI_MANAGER_MAX_NETWORKS)
+        {
+            return false;
+        }
+
+        index = networksUsed++;
+        memset(&networks[index], 0, sizeof(networks[index]));
+        strncpy(networks[index].ssid, ssid, sizeof(networks[index].ssid) - 1);
+    }
+
+    networks[index].password = password;
+    return true;
+}
+
+void WifiManager::begin()
+{
+    backoffMicroS = config.backoffMinMicroS;
+
+    if (mergeStoredNetworks())
+    {
+        saveNetworks();
+    }
+
+    loadCache();
+    startAttempt();
+}
+
+void WifiManager::begin(const char* ssid, const char* password)
+{
+    addNetwork(ssid, password);
+    begin();
+}
+
+WifiManagerState WifiManager::poll()
+{
+    int64_t now = clock->nowMicroS();
+    int64_t inState = now - stateStartMicroS;
+    HalWifiStatus status = currentState == WIFI_MANAGER_FAST_CONNECTING || currentState == WIFI_MANAGER_SCAN_CONNECTING ||
+                                   currentState == WIFI_MANAGER_CONNECTED
+                               ? wifi->status()
+                               : HAL_WIFI_DISCONNECTED;
+
+    switch (currentState)
+    {
+    case WIFI_MANAGER_IDLE:
+        break;
+
+    case WIFI_MANAGER_FAST_CONNECTING:
+    case WIFI_MANAGER_SCAN_CONNECTING:
+    {
+        bool fast = currentState == WIFI_MANAGER_FAST_CONNECTING;
+
+        if (status == HAL_WIFI_CONNECTED)
+        {
+            statistics.lastConnectMicroS = now - attemptStartMicroS;
+            statistics.lastConnectFast = fast;
+            (fast ? statistics.fastConnects : statistics.scanConnects)++;
+
+            if (everConnected)
+            {
+                statistics.reconnects++;
+            }
+
+            everConnected = true;
+            connectedNetwork = joiningNetwork;
+            backoffMicroS = config.backoffMinMicroS;
+            SMART_LOGI("Wifi", "Connected to %s via %s in %lld ms",
+                       networks[connectedNetwork].ssid,
+                       fast ? "cached link" : "scan",
+                       statistics.lastConnectMicroS / 1000);
+
+            if (!fast)
+            {
+                saveCache();
+            }
+
+            enter(WIFI_MANAGER_CONNECTED);
+        }
+        else if (status == HAL_WIFI_FAILED || inState >= (fast ? config.fastTimeoutMicroS : config.joinTimeoutMicroS))
+        {
+            wifi->disconnect();
+
+            if (fast)
+            {
+                SMART_LOGW("Wifi", "Cached link failed, scanning");
+                statistics.fastFallbacks++;
+                fastFailed = true;
+                startScan();
+            }
+            else
+            {
+                SMART_LOGW("Wifi", "Joining %s failed", networks[joiningNetwork].ssid);
+                candidateIndex++;
+                joinCandidate();
+            }
+        }
+        break;
+    }
+
+    case WIFI_MANAGER_SCANNING:
+    {
+        int found = wifi->scanResults(scanned, WIFI_MANAGER_SCAN_MAX);
+
+        if (found >= 0 || inState >= config.scanTimeoutMicroS)
+        {
+            rankCandidates(found);
+            joinCandidate();
+        }
+        break;
+    }
+
+    case WIFI_MANAGER_CONNECTED:
+        if (status != HAL_WIFI_CONNECTED)
+        {
+            SMART_LOGW("Wifi", "Connection lost, reconnecting");
+            connectedNetwork = -1;
+            startAttempt();
+        }
+        else if (pendingThroughput != 0)
+        {
+            applyThroughput();
+        }
+        break;
+
+    case WIFI_MANAGER_BACKOFF:
+        if (inState >= backoffMicroS)
+        {
+            backoffMicroS *= 2;
+            if (backoffMicroS > config.backoffMaxMicroS)
+            {
+                backoffMicroS = config.backoffMaxMicroS;
+            }
+
+            // A new cycle gives the cached link another chance, the AP may
+            // just have been rebooting
+            fastFailed = false;
+            startAttempt();
+        }
+        break;
+    }
+
+    return currentState;
+}
+
+void WifiManager::suspend()
+{
+    wifi->disconnect();
+    connectedNetwork = -1;
+    enter(WIFI_MANAGER_IDLE);
+}
+
+void WifiManager::resume()
+{
+    if (currentState != WIFI_MANAGER_IDLE || networksUsed == 0)
+    {
+        return;
+    }
+
+    backoffMicroS = config.backoffMinMicroS;
+    fastFailed = false;
+    startAttempt();
+}
+
+void WifiManager::recordThroughput(uint32_t bytesPerS)
+{
+    pendingThroughput = bytesPerS;
+}
+
+WifiManagerState WifiManager::state() const
+{
+    return currentState;
+}
+
+const WifiManagerStats* WifiManager::stats() const
+{
+    return &statistics;
+}
+
+bool WifiManager::isConnected() const
+{
+    return currentState == WIFI_MANAGER_CONNECTED;
+}
+
+const char* WifiManager::connectedSsid() const
+{
+    return isConnected() && connectedNetwork >= 0 ? networks[connectedNetwork].ssid : "";
+}
+
+int WifiManager::networkCount() const
+{
+    return networksUsed;
+}
+
+const WifiNetwork* WifiManager::network(int index) const
+{
+    return index >= 0 && index < networksUsed ? &networks[index] : nullptr;
+}
+
+int WifiManager::findNetwork(const char* ssid) const
+{
+    for (int i = 0; i < networksUsed; i++)
+    {
+        if (strncmp(networks[i].ssid, ssid, sizeof(networks[i].ssid)) == 0)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Keeps the networks given in code and the history from NVS, networks only
+// NVS knows borrow their password. Returns true when the stored list differs
+// from the merged one.
+bool WifiManager::mergeStoredNetworks()
+{
+    WifiNetworksRecord record;
+    size_t len = sizeof(record);
+    bool loaded = false;
+
+    if (storage->open(WIFI_MANAGER_NVS_NAMESPACE, false))
+    {
+        loaded = storage->getBlob(WIFI_NETWORKS_KEY, &record, &len) &&
+                 len == sizeof(record) &&
+                 record.version == WIFI_NETWORKS_VERSION &&
+                 record.count <= WIFI_MANAGER_MAX_NETWORKS;
+        storage->close();
+    }
+
+    if (!loaded)
+    {
+        // Nothing stored yet, or a version 1 record with passwords in it
+        return true;
+    }
+
+    bool changed = false;
+
+    for (int i = 0; i < record.count; i++)
+    {
+        const WifiNetworkRecord* stored = &record.networks[i];
+        int index = findNetwork(stored->ssid);
+
+        if (index < 0)
+        {
+            if (networksUsed == WIFI_MANAGER_MAX_NETWORKS)
+            {
+                changed = true;
+                continue;
+            }
+
+            index = networksUsed++;
+            memset(&networks[index], 0, sizeof(networks[index]));
+            memcpy(networks[index].ssid, stored->ssid, sizeof(networks[index].ssid));
+            networks[index].ssid[sizeof(networks[index].ssid) - 1] = 0;
+        }
+
+        networks[index].throughput = stored->throughput;
+        networks[index].throughputRssi = stored->throughputRssi;
+    }
+
+    return changed || networksUsed != record.count;
+}
+
+void WifiManager::saveNetworks()
+{
+    WifiNetworksRecord record;
+    memset(&record, 0, sizeof(record));
+    record.version = WIFI_NETWORKS_VERSION;
+    record.count = networksUsed;
+
+    for (int i = 0; i < networksUsed; i++)
+    {
+        memcpy(record.networks[i].ssid, networks[i].ssid, sizeof(record.networks[i].ssid));
+        record.networks[i].throughput = networks[i].throughput;
+        record.networks[i].throughputRssi = networks[i].throughputRssi;
+    }
+
+    if (storage->open(WIFI_MANAGER_NVS_NAMESPACE, true))
+    {
+        if (storage->setBlob(WIFI_NETWORKS_KEY, &record, sizeof(record)))
+        {
+            storage->commit();
+        }
+
+        storage->close();
+    }
+}
+
+void WifiManager::loadCache()
+{
+    WifiCacheRecord record;
+    size_t len = sizeof(record);
+
+    cacheValid = false;
+    cachedNetwork = -1;
+
+    if (!storage->open(WIFI_MANAGER_NVS_NAMESPACE, false))
+    {
+        return;
+    }
+
+    if (storage->getBlob(WIFI_CACHE_KEY, &record, &len) &&
+        len == sizeof(record) &&
+        record.version == WIFI_CACHE_VERSION)
+    {
+        record.ssid[sizeof(record.ssid) - 1] = 0;
+        cachedNetwork = findNetwork(record.ssid);
+        cachedLink = record.link;
+        cacheValid = cachedNetwork >= 0;
+    }
+
+    storage->close();
+}
+
+// Only written when the link changed, a reconnect to the same AP costs no
+// flash wear
+void WifiManager::saveCache()
+{
+    HalWifiLink current;
+
+    if (!wifi->link(&current) ||
+        (cacheValid && cachedNetwork == connectedNetwork && memcmp(&current, &cachedLink, sizeof(current)) == 0))
+    {
+        return;
+    }
+
+    WifiCacheRecord record;
+    memset(&record, 0, sizeof(record));
+    record.version = WIFI_CACHE_VERSION;
+    strncpy(record.ssid, networks[connectedNetwork].ssid, sizeof(record.ssid) - 1);
+    record.link = current;
+
+    if (storage->open(WIFI_MANAGER_NVS_NAMESPACE, true))
+    {
+        if (storage->setBlob(WIFI_CACHE_KEY, &record, sizeof(record)))
+        {
+            storage->commit();
+            cachedLink = current;
+            cachedNetwork = connectedNetwork;
+            cacheValid = true;
+        }
+
+        storage->close();
+    }
+}
+
+// The password is only borrowed for the call, the driver keeps its own copy
+// of the station config. False when there is none for the network.
+bool WifiManager::beginJoin(int index, const HalWifiLink* link)
+{
+    const WifiNetwork* target = &networks[index];
+    const char* password = target->password;
+    bool borrowed = password == nullptr && passwordSource != nullptr;
+
+    if (borrowed)
+    {
+        password = passwordSource->acquirePassword(target->ssid);
+        borrowed = password != nullptr;
+    }
+
+    if (password == nullptr)
+    {
+        SMART_LOGW("Wifi", "No password for %s", target->ssid);
+        return false;
+    }
+
+    joiningNetwork = index;
+    wifi->begin(target->ssid, password, link);
+
+    if (borrowed)
+    {
+        passwordSource->releasePassword(target->ssid);
+    }
+
+    return true;
+}
+
+void WifiManager::startAttempt()
+{
+    attemptStartMicroS = clock->nowMicroS();
+
+    if (cacheValid && !fastFailed && beginJoin(cachedNetwork, &cachedLink))
+    {
+        enter(WIFI_MANAGER_FAST_CONNECTING);
+    }
+    else
+    {
+        startScan();
+    }
+}
+
+void WifiManager::startScan()
+{
+    if (!wifi->startScan())
+    {
+        rankCandidates(-1);
+        joinCandidate();
+        return;
+    }
+
+    enter(WIFI_MANAGER_SCANNING);
+}
+
+// Configured networks the scan saw, best score first, then the ones it did
+// not see in configuration order: a hidden SSID never shows up in a scan but
+// an undirected join still finds it.
+void WifiManager::rankCandidates(int found)
+{
+    candidateCount = 0;
+    candidateIndex = 0;
+
+    for (int i = 0; i < networksUsed; i++)
+    {
+        Candidate* candidate = &candidates[candidateCount++];
+        candidate->network = i;
+        candidate->visible = false;
+        candidate->score = 0;
+
+        for (int j = 0; j < found; j++)
+        {
+            if (strncmp(scanned[j].ssid, networks[i].ssid, sizeof(scanned[j].ssid)) == 0 &&
+                (!candidate->visible || scanned[j].rssi > candidate->seen.rssi))
+            {
+                candidate->seen = scanned[j];
+                candidate->visible = true;
+            }
+        }
+
+        if (candidate->visible)
+        {
+            candidate->score = networkScore(&networks[i], candidate->seen.rssi);
+        }
+    }
+
+    // Insertion sort, stable so equal scores keep configuration order
+    for (int i = 1; i < candidateCount; i++)
+    {
+        Candidate moving = candidates[i];
+        int j = i - 1;
+
+        while (j >= 0 && (moving.visible > candidates[j].visible ||
+                          (moving.visible == candidates[j].visible && moving.score > candidates[j].score)))
+        {
+            candidates[j + 1] = candidates[j];
+            j--;
+        }
+
+        candidates[j + 1] = moving;
+    }
+
+    for (int i = 0; i < candidateCount && candidates[i].visible; i++)
+    {
+        SMART_LOGD("Wifi", "Candidate %s: %d dBm, score %u B/s",
+                   networks[candidates[i].network].ssid,
+                   candidates[i].seen.rssi,
+                   candidates[i].score);
+    }
+}
+
+void WifiManager::joinCandidate()
+{
+    for (; candidateIndex < candidateCount; candidateIndex++)
+    {
+        const Candidate* candidate = &candidates[candidateIndex];
+        HalWifiLink link;
+
+        // The scan already found the BSSID, join it directly with DHCP
+        // instead of letting the driver scan again
+        memset(&link, 0, sizeof(link));
+        memcpy(link.bssid, candidate->seen.bssid, sizeof(link.bssid));
+        link.channel = candidate->seen.channel;
+
+        if (beginJoin(candidate->network, candidate->visible ? &link : nullptr))
+        {
+            enter(WIFI_MANAGER_SCAN_CONNECTING);
+            return;
+        }
+    }
+
+    statistics.failures++;
+    SMART_LOGW("Wifi", "Connect failed, retrying in %lld ms", backoffMicroS / 1000);
+    enter(WIFI_MANAGER_BACKOFF);
+}
+
+// Smoothed over updates so one slow transfer does not demote a network
+void WifiManager::applyThroughput()
+{
+    uint32_t sample = pendingThroughput;
+    pendingThroughput = 0;
+
+    if (connectedNetwork < 0)
+    {
+        return;
+    }
+
+    WifiNetwork* current = &networks[connectedNetwork];
+    current->throughput = current->throughput == 0 ? sample : (uint32_t)(((uint64_t)current->throughput * 3 + sample) / 4);
+    current->throughputRssi = wifi->rssi();
+    saveNetworks();
+}
+
+void WifiManager::enter(WifiManagerState next)
+{
+    currentState = next;
+    stateStartMicroS = clock->nowMicroS();
+}
+
+const char* wifiManagerStateName(WifiManagerState state)
+{
+    switch (state)
+    {
+    case WIFI_MANAGER_IDLE:
+        return "idle";
+    case WIFI_MANAGER_FAST_CONNECTING:
+        return "fast connecting";
+    case WIFI_MANAGER_SCANNING:
+        return "scanning";
+    case WIFI_MANAGER_SCAN_CONNECTING:
+        return "scan connecting";
+    case WIFI_MANAGER_CONNECTED:
+        return "connected";
+    case WIFI_MANAGER_BACKOFF:
+        return "backoff";
+    }
+    return "unknown";
+}
@@ -0,0 +1,163 @@
+#ifndef __ESP_WIFI_MANAGER__
+#define __ESP_WIFI_MANAGER__
+
+#include "hal.h"
+
+#define WIFI_MANAGER_NVS_NAMESPACE "wifi"
+#define WIFI_MANAGER_MAX_NETWORKS 4
+#define WIFI_MANAGER_SCAN_MAX 16
+
+enum WifiManagerState {
+    WIFI_MANAGER_IDLE,
+    // Joining the cached BSSID/channel with the cached IP config
+    WIFI_MANAGER_FAST_CONNECTING,
+    WIFI_MANAGER_SCANNING,
+    // Joining the ranked candidates from the scan one after the other
+    WIFI_MANAGER_SCAN_CONNECTING,
+    WIFI_MANAGER_CONNECTED,
+    WIFI_MANAGER_BACKOFF,
+};
+
+struct WifiManagerConfig {
+    int64_t fastTimeoutMicroS;
+    int64_t scanTimeoutMicroS;
+    // Per candidate, association plus DHCP
+    int64_t joinTimeoutMicroS;
+    // Wait after the first failed cycle, doubled per failure up to the max
+    int64_t backoffMinMicroS;
+    int64_t backoffMaxMicroS;
+};
+
+struct WifiManagerStats {
+    uint32_t fastConnects;
+    uint32_t scanConnects;
+    // Fast attempts that fell back to a scan
+    uint32_t fastFallbacks;
+    // Cycles that ended in backoff
+    uint32_t failures;
+    // Connections after the first one
+    uint32_t reconnects;
+    // From the start of the attempt to holding an IP, -1 until connected
+    int64_t lastConnectMicroS;
+    bool lastConnectFast;
+};
+
+// Lends passwords for the duration of one join, so WifiManager keeps no copy
+// of them. SecretCache is the lender on the device.
+class WifiPasswordSource {
+public:
+    virtual ~WifiPasswordSource() {}
+    // nullptr when it has no password for ssid, otherwise valid until
+    // releasePassword()
+    virtual const char* acquirePassword(const char* ssid) = 0;
+    virtual void releasePassword(const char* ssid) = 0;
+};
+
+// A configured network with what past updates measured on it
+struct WifiNetwork {
+    char ssid[HAL_WIFI_SSID_SIZE];
+    // Given in code, nullptr when it is borrowed from the password source
+    const char* password;
+    // Smoothed OTA transfer speed in B/s, 0 until an update ran on it
+    uint32_t throughput;
+    // Signal while that speed was measured
+    int8_t throughputRssi;
+};
+
+// Owns the station connection: first try the link remembered in NVS, fall
+// back to a scan, back off exponentially when both fail, and start over when
+// a connection drops. Driven by poll() so the same code runs against the
+// Arduino WiFi class on the device and a simulated radio on the host.
+//
+// With several networks configured the scan ranks the visible ones by the
+// speed measured on them before, scaled to today's signal, or by signal
+// alone when none was measured, and joins them best first. The winner's link
+// is what the next boot tries without scanning.
+//
+// NVS keeps the SSIDs with their history, never a password: those come from
+// code or the password source each time a join starts.
+class WifiManager {
+public:
+    WifiManager(HalWifi* wifi, HalStorage* storage, HalClock* clock);
+
+    void setConfig(const WifiManagerConfig* config);
+    // Asked for the password of networks added without one and of networks
+    // only NVS remembers
+    void setPasswordSource(WifiPasswordSource* source);
+    // The SSID is copied. password must outlive the manager, "" for an open
+    // network, nullptr borrows it from the password source at each join.
+    // Returns false when the list is full.
+    bool addNetwork(const char* ssid, const char* password);
+    // Merges the networks stored in NVS, persists the list and starts
+    void begin();
+    // Single network shorthand
+    void begin(const char* ssid, const char* password);
+    WifiManagerState poll();
+    // Drops the connection and stays idle until resume(), for idle modes
+    // that stop the radio
+    void suspend();
+    // Reconnects, cached link first
+    void resume();
+    // Speed of a finished update, applied to the current network on the next
+    // poll so any task may call it
+    void recordThroughput(uint32_t bytesPerS);
+
+    WifiManagerState state() const;
+    const WifiManagerStats* stats() const;
+    bool isConnected() const;
+    // Empty when not connected
+    const char* connectedSsid() const;
+    int networkCount() const;
+    const WifiNetwork* network(int index) const;
+
+private:
+    struct Candidate {
+        int network;
+        // Strongest BSSID of the network in the scan, unset when not seen
+        HalWifiNetwork seen;
+        bool visible;
+        uint32_t score;
+    };
+
+    int findNetwork(const char* ssid) const;
+    bool mergeStoredNetworks();
+    void saveNetworks();
+    void loadCache();
+    void saveCache();
+    bool beginJoin(int network, const HalWifiLink* link);
+    void startAttempt();
+    void startScan();
+    void rankCandidates(int found);
+    void joinCandidate();
+    void applyThroughput();
+    void enter(WifiManagerState next);
+
+    HalWifi* wifi;
+    HalStorage* storage;
+    HalClock* clock;
+    WifiManagerConfig config;
+    WifiPasswordSource* passwordSource;
+    WifiManagerStats statistics;
+    WifiNetwork networks[WIFI_MANAGER_MAX_NETWORKS];
+    int networksUsed;
+    HalWifiNetwork scanned[WIFI_MANAGER_SCAN_MAX];
+    Candidate candidates[WIFI_MANAGER_MAX_NETWORKS];
+    int candidateCount;
+    int candidateIndex;
+    HalWifiLink cachedLink;
+    int cachedNetwork;
+    int connectedNetwork;
+    int joiningNetwork;
+    volatile uint32_t pendingThroughput;
+    bool cacheValid;
+    bool fastFailed;
+    bool everConnected;
+    int64_t attemptStartMicroS;
+    int64_t stateStartMicroS;
+    int64_t backoffMicroS;
+    WifiManagerState currentState;
+};
+
+const char* wifiManagerStateName(WifiManagerState state);
+
+#endif // __ESP_WIFI_MANAGER__